@@ -0,0 +1,142 @@
+#include "affinity.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace ImageProcessor {
+
+namespace {
+
+thread_local int pinnedNode = -1;
+
+#if defined(__linux__)
+// Parses a sysfs CPU list such as "0-47,96-143".
+std::vector<int> parseCpuList(const std::string &text) {
+  std::vector<int> cpus;
+  const char *cursor = text.c_str();
+  while (*cursor != '\0') {
+    char *end;
+    long first = std::strtol(cursor, &end, 10);
+    if (end == cursor)
+      break;
+    long last = first;
+    cursor = end;
+    if (*cursor == '-') {
+      last = std::strtol(cursor + 1, &end, 10);
+      cursor = end;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+    if (*cursor == ',')
+      cursor++;
+    else
+      break;
+  }
+  return cpus;
+}
+
+std::string readLine(const std::string &path) {
+  std::string line;
+  if (std::FILE *file = std::fopen(path.c_str(), "r")) {
+    char buffer[4096];
+    if (std::fgets(buffer, sizeof(buffer), file) != nullptr) {
+      line = buffer;
+    }
+    std::fclose(file);
+  }
+  return line;
+}
+
+// Honours taskset and cgroup cpusets, so containers only see their CPUs.
+std::vector<int> allowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+#endif
+
+} // namespace
+
+std::vector<NumaNode> numaNodes() {
+  std::vector<NumaNode> nodes;
+
+#if defined(__linux__)
+  const std::vector<int> allowed = allowedCpus();
+  const std::string root = "/sys/devices/system/node";
+  if (DIR *directory = opendir(root.c_str())) {
+    while (dirent *entry = readdir(directory)) {
+      const std::string name = entry->d_name;
+      if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+          name.find_first_not_of("0123456789", 4) != std::string::npos) {
+        continue;
+      }
+      NumaNode node{std::stoi(name.substr(4)), {}};
+      for (int cpu : parseCpuList(readLine(root + "/" + name + "/cpulist"))) {
+        if (std::binary_search(allowed.begin(), allowed.end(), cpu))
+          node.cpus.push_back(cpu);
+      }
+      if (!node.cpus.empty())
+        nodes.push_back(std::move(node));
+    }
+    closedir(directory);
+  }
+  std::sort(nodes.begin(), nodes.end(),
+            [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+  if (nodes.empty() && !allowed.empty()) {
+    nodes.push_back({0, allowed});
+  }
+#endif
+
+  if (nodes.empty()) {
+    NumaNode node{0, {}};
+    int count =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int cpu = 0; cpu < count; cpu++) {
+      node.cpus.push_back(cpu);
+    }
+    nodes.push_back(std::move(node));
+  }
+  return nodes;
+}
+
+bool pinCurrentThread(const std::vector<int> &cpus, int node) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  }
+  if (CPU_COUNT(&set) == 0 ||
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    return false;
+  }
+  pinnedNode = node;
+  return true;
+#else
+  (void)cpus;
+  (void)node;
+  return false;
+#endif
+}
+
+int currentNode() { return pinnedNode; }
+
+} // namespace ImageProcessor
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+namespace ImageProcessor {
+
+struct NumaNode {
+  int id;
+  // CPUs of the node that this process may run on, ascending.
+  std::vector<int> cpus;
+};
+
+// The NUMA nodes with at least one CPU the process may run on, read from
+// sysfs on Linux. Elsewhere, or without sysfs, all CPUs form node 0.
+std::vector<NumaNode> numaNodes();
+
+// Restricts the calling thread to cpus. A node of 0 or more also makes
+// ThreadPool::shared() hand this thread a pool whose helpers run on the
+// same CPUs, so work it splits into bands stays on the node, and so does
+// the memory they first touch. Returns false where threads can't be pinned.
+bool pinCurrentThread(const std::vector<int> &cpus, int node);
+
+// The node the calling thread was pinned to, or -1.
+int currentNode();
+
+} // namespace ImageProcessor
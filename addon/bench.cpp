@@ -0,0 +1,582 @@
+// Micro-benchmarks for the addon's kernels, built as the standalone
+// image_processor_bench executable when binding.gyp's with_bench variable
+// is set. Every stage runs over a matrix of image sizes and channel counts
+// and reports megapixels per second and pixel bytes per cycle. Results can
+// be written as JSON in Google Benchmark's layout and compared against an
+// earlier run, which exits non-zero when a case got slower than the
+// threshold allows. --digest instead prints a hash of the resize outputs,
+// which must not change with IMAGE_PROCESSOR_KERNELS. Run with --help for
+// the flags.
+
+#include "decode.h"
+#include "encode.h"
+#include "filters.h"
+#include "hash.h"
+#include "image_data.h"
+#include "kernels.h"
+#include "linear_resize.h"
+#include "probe.h"
+#include "resize.h"
+#include "scratch_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace ImageProcessor {
+
+namespace {
+
+// Time-stamp counter ticks, which run at the nominal clock whatever the
+// core's current frequency is. Zero where there is no such counter, and
+// bytes per cycle is then not reported.
+uint64_t readCycleCounter() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+struct BenchConfig {
+  std::string filter;
+  double minTime = 0.2;
+  int repetitions = 3;
+  int threads = 1;
+  std::string jsonPath;
+  std::string comparePath;
+  double threshold = 10.0;
+  bool list = false;
+  bool digest = false;
+};
+
+struct ImageSize {
+  int width;
+  int height;
+};
+
+// 64x64, then roughly 1, 12 and 50 megapixels.
+const ImageSize kSizes[] = {
+    {64, 64}, {1024, 1024}, {4000, 3000}, {8192, 6144}};
+
+// A gradient with some noise, so the JPEG stages see a plausible amount of
+// detail rather than a flat or random image.
+ImageData makeTestImage(int width, int height, int channels) {
+  ImageData image{ScratchBuffer(static_cast<size_t>(width) * height *
+                                channels),
+                  width, height, channels};
+  uint32_t noise = 0x12345678;
+  uint8_t *out = image.data.data();
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < channels; c++) {
+        noise = noise * 1664525u + 1013904223u;
+        int value = (x * 255 / width + y * 255 / height) / 2 + c * 40 +
+                    static_cast<int>(noise >> 28);
+        *out++ = static_cast<uint8_t>(value & 0xff);
+      }
+    }
+  }
+  return image;
+}
+
+// Resize stages reduce each side by four, like a typical photo to web size.
+OutputSize reducedSize(const ImageData &image) {
+  return {std::max(1, image.width / 4), std::max(1, image.height / 4)};
+}
+
+using Body = std::function<void()>;
+
+// A stage builds its inputs and scratch once per case and returns the work
+// one iteration does; whatever it allocates is freed with the body.
+struct Stage {
+  const char *name;
+  std::vector<int> channels;
+  std::function<Body(std::shared_ptr<ImageData>, int threads)> prepare;
+};
+
+std::vector<Stage> makeStages() {
+  std::vector<Stage> stages;
+
+  stages.push_back({"luma", {3, 4}, [](std::shared_ptr<ImageData> image, int) {
+                      auto dst = std::make_shared<ScratchBuffer>(
+                          static_cast<size_t>(image->width) * image->height);
+                      return [image, dst] {
+                        activeKernels().lumaRow(
+                            image->data.data(), image->channels,
+                            static_cast<size_t>(image->width) * image->height,
+                            dst->data());
+                      };
+                    }});
+
+  stages.push_back(
+      {"resize_bilinear", {1, 3, 4},
+       [](std::shared_ptr<ImageData> image, int threads) {
+         OutputSize size = reducedSize(*image);
+         return [image, size, threads] {
+           resizeImage(*image, size.width, size.height, threads);
+         };
+       }});
+
+  stages.push_back(
+      {"resize_luma_bilinear", {3, 4},
+       [](std::shared_ptr<ImageData> image, int threads) {
+         OutputSize size = reducedSize(*image);
+         auto dst = std::make_shared<ScratchBuffer>(
+             static_cast<size_t>(size.width) * size.height);
+         return [image, size, dst, threads] {
+           ResizePlan plan = makeResizePlan(image->width, image->height,
+                                            size.width, size.height, 1);
+           ImageView view = viewOf(*image);
+           forEachRowBand(size.height, view.stride * view.height, threads,
+                          [&](int yBegin, int yEnd) {
+                            resizeLumaRows(plan, view.data, view.channels,
+                                           view.stride, dst->data(),
+                                           size.width, yBegin, yEnd);
+                          });
+         };
+       }});
+
+  auto filtered = [](ResizeFilter filter) {
+    return [filter](std::shared_ptr<ImageData> image, int threads) -> Body {
+      OutputSize size = reducedSize(*image);
+      auto dst = std::make_shared<ScratchBuffer>(
+          static_cast<size_t>(size.width) * size.height);
+      return [image, size, dst, threads, filter] {
+        FilterPlan plan = makeFilterPlan(filter, image->width, image->height,
+                                         size.width, size.height);
+        ImageView view = viewOf(*image);
+        forEachRowBand(size.height, view.stride * view.height, threads,
+                       [&](int yBegin, int yEnd) {
+                         filterLumaRows(plan, view.data, view.channels,
+                                        view.stride, dst->data(), size.width,
+                                        yBegin, yEnd);
+                       });
+      };
+    };
+  };
+  stages.push_back({"resize_luma_box", {1, 3}, filtered(ResizeFilter::Box)});
+  stages.push_back(
+      {"resize_luma_lanczos3", {1, 3}, filtered(ResizeFilter::Lanczos3)});
+
+  stages.push_back(
+      {"resize_luma_linear", {3},
+       [](std::shared_ptr<ImageData> image, int threads) {
+         OutputSize size = reducedSize(*image);
+         auto dst = std::make_shared<ScratchBuffer>(
+             static_cast<size_t>(size.width) * size.height);
+         return [image, size, dst, threads] {
+           resizeLinearLuma(viewOf(*image), size.width, size.height,
+                            dst->data(), threads, ResizeFilter::Bilinear);
+         };
+       }});
+
+  stages.push_back({"xxh64", {3}, [](std::shared_ptr<ImageData> image, int) {
+                      return [image] {
+                        volatile uint64_t sink = xxh64(
+                            image->data.data(), image->data.size(), 0);
+                        (void)sink;
+                      };
+                    }});
+
+  if (canEncodeJpeg()) {
+    stages.push_back(
+        {"encode_jpeg", {1, 3}, [](std::shared_ptr<ImageData> image, int) {
+           size_t capacity = jpegMaxByteLength(image->width, image->height,
+                                               image->channels);
+           auto dst = std::make_shared<ScratchBuffer>(capacity);
+           return [image, dst, capacity] {
+             encodeJpeg(image->data.data(), image->width, image->height,
+                        image->channels,
+                        static_cast<size_t>(image->width) * image->channels,
+                        JpegOptions(), dst->data(), capacity);
+           };
+         }});
+  }
+
+  if (canDecode(ImageFormat::Jpeg)) {
+    stages.push_back(
+        {"decode_jpeg", {1, 3}, [](std::shared_ptr<ImageData> image, int) {
+           size_t capacity = jpegMaxByteLength(image->width, image->height,
+                                               image->channels);
+           auto file = std::make_shared<std::vector<uint8_t>>(capacity);
+           file->resize(encodeJpeg(
+               image->data.data(), image->width, image->height,
+               image->channels,
+               static_cast<size_t>(image->width) * image->channels,
+               JpegOptions(), file->data(), capacity));
+           return [file] {
+             decodeImage(file->data(), file->size(), DecodeOptions());
+           };
+         }});
+  }
+
+  // Header only, so the time should not grow with the image.
+  if (canEncodeJpeg()) {
+    stages.push_back(
+        {"probe_jpeg", {3}, [](std::shared_ptr<ImageData> image, int) {
+           size_t capacity = jpegMaxByteLength(image->width, image->height,
+                                               image->channels);
+           auto file = std::make_shared<std::vector<uint8_t>>(capacity);
+           file->resize(encodeJpeg(
+               image->data.data(), image->width, image->height,
+               image->channels,
+               static_cast<size_t>(image->width) * image->channels,
+               JpegOptions(), file->data(), capacity));
+           return [file] {
+             volatile int sink = probeImage(file->data(), file->size()).width;
+             (void)sink;
+           };
+         }});
+  }
+
+  return stages;
+}
+
+struct BenchResult {
+  std::string name;
+  uint64_t iterations;
+  double nanoseconds;
+  double cpuNanoseconds;
+  double cycles;
+  double pixels;
+  double bytes;
+};
+
+// Runs body in repetitions of at least minTime seconds each and keeps the
+// median repetition, which shrugs off the odd interrupted one.
+BenchResult measure(const std::string &name, const Body &body, double pixels,
+                    double bytes, const BenchConfig &config) {
+  using Clock = std::chrono::steady_clock;
+  body();
+
+  struct Sample {
+    double nanoseconds;
+    double cpuNanoseconds;
+    double cycles;
+    uint64_t iterations;
+  };
+  std::vector<Sample> samples;
+  for (int rep = 0; rep < config.repetitions; rep++) {
+    uint64_t iterations = 0;
+    std::clock_t cpuStart = std::clock();
+    uint64_t cycleStart = readCycleCounter();
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    do {
+      body();
+      iterations++;
+      elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < config.minTime);
+    uint64_t cycles = readCycleCounter() - cycleStart;
+    double cpu = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+    samples.push_back({elapsed * 1e9 / iterations, cpu * 1e9 / iterations,
+                       static_cast<double>(cycles) / iterations, iterations});
+  }
+
+  std::sort(samples.begin(), samples.end(),
+            [](const Sample &a, const Sample &b) {
+              return a.nanoseconds < b.nanoseconds;
+            });
+  const Sample &median = samples[samples.size() / 2];
+  return {name,           median.iterations, median.nanoseconds,
+          median.cpuNanoseconds, median.cycles, pixels, bytes};
+}
+
+double megapixelsPerSecond(const BenchResult &result) {
+  return result.pixels / result.nanoseconds * 1e3;
+}
+
+double bytesPerCycle(const BenchResult &result) {
+  return result.cycles > 0 ? result.bytes / result.cycles : 0;
+}
+
+std::string jsonEscape(const std::string &text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+bool writeJson(const std::string &path, const std::vector<BenchResult> &all,
+               const BenchConfig &config) {
+  std::FILE *file = std::fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  char date[32];
+  std::time_t now = std::time(nullptr);
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+  std::fprintf(file,
+               "{\n  \"context\": {\n    \"date\": \"%s\",\n"
+               "    \"num_cpus\": %u,\n    \"kernels\": \"%s\",\n"
+               "    \"threads\": %d\n  },\n  \"benchmarks\": [",
+               date, std::thread::hardware_concurrency(),
+               activeKernels().name, config.threads);
+  for (size_t i = 0; i < all.size(); i++) {
+    const BenchResult &result = all[i];
+    std::string name = jsonEscape(result.name);
+    std::fprintf(
+        file,
+        "%s\n    {\"name\": \"%s\", \"run_name\": \"%s\", "
+        "\"run_type\": \"iteration\", \"repetitions\": %d, "
+        "\"iterations\": %llu, \"real_time\": %.1f, \"cpu_time\": %.1f, "
+        "\"time_unit\": \"ns\", \"items_per_second\": %.1f, "
+        "\"bytes_per_second\": %.1f, \"megapixels_per_second\": %.3f, "
+        "\"bytes_per_cycle\": %.4f}",
+        i == 0 ? "" : ",", name.c_str(), name.c_str(), config.repetitions,
+        static_cast<unsigned long long>(result.iterations), result.nanoseconds,
+        result.cpuNanoseconds, result.pixels / result.nanoseconds * 1e9,
+        result.bytes / result.nanoseconds * 1e9, megapixelsPerSecond(result),
+        bytesPerCycle(result));
+  }
+  std::fprintf(file, "\n  ]\n}\n");
+  return std::fclose(file) == 0;
+}
+
+// Reads the name and real_time of every benchmark in a file written by
+// writeJson, or by Google Benchmark's --benchmark_out.
+bool readBaseline(const std::string &path,
+                  std::map<std::string, double> &baseline) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::string text;
+  char chunk[4096];
+  size_t read;
+  while ((read = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    text.append(chunk, read);
+  }
+  std::fclose(file);
+
+  const std::string nameKey = "\"name\": \"";
+  const std::string timeKey = "\"real_time\": ";
+  size_t position = 0;
+  while ((position = text.find(nameKey, position)) != std::string::npos) {
+    size_t begin = position + nameKey.size();
+    size_t end = text.find('"', begin);
+    size_t time = text.find(timeKey, end);
+    if (end == std::string::npos || time == std::string::npos) {
+      break;
+    }
+    baseline[text.substr(begin, end - begin)] =
+        std::strtod(text.c_str() + time + timeKey.size(), nullptr);
+    position = time;
+  }
+  return true;
+}
+
+// Prints each case's change in time per iteration against the baseline and
+// returns how many got slower by more than the threshold.
+int compareWithBaseline(const std::vector<BenchResult> &all,
+                        const std::map<std::string, double> &baseline,
+                        double threshold) {
+  int regressions = 0;
+  std::printf("\n%-36s %12s %12s %9s\n", "Comparison", "Baseline ns",
+              "Current ns", "Change");
+  for (const BenchResult &result : all) {
+    auto it = baseline.find(result.name);
+    if (it == baseline.end() || it->second <= 0) {
+      std::printf("%-36s %12s %12.0f %9s\n", result.name.c_str(), "-",
+                  result.nanoseconds, "new");
+      continue;
+    }
+    double change = (result.nanoseconds - it->second) / it->second * 100;
+    bool regressed = change > threshold;
+    regressions += regressed;
+    std::printf("%-36s %12.0f %12.0f %+8.1f%%%s\n", result.name.c_str(),
+                it->second, result.nanoseconds, change,
+                regressed ? "  REGRESSION" : "");
+  }
+  return regressions;
+}
+
+// Hashes resizeImage and lumaRow output for every channel count over
+// shrinks, skewed ratios and enlargements. Each kernel set computes the
+// same fixed-point formulas, so the digest is the same whichever one is
+// active; any difference is a kernel bug, such as a store past the end of a
+// row. The timed stages only run 1, 3 and 4 channels and check nothing.
+int printDigest(const BenchConfig &config) {
+  const ImageSize pairs[][2] = {{{400, 300}, {100, 200}},
+                                {{1000, 100}, {300, 90}},
+                                {{333, 211}, {100, 100}},
+                                {{123, 77}, {500, 320}},
+                                {{64, 64}, {63, 1}},
+                                {{7, 5}, {3, 2}}};
+  uint64_t digest = 0;
+  for (int channels = 1; channels <= 4; channels++) {
+    for (const auto &pair : pairs) {
+      ImageData input = makeTestImage(pair[0].width, pair[0].height, channels);
+      ImageData output = resizeImage(input, pair[1].width, pair[1].height,
+                                     config.threads);
+      digest = xxh64(output.data.data(), output.data.size(), digest);
+
+      size_t pixels = static_cast<size_t>(input.width) * input.height;
+      ScratchBuffer luma(pixels);
+      activeKernels().lumaRow(input.data.data(), channels, pixels,
+                              luma.data());
+      digest = xxh64(luma.data(), pixels, digest);
+    }
+  }
+  std::printf("%s %016llx\n", activeKernels().name,
+              static_cast<unsigned long long>(digest));
+  return 0;
+}
+
+void printUsage() {
+  std::printf(
+      "Usage: image_processor_bench [options]\n"
+      "  --filter <text>       only run cases whose name contains text\n"
+      "  --min-time <seconds>  minimum length of a repetition (0.2)\n"
+      "  --repetitions <n>     repetitions per case, median kept (3)\n"
+      "  --threads <n>         threads for the resize stages (1, 0 = all)\n"
+      "  --json <path>         write the results as JSON\n"
+      "  --compare <path>      compare against an earlier --json file\n"
+      "  --threshold <percent> slowdown that counts as a regression (10)\n"
+      "  --list                print the case names and exit\n"
+      "  --digest              print a hash of the resize outputs and exit\n");
+}
+
+bool parseArgs(int argc, char **argv, BenchConfig &config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--list") {
+      config.list = true;
+      continue;
+    }
+    if (arg == "--digest") {
+      config.digest = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const char *value = argv[++i];
+    if (arg == "--filter") {
+      config.filter = value;
+    } else if (arg == "--min-time") {
+      config.minTime = std::atof(value);
+    } else if (arg == "--repetitions") {
+      config.repetitions = std::max(1, std::atoi(value));
+    } else if (arg == "--threads") {
+      config.threads = std::max(0, std::atoi(value));
+    } else if (arg == "--json") {
+      config.jsonPath = value;
+    } else if (arg == "--compare") {
+      config.comparePath = value;
+    } else if (arg == "--threshold") {
+      config.threshold = std::atof(value);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+int runBenchmarks(const BenchConfig &config) {
+  std::map<std::string, double> baseline;
+  if (!config.comparePath.empty() &&
+      !readBaseline(config.comparePath, baseline)) {
+    std::fprintf(stderr, "Cannot read %s\n", config.comparePath.c_str());
+    return 2;
+  }
+
+  if (!config.list) {
+    std::printf("Kernels: %s, threads: %d\n\n%-36s %12s %10s %10s\n",
+                activeKernels().name, config.threads, "Case", "ns/iter",
+                "MP/s", "B/cycle");
+  }
+
+  std::vector<BenchResult> all;
+  for (const Stage &stage : makeStages()) {
+    for (const ImageSize &size : kSizes) {
+      for (int channels : stage.channels) {
+        std::string name = std::string(stage.name) + "/" +
+                           std::to_string(size.width) + "x" +
+                           std::to_string(size.height) + "x" +
+                           std::to_string(channels);
+        if (name.find(config.filter) == std::string::npos) {
+          continue;
+        }
+        if (config.list) {
+          std::printf("%s\n", name.c_str());
+          continue;
+        }
+
+        double pixels = static_cast<double>(size.width) * size.height;
+        BenchResult result;
+        {
+          auto image = std::make_shared<ImageData>(
+              makeTestImage(size.width, size.height, channels));
+          Body body = stage.prepare(image, config.threads);
+          result = measure(name, body, pixels, pixels * channels, config);
+        }
+        std::printf("%-36s %12.0f %10.1f ", name.c_str(), result.nanoseconds,
+                    megapixelsPerSecond(result));
+        if (result.cycles > 0) {
+          std::printf("%10.3f\n", bytesPerCycle(result));
+        } else {
+          std::printf("%10s\n", "-");
+        }
+        std::fflush(stdout);
+        all.push_back(result);
+      }
+    }
+  }
+
+  if (!config.jsonPath.empty() && !writeJson(config.jsonPath, all, config)) {
+    std::fprintf(stderr, "Cannot write %s\n", config.jsonPath.c_str());
+    return 2;
+  }
+  if (!config.comparePath.empty() &&
+      compareWithBaseline(all, baseline, config.threshold) > 0) {
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace
+
+} // namespace ImageProcessor
+
+int main(int argc, char **argv) {
+  ImageProcessor::BenchConfig config;
+  if (!ImageProcessor::parseArgs(argc, argv, config)) {
+    ImageProcessor::printUsage();
+    return 2;
+  }
+  try {
+    if (config.digest) {
+      return ImageProcessor::printDigest(config);
+    }
+    return ImageProcessor::runBenchmarks(config);
+  } catch (const std::exception &error) {
+    std::fprintf(stderr, "Benchmark failed: %s\n", error.what());
+    return 2;
+  }
+}
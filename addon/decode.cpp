@@ -0,0 +1,564 @@
+#include "decode.h"
+#include "resize.h"
+#include "stage_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+#include "jpeg_error.h"
+#endif
+
+#if defined(IMAGE_PROCESSOR_HAVE_PNG)
+#include <png.h>
+#endif
+
+#if defined(IMAGE_PROCESSOR_HAVE_WEBP)
+#include <webp/decode.h>
+#endif
+
+namespace ImageProcessor {
+
+ImageFormat sniffFormat(const uint8_t *data, size_t size) {
+  static const uint8_t kPngSignature[8] = {0x89, 'P',  'N',  'G',
+                                           '\r', '\n', 0x1A, '\n'};
+
+  if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+    return ImageFormat::Jpeg;
+  if (size >= 8 && std::memcmp(data, kPngSignature, 8) == 0)
+    return ImageFormat::Png;
+  if (size >= 12 && std::memcmp(data, "RIFF", 4) == 0 &&
+      std::memcmp(data + 8, "WEBP", 4) == 0)
+    return ImageFormat::WebP;
+  return ImageFormat::Unknown;
+}
+
+bool canDecode(ImageFormat format) {
+  switch (format) {
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+  case ImageFormat::Jpeg:
+    return true;
+#endif
+#if defined(IMAGE_PROCESSOR_HAVE_PNG)
+  case ImageFormat::Png:
+    return true;
+#endif
+#if defined(IMAGE_PROCESSOR_HAVE_WEBP)
+  case ImageFormat::WebP:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+namespace {
+
+ImageData allocateImage(int width, int height, int channels,
+                        PixelType type = PixelType::U8) {
+  if (static_cast<uint64_t>(width) * static_cast<uint64_t>(height) >
+      kMaxDecodedPixels) {
+    throw std::runtime_error("Image too large: " + std::to_string(width) +
+                             "x" + std::to_string(height));
+  }
+
+  ImageData image;
+  image.width = width;
+  image.height = height;
+  image.channels = channels;
+  image.type = type;
+  image.data = ScratchBuffer(static_cast<size_t>(width) * height * channels *
+                             bytesPerSample(type));
+  return image;
+}
+
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+// Adobe CMYK JPEGs store inverted ink values, so each channel times K is the
+// matching RGB value.
+void cmykRowToRgb(const uint8_t *src, size_t pixels, uint8_t *dst) {
+  for (size_t i = 0; i < pixels; i++) {
+    uint32_t k = src[3];
+    dst[0] = static_cast<uint8_t>(src[0] * k / 255);
+    dst[1] = static_cast<uint8_t>(src[1] * k / 255);
+    dst[2] = static_cast<uint8_t>(src[2] * k / 255);
+    src += 4;
+    dst += 3;
+  }
+}
+
+// Picks the largest 1/2, 1/4 or 1/8 IDCT scale whose output still covers
+// target, leaving only the remaining ratio to the resize.
+void chooseJpegScale(jpeg_decompress_struct &cinfo, const OutputSize &target) {
+  for (unsigned int denom : {8u, 4u, 2u}) {
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    jpeg_calc_output_dimensions(&cinfo);
+    if (cinfo.output_width >= static_cast<JDIMENSION>(target.width) &&
+        cinfo.output_height >= static_cast<JDIMENSION>(target.height)) {
+      return;
+    }
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1;
+  jpeg_calc_output_dimensions(&cinfo);
+}
+
+// Picks the output colour space and IDCT scale once the header is read.
+// Returns whether the file is CMYK, which is decoded as CMYK and converted
+// to RGB row by row.
+bool configureJpegOutput(jpeg_decompress_struct &cinfo,
+                         const DecodeOptions &options) {
+  const bool cmyk = cinfo.jpeg_color_space == JCS_CMYK ||
+                    cinfo.jpeg_color_space == JCS_YCCK;
+  if (cmyk) {
+    cinfo.out_color_space = JCS_CMYK;
+  } else if (options.lumaOnly || cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+    cinfo.out_color_space = JCS_GRAYSCALE;
+  } else {
+    cinfo.out_color_space = JCS_RGB;
+  }
+  cinfo.dct_method = JDCT_ISLOW;
+
+  if (options.fitWidth > 0 && options.fitHeight > 0) {
+    chooseJpegScale(cinfo,
+                    computeOutputSize(static_cast<int>(cinfo.image_width),
+                                      static_cast<int>(cinfo.image_height),
+                                      options.fitWidth, options.fitHeight));
+  } else {
+    jpeg_calc_output_dimensions(&cinfo);
+  }
+  return cmyk;
+}
+
+// Runs the libjpeg calls that can fail. A fatal error longjmps back to the
+// setjmp here and returns false, so the objects with destructors live in the
+// caller's frame and are never affected by the jump.
+bool readJpeg(jpeg_decompress_struct &cinfo, JpegErrorManager &errors,
+              const uint8_t *data, size_t size, const DecodeOptions &options,
+              DecodedImage &decoded, ScratchBuffer &cmykRow) {
+  if (setjmp(errors.jump)) {
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, data, static_cast<unsigned long>(size));
+  jpeg_read_header(&cinfo, TRUE);
+
+  const bool cmyk = configureJpegOutput(cinfo, options);
+  decoded.sourceWidth = static_cast<int>(cinfo.image_width);
+  decoded.sourceHeight = static_cast<int>(cinfo.image_height);
+
+  jpeg_start_decompress(&cinfo);
+
+  ImageData &image = decoded.pixels;
+  const int channels = cmyk ? 3 : cinfo.output_components;
+  image = allocateImage(static_cast<int>(cinfo.output_width),
+                        static_cast<int>(cinfo.output_height), channels);
+  const size_t stride = static_cast<size_t>(image.width) * channels;
+  if (cmyk) {
+    cmykRow = ScratchBuffer(static_cast<size_t>(image.width) * 4);
+  }
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    uint8_t *dst = image.data.data() + cinfo.output_scanline * stride;
+    JSAMPROW row = cmyk ? cmykRow.data() : dst;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    if (cmyk) {
+      cmykRowToRgb(cmykRow.data(), image.width, dst);
+    }
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  return true;
+}
+
+DecodedImage decodeJpeg(const uint8_t *data, size_t size,
+                        const DecodeOptions &options) {
+  jpeg_decompress_struct cinfo;
+  std::memset(&cinfo, 0, sizeof(cinfo));
+  JpegErrorManager errors;
+  cinfo.err = initJpegErrors(errors);
+
+  DecodedImage decoded;
+  ScratchBuffer cmykRow;
+  bool ok;
+  try {
+    ok = readJpeg(cinfo, errors, data, size, options, decoded, cmykRow);
+  } catch (...) {
+    jpeg_destroy_decompress(&cinfo);
+    throw;
+  }
+  jpeg_destroy_decompress(&cinfo);
+
+  if (!ok) {
+    throw std::runtime_error(std::string("JPEG decode failed: ") +
+                             errors.message);
+  }
+  return decoded;
+}
+#endif
+
+#if defined(IMAGE_PROCESSOR_HAVE_PNG)
+// The simplified libpng API handles palettes, 16-bit samples and transparency
+// chunks; asking for the file's own channel layout avoids any color math.
+// With keepDepth a 16-bit file is read at 16 bits, which the simplified API
+// only offers as linear light, with alpha premultiplied.
+ImageData decodePng(const uint8_t *data, size_t size, bool keepDepth) {
+  png_image png;
+  std::memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+
+  if (!png_image_begin_read_from_memory(&png, data, size)) {
+    throw std::runtime_error(std::string("PNG decode failed: ") + png.message);
+  }
+
+  const bool color = (png.format & PNG_FORMAT_FLAG_COLOR) != 0;
+  const bool alpha = (png.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+  const bool wide = keepDepth && (png.format & PNG_FORMAT_FLAG_LINEAR) != 0;
+  png.format = color ? (alpha ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB)
+                     : (alpha ? PNG_FORMAT_GA : PNG_FORMAT_GRAY);
+  if (wide) {
+    png.format |= PNG_FORMAT_FLAG_LINEAR;
+  }
+
+  ImageData image;
+  try {
+    image = allocateImage(
+        static_cast<int>(png.width), static_cast<int>(png.height),
+        static_cast<int>(PNG_IMAGE_PIXEL_CHANNELS(png.format)),
+        wide ? PixelType::U16 : PixelType::U8);
+    image.linearLight = wide;
+  } catch (...) {
+    png_image_free(&png);
+    throw;
+  }
+
+  if (!png_image_finish_read(&png, nullptr, image.data.data(), 0, nullptr)) {
+    std::string message = png.message;
+    png_image_free(&png);
+    throw std::runtime_error("PNG decode failed: " + message);
+  }
+
+  return image;
+}
+#endif
+
+#if defined(IMAGE_PROCESSOR_HAVE_WEBP)
+ImageData decodeWebP(const uint8_t *data, size_t size) {
+  WebPBitstreamFeatures features;
+  if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK) {
+    throw std::runtime_error("WebP decode failed: invalid bitstream");
+  }
+
+  const int channels = features.has_alpha ? 4 : 3;
+  ImageData image = allocateImage(features.width, features.height, channels);
+  const int stride = features.width * channels;
+
+  uint8_t *decoded =
+      features.has_alpha
+          ? WebPDecodeRGBAInto(data, size, image.data.data(),
+                               image.data.size(), stride)
+          : WebPDecodeRGBInto(data, size, image.data.data(), image.data.size(),
+                              stride);
+  if (decoded == nullptr) {
+    throw std::runtime_error("WebP decode failed: corrupt image data");
+  }
+
+  return image;
+}
+#endif
+
+[[maybe_unused]] DecodedImage fullSize(ImageData &&pixels) {
+  DecodedImage decoded;
+  decoded.sourceWidth = pixels.width;
+  decoded.sourceHeight = pixels.height;
+  decoded.pixels = std::move(pixels);
+  return decoded;
+}
+
+const char *formatName(ImageFormat format) {
+  switch (format) {
+  case ImageFormat::Jpeg:
+    return "JPEG";
+  case ImageFormat::Png:
+    return "PNG";
+  case ImageFormat::WebP:
+    return "WebP";
+  default:
+    return "unknown";
+  }
+}
+
+} // namespace
+
+DecodedImage decodeImage(const uint8_t *data, size_t size,
+                         const DecodeOptions &options) {
+  StageTimer timer(Stage::Decode, size);
+  ImageFormat format = sniffFormat(data, size);
+
+  switch (format) {
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+  case ImageFormat::Jpeg:
+    return decodeJpeg(data, size, options);
+#endif
+#if defined(IMAGE_PROCESSOR_HAVE_PNG)
+  case ImageFormat::Png:
+    return fullSize(decodePng(data, size, options.keepDepth));
+#endif
+#if defined(IMAGE_PROCESSOR_HAVE_WEBP)
+  case ImageFormat::WebP:
+    return fullSize(decodeWebP(data, size));
+#endif
+  default:
+    break;
+  }
+
+  (void)options;
+  throw std::runtime_error(std::string(formatName(format)) +
+                           " decoding is not available in this build");
+}
+
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+
+namespace {
+
+// Source manager that suspends instead of failing when it runs dry: the
+// unread part of the file starts at base.next_input_byte, and append() moves
+// those bytes to the front of the buffer before adding new ones. Skips past
+// the end of the buffered data are remembered and applied to later input.
+struct SuspendingSource {
+  jpeg_source_mgr base;
+  size_t skip = 0;
+  bool inputEnded = false;
+};
+
+void initSource(j_decompress_ptr) {}
+
+boolean fillInputBuffer(j_decompress_ptr cinfo) {
+  static const JOCTET kEndOfImage[2] = {0xFF, JPEG_EOI};
+  if (!reinterpret_cast<SuspendingSource *>(cinfo->src)->inputEnded) {
+    return FALSE;
+  }
+  // Fatal, see jpegEmitMessage; the fake EOI is what libjpeg's own sources
+  // insert.
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = kEndOfImage;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+void skipInputData(j_decompress_ptr cinfo, long count) {
+  auto *source = reinterpret_cast<SuspendingSource *>(cinfo->src);
+  if (count <= 0) {
+    return;
+  }
+  size_t bytes = static_cast<size_t>(count);
+  if (bytes <= source->base.bytes_in_buffer) {
+    source->base.next_input_byte += bytes;
+    source->base.bytes_in_buffer -= bytes;
+    return;
+  }
+  source->skip += bytes - source->base.bytes_in_buffer;
+  source->base.next_input_byte += source->base.bytes_in_buffer;
+  source->base.bytes_in_buffer = 0;
+}
+
+void termSource(j_decompress_ptr) {}
+
+} // namespace
+
+struct JpegRowDecoder::State {
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager errors;
+  SuspendingSource source;
+  DecodeOptions options;
+  ScratchBuffer input;
+  enum class Phase { Create, Header, Start, Rows, Done } phase = Phase::Create;
+  bool cmyk = false;
+  ScratchBuffer cmykRow;
+};
+
+JpegRowDecoder::JpegRowDecoder(const DecodeOptions &options)
+    : state_(new State) {
+  State &state = *state_;
+  std::memset(&state.cinfo, 0, sizeof(state.cinfo));
+  state.cinfo.err = initJpegErrors(state.errors);
+  jpeg_source_mgr &source = state.source.base;
+  source.next_input_byte = nullptr;
+  source.bytes_in_buffer = 0;
+  source.init_source = initSource;
+  source.fill_input_buffer = fillInputBuffer;
+  source.skip_input_data = skipInputData;
+  source.resync_to_restart = jpeg_resync_to_restart;
+  source.term_source = termSource;
+  state.options = options;
+  state.options.lumaOnly = true;
+}
+
+JpegRowDecoder::~JpegRowDecoder() {
+  if (state_->phase != State::Phase::Create) {
+    jpeg_destroy_decompress(&state_->cinfo);
+  }
+}
+
+void JpegRowDecoder::append(const uint8_t *data, size_t size) {
+  State &state = *state_;
+  SuspendingSource &source = state.source;
+  size_t skipped = std::min(source.skip, size);
+  source.skip -= skipped;
+  data += skipped;
+  size -= skipped;
+  if (size == 0) {
+    return;
+  }
+
+  const size_t pending = source.base.bytes_in_buffer;
+  if (pending + size > state.input.size()) {
+    ScratchBuffer grown(std::max(pending + size, 2 * state.input.size()));
+    if (pending > 0) {
+      std::memcpy(grown.data(), source.base.next_input_byte, pending);
+    }
+    state.input = std::move(grown);
+  } else if (pending > 0) {
+    std::memmove(state.input.data(), source.base.next_input_byte, pending);
+  }
+  std::memcpy(state.input.data() + pending, data, size);
+  source.base.next_input_byte = state.input.data();
+  source.base.bytes_in_buffer = pending + size;
+}
+
+void JpegRowDecoder::endOfInput() { state_->source.inputEnded = true; }
+
+// Advances the decoder as far as the buffered input allows: the header, then
+// with maxRows > 0 up to that many rows. Suspension is not an error; a fatal
+// libjpeg error longjmps back here and returns false (see readJpeg).
+bool JpegRowDecoder::step(uint8_t *dst, size_t stride, int maxRows,
+                          int &rows) {
+  State &state = *state_;
+  jpeg_decompress_struct &cinfo = state.cinfo;
+  if (setjmp(state.errors.jump)) {
+    return false;
+  }
+
+  if (state.phase == State::Phase::Create) {
+    jpeg_create_decompress(&cinfo);
+    cinfo.src = &state.source.base;
+    state.phase = State::Phase::Header;
+  }
+  if (state.phase == State::Phase::Header) {
+    if (jpeg_read_header(&cinfo, TRUE) == JPEG_SUSPENDED) {
+      return true;
+    }
+    if (jpeg_has_multiple_scans(&cinfo)) {
+      std::strcpy(state.errors.message,
+                  "progressive and multi-scan JPEGs can't be streamed");
+      return false;
+    }
+    state.cmyk = configureJpegOutput(cinfo, state.options);
+    state.phase = State::Phase::Start;
+  }
+  if (maxRows == 0) {
+    return true;
+  }
+  if (state.phase == State::Phase::Start) {
+    if (!jpeg_start_decompress(&cinfo)) {
+      return true;
+    }
+    state.phase = State::Phase::Rows;
+  }
+
+  while (rows < maxRows && cinfo.output_scanline < cinfo.output_height) {
+    uint8_t *out = dst + static_cast<size_t>(rows) * stride;
+    JSAMPROW row = state.cmyk ? state.cmykRow.data() : out;
+    if (jpeg_read_scanlines(&cinfo, &row, 1) == 0) {
+      return true;
+    }
+    if (state.cmyk) {
+      cmykRowToRgb(state.cmykRow.data(), cinfo.output_width, out);
+    }
+    rows++;
+  }
+  if (cinfo.output_scanline == cinfo.output_height) {
+    state.phase = State::Phase::Done;
+  }
+  return true;
+}
+
+bool JpegRowDecoder::readHeader() {
+  if (state_->phase > State::Phase::Header) {
+    return true;
+  }
+  int rows = 0;
+  if (!step(nullptr, 0, 0, rows)) {
+    throw std::runtime_error(std::string("JPEG decode failed: ") +
+                             state_->errors.message);
+  }
+  if (state_->phase > State::Phase::Header && state_->cmyk) {
+    state_->cmykRow =
+        ScratchBuffer(static_cast<size_t>(state_->cinfo.output_width) * 4);
+  }
+  return state_->phase > State::Phase::Header;
+}
+
+int JpegRowDecoder::width() const {
+  return static_cast<int>(state_->cinfo.output_width);
+}
+
+int JpegRowDecoder::height() const {
+  return static_cast<int>(state_->cinfo.output_height);
+}
+
+int JpegRowDecoder::channels() const {
+  return state_->cmyk ? 3 : state_->cinfo.output_components;
+}
+
+int JpegRowDecoder::sourceWidth() const {
+  return static_cast<int>(state_->cinfo.image_width);
+}
+
+int JpegRowDecoder::sourceHeight() const {
+  return static_cast<int>(state_->cinfo.image_height);
+}
+
+int JpegRowDecoder::readRows(uint8_t *dst, size_t stride, int maxRows) {
+  if (!readHeader() || state_->phase == State::Phase::Done) {
+    return 0;
+  }
+  int rows = 0;
+  if (!step(dst, stride, maxRows, rows)) {
+    throw std::runtime_error(std::string("JPEG decode failed: ") +
+                             state_->errors.message);
+  }
+  return rows;
+}
+
+bool JpegRowDecoder::finished() const {
+  return state_->phase == State::Phase::Done;
+}
+
+#else
+
+struct JpegRowDecoder::State {};
+
+JpegRowDecoder::JpegRowDecoder(const DecodeOptions &) {
+  throw std::runtime_error("JPEG decoding is not available in this build");
+}
+
+JpegRowDecoder::~JpegRowDecoder() = default;
+void JpegRowDecoder::append(const uint8_t *, size_t) {}
+void JpegRowDecoder::endOfInput() {}
+bool JpegRowDecoder::readHeader() { return false; }
+int JpegRowDecoder::width() const { return 0; }
+int JpegRowDecoder::height() const { return 0; }
+int JpegRowDecoder::channels() const { return 0; }
+int JpegRowDecoder::sourceWidth() const { return 0; }
+int JpegRowDecoder::sourceHeight() const { return 0; }
+int JpegRowDecoder::readRows(uint8_t *, size_t, int) { return 0; }
+bool JpegRowDecoder::finished() const { return false; }
+bool JpegRowDecoder::step(uint8_t *, size_t, int, int &) { return false; }
+
+#endif
+} // namespace ImageProcessor
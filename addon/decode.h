@@ -0,0 +1,96 @@
+#pragma once
+
+#include "image_data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace ImageProcessor {
+
+enum class ImageFormat { Unknown, Jpeg, Png, WebP };
+
+// Identifies a compressed image from its signature bytes.
+ImageFormat sniffFormat(const uint8_t *data, size_t size);
+
+// Same default cap as sharp's limitInputPixels, so a tiny file declaring huge
+// dimensions cannot make us reserve gigabytes. Also the largest maxWidth or
+// maxHeight the bindings accept.
+constexpr uint64_t kMaxDecodedPixels = uint64_t(0x3FFF) * 0x3FFF;
+
+// Whether this build links a decoder for the format (see the with_* variables
+// in binding.gyp).
+bool canDecode(ImageFormat format);
+
+struct DecodeOptions {
+  // Decoders that can produce luma directly do so, e.g. a YCbCr JPEG returns
+  // its Y plane without upsampling or converting chroma; other formats keep
+  // their channels.
+  bool lumaOnly = false;
+  // 16-bit PNGs keep their depth, as linear-light U16 samples, instead of
+  // being rounded to 8 bits.
+  bool keepDepth = false;
+  // When both are set, the image is only needed at the size that
+  // computeOutputSize fits into fitWidth x fitHeight. JPEGs are then decoded
+  // at the smallest DCT scale (1/2, 1/4 or 1/8) that still covers it.
+  int fitWidth = 0;
+  int fitHeight = 0;
+};
+
+struct DecodedImage {
+  ImageData pixels;
+  // Dimensions stored in the file, before any shrink-on-load.
+  int sourceWidth;
+  int sourceHeight;
+};
+
+// Decodes a compressed image to interleaved pixels, 8-bit unless
+// options.keepDepth applies. Throws std::runtime_error on corrupt or
+// unsupported input.
+DecodedImage decodeImage(const uint8_t *data, size_t size,
+                         const DecodeOptions &options);
+
+// Incremental JPEG decoder for the streaming pipeline. Compressed bytes are
+// appended as they arrive and rows are read out top to bottom; libjpeg only
+// keeps the current MCU row, so memory does not grow with the image height.
+// Only single-scan JPEGs can be read this way. A progressive or multi-scan
+// file needs every coefficient in memory before its first row, so it is
+// rejected.
+class JpegRowDecoder {
+public:
+  explicit JpegRowDecoder(const DecodeOptions &options);
+  ~JpegRowDecoder();
+
+  JpegRowDecoder(const JpegRowDecoder &) = delete;
+  JpegRowDecoder &operator=(const JpegRowDecoder &) = delete;
+
+  // Appends the next piece of the file. endOfInput marks the end, so a
+  // truncated file fails instead of waiting for more data.
+  void append(const uint8_t *data, size_t size);
+  void endOfInput();
+
+  // Reads the header once enough input has arrived and returns whether the
+  // dimensions below are known. The output size includes any shrink-on-load
+  // from options.fitWidth and fitHeight; the source size is the stored one.
+  bool readHeader();
+  int width() const;
+  int height() const;
+  int channels() const;
+  int sourceWidth() const;
+  int sourceHeight() const;
+
+  // Decodes up to maxRows rows into dst and returns how many it produced.
+  // Fewer than maxRows means the input so far is used up, or the image is
+  // complete; finished() tells which. Throws std::runtime_error on corrupt
+  // input.
+  int readRows(uint8_t *dst, size_t stride, int maxRows);
+  bool finished() const;
+
+private:
+  struct State;
+  bool step(uint8_t *dst, size_t stride, int maxRows, int &rows);
+
+  std::unique_ptr<State> state_;
+};
+
+} // namespace ImageProcessor
@@ -0,0 +1,284 @@
+#include "encode.h"
+#include "scratch_pool.h"
+#include "stage_stats.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+#include "jpeg_error.h"
+#endif
+
+namespace ImageProcessor {
+
+bool canEncodeJpeg() {
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+  return true;
+#else
+  return false;
+#endif
+}
+
+size_t jpegMaxByteLength(int width, int height, int channels) {
+  // Same bound as libjpeg-turbo's tjBufSize(): two bytes per sample of the
+  // MCU-padded image (chroma at full resolution at worst) plus room for the
+  // headers and tables.
+  size_t paddedWidth = (static_cast<size_t>(width) + 15) & ~size_t(15);
+  size_t paddedHeight = (static_cast<size_t>(height) + 15) & ~size_t(15);
+  size_t components = channels == 1 ? 1 : 3;
+  return paddedWidth * paddedHeight * components * 2 + 2048;
+}
+
+#if defined(IMAGE_PROCESSOR_HAVE_JPEG)
+
+namespace {
+
+// Destination manager over a fixed, caller-sized buffer: libjpeg writes
+// straight into it and running out of room is an error, not a reallocation.
+struct FixedDestination {
+  jpeg_destination_mgr base;
+  uint8_t *data;
+  size_t capacity;
+  bool overflowed = false;
+};
+
+void initDestination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<FixedDestination *>(cinfo->dest);
+  dest->base.next_output_byte = dest->data;
+  dest->base.free_in_buffer = dest->capacity;
+}
+
+boolean emptyOutputBuffer(j_compress_ptr cinfo) {
+  reinterpret_cast<FixedDestination *>(cinfo->dest)->overflowed = true;
+  ERREXIT(cinfo, JERR_BUFFER_SIZE);
+  return FALSE;
+}
+
+void termDestination(j_compress_ptr) {}
+
+// Sets the image layout and compression parameters before
+// jpeg_start_compress. Fatal errors longjmp to the caller's setjmp.
+void configureCompress(jpeg_compress_struct &cinfo, int width, int height,
+                       int channels, const JpegOptions &options) {
+  cinfo.image_width = static_cast<JDIMENSION>(width);
+  cinfo.image_height = static_cast<JDIMENSION>(height);
+  cinfo.input_components = channels;
+  if (channels == 1) {
+    cinfo.in_color_space = JCS_GRAYSCALE;
+  } else if (channels == 3) {
+    cinfo.in_color_space = JCS_RGB;
+  } else {
+#if defined(JCS_EXTENSIONS)
+    cinfo.in_color_space = JCS_EXT_RGBX;
+#else
+    ERREXIT1(&cinfo, JERR_BAD_IN_COLORSPACE, channels);
+#endif
+  }
+
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, options.quality, TRUE);
+  cinfo.dct_method = JDCT_ISLOW;
+  if (options.progressive) {
+    jpeg_simple_progression(&cinfo);
+  }
+}
+
+// Drives the libjpeg calls that can fail; see readJpeg in decode.cpp for why
+// the setjmp lives in a frame without destructors.
+bool writeJpeg(jpeg_compress_struct &cinfo, JpegErrorManager &errors,
+               FixedDestination &dest, const uint8_t *pixels, int width,
+               int height, int channels, size_t stride,
+               const JpegOptions &options) {
+  if (setjmp(errors.jump)) {
+    return false;
+  }
+
+  jpeg_create_compress(&cinfo);
+  cinfo.dest = &dest.base;
+  configureCompress(cinfo, width, height, channels, options);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<JSAMPROW>(pixels + cinfo.next_scanline * stride);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  return true;
+}
+
+} // namespace
+
+size_t encodeJpeg(const uint8_t *pixels, int width, int height, int channels,
+                  size_t stride, const JpegOptions &options, uint8_t *dst,
+                  size_t capacity) {
+  StageTimer timer(Stage::Encode,
+                   static_cast<size_t>(width) * height * channels);
+  jpeg_compress_struct cinfo;
+  std::memset(&cinfo, 0, sizeof(cinfo));
+  JpegErrorManager errors;
+  cinfo.err = initJpegErrors(errors);
+
+  FixedDestination dest;
+  dest.base.init_destination = initDestination;
+  dest.base.empty_output_buffer = emptyOutputBuffer;
+  dest.base.term_destination = termDestination;
+  dest.data = dst;
+  dest.capacity = capacity;
+
+  bool ok = writeJpeg(cinfo, errors, dest, pixels, width, height, channels,
+                      stride, options);
+  size_t written = capacity - dest.base.free_in_buffer;
+  jpeg_destroy_compress(&cinfo);
+
+  if (dest.overflowed) {
+    throw std::runtime_error("output buffer too small for JPEG: " +
+                             std::to_string(capacity) + " bytes");
+  }
+  if (!ok) {
+    throw std::runtime_error(std::string("JPEG encode failed: ") +
+                             errors.message);
+  }
+  return written;
+}
+
+namespace {
+
+constexpr size_t kSinkBlockSize = 64 * 1024;
+
+// Destination manager that hands each full block to the caller's sink and
+// reuses it; a sink that cannot take the bytes fails the encode.
+struct SinkDestination {
+  jpeg_destination_mgr base;
+  ScratchBuffer block;
+  JpegRowEncoder::Sink sink;
+};
+
+void initSinkDestination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<SinkDestination *>(cinfo->dest);
+  dest->base.next_output_byte = dest->block.data();
+  dest->base.free_in_buffer = dest->block.size();
+}
+
+boolean emptySinkBuffer(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<SinkDestination *>(cinfo->dest);
+  if (!dest->sink(dest->block.data(), dest->block.size())) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+  initSinkDestination(cinfo);
+  return TRUE;
+}
+
+void termSinkDestination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<SinkDestination *>(cinfo->dest);
+  size_t used = dest->block.size() - dest->base.free_in_buffer;
+  if (used > 0 && !dest->sink(dest->block.data(), used)) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+}
+
+} // namespace
+
+struct JpegRowEncoder::State {
+  jpeg_compress_struct cinfo;
+  JpegErrorManager errors;
+  SinkDestination dest;
+  int width;
+  int height;
+  int channels;
+  JpegOptions options;
+  bool created = false;
+};
+
+JpegRowEncoder::JpegRowEncoder(int width, int height, int channels,
+                               const JpegOptions &options, Sink sink)
+    : state_(new State) {
+  State &state = *state_;
+  std::memset(&state.cinfo, 0, sizeof(state.cinfo));
+  state.cinfo.err = initJpegErrors(state.errors);
+  state.dest.base.init_destination = initSinkDestination;
+  state.dest.base.empty_output_buffer = emptySinkBuffer;
+  state.dest.base.term_destination = termSinkDestination;
+  state.dest.block = ScratchBuffer(kSinkBlockSize);
+  state.dest.sink = std::move(sink);
+  state.width = width;
+  state.height = height;
+  state.channels = channels;
+  state.options = options;
+  writeRows(nullptr, 0, 0);
+}
+
+JpegRowEncoder::~JpegRowEncoder() {
+  if (state_->created) {
+    jpeg_destroy_compress(&state_->cinfo);
+  }
+}
+
+// Starts the compressor on first use, then writes rows and optionally the
+// end of the file. See readJpeg in decode.cpp for why the setjmp lives here.
+bool JpegRowEncoder::step(const uint8_t *pixels, size_t stride, int rows,
+                          bool finish) {
+  State &state = *state_;
+  jpeg_compress_struct &cinfo = state.cinfo;
+  if (setjmp(state.errors.jump)) {
+    return false;
+  }
+
+  if (!state.created) {
+    jpeg_create_compress(&cinfo);
+    state.created = true;
+    cinfo.dest = &state.dest.base;
+    configureCompress(cinfo, state.width, state.height, state.channels,
+                      state.options);
+    jpeg_start_compress(&cinfo, TRUE);
+  }
+
+  for (int i = 0; i < rows; i++) {
+    JSAMPROW row = const_cast<JSAMPROW>(pixels + i * stride);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  if (finish) {
+    jpeg_finish_compress(&cinfo);
+  }
+  return true;
+}
+
+void JpegRowEncoder::writeRows(const uint8_t *pixels, size_t stride,
+                               int rows) {
+  if (!step(pixels, stride, rows, false)) {
+    throw std::runtime_error(std::string("JPEG encode failed: ") +
+                             state_->errors.message);
+  }
+}
+
+void JpegRowEncoder::finish() {
+  if (!step(nullptr, 0, 0, true)) {
+    throw std::runtime_error(std::string("JPEG encode failed: ") +
+                             state_->errors.message);
+  }
+}
+
+#else
+
+size_t encodeJpeg(const uint8_t *, int, int, int, size_t, const JpegOptions &,
+                  uint8_t *, size_t) {
+  throw std::runtime_error("JPEG encoding is not available in this build");
+}
+
+struct JpegRowEncoder::State {};
+
+JpegRowEncoder::JpegRowEncoder(int, int, int, const JpegOptions &, Sink) {
+  throw std::runtime_error("JPEG encoding is not available in this build");
+}
+
+JpegRowEncoder::~JpegRowEncoder() = default;
+void JpegRowEncoder::writeRows(const uint8_t *, size_t, int) {}
+void JpegRowEncoder::finish() {}
+bool JpegRowEncoder::step(const uint8_t *, size_t, int, bool) { return false; }
+
+#endif
+
+} // namespace ImageProcessor
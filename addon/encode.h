@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace ImageProcessor {
+
+struct JpegOptions {
+  int quality = 85;
+  bool progressive = false;
+};
+
+// Whether this build links the JPEG encoder (the with_jpeg variable in
+// binding.gyp).
+bool canEncodeJpeg();
+
+// Upper bound on the size of a JPEG for a width x height image, so callers
+// can size the destination once.
+size_t jpegMaxByteLength(int width, int height, int channels);
+
+// Compresses interleaved 8-bit pixels (1, 3 or 4 channels; a fourth channel
+// is ignored) straight into dst and returns the number of bytes written.
+// Single-channel input produces a one-component grayscale JPEG. Throws
+// std::runtime_error if the output does not fit in capacity bytes.
+size_t encodeJpeg(const uint8_t *pixels, int width, int height, int channels,
+                  size_t stride, const JpegOptions &options, uint8_t *dst,
+                  size_t capacity);
+
+// Incremental counterpart of encodeJpeg for the streaming pipeline: rows are
+// compressed as they arrive and the compressed bytes go to `sink` in blocks,
+// so neither the image nor the file has to be held in memory. The sink
+// returns false if it could not keep the bytes, which fails the encode.
+class JpegRowEncoder {
+public:
+  using Sink = std::function<bool(const uint8_t *data, size_t size)>;
+
+  JpegRowEncoder(int width, int height, int channels,
+                 const JpegOptions &options, Sink sink);
+  ~JpegRowEncoder();
+
+  JpegRowEncoder(const JpegRowEncoder &) = delete;
+  JpegRowEncoder &operator=(const JpegRowEncoder &) = delete;
+
+  // Compresses the next `rows` rows. Throws std::runtime_error on failure.
+  void writeRows(const uint8_t *pixels, size_t stride, int rows);
+  // Writes the end of the file once every row has been written.
+  void finish();
+
+private:
+  struct State;
+  bool step(const uint8_t *pixels, size_t stride, int rows, bool finish);
+
+  std::unique_ptr<State> state_;
+};
+
+} // namespace ImageProcessor
@@ -0,0 +1,661 @@
+#include "file_batch.h"
+#include "file_io.h"
+#include "stage_stats.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IMAGE_PROCESSOR_IO_URING 1
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace ImageProcessor {
+
+namespace {
+
+// Bigger single reads and writes gain nothing and the SQE length is 32-bit.
+constexpr size_t kMaxTransfer = size_t(1) << 30;
+
+std::string notRegularFile(const std::string &path) {
+  return "not a regular file: '" + path + "'";
+}
+
+std::string changedWhileReading(const std::string &path) {
+  return "file changed while being read: '" + path + "'";
+}
+
+// Splits count files over the shared pool; the work is blocking I/O, so
+// every file is its own chunk.
+template <typename Body> void forEachFile(size_t count, Body body) {
+  ThreadPool::shared().parallelFor(0, static_cast<int>(count), 1, 0,
+                                   [&](int begin, int end) {
+                                     for (int i = begin; i < end; i++) {
+                                       body(static_cast<size_t>(i));
+                                     }
+                                   });
+}
+
+#if defined(_WIN32)
+void readBlocking(FileRead &file) {
+  std::FILE *stream = std::fopen(file.path.c_str(), "rb");
+  if (stream == nullptr) {
+    file.error = fileErrorMessage("cannot open", file.path, errno);
+    return;
+  }
+  _fseeki64(stream, 0, SEEK_END);
+  size_t size = static_cast<size_t>(_ftelli64(stream));
+  _fseeki64(stream, 0, SEEK_SET);
+
+  file.data = ScratchBuffer(size);
+  if (size > 0 && std::fread(file.data.data(), 1, size, stream) != size) {
+    file.error = fileErrorMessage("cannot read", file.path, errno);
+  }
+  std::fclose(stream);
+}
+
+void writeBlocking(FileWrite &file) {
+  std::FILE *stream = std::fopen(file.path.c_str(), "wb");
+  if (stream == nullptr) {
+    file.error = fileErrorMessage("cannot create", file.path, errno);
+    return;
+  }
+  bool ok = std::fwrite(file.data, 1, file.size, stream) == file.size;
+  int error = errno;
+  if (std::fclose(stream) != 0 && ok) {
+    ok = false;
+    error = errno;
+  }
+  if (!ok) {
+    file.error = fileErrorMessage("cannot write", file.path, error);
+  }
+}
+
+std::vector<DirectoryEntry> listBlocking(const std::string &dir) {
+  WIN32_FIND_DATAA found;
+  HANDLE search = FindFirstFileA((dir + "\\*").c_str(), &found);
+  if (search == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("cannot open directory '" + dir + "'");
+  }
+
+  std::vector<DirectoryEntry> entries;
+  do {
+    if ((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+      entries.push_back(
+          {found.cFileName, (static_cast<uint64_t>(found.nFileSizeHigh) << 32) |
+                                found.nFileSizeLow});
+    }
+  } while (FindNextFileA(search, &found));
+  FindClose(search);
+  return entries;
+}
+#else
+void readBlocking(FileRead &file) {
+  int fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    file.error = fileErrorMessage("cannot open", file.path, errno);
+    return;
+  }
+
+  struct stat info;
+  if (::fstat(fd, &info) != 0) {
+    file.error = fileErrorMessage("cannot stat", file.path, errno);
+  } else if (!S_ISREG(info.st_mode)) {
+    file.error = notRegularFile(file.path);
+  } else {
+    const size_t size = static_cast<size_t>(info.st_size);
+    file.data = ScratchBuffer(size);
+    size_t done = 0;
+    while (done < size) {
+      ssize_t got = ::pread(fd, file.data.data() + done,
+                            std::min(size - done, kMaxTransfer),
+                            static_cast<off_t>(done));
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0) {
+        file.error = got < 0
+                         ? fileErrorMessage("cannot read", file.path, errno)
+                         : changedWhileReading(file.path);
+        break;
+      }
+      done += static_cast<size_t>(got);
+    }
+  }
+  ::close(fd);
+}
+
+void writeBlocking(FileWrite &file) {
+  int fd = ::open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+  if (fd < 0) {
+    file.error = fileErrorMessage("cannot create", file.path, errno);
+    return;
+  }
+
+  int error = 0;
+  size_t done = 0;
+  while (done < file.size && error == 0) {
+    ssize_t put = ::pwrite(fd, file.data + done,
+                           std::min(file.size - done, kMaxTransfer),
+                           static_cast<off_t>(done));
+    if (put < 0) {
+      if (errno != EINTR)
+        error = errno;
+      continue;
+    }
+    if (put == 0) {
+      error = ENOSPC;
+      break;
+    }
+    done += static_cast<size_t>(put);
+  }
+  if (::close(fd) != 0 && error == 0)
+    error = errno;
+  if (error != 0) {
+    file.error = fileErrorMessage("cannot write", file.path, error);
+  }
+}
+
+// Names come from readdir, which already reads the directory in large
+// getdents batches; directories are skipped by d_type before any stat.
+struct DirectoryListing {
+  explicit DirectoryListing(const std::string &dir)
+      : handle(::opendir(dir.c_str())) {
+    if (handle == nullptr) {
+      throw std::runtime_error(
+          fileErrorMessage("cannot open directory", dir, errno));
+    }
+    while (dirent *entry = ::readdir(handle)) {
+      if (entry->d_type == DT_DIR || std::strcmp(entry->d_name, ".") == 0 ||
+          std::strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      names.emplace_back(entry->d_name);
+    }
+  }
+  ~DirectoryListing() { ::closedir(handle); }
+
+  DIR *handle;
+  std::vector<std::string> names;
+};
+
+// Marks entries that turned out not to be regular files.
+constexpr uint64_t kNotAFile = ~uint64_t(0);
+
+std::vector<DirectoryEntry> keepRegularFiles(DirectoryListing &listing,
+                                             std::vector<uint64_t> &sizes) {
+  std::vector<DirectoryEntry> entries;
+  entries.reserve(listing.names.size());
+  for (size_t i = 0; i < listing.names.size(); i++) {
+    if (sizes[i] != kNotAFile) {
+      entries.push_back({std::move(listing.names[i]), sizes[i]});
+    }
+  }
+  return entries;
+}
+
+std::vector<DirectoryEntry> listBlocking(const std::string &dir) {
+  DirectoryListing listing(dir);
+  const int dirFd = ::dirfd(listing.handle);
+  std::vector<uint64_t> sizes(listing.names.size());
+
+  forEachFile(listing.names.size(), [&](size_t i) {
+    struct stat info;
+    bool regular = ::fstatat(dirFd, listing.names[i].c_str(), &info, 0) == 0 &&
+                   S_ISREG(info.st_mode);
+    sizes[i] = regular ? static_cast<uint64_t>(info.st_size) : kNotAFile;
+  });
+  return keepRegularFiles(listing, sizes);
+}
+#endif
+
+#if defined(IMAGE_PROCESSOR_IO_URING)
+constexpr unsigned kQueueDepth = 64;
+
+// The parts of io_uring this file needs, over the raw syscalls so liburing
+// is not a build dependency. The submission queue has kQueueDepth entries
+// and runJobs never has more operations than that in flight, so prepare()
+// always finds a free entry.
+class Ring {
+public:
+  Ring() = default;
+  ~Ring() {
+    if (sqes_ != nullptr)
+      ::munmap(sqes_, sqesSize_);
+    if (cqRing_ != nullptr && cqRing_ != sqRing_)
+      ::munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != nullptr)
+      ::munmap(sqRing_, sqRingSize_);
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+
+  // False when the kernel lacks io_uring, refuses it, or predates any of
+  // the opcodes used here.
+  bool open() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd_ = static_cast<int>(
+        ::syscall(__NR_io_uring_setup, kQueueDepth, &params));
+    if (fd_ < 0)
+      return false;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+      sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = map(sqRingSize_, IORING_OFF_SQ_RING);
+    if (sqRing_ == nullptr)
+      return false;
+    cqRing_ = single ? sqRing_ : map(cqRingSize_, IORING_OFF_CQ_RING);
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(map(sqesSize_, IORING_OFF_SQES));
+    if (cqRing_ == nullptr || sqes_ == nullptr)
+      return false;
+
+    uint8_t *sq = static_cast<uint8_t *>(sqRing_);
+    uint8_t *cq = static_cast<uint8_t *>(cqRing_);
+    sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    return supports({IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                     IORING_OP_WRITE, IORING_OP_CLOSE});
+  }
+
+  // A zeroed entry for the next operation; it is submitted by wait().
+  io_uring_sqe &prepare(uint8_t opcode, uint64_t userData) {
+    unsigned tail = *sqTail_ + queued_;
+    unsigned index = tail & sqMask_;
+    io_uring_sqe &sqe = sqes_[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.user_data = userData;
+    sqArray_[index] = index;
+    queued_++;
+    return sqe;
+  }
+
+  // Submits everything prepared and blocks for at least one completion,
+  // then passes each completion to handle(userData, result).
+  template <typename Handle> void wait(Handle handle) {
+    if (queued_ > 0) {
+      __atomic_store_n(sqTail_, *sqTail_ + queued_, __ATOMIC_RELEASE);
+    }
+    unsigned submit = queued_;
+    queued_ = 0;
+    while (::syscall(__NR_io_uring_enter, fd_, submit, 1,
+                     IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        throw std::runtime_error(std::string("io_uring_enter failed: ") +
+                                 std::strerror(errno));
+      }
+      submit = 0;
+    }
+
+    unsigned head = *cqHead_;
+    const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const io_uring_cqe &cqe = cqes_[head & cqMask_];
+      handle(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+  }
+
+private:
+  void *map(size_t size, off_t offset) {
+    void *mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return mapping == MAP_FAILED ? nullptr : mapping;
+  }
+
+  bool supports(std::initializer_list<int> opcodes) {
+    constexpr unsigned kProbeOps = 256;
+    ScratchBuffer storage(sizeof(io_uring_probe) +
+                          kProbeOps * sizeof(io_uring_probe_op));
+    std::memset(storage.data(), 0, storage.size());
+    io_uring_probe *probe = storage.as<io_uring_probe>();
+    if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                  kProbeOps) < 0)
+      return false;
+    for (int opcode : opcodes) {
+      if (opcode > probe->last_op ||
+          (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) == 0)
+        return false;
+    }
+    return true;
+  }
+
+  int fd_ = -1;
+  void *sqRing_ = nullptr;
+  void *cqRing_ = nullptr;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqRingSize_ = 0;
+  size_t cqRingSize_ = 0;
+  size_t sqesSize_ = 0;
+  unsigned *sqTail_ = nullptr;
+  unsigned sqMask_ = 0;
+  unsigned *sqArray_ = nullptr;
+  unsigned *cqHead_ = nullptr;
+  unsigned *cqTail_ = nullptr;
+  unsigned cqMask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  unsigned queued_ = 0;
+};
+
+// Runs count jobs through the ring, each a chain of operations with one in
+// flight at a time. A job gets one of kQueueDepth slots for its state while
+// it runs; start(job, slot) queues its first operation, and step(job, slot,
+// result) handles each completion, queueing the next operation or returning
+// true when the job is done.
+template <typename Start, typename Step>
+void runJobs(Ring &ring, size_t count, Start start, Step step) {
+  unsigned freeSlots[kQueueDepth];
+  unsigned freeCount = kQueueDepth;
+  for (unsigned i = 0; i < kQueueDepth; i++) {
+    freeSlots[i] = kQueueDepth - 1 - i;
+  }
+
+  size_t next = 0;
+  while (next < count || freeCount < kQueueDepth) {
+    while (next < count && freeCount > 0) {
+      start(next++, freeSlots[--freeCount]);
+    }
+    ring.wait([&](uint64_t userData, int32_t result) {
+      size_t job = static_cast<size_t>(userData / kQueueDepth);
+      unsigned slot = static_cast<unsigned>(userData % kQueueDepth);
+      if (step(job, slot, result)) {
+        freeSlots[freeCount++] = slot;
+      }
+    });
+  }
+}
+
+uint64_t tag(size_t job, unsigned slot) {
+  return static_cast<uint64_t>(job) * kQueueDepth + slot;
+}
+
+struct ReadSlot {
+  enum class Stage { Open, Stat, Read, Close } stage;
+  int fd;
+  size_t done;
+  struct statx info;
+};
+
+void readWithRing(Ring &ring, std::vector<FileRead> &files) {
+  ReadSlot slots[kQueueDepth];
+
+  auto queueClose = [&](size_t job, unsigned slot) {
+    slots[slot].stage = ReadSlot::Stage::Close;
+    ring.prepare(IORING_OP_CLOSE, tag(job, slot)).fd = slots[slot].fd;
+  };
+  auto queueRead = [&](size_t job, unsigned slot) {
+    ReadSlot &state = slots[slot];
+    FileRead &file = files[job];
+    state.stage = ReadSlot::Stage::Read;
+    io_uring_sqe &sqe = ring.prepare(IORING_OP_READ, tag(job, slot));
+    sqe.fd = state.fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(file.data.data() + state.done);
+    sqe.len = static_cast<unsigned>(
+        std::min(file.data.size() - state.done, kMaxTransfer));
+    sqe.off = state.done;
+  };
+
+  runJobs(
+      ring, files.size(),
+      [&](size_t job, unsigned slot) {
+        slots[slot].stage = ReadSlot::Stage::Open;
+        io_uring_sqe &sqe = ring.prepare(IORING_OP_OPENAT, tag(job, slot));
+        sqe.fd = AT_FDCWD;
+        sqe.addr = reinterpret_cast<uintptr_t>(files[job].path.c_str());
+        sqe.open_flags = O_RDONLY | O_CLOEXEC;
+      },
+      [&](size_t job, unsigned slot, int32_t result) {
+        ReadSlot &state = slots[slot];
+        FileRead &file = files[job];
+
+        switch (state.stage) {
+        case ReadSlot::Stage::Open: {
+          if (result < 0) {
+            file.error = fileErrorMessage("cannot open", file.path, -result);
+            return true;
+          }
+          state.fd = result;
+          state.stage = ReadSlot::Stage::Stat;
+          io_uring_sqe &sqe = ring.prepare(IORING_OP_STATX, tag(job, slot));
+          sqe.fd = state.fd;
+          sqe.addr = reinterpret_cast<uintptr_t>("");
+          sqe.len = STATX_TYPE | STATX_SIZE;
+          sqe.statx_flags = AT_EMPTY_PATH;
+          sqe.off = reinterpret_cast<uintptr_t>(&state.info);
+          return false;
+        }
+        case ReadSlot::Stage::Stat:
+          if (result < 0) {
+            file.error = fileErrorMessage("cannot stat", file.path, -result);
+          } else if (!S_ISREG(state.info.stx_mode)) {
+            file.error = notRegularFile(file.path);
+          } else if (state.info.stx_size > 0) {
+            file.data = ScratchBuffer(static_cast<size_t>(state.info.stx_size));
+            state.done = 0;
+            queueRead(job, slot);
+            return false;
+          }
+          queueClose(job, slot);
+          return false;
+        case ReadSlot::Stage::Read:
+          if (result <= 0) {
+            file.error =
+                result < 0 ? fileErrorMessage("cannot read", file.path, -result)
+                           : changedWhileReading(file.path);
+            queueClose(job, slot);
+            return false;
+          }
+          state.done += static_cast<size_t>(result);
+          if (state.done < file.data.size()) {
+            queueRead(job, slot);
+          } else {
+            queueClose(job, slot);
+          }
+          return false;
+        case ReadSlot::Stage::Close:
+          return true;
+        }
+        return true;
+      });
+}
+
+struct WriteSlot {
+  enum class Stage { Open, Write, Close } stage;
+  int fd;
+  size_t done;
+};
+
+void writeWithRing(Ring &ring, std::vector<FileWrite> &files) {
+  WriteSlot slots[kQueueDepth];
+
+  auto queueNext = [&](size_t job, unsigned slot) {
+    WriteSlot &state = slots[slot];
+    FileWrite &file = files[job];
+    if (state.done < file.size && file.error.empty()) {
+      state.stage = WriteSlot::Stage::Write;
+      io_uring_sqe &sqe = ring.prepare(IORING_OP_WRITE, tag(job, slot));
+      sqe.fd = state.fd;
+      sqe.addr = reinterpret_cast<uintptr_t>(file.data + state.done);
+      sqe.len =
+          static_cast<unsigned>(std::min(file.size - state.done, kMaxTransfer));
+      sqe.off = state.done;
+    } else {
+      state.stage = WriteSlot::Stage::Close;
+      ring.prepare(IORING_OP_CLOSE, tag(job, slot)).fd = state.fd;
+    }
+  };
+
+  runJobs(
+      ring, files.size(),
+      [&](size_t job, unsigned slot) {
+        slots[slot].stage = WriteSlot::Stage::Open;
+        io_uring_sqe &sqe = ring.prepare(IORING_OP_OPENAT, tag(job, slot));
+        sqe.fd = AT_FDCWD;
+        sqe.addr = reinterpret_cast<uintptr_t>(files[job].path.c_str());
+        sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe.len = 0666;
+      },
+      [&](size_t job, unsigned slot, int32_t result) {
+        WriteSlot &state = slots[slot];
+        FileWrite &file = files[job];
+
+        switch (state.stage) {
+        case WriteSlot::Stage::Open:
+          if (result < 0) {
+            file.error = fileErrorMessage("cannot create", file.path, -result);
+            return true;
+          }
+          state.fd = result;
+          state.done = 0;
+          queueNext(job, slot);
+          return false;
+        case WriteSlot::Stage::Write:
+          // A write that takes no bytes would be queued again forever; like
+          // a short read, it means the file cannot be written.
+          if (result <= 0) {
+            file.error = fileErrorMessage("cannot write", file.path,
+                                          result < 0 ? -result : ENOSPC);
+          } else {
+            state.done += static_cast<size_t>(result);
+          }
+          queueNext(job, slot);
+          return false;
+        case WriteSlot::Stage::Close:
+          if (result < 0 && file.error.empty()) {
+            file.error = fileErrorMessage("cannot write", file.path, -result);
+          }
+          return true;
+        }
+        return true;
+      });
+}
+
+std::vector<DirectoryEntry> listWithRing(Ring &ring, const std::string &dir) {
+  DirectoryListing listing(dir);
+  const int dirFd = ::dirfd(listing.handle);
+  std::vector<uint64_t> sizes(listing.names.size());
+  struct statx slots[kQueueDepth];
+
+  runJobs(
+      ring, listing.names.size(),
+      [&](size_t job, unsigned slot) {
+        io_uring_sqe &sqe = ring.prepare(IORING_OP_STATX, tag(job, slot));
+        sqe.fd = dirFd;
+        sqe.addr = reinterpret_cast<uintptr_t>(listing.names[job].c_str());
+        sqe.len = STATX_TYPE | STATX_SIZE;
+        sqe.off = reinterpret_cast<uintptr_t>(&slots[slot]);
+      },
+      [&](size_t job, unsigned slot, int32_t result) {
+        sizes[job] = result == 0 && S_ISREG(slots[slot].stx_mode)
+                         ? slots[slot].stx_size
+                         : kNotAFile;
+        return true;
+      });
+  return keepRegularFiles(listing, sizes);
+}
+
+// IMAGE_PROCESSOR_IO=threads forces the thread-pool backend, e.g. to
+// compare the two or to rule io_uring out.
+bool useRing() {
+  static const bool usable = [] {
+    const char *requested = std::getenv("IMAGE_PROCESSOR_IO");
+    if (requested != nullptr && std::strcmp(requested, "threads") == 0)
+      return false;
+    Ring ring;
+    return ring.open();
+  }();
+  return usable;
+}
+#else
+bool useRing() { return false; }
+#endif
+
+} // namespace
+
+const char *fileBatchBackend() { return useRing() ? "io_uring" : "threads"; }
+
+// A whole batch is timed as one read or write, since its files are in
+// flight together.
+void readFiles(std::vector<FileRead> &files) {
+  StageTimer timer(Stage::Read, 0);
+  auto countBytes = [&] {
+    size_t bytes = 0;
+    for (const FileRead &file : files) {
+      bytes += file.data.size();
+    }
+    timer.setBytes(bytes);
+  };
+#if defined(IMAGE_PROCESSOR_IO_URING)
+  Ring ring;
+  if (useRing() && ring.open()) {
+    readWithRing(ring, files);
+    countBytes();
+    return;
+  }
+#endif
+  forEachFile(files.size(), [&](size_t i) { readBlocking(files[i]); });
+  countBytes();
+}
+
+void writeFiles(std::vector<FileWrite> &files) {
+  size_t bytes = 0;
+  for (const FileWrite &file : files) {
+    bytes += file.size;
+  }
+  StageTimer timer(Stage::Write, bytes);
+#if defined(IMAGE_PROCESSOR_IO_URING)
+  Ring ring;
+  if (useRing() && ring.open()) {
+    writeWithRing(ring, files);
+    return;
+  }
+#endif
+  forEachFile(files.size(), [&](size_t i) { writeBlocking(files[i]); });
+}
+
+std::vector<DirectoryEntry> listDirectory(const std::string &dir) {
+#if defined(IMAGE_PROCESSOR_IO_URING)
+  Ring ring;
+  if (useRing() && ring.open()) {
+    return listWithRing(ring, dir);
+  }
+#endif
+  return listBlocking(dir);
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "scratch_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ImageProcessor {
+
+// Whole-file I/O for many files per call. On Linux the opens, size queries,
+// reads, writes and closes of a batch are queued on one io_uring, with up to
+// 64 files in flight, so a batch costs a handful of io_uring_enter calls
+// instead of four or five syscalls per file. Where io_uring is missing or
+// blocked (old kernels, seccomp), or with IMAGE_PROCESSOR_IO=threads, the
+// files are spread over the shared thread pool with plain blocking calls.
+// Failures are reported per file in `error`, worded like InputFile's, and
+// never stop the rest of the batch.
+
+struct FileRead {
+  std::string path;
+  ScratchBuffer data;
+  std::string error;
+};
+
+struct FileWrite {
+  std::string path;
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  std::string error;
+};
+
+struct DirectoryEntry {
+  std::string name;
+  uint64_t size;
+};
+
+// "io_uring" or "threads", decided once per process.
+const char *fileBatchBackend();
+
+void readFiles(std::vector<FileRead> &files);
+
+// Creates or truncates each path and writes its bytes.
+void writeFiles(std::vector<FileWrite> &files);
+
+// The regular files in dir (following symlinks) with their sizes, in
+// directory order. Throws std::runtime_error if dir cannot be opened.
+std::vector<DirectoryEntry> listDirectory(const std::string &dir);
+
+} // namespace ImageProcessor
@@ -0,0 +1,226 @@
+#include "file_io.h"
+#include "stage_stats.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ImageProcessor {
+
+std::string fileErrorMessage(const char *what, const std::string &path,
+                             int error) {
+  return std::string(what) + " '" + path + "': " + std::strerror(error);
+}
+
+namespace {
+
+std::runtime_error fileError(const char *what, const std::string &path,
+                             int error) {
+  return std::runtime_error(fileErrorMessage(what, path, error));
+}
+
+size_t roundUpToBlock(size_t size) {
+  return (size + kDirectIoAlignment - 1) / kDirectIoAlignment *
+         kDirectIoAlignment;
+}
+
+#if !defined(_WIN32)
+// Closes the descriptor on every exit path; close() reports deferred write
+// errors (NFS, quota), so writers call it explicitly and check the result.
+struct FileDescriptor {
+  explicit FileDescriptor(int fd) : fd(fd) {}
+  ~FileDescriptor() { close(); }
+
+  int close() {
+    int result = fd >= 0 ? ::close(fd) : 0;
+    fd = -1;
+    return result;
+  }
+
+  int fd;
+};
+
+// Returns 0 or the errno of the failed write.
+int writeAll(int fd, const uint8_t *data, size_t size) {
+  off_t offset = 0;
+  while (size > 0) {
+    ssize_t written = ::pwrite(fd, data, size, offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+    offset += written;
+  }
+  return 0;
+}
+
+// Returns false when the filesystem does not take O_DIRECT, so the caller
+// falls back to a buffered write.
+bool writeDirect(const std::string &path, OutputBlock &block, size_t length) {
+#if defined(O_DIRECT)
+  FileDescriptor file(::open(path.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC |
+                                 O_DIRECT,
+                             0666));
+  if (file.fd < 0) {
+    if (errno == EINVAL)
+      return false;
+    throw fileError("cannot create", path, errno);
+  }
+
+  const size_t padded = roundUpToBlock(length);
+  std::memset(block.data + length, 0, padded - length);
+  int error = writeAll(file.fd, block.data, padded);
+  if (error == EINVAL)
+    return false;
+  if (error == 0 && ::ftruncate(file.fd, static_cast<off_t>(length)) != 0)
+    error = errno;
+  if (error == 0 && file.close() != 0)
+    error = errno;
+  if (error != 0)
+    throw fileError("cannot write", path, error);
+  return true;
+#else
+  (void)path;
+  (void)block;
+  (void)length;
+  return false;
+#endif
+}
+#endif
+
+} // namespace
+
+#if defined(_WIN32)
+InputFile::InputFile(const std::string &path) {
+  StageTimer timer(Stage::Read, 0);
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    throw fileError("cannot open", path, errno);
+  }
+  _fseeki64(file, 0, SEEK_END);
+  size_ = static_cast<size_t>(_ftelli64(file));
+  _fseeki64(file, 0, SEEK_SET);
+
+  copy_ = ScratchBuffer(size_);
+  size_t read = size_ > 0 ? std::fread(copy_.data(), 1, size_, file) : 0;
+  int error = errno;
+  std::fclose(file);
+  if (read != size_) {
+    throw fileError("cannot read", path, error);
+  }
+  data_ = copy_.data();
+  timer.setBytes(size_);
+}
+
+InputFile::~InputFile() = default;
+
+void writeOutputFile(const std::string &path, OutputBlock &block,
+                     size_t length, bool) {
+  StageTimer timer(Stage::Write, length);
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    throw fileError("cannot create", path, errno);
+  }
+  size_t written = std::fwrite(block.data, 1, length, file);
+  int error = errno;
+  if (std::fclose(file) != 0 && written == length) {
+    written = 0;
+    error = errno;
+  }
+  if (written != length) {
+    throw fileError("cannot write", path, error);
+  }
+}
+#else
+InputFile::InputFile(const std::string &path) {
+  StageTimer timer(Stage::Read, 0);
+  FileDescriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (file.fd < 0) {
+    throw fileError("cannot open", path, errno);
+  }
+
+  struct stat info;
+  if (::fstat(file.fd, &info) != 0) {
+    throw fileError("cannot stat", path, errno);
+  }
+  if (!S_ISREG(info.st_mode)) {
+    throw std::runtime_error("not a regular file: '" + path + "'");
+  }
+  size_ = static_cast<size_t>(info.st_size);
+  timer.setBytes(size_);
+  if (size_ == 0) {
+    return;
+  }
+
+  // Prefaulting maps the whole file in one call instead of taking a page
+  // fault per 4 KiB as the decoder walks through it.
+  int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+  flags |= MAP_POPULATE;
+#endif
+  void *mapping = ::mmap(nullptr, size_, PROT_READ, flags, file.fd, 0);
+  if (mapping == MAP_FAILED) {
+    throw fileError("cannot map", path, errno);
+  }
+  ::posix_madvise(mapping, size_, POSIX_MADV_SEQUENTIAL);
+  data_ = static_cast<const uint8_t *>(mapping);
+  mapped_ = true;
+}
+
+InputFile::~InputFile() {
+  if (mapped_) {
+    ::munmap(const_cast<uint8_t *>(data_), size_);
+  }
+}
+
+void writeOutputFile(const std::string &path, OutputBlock &block,
+                     size_t length, bool direct) {
+  StageTimer timer(Stage::Write, length);
+  if (direct && writeDirect(path, block, length)) {
+    return;
+  }
+
+  FileDescriptor file(
+      ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+  if (file.fd < 0) {
+    throw fileError("cannot create", path, errno);
+  }
+#if defined(F_NOCACHE)
+  if (direct) {
+    ::fcntl(file.fd, F_NOCACHE, 1);
+  }
+#endif
+
+  int error = writeAll(file.fd, block.data, length);
+  if (error == 0 && file.close() != 0)
+    error = errno;
+  if (error != 0) {
+    throw fileError("cannot write", path, error);
+  }
+}
+#endif
+
+OutputBlock allocateOutputBlock(size_t size) {
+  OutputBlock block;
+  block.capacity = roundUpToBlock(size);
+  block.storage = ScratchBuffer(block.capacity + kDirectIoAlignment);
+  uintptr_t address = reinterpret_cast<uintptr_t>(block.storage.data());
+  uintptr_t aligned =
+      (address + kDirectIoAlignment - 1) & ~uintptr_t(kDirectIoAlignment - 1);
+  block.data = block.storage.data() + (aligned - address);
+  return block;
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "scratch_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ImageProcessor {
+
+// "<what> '<path>': <strerror(error)>", the wording of every file error.
+std::string fileErrorMessage(const char *what, const std::string &path,
+                             int error);
+
+// Read-only view of a whole file. On POSIX systems the file is mapped
+// (prefaulted where the kernel supports it), so the decoder reads straight
+// from the page cache and the bytes are never copied into a buffer; other
+// platforms read it into a scratch block. The file must not be truncated
+// while it is mapped. Throws std::runtime_error naming the path on failure.
+class InputFile {
+public:
+  explicit InputFile(const std::string &path);
+  ~InputFile();
+
+  InputFile(const InputFile &) = delete;
+  InputFile &operator=(const InputFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  ScratchBuffer copy_;
+};
+
+// O_DIRECT needs the buffer, the file offset and the length aligned to the
+// device's logical block; 4 KiB covers every common device.
+constexpr size_t kDirectIoAlignment = 4096;
+
+// Scratch memory for an output of up to `size` bytes that writeOutputFile can
+// hand to O_DIRECT as it is: data is block-aligned and capacity is size
+// rounded up to whole blocks.
+struct OutputBlock {
+  ScratchBuffer storage;
+  uint8_t *data;
+  size_t capacity;
+};
+
+OutputBlock allocateOutputBlock(size_t size);
+
+// Creates or truncates path and writes length bytes of block to it. With
+// direct the write bypasses the page cache (O_DIRECT on Linux, F_NOCACHE on
+// macOS): the tail block is zero-padded and the file truncated back to
+// length afterwards. Filesystems that refuse O_DIRECT, such as tmpfs, get a
+// normal write instead. Throws std::runtime_error naming the path on failure.
+void writeOutputFile(const std::string &path, OutputBlock &block,
+                     size_t length, bool direct);
+
+} // namespace ImageProcessor
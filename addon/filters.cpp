@@ -0,0 +1,276 @@
+#include "filters.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace ImageProcessor {
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+double sinc(double x) {
+  if (x == 0.0)
+    return 1.0;
+  x *= kPi;
+  return std::sin(x) / x;
+}
+
+double lanczos3(double x) {
+  x = std::fabs(x);
+  return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+// Taps needed by any output sample when srcSize source samples, averaged in
+// blocks of `block`, map onto outSize.
+int maxTapsFor(ResizeFilter filter, int srcSize, int block, int outSize) {
+  double scale = static_cast<double>(srcSize) / outSize;
+  if (filter == ResizeFilter::Lanczos3) {
+    double support = 3.0 * std::max(scale, 1.0);
+    return static_cast<int>(std::ceil(2.0 * support)) + 1;
+  }
+  return static_cast<int>(std::ceil(scale / block)) + 1;
+}
+
+// Fills one axis of taps over the inputs left after averaging blocks of
+// `block` source samples. Box weights are the overlap, in source
+// coordinates, of each block with the output sample's footprint, so a short
+// block at the edge counts only for what it covers. Lanczos is centred on
+// the footprint and widened by the reduction ratio so it also low-passes.
+// Taps falling outside the image are dropped and the rest renormalised, and
+// rounding is absorbed by the largest tap so flat areas stay exactly flat.
+void buildTaps(ResizeFilter filter, int srcSize, int block, int outSize,
+               int maxTaps, int32_t *start, int32_t *count,
+               int16_t *weights) {
+  const int inSize = (srcSize + block - 1) / block;
+  const double scale = static_cast<double>(srcSize) / outSize;
+  const double filterScale = std::max(scale, 1.0);
+  double exact[64];
+  double *values = maxTaps <= 64 ? exact : nullptr;
+  ScratchBuffer spill;
+  if (values == nullptr) {
+    spill = ScratchBuffer(maxTaps * sizeof(double));
+    values = spill.as<double>();
+  }
+
+  for (int i = 0; i < outSize; i++) {
+    int first;
+    int last;
+    if (filter == ResizeFilter::Lanczos3) {
+      double center = (i + 0.5) * scale;
+      double support = 3.0 * filterScale;
+      first = std::max(0, static_cast<int>(std::floor(center - support)));
+      last = std::min(inSize, static_cast<int>(std::ceil(center + support)));
+      last = std::min(last, first + maxTaps);
+      for (int j = first; j < last; j++) {
+        values[j - first] = lanczos3((j + 0.5 - center) / filterScale);
+      }
+    } else {
+      double low = i * scale;
+      double high = low + scale;
+      first = std::min(inSize - 1, static_cast<int>(std::floor(low / block)));
+      last = std::min(inSize, static_cast<int>(std::ceil(high / block)));
+      last = std::min(std::max(last, first + 1), first + maxTaps);
+      for (int j = first; j < last; j++) {
+        double blockEnd = std::min<double>((j + 1.0) * block, srcSize);
+        values[j - first] = std::max(
+            0.0, std::min(blockEnd, high) - std::max<double>(j * block, low));
+      }
+    }
+
+    int taps = last - first;
+    double total = 0.0;
+    for (int t = 0; t < taps; t++) {
+      total += values[t];
+    }
+
+    int16_t *row = weights + static_cast<size_t>(i) * maxTaps;
+    int32_t sum = 0;
+    int largest = 0;
+    for (int t = 0; t < taps; t++) {
+      double weight = total != 0.0 ? values[t] / total : (t == 0 ? 1.0 : 0.0);
+      row[t] = static_cast<int16_t>(std::lround(weight * kFilterWeightOne));
+      sum += row[t];
+      if (values[t] > values[largest])
+        largest = t;
+    }
+    row[largest] = static_cast<int16_t>(row[largest] + kFilterWeightOne - sum);
+
+    start[i] = first;
+    count[i] = taps;
+  }
+}
+
+} // namespace
+
+FilterPlan makeFilterPlan(ResizeFilter filter, int srcWidth, int srcHeight,
+                          int dstWidth, int dstHeight) {
+  FilterPlan plan;
+  plan.srcWidth = srcWidth;
+  plan.srcHeight = srcHeight;
+  plan.dstWidth = dstWidth;
+  plan.dstHeight = dstHeight;
+
+  // Whole blocks are averaged without multiplies, and the taps only have to
+  // cover the remaining ratio, which is below two.
+  const bool box = filter == ResizeFilter::Box;
+  plan.shrinkX = box ? std::max(1, srcWidth / dstWidth) : 1;
+  plan.shrinkY = box ? std::max(1, srcHeight / dstHeight) : 1;
+  plan.reducedWidth = (srcWidth + plan.shrinkX - 1) / plan.shrinkX;
+  plan.reducedHeight = (srcHeight + plan.shrinkY - 1) / plan.shrinkY;
+
+  const int xTaps = maxTapsFor(filter, srcWidth, plan.shrinkX, dstWidth);
+  const int yTaps = maxTapsFor(filter, srcHeight, plan.shrinkY, dstHeight);
+  const size_t columns = static_cast<size_t>(dstWidth);
+  const size_t rows = static_cast<size_t>(dstHeight);
+  plan.storage = ScratchBuffer((2 * columns + 2 * rows) * sizeof(int32_t) +
+                               (columns * xTaps + rows * yTaps) *
+                                   sizeof(int16_t));
+
+  int32_t *xStart = plan.storage.as<int32_t>();
+  int32_t *xCount = xStart + columns;
+  int32_t *yStart = xCount + columns;
+  int32_t *yCount = yStart + rows;
+  int16_t *xWeights = reinterpret_cast<int16_t *>(yCount + rows);
+  int16_t *yWeights = xWeights + columns * xTaps;
+
+  buildTaps(filter, srcWidth, plan.shrinkX, dstWidth, xTaps, xStart, xCount,
+            xWeights);
+  buildTaps(filter, srcHeight, plan.shrinkY, dstHeight, yTaps, yStart, yCount,
+            yWeights);
+
+  plan.x = {xTaps, xStart, xCount, xWeights};
+  plan.y = {yTaps, yStart, yCount, yWeights};
+  return plan;
+}
+
+void accumulateBlocks(const FilterPlan &plan, const uint8_t *luma,
+                      uint32_t *sums) {
+  const size_t srcWidth = static_cast<size_t>(plan.srcWidth);
+  for (int c = 0; c < plan.reducedWidth; c++) {
+    size_t x = static_cast<size_t>(c) * plan.shrinkX;
+    size_t end = std::min(srcWidth, x + plan.shrinkX);
+    uint32_t sum = 0;
+    for (; x < end; x++) {
+      sum += luma[x];
+    }
+    sums[c] += sum;
+  }
+}
+
+void finishBlocks(const FilterPlan &plan, const uint32_t *sums, int blockRows,
+                  uint8_t *reduced) {
+  const size_t srcWidth = static_cast<size_t>(plan.srcWidth);
+  for (int c = 0; c < plan.reducedWidth; c++) {
+    size_t x = static_cast<size_t>(c) * plan.shrinkX;
+    uint32_t area = static_cast<uint32_t>(blockRows) *
+                    static_cast<uint32_t>(std::min(srcWidth, x + plan.shrinkX) -
+                                          x);
+    reduced[c] = static_cast<uint8_t>((sums[c] + area / 2) / area);
+  }
+}
+
+void filterRowHorizontal(const FilterPlan &plan, const uint8_t *reduced,
+                         int32_t *out) {
+  constexpr int shift = kFilterWeightBits - kFilterPrecisionBits;
+  for (int x = 0; x < plan.dstWidth; x++) {
+    const uint8_t *in = reduced + plan.x.start[x];
+    const int16_t *weights =
+        plan.x.weights + static_cast<size_t>(x) * plan.x.maxTaps;
+    int32_t sum = 0;
+    for (int t = 0; t < plan.x.count[x]; t++) {
+      sum += weights[t] * in[t];
+    }
+    out[x] = (sum + (1 << (shift - 1))) >> shift;
+  }
+}
+
+void filterRowVertical(const FilterPlan &plan, int y,
+                       const int32_t *const *rows, int32_t *sums,
+                       uint8_t *dst) {
+  constexpr int shift = kFilterWeightBits + kFilterPrecisionBits;
+  const size_t dstWidth = static_cast<size_t>(plan.dstWidth);
+  const int16_t *weights =
+      plan.y.weights + static_cast<size_t>(y) * plan.y.maxTaps;
+
+  std::fill(sums, sums + dstWidth, 1 << (shift - 1));
+  for (int t = 0; t < plan.y.count[y]; t++) {
+    const int32_t *row = rows[t];
+    const int32_t weight = weights[t];
+    for (size_t x = 0; x < dstWidth; x++) {
+      sums[x] += weight * row[x];
+    }
+  }
+
+  for (size_t x = 0; x < dstWidth; x++) {
+    dst[x] = static_cast<uint8_t>(std::clamp(sums[x] >> shift, 0, 255));
+  }
+}
+
+void filterLumaRows(const FilterPlan &plan, const uint8_t *src,
+                    int srcChannels, size_t srcStride, uint8_t *dst,
+                    size_t dstStride, int yBegin, int yEnd) {
+  const KernelTable &kernels = activeKernels();
+  const size_t srcWidth = static_cast<size_t>(plan.srcWidth);
+  const size_t reducedWidth = static_cast<size_t>(plan.reducedWidth);
+  const size_t dstWidth = static_cast<size_t>(plan.dstWidth);
+  const bool shrinking = plan.shrinkX > 1 || plan.shrinkY > 1;
+  const int slots = plan.y.maxTaps;
+
+  ScratchBuffer luma(srcChannels == 1 ? 0 : srcWidth);
+  ScratchBuffer blockSums(shrinking ? reducedWidth * sizeof(uint32_t) : 0);
+  ScratchBuffer reduced(shrinking ? reducedWidth : 0);
+  ScratchBuffer ring(static_cast<size_t>(slots) * dstWidth * sizeof(int32_t));
+  ScratchBuffer accumulator(dstWidth * sizeof(int32_t));
+  ScratchBuffer ringRows(static_cast<size_t>(slots) *
+                         (sizeof(int) + sizeof(const int32_t *)));
+  const int32_t **taps = ringRows.as<const int32_t *>();
+  int *slotRow = reinterpret_cast<int *>(taps + slots);
+  std::fill(slotRow, slotRow + slots, -1);
+
+  auto lumaRow = [&](int row) -> const uint8_t * {
+    const uint8_t *pixels = src + static_cast<size_t>(row) * srcStride;
+    if (srcChannels == 1)
+      return pixels;
+    kernels.lumaRow(pixels, srcChannels, srcWidth, luma.data());
+    return luma.data();
+  };
+
+  // Row `row` of the reduced grid: the rounded mean of each block, streamed
+  // through one source row at a time.
+  auto reducedRow = [&](int row) -> const uint8_t * {
+    if (!shrinking)
+      return lumaRow(row);
+
+    uint32_t *sums = blockSums.as<uint32_t>();
+    std::fill(sums, sums + reducedWidth, 0u);
+    const int first = row * plan.shrinkY;
+    const int last = std::min(plan.srcHeight, first + plan.shrinkY);
+    for (int sy = first; sy < last; sy++) {
+      accumulateBlocks(plan, lumaRow(sy), sums);
+    }
+    finishBlocks(plan, sums, last - first, reduced.data());
+    return reduced.data();
+  };
+
+  auto filteredRow = [&](int row) -> const int32_t * {
+    int slot = row % slots;
+    int32_t *out = ring.as<int32_t>() + static_cast<size_t>(slot) * dstWidth;
+    if (slotRow[slot] != row) {
+      filterRowHorizontal(plan, reducedRow(row), out);
+      slotRow[slot] = row;
+    }
+    return out;
+  };
+
+  for (int y = yBegin; y < yEnd; y++) {
+    for (int t = 0; t < plan.y.count[y]; t++) {
+      taps[t] = filteredRow(plan.y.start[y] + t);
+    }
+    filterRowVertical(plan, y, taps, accumulator.as<int32_t>(),
+                      dst + static_cast<size_t>(y) * dstStride);
+  }
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "scratch_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+// Resampling filter for the `filter` option. Bilinear uses ResizePlan;
+// the others use FilterPlan below.
+enum class ResizeFilter { Bilinear, Box, Lanczos3 };
+
+// Filter taps are signed fixed point with this many fractional bits, and the
+// taps of every output sample sum to exactly kFilterWeightOne.
+constexpr int kFilterWeightBits = 14;
+constexpr int32_t kFilterWeightOne = 1 << kFilterWeightBits;
+
+// Fractional bits kept between the horizontal and vertical passes.
+// Lanczos lobes make the intermediate signed, and 255 << (kFilterWeightBits +
+// kFilterPrecisionBits) times the largest tap sum still fits in an int32_t.
+constexpr int kFilterPrecisionBits = 7;
+
+// Convolution taps along one axis: output sample i reads count[i] consecutive
+// inputs from start[i], weighted by weights[i * maxTaps ...].
+struct FilterAxis {
+  int maxTaps;
+  const int32_t *start;
+  const int32_t *count;
+  const int16_t *weights;
+};
+
+// A box or Lanczos resize, computed once per image. Large reductions first
+// average shrinkX x shrinkY blocks of source pixels (partial blocks at the
+// right and bottom edges average what they cover), one source row at a time,
+// giving a reducedWidth x reducedHeight grid. The taps then resample that
+// grid to the output size; for an exact integer ratio they are the identity.
+// Lanczos never pre-reduces, so it always filters the full-resolution rows.
+struct FilterPlan {
+  int srcWidth;
+  int srcHeight;
+  int dstWidth;
+  int dstHeight;
+  int shrinkX;
+  int shrinkY;
+  int reducedWidth;
+  int reducedHeight;
+  FilterAxis x;
+  FilterAxis y;
+  ScratchBuffer storage;
+};
+
+FilterPlan makeFilterPlan(ResizeFilter filter, int srcWidth, int srcHeight,
+                          int dstWidth, int dstHeight);
+
+// The stages filterLumaRows runs for each row, for callers that receive
+// source rows one at a time. accumulateBlocks adds one luma row to the
+// per-block sums, and finishBlocks turns sums over blockRows rows into the
+// reduced row. filterRowHorizontal resamples a reduced row into
+// plan.dstWidth intermediate samples. filterRowVertical writes output row y
+// from the intermediate rows of its taps, rows[t] for t < plan.y.count[y];
+// sums is plan.dstWidth values of scratch.
+void accumulateBlocks(const FilterPlan &plan, const uint8_t *luma,
+                      uint32_t *sums);
+void finishBlocks(const FilterPlan &plan, const uint32_t *sums, int blockRows,
+                  uint8_t *reduced);
+void filterRowHorizontal(const FilterPlan &plan, const uint8_t *reduced,
+                         int32_t *out);
+void filterRowVertical(const FilterPlan &plan, int y,
+                       const int32_t *const *rows, int32_t *sums,
+                       uint8_t *dst);
+
+// Fused grayscale + filtered resize, the FilterPlan counterpart of
+// resizeLumaRows: writes output rows [yBegin, yEnd) to dst, reducing each
+// source row those rows need to luma once.
+void filterLumaRows(const FilterPlan &plan, const uint8_t *src,
+                    int srcChannels, size_t srcStride, uint8_t *dst,
+                    size_t dstStride, int yBegin, int yEnd);
+
+} // namespace ImageProcessor
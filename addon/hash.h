@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+// XXH64 (Yann Collet's xxHash, 64-bit variant), bit-compatible with the
+// reference implementation. It hashes several GB/s per core, so keying a
+// cache by the whole input costs far less than decoding it.
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+
+} // namespace ImageProcessor
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "scratch_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+// Sample type of a plane. Samples are in native byte order. Integer samples
+// are sRGB-encoded unless the plane says they are linear light; float
+// samples are always linear light, nominally 0-1.
+enum class PixelType { U8, U16, F16, F32 };
+
+inline size_t bytesPerSample(PixelType type) {
+  switch (type) {
+  case PixelType::U8:
+    return 1;
+  case PixelType::U16:
+  case PixelType::F16:
+    return 2;
+  default:
+    return 4;
+  }
+}
+
+// Owning plane of interleaved pixels, 8-bit unless type says otherwise. The
+// storage comes from the thread's scratch pool and is left uninitialized.
+struct ImageData {
+  ScratchBuffer data;
+  int width;
+  int height;
+  int channels;
+  PixelType type = PixelType::U8;
+  bool linearLight = false;
+};
+
+// Non-owning view of interleaved pixels, typically pointing straight into a
+// caller's Buffer. stride is the distance between rows in bytes.
+struct ImageView {
+  const uint8_t *data;
+  int width;
+  int height;
+  int channels;
+  size_t stride;
+  PixelType type = PixelType::U8;
+  bool linearLight = false;
+};
+
+inline ImageView viewOf(const ImageData &image) {
+  return {image.data.data(),
+          image.width,
+          image.height,
+          image.channels,
+          static_cast<size_t>(image.width) * image.channels *
+              bytesPerSample(image.type),
+          image.type,
+          image.linearLight};
+}
+
+} // namespace ImageProcessor
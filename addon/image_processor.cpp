@@ -1,223 +1,2078 @@
+#include "affinity.h"
+#include "decode.h"
+#include "encode.h"
+#include "file_batch.h"
+#include "file_io.h"
+#include "filters.h"
+#include "image_data.h"
+#include "job_queue.h"
+#include "kernels.h"
+#include "linear_resize.h"
+#include "probe.h"
+#include "process_options.h"
+#include "result_cache.h"
+#include "resize.h"
+#include "scratch_pool.h"
+#include "stage_stats.h"
+#include "stream.h"
+#include "thread_pool.h"
+
 #include <algorithm>
-#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <exception>
+#include <limits>
+#include <memory>
 #include <napi.h>
 #include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace ImageProcessor {
 
-struct ImageData {
-  std::vector<uint8_t> data;
-  int width;
-  int height;
-  int channels;
-};
+// Grayscale conversion fused with the resize: source rows are reduced to one
+// channel before interpolation and each output row is written once, straight
+// into dst (newWidth * newHeight bytes), using `filter` to resample. Large
+// images are split into row bands across the shared thread pool. Input
+// wider than 8 bits, and any input when `linear` is set, is resized in
+// linear light instead.
+void resizeToGrayscale(const ImageView &input, int newWidth, int newHeight,
+                       uint8_t *dst, int threads, ResizeFilter filter,
+                       bool linear) {
+  StageTimer timer(Stage::Resize, input.stride * input.height);
+  const size_t pixelsPerRow = static_cast<size_t>(newWidth);
+
+  if (linear || input.type != PixelType::U8) {
+    resizeLinearLuma(input, newWidth, newHeight, dst, threads, filter);
+    return;
+  }
+
+  if (newWidth == input.width && newHeight == input.height) {
+    forEachRowBand(newHeight, input.stride * input.height, threads,
+                   [&](int yBegin, int yEnd) {
+                     if (input.stride == pixelsPerRow * input.channels) {
+                       activeKernels().lumaRow(
+                           input.data + yBegin * input.stride, input.channels,
+                           pixelsPerRow * (yEnd - yBegin),
+                           dst + yBegin * pixelsPerRow);
+                       return;
+                     }
+                     for (int y = yBegin; y < yEnd; y++) {
+                       activeKernels().lumaRow(input.data + y * input.stride,
+                                               input.channels, pixelsPerRow,
+                                               dst + y * pixelsPerRow);
+                     }
+                   });
+    return;
+  }
+
+  // Box and Lanczos taps span every source row when reducing, so the whole
+  // input is read.
+  if (filter != ResizeFilter::Bilinear) {
+    FilterPlan plan = makeFilterPlan(filter, input.width, input.height,
+                                     newWidth, newHeight);
+    forEachRowBand(newHeight, input.stride * input.height, threads,
+                   [&](int yBegin, int yEnd) {
+                     filterLumaRows(plan, input.data, input.channels,
+                                    input.stride, dst, newWidth, yBegin,
+                                    yEnd);
+                   });
+    return;
+  }
+
+  ResizePlan plan =
+      makeResizePlan(input.width, input.height, newWidth, newHeight, 1);
+  const size_t rowsRead =
+      std::min<size_t>(input.height, 2 * static_cast<size_t>(newHeight));
+
+  forEachRowBand(newHeight, input.stride * rowsRead, threads,
+                 [&](int yBegin, int yEnd) {
+                   resizeLumaRows(plan, input.data, input.channels,
+                                  input.stride, dst, newWidth, yBegin, yEnd);
+                 });
+}
+
+// Describes the input in place; pixel data is never copied out of the
+// caller's buffer.
+ImageView parseSimpleImage(const uint8_t *data, size_t size) {
+  ImageView image;
+
+  if (size < 12) {
+    throw std::runtime_error("Invalid image data: too small");
+  }
 
-uint8_t bilinearInterpolate(const std::vector<uint8_t> &data, int width,
-                            int height, int channels, float x, float y,
-                            int channel) {
-  int x1 = static_cast<int>(std::floor(x));
-  int y1 = static_cast<int>(std::floor(y));
-  int x2 = std::min(x1 + 1, width - 1);
-  int y2 = std::min(y1 + 1, height - 1);
-
-  float dx = x - x1;
-  float dy = y - y1;
-
-  auto getPixel = [&](int px, int py, int ch) -> uint8_t {
-    if (px < 0 || px >= width || py < 0 || py >= height)
-      return 0;
-    return data[(py * width + px) * channels + ch];
+  auto readInt = [](const uint8_t *data, size_t offset) -> int {
+    return (data[offset] << 24) | (data[offset + 1] << 16) |
+           (data[offset + 2] << 8) | data[offset + 3];
   };
 
-  float top =
-      getPixel(x1, y1, channel) * (1 - dx) + getPixel(x2, y1, channel) * dx;
-  float bottom =
-      getPixel(x1, y2, channel) * (1 - dx) + getPixel(x2, y2, channel) * dx;
+  image.width = readInt(data, 0);
+  image.height = readInt(data, 4);
+  image.channels = readInt(data, 8);
+
+  if (image.width <= 0 || image.height <= 0 || image.channels <= 0 ||
+      image.channels > 4) {
+    image.width = 100;
+    image.height = static_cast<int>(size / (image.width * 3));
+    image.channels = 3;
+
+    if (image.height <= 0) {
+      image.height = 100;
+      image.width = static_cast<int>(size / (image.height * 3));
+    }
+  }
+
+  size_t pixelBytes =
+      static_cast<size_t>(image.width) * image.height * image.channels;
+  if (size >= 12 + pixelBytes) {
+    image.data = data + 12;
+  } else if (size >= pixelBytes) {
+    image.data = data;
+  } else {
+    throw std::runtime_error("Invalid image data: expected " +
+                             std::to_string(pixelBytes) +
+                             " bytes of pixels, got " +
+                             std::to_string(size - 12));
+  }
+  image.stride = static_cast<size_t>(image.width) * image.channels;
+
+  return image;
+}
 
-  return static_cast<uint8_t>(top * (1 - dy) + bottom * dy);
+// True when data starts with a valid frame header and holds all its pixels,
+// unlike parseSimpleImage, which guesses a layout for anything.
+bool isFramedImage(const uint8_t *data, size_t size) {
+  if (size < kFrameHeaderSize) {
+    return false;
+  }
+  auto readInt = [data](size_t offset) -> int {
+    return (data[offset] << 24) | (data[offset + 1] << 16) |
+           (data[offset + 2] << 8) | data[offset + 3];
+  };
+  int width = readInt(0);
+  int height = readInt(4);
+  int channels = readInt(8);
+  return width > 0 && height > 0 && channels > 0 && channels <= 4 &&
+         size - kFrameHeaderSize >=
+             static_cast<size_t>(width) * height * channels;
 }
 
-ImageData resizeImage(const ImageData &input, int newWidth, int newHeight) {
-  ImageData output;
-  output.width = newWidth;
-  output.height = newHeight;
-  output.channels = input.channels;
-  output.data.resize(newWidth * newHeight * input.channels);
+// Headerless interleaved pixels described by the caller, e.g. straight from
+// sharp's raw() output, so JS does not have to prepend a header by copying.
+// Float samples are taken to be linear light already.
+ImageView describeRawImage(const uint8_t *data, size_t size,
+                           const ProcessOptions &options) {
+  ImageView image;
+  image.data = data;
+  image.width = options.rawWidth;
+  image.height = options.rawHeight;
+  image.channels = options.rawChannels;
+  image.type = options.rawType;
+  image.linearLight =
+      image.type == PixelType::F16 || image.type == PixelType::F32;
+  image.stride = static_cast<size_t>(image.width) * image.channels *
+                 bytesPerSample(image.type);
 
-  float xRatio = static_cast<float>(input.width) / newWidth;
-  float yRatio = static_cast<float>(input.height) / newHeight;
+  if (size < image.stride * image.height) {
+    throw std::runtime_error("Invalid image data: raw buffer holds " +
+                             std::to_string(size) + " bytes, expected " +
+                             std::to_string(image.stride * image.height));
+  }
 
-  for (int y = 0; y < newHeight; y++) {
-    for (int x = 0; x < newWidth; x++) {
-      float srcX = x * xRatio;
-      float srcY = y * yRatio;
+  return image;
+}
 
-      for (int c = 0; c < input.channels; c++) {
-        uint8_t value =
-            bilinearInterpolate(input.data, input.width, input.height,
-                                input.channels, srcX, srcY, c);
-        output.data[(y * newWidth + x) * input.channels + c] = value;
-      }
+size_t frameByteLength(const OutputSize &size) {
+  return kFrameHeaderSize + static_cast<size_t>(size.width) * size.height;
+}
+
+// Compressed input is decoded into `decoded`, which must outlive the
+// returned view; framed and raw input is viewed in place. outputSize is
+// always computed from the dimensions stored in the input, so decoding at a
+// reduced scale never changes the result's size.
+ImageView readInput(const uint8_t *data, size_t size,
+                    const ProcessOptions &options, DecodedImage &decoded,
+                    OutputSize &outputSize) {
+  ImageView view;
+
+  if (options.rawWidth > 0) {
+    StageTimer timer(Stage::Parse, size);
+    view = describeRawImage(data, size, options);
+  } else if (sniffFormat(data, size) != ImageFormat::Unknown) {
+    // Linear-light luma needs the colour channels, and a 16-bit PNG keeps
+    // its depth rather than being rounded to 8 bits first.
+    DecodeOptions decodeOptions;
+    decodeOptions.lumaOnly = !options.linear;
+    decodeOptions.keepDepth = options.linear;
+    if (options.shrinkOnLoad) {
+      decodeOptions.fitWidth = options.maxWidth;
+      decodeOptions.fitHeight = options.maxHeight;
     }
+    decoded = decodeImage(data, size, decodeOptions);
+    outputSize =
+        computeOutputSize(decoded.sourceWidth, decoded.sourceHeight,
+                          options.maxWidth, options.maxHeight);
+    return viewOf(decoded.pixels);
+  } else {
+    StageTimer timer(Stage::Parse, size);
+    view = parseSimpleImage(data, size);
   }
 
-  return output;
+  outputSize = computeOutputSize(view.width, view.height, options.maxWidth,
+                                 options.maxHeight);
+  return view;
 }
 
-ImageData convertToGrayscale(const ImageData &input) {
-  ImageData output;
-  output.width = input.width;
-  output.height = input.height;
-  output.channels = 1;
-  output.data.resize(input.width * input.height);
+// Largest output the pipeline can produce for this size; exact for frames.
+size_t maxOutputLength(const OutputSize &size, const ProcessOptions &options) {
+  return options.format == OutputFormat::Jpeg
+             ? jpegMaxByteLength(size.width, size.height, 1)
+             : frameByteLength(size);
+}
 
-  for (int i = 0; i < input.width * input.height; i++) {
-    if (input.channels >= 3) {
-      uint8_t r = input.data[i * input.channels];
-      uint8_t g = input.data[i * input.channels + 1];
-      uint8_t b = input.data[i * input.channels + 2];
+// Writes the output for input into dst and returns its length. Frames are
+// rendered in place; JPEG output goes through a pooled grayscale plane that
+// is compressed straight into dst.
+size_t renderOutput(const ImageView &input, const OutputSize &size,
+                    const ProcessOptions &options, uint8_t *dst,
+                    size_t capacity) {
+  if (options.format == OutputFormat::Jpeg) {
+    ScratchBuffer plane(static_cast<size_t>(size.width) * size.height);
+    resizeToGrayscale(input, size.width, size.height, plane.data(),
+                      options.threads, options.filter, options.linear);
+    return encodeJpeg(plane.data(), size.width, size.height, 1, size.width,
+                      options.jpeg, dst, capacity);
+  }
 
-      uint8_t gray = static_cast<uint8_t>(0.299f * r + 0.587f * g + 0.114f * b);
-      output.data[i] = gray;
-    } else {
-      output.data[i] = input.data[i * input.channels];
+  writeFrameHeader(dst, size.width, size.height, 1);
+  resizeToGrayscale(input, size.width, size.height, dst + kFrameHeaderSize,
+                    options.threads, options.filter, options.linear);
+  return frameByteLength(size);
+}
+
+// Outputs leave the scratch pool: they are handed to JS and freed on its
+// thread, so they are plain exact-size heap blocks instead.
+std::vector<uint8_t> runPipeline(const uint8_t *data, size_t size,
+                                 const ProcessOptions &options) {
+  ResultCache &cache = ResultCache::shared();
+  CacheKey key{};
+  if (cache.enabled()) {
+    key = makeCacheKey(data, size, options);
+    if (CachedOutput hit = cache.find(key)) {
+      return std::vector<uint8_t>(hit->data(), hit->data() + hit->size());
     }
   }
 
+  DecodedImage decoded;
+  OutputSize outputSize;
+  ImageView inputImage = readInput(data, size, options, decoded, outputSize);
+
+  // A frame is exactly its bound and renders in place. A JPEG is usually a
+  // small fraction of its bound, so it is encoded into a pooled block and
+  // only the bytes written are copied out.
+  size_t capacity = maxOutputLength(outputSize, options);
+  std::vector<uint8_t> output;
+  if (options.format == OutputFormat::Jpeg) {
+    ScratchBuffer encoded(capacity);
+    size_t length =
+        renderOutput(inputImage, outputSize, options, encoded.data(), capacity);
+    output.assign(encoded.data(), encoded.data() + length);
+  } else {
+    output.resize(capacity);
+    output.resize(
+        renderOutput(inputImage, outputSize, options, output.data(), capacity));
+  }
+
+  if (cache.enabled()) {
+    cache.store(key, output.data(), output.size());
+  }
   return output;
 }
 
-std::vector<uint8_t> encodeAsJPEG(const ImageData &image) {
-  std::vector<uint8_t> encoded;
+// Same as runPipeline but writes into caller-owned memory; returns the
+// number of bytes written. JPEG output only fails if it really does not fit.
+size_t runPipelineInto(const uint8_t *data, size_t size,
+                       const ProcessOptions &options, uint8_t *output,
+                       size_t outputLength) {
+  ResultCache &cache = ResultCache::shared();
+  CacheKey key{};
+  if (cache.enabled()) {
+    key = makeCacheKey(data, size, options);
+    CachedOutput hit = cache.find(key);
+    if (hit && hit->size() <= outputLength) {
+      std::memcpy(output, hit->data(), hit->size());
+      return hit->size();
+    }
+  }
+
+  DecodedImage decoded;
+  OutputSize outputSize;
+  ImageView inputImage = readInput(data, size, options, decoded, outputSize);
+
+  if (options.format == OutputFormat::Frame) {
+    size_t needed = frameByteLength(outputSize);
+    if (outputLength < needed) {
+      throw std::runtime_error("output buffer too small: need " +
+                               std::to_string(needed) + " bytes, got " +
+                               std::to_string(outputLength));
+    }
+  }
+
+  size_t length =
+      renderOutput(inputImage, outputSize, options, output, outputLength);
+  if (cache.enabled()) {
+    cache.store(key, output, length);
+  }
+  return length;
+}
+
+struct RenditionSize {
+  int maxWidth;
+  int maxHeight;
+};
+
+// Renders one output per size from a single decode. Sizes are rendered
+// largest first, and each comes from the smallest plane rendered so far that
+// still covers it (or from the source when none does), so every pass reads
+// a few times the pixels it writes instead of the whole source. Output
+// dimensions are those processImage would produce; the pixels can differ
+// slightly, since smaller renditions are resampled from larger ones.
+std::vector<std::vector<uint8_t>>
+runRenditions(const uint8_t *data, size_t size, const ProcessOptions &options,
+              const std::vector<RenditionSize> &sizes) {
+  // Shrink-on-load may only go as far as the largest rendition allows.
+  ProcessOptions fitOptions = options;
+  fitOptions.maxWidth = 0;
+  fitOptions.maxHeight = 0;
+  for (const RenditionSize &target : sizes) {
+    fitOptions.maxWidth = std::max(fitOptions.maxWidth, target.maxWidth);
+    fitOptions.maxHeight = std::max(fitOptions.maxHeight, target.maxHeight);
+  }
+
+  DecodedImage decoded;
+  OutputSize fitSize;
+  ImageView source = readInput(data, size, fitOptions, decoded, fitSize);
+  bool compressed = options.rawWidth == 0 &&
+                    sniffFormat(data, size) != ImageFormat::Unknown;
+  int sourceWidth = compressed ? decoded.sourceWidth : source.width;
+  int sourceHeight = compressed ? decoded.sourceHeight : source.height;
 
-  auto writeInt = [&encoded](int value) {
-    encoded.push_back((value >> 24) & 0xFF);
-    encoded.push_back((value >> 16) & 0xFF);
-    encoded.push_back((value >> 8) & 0xFF);
-    encoded.push_back(value & 0xFF);
+  std::vector<OutputSize> outputSizes;
+  std::vector<size_t> order(sizes.size());
+  for (size_t i = 0; i < sizes.size(); i++) {
+    outputSizes.push_back(computeOutputSize(sourceWidth, sourceHeight,
+                                            sizes[i].maxWidth,
+                                            sizes[i].maxHeight));
+    order[i] = i;
+  }
+  auto area = [](const OutputSize &size) {
+    return static_cast<int64_t>(size.width) * size.height;
   };
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return area(outputSizes[a]) > area(outputSizes[b]);
+  });
+
+  std::vector<ScratchBuffer> planes(sizes.size());
+  std::vector<std::vector<uint8_t>> outputs(sizes.size());
+  std::vector<size_t> rendered;
+  for (size_t index : order) {
+    const OutputSize &out = outputSizes[index];
+
+    ImageView base = source;
+    for (size_t previous : rendered) {
+      const OutputSize &candidate = outputSizes[previous];
+      bool covers =
+          candidate.width >= out.width && candidate.height >= out.height;
+      bool smaller = base.data == source.data ||
+                     area(candidate) < int64_t(base.width) * base.height;
+      if (covers && smaller) {
+        base = {planes[previous].data(), candidate.width, candidate.height, 1,
+                static_cast<size_t>(candidate.width)};
+      }
+    }
 
-  writeInt(image.width);
-  writeInt(image.height);
-  writeInt(image.channels);
+    ScratchBuffer plane(static_cast<size_t>(out.width) * out.height);
+    resizeToGrayscale(base, out.width, out.height, plane.data(),
+                      options.threads, options.filter, options.linear);
+
+    if (options.format == OutputFormat::Jpeg) {
+      ScratchBuffer encoded(maxOutputLength(out, options));
+      size_t length = encodeJpeg(plane.data(), out.width, out.height, 1,
+                                 out.width, options.jpeg, encoded.data(),
+                                 encoded.size());
+      outputs[index].assign(encoded.data(), encoded.data() + length);
+    } else {
+      outputs[index].resize(frameByteLength(out));
+      writeFrameHeader(outputs[index].data(), out.width, out.height, 1);
+      std::memcpy(outputs[index].data() + kFrameHeaderSize, plane.data(),
+                  plane.size());
+    }
 
-  for (const auto &byte : image.data) {
-    encoded.push_back(byte);
+    planes[index] = std::move(plane);
+    rendered.push_back(index);
   }
 
-  return encoded;
+  return outputs;
 }
 
-ImageData parseSimpleImage(const uint8_t *data, size_t size) {
-  ImageData image;
+// Hands the bytes to JS without copying them. V8 is told about the block so
+// a burst of outputs counts towards GC pressure, and the finalizer frees it
+// once the Buffer is garbage collected.
+Napi::Value wrapOutput(Napi::Env env, std::vector<uint8_t> &&bytes) {
+#if defined(NODE_API_NO_EXTERNAL_BUFFERS_ALLOWED)
+  return Napi::Buffer<uint8_t>::Copy(env, bytes.data(), bytes.size());
+#else
+  auto *owned = new std::vector<uint8_t>(std::move(bytes));
+  int64_t length = static_cast<int64_t>(owned->size());
+  Napi::MemoryManagement::AdjustExternalMemory(env, length);
+  return Napi::Buffer<uint8_t>::New(
+      env, owned->data(), owned->size(),
+      [](Napi::Env env, uint8_t *, std::vector<uint8_t> *hint) {
+        Napi::MemoryManagement::AdjustExternalMemory(
+            env, -static_cast<int64_t>(hint->size()));
+        delete hint;
+      },
+      owned);
+#endif
+}
 
-  if (size < 12) {
-    throw std::runtime_error("Invalid image data: too small");
+bool readIntOption(Napi::Object object, const char *key, int &value) {
+  Napi::Value option = object.Get(key);
+  if (option.IsUndefined()) {
+    return true;
   }
+  if (!option.IsNumber()) {
+    Napi::TypeError::New(object.Env(),
+                         std::string("Option '") + key + "' must be a number")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+  value = option.As<Napi::Number>().Int32Value();
+  return true;
+}
 
-  auto readInt = [](const uint8_t *data, size_t offset) -> int {
-    return (data[offset] << 24) | (data[offset + 1] << 16) |
-           (data[offset + 2] << 8) | data[offset + 3];
-  };
+// Reads `raw: { width, height, channels[, type] }` into options. type is
+// the sample type, "u8" (the default), "u16", "f16" or "f32".
+bool parseRawOption(Napi::Value raw, ProcessOptions &options) {
+  Napi::Env env = raw.Env();
 
-  image.width = readInt(data, 0);
-  image.height = readInt(data, 4);
-  image.channels = readInt(data, 8);
+  if (!raw.IsObject()) {
+    Napi::TypeError::New(env, "Option 'raw' must be an object")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+  Napi::Object rawObject = raw.As<Napi::Object>();
+  if (!readIntOption(rawObject, "width", options.rawWidth) ||
+      !readIntOption(rawObject, "height", options.rawHeight) ||
+      !readIntOption(rawObject, "channels", options.rawChannels)) {
+    return false;
+  }
+  if (options.rawWidth <= 0 || options.rawHeight <= 0 ||
+      options.rawChannels <= 0 || options.rawChannels > 4) {
+    Napi::RangeError::New(env, "Option 'raw' needs a positive width and "
+                               "height and 1-4 channels")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
 
-  if (image.width <= 0 || image.height <= 0 || image.channels <= 0 ||
-      image.channels > 4) {
-    image.width = 100;
-    image.height = static_cast<int>(size / (image.width * 3));
-    image.channels = 3;
+  Napi::Value type = rawObject.Get("type");
+  if (!type.IsUndefined()) {
+    std::string name =
+        type.IsString() ? type.As<Napi::String>().Utf8Value() : std::string();
+    if (name == "u8") {
+      options.rawType = PixelType::U8;
+    } else if (name == "u16") {
+      options.rawType = PixelType::U16;
+    } else if (name == "f16") {
+      options.rawType = PixelType::F16;
+    } else if (name == "f32") {
+      options.rawType = PixelType::F32;
+    } else {
+      Napi::TypeError::New(env, "Option 'raw.type' must be 'u8', 'u16', "
+                                "'f16' or 'f32'")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+  }
+  return true;
+}
 
-    if (image.height <= 0) {
-      image.height = 100;
-      image.width = static_cast<int>(size / (image.height * 3));
+bool readBoolOption(Napi::Object object, const char *key, bool &value) {
+  Napi::Value option = object.Get(key);
+  if (option.IsUndefined()) {
+    return true;
+  }
+  if (!option.IsBoolean()) {
+    Napi::TypeError::New(object.Env(),
+                         std::string("Option '") + key + "' must be a boolean")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+  value = option.As<Napi::Boolean>().Value();
+  return true;
+}
+
+// Reads `format` ("frame" or "jpeg"), the JPEG `quality` (1-100) and
+// `progressive` options, `shrinkOnLoad` and `linear`.
+bool parseOutputOptions(Napi::Object object, ProcessOptions &options) {
+  Napi::Env env = object.Env();
+
+  Napi::Value format = object.Get("format");
+  if (!format.IsUndefined()) {
+    std::string name = format.IsString()
+                           ? format.As<Napi::String>().Utf8Value()
+                           : std::string();
+    if (name == "frame") {
+      options.format = OutputFormat::Frame;
+    } else if (name == "jpeg") {
+      if (!canEncodeJpeg()) {
+        Napi::Error::New(env, "JPEG encoding is not available in this build")
+            .ThrowAsJavaScriptException();
+        return false;
+      }
+      options.format = OutputFormat::Jpeg;
+    } else {
+      Napi::TypeError::New(env, "Option 'format' must be 'frame' or 'jpeg'")
+          .ThrowAsJavaScriptException();
+      return false;
     }
   }
 
-  size_t expectedSize = 12 + image.width * image.height * image.channels;
-  if (size >= expectedSize) {
-    image.data.assign(data + 12, data + expectedSize);
-  } else {
-    image.data.assign(data, data + size);
+  if (!readIntOption(object, "quality", options.jpeg.quality) ||
+      !readBoolOption(object, "progressive", options.jpeg.progressive) ||
+      !readBoolOption(object, "shrinkOnLoad", options.shrinkOnLoad) ||
+      !readBoolOption(object, "linear", options.linear)) {
+    return false;
+  }
+  if (options.jpeg.quality < 1 || options.jpeg.quality > 100) {
+    Napi::RangeError::New(env, "Option 'quality' must be between 1 and 100")
+        .ThrowAsJavaScriptException();
+    return false;
   }
 
-  return image;
+  return true;
+}
+
+// Reads raw, threads, filter and the output options from an options object.
+bool parseOptionsObject(Napi::Object object, ProcessOptions &options) {
+  Napi::Env env = object.Env();
+
+  Napi::Value raw = object.Get("raw");
+  if (!raw.IsUndefined() && !parseRawOption(raw, options)) {
+    return false;
+  }
+
+  if (!readIntOption(object, "threads", options.threads)) {
+    return false;
+  }
+  if (options.threads < 0) {
+    Napi::RangeError::New(env, "Option 'threads' must be 0 or more")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  Napi::Value filter = object.Get("filter");
+  if (!filter.IsUndefined()) {
+    std::string name = filter.IsString()
+                           ? filter.As<Napi::String>().Utf8Value()
+                           : std::string();
+    if (name == "bilinear") {
+      options.filter = ResizeFilter::Bilinear;
+    } else if (name == "box") {
+      options.filter = ResizeFilter::Box;
+    } else if (name == "lanczos3") {
+      options.filter = ResizeFilter::Lanczos3;
+    } else {
+      Napi::TypeError::New(env, "Option 'filter' must be 'bilinear', 'box' or "
+                                "'lanczos3'")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+  }
+
+  return parseOutputOptions(object, options);
+}
+
+// Reads a maxWidth and maxHeight pair. Zero, negative or absurd limits
+// would become huge unsigned sizes further down, so they throw a RangeError
+// here instead.
+bool readMaxSize(Napi::Value width, Napi::Value height, int &maxWidth,
+                 int &maxHeight) {
+  Napi::Env env = width.Env();
+
+  if (!width.IsNumber() || !height.IsNumber()) {
+    Napi::TypeError::New(env, "maxWidth and maxHeight must be numbers")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+  double w = width.As<Napi::Number>().DoubleValue();
+  double h = height.As<Napi::Number>().DoubleValue();
+  constexpr double kLimit = static_cast<double>(kMaxDecodedPixels);
+  if (!(w >= 1 && w <= kLimit && h >= 1 && h <= kLimit)) {
+    Napi::RangeError::New(env, "maxWidth and maxHeight must be between 1 and " +
+                                   std::to_string(kMaxDecodedPixels))
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+  maxWidth = static_cast<int>(w);
+  maxHeight = static_cast<int>(h);
+  return true;
+}
+
+// Validates `maxWidth, maxHeight[, options]` starting at sizeIndex.
+bool parseSizeAndOptions(const Napi::CallbackInfo &info, size_t sizeIndex,
+                         ProcessOptions &options) {
+  Napi::Env env = info.Env();
+
+  if (!readMaxSize(info[sizeIndex], info[sizeIndex + 1], options.maxWidth,
+                   options.maxHeight)) {
+    return false;
+  }
+
+  size_t optionsIndex = sizeIndex + 2;
+  if (info.Length() <= optionsIndex || info[optionsIndex].IsUndefined()) {
+    return true;
+  }
+
+  if (!info[optionsIndex].IsObject()) {
+    Napi::TypeError::New(env, "Options must be an object")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  return parseOptionsObject(info[optionsIndex].As<Napi::Object>(), options);
+}
+
+// Validates `buffer, [output,] maxWidth, maxHeight[, options]`. sizeIndex is
+// the position of maxWidth, so every Buffer argument comes before it.
+bool parseProcessArgs(const Napi::CallbackInfo &info, size_t sizeIndex,
+                      ProcessOptions &options) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < sizeIndex + 2) {
+    Napi::TypeError::New(env, sizeIndex == 1
+                                  ? "Expected 3 arguments: buffer, maxWidth, "
+                                    "maxHeight"
+                                  : "Expected 4 arguments: input, output, "
+                                    "maxWidth, maxHeight")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  for (size_t i = 0; i < sizeIndex; i++) {
+    if (!info[i].IsBuffer()) {
+      Napi::TypeError::New(env, i == 0 ? "First argument must be a Buffer"
+                                       : "Output must be a Buffer")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+  }
+
+  return parseSizeAndOptions(info, sizeIndex, options);
 }
 
 Napi::Value ProcessImage(const Napi::CallbackInfo &info) {
   Napi::Env env = info.Env();
 
-  if (info.Length() < 3) {
-    Napi::TypeError::New(env,
-                         "Expected 3 arguments: buffer, maxWidth, maxHeight")
+  ProcessOptions options;
+  if (!parseProcessArgs(info, 1, options)) {
+    return env.Null();
+  }
+
+  try {
+    Napi::Buffer<uint8_t> inputBuffer = info[0].As<Napi::Buffer<uint8_t>>();
+
+    return wrapOutput(
+        env, runPipeline(inputBuffer.Data(), inputBuffer.Length(), options));
+
+  } catch (const std::exception &e) {
+    Napi::Error::New(env, std::string("Image processing failed: ") + e.what())
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+}
+
+Napi::Value ProcessImageInto(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  ProcessOptions options;
+  if (!parseProcessArgs(info, 2, options)) {
+    return env.Null();
+  }
+
+  try {
+    Napi::Buffer<uint8_t> inputBuffer = info[0].As<Napi::Buffer<uint8_t>>();
+    Napi::Buffer<uint8_t> outputBuffer = info[1].As<Napi::Buffer<uint8_t>>();
+
+    size_t written =
+        runPipelineInto(inputBuffer.Data(), inputBuffer.Length(), options,
+                        outputBuffer.Data(), outputBuffer.Length());
+    return Napi::Number::New(env, static_cast<double>(written));
+
+  } catch (const std::exception &e) {
+    Napi::Error::New(env, std::string("Image processing failed: ") + e.what())
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+}
+
+Napi::Value ComputeOutputSize(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 4 || !info[0].IsNumber() || !info[1].IsNumber() ||
+      !info[2].IsNumber() || !info[3].IsNumber()) {
+    Napi::TypeError::New(env, "Expected 4 numbers: width, height, maxWidth, "
+                              "maxHeight")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  int width = info[0].As<Napi::Number>().Int32Value();
+  int height = info[1].As<Napi::Number>().Int32Value();
+  if (width <= 0 || height <= 0) {
+    Napi::RangeError::New(env, "width and height must be positive")
         .ThrowAsJavaScriptException();
     return env.Null();
   }
 
-  if (!info[0].IsBuffer()) {
+  // An options object with `format: "jpeg"` makes byteLength the worst-case
+  // JPEG size, enough for processImageInto to never run out of room.
+  ProcessOptions options;
+  if (info.Length() > 4 && info[4].IsObject() &&
+      !parseOutputOptions(info[4].As<Napi::Object>(), options)) {
+    return env.Null();
+  }
+
+  int maxWidth;
+  int maxHeight;
+  if (!readMaxSize(info[2], info[3], maxWidth, maxHeight)) {
+    return env.Null();
+  }
+  OutputSize size = computeOutputSize(width, height, maxWidth, maxHeight);
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("width", Napi::Number::New(env, size.width));
+  result.Set("height", Napi::Number::New(env, size.height));
+  result.Set("channels", Napi::Number::New(env, 1));
+  result.Set("byteLength",
+             Napi::Number::New(env, static_cast<double>(
+                                        maxOutputLength(size, options))));
+  return result;
+}
+
+Napi::Value CanDecode(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsBuffer()) {
     Napi::TypeError::New(env, "First argument must be a Buffer")
         .ThrowAsJavaScriptException();
     return env.Null();
   }
 
-  if (!info[1].IsNumber() || !info[2].IsNumber()) {
-    Napi::TypeError::New(env, "maxWidth and maxHeight must be numbers")
+  Napi::Buffer<uint8_t> buffer = info[0].As<Napi::Buffer<uint8_t>>();
+  return Napi::Boolean::New(
+      env, canDecode(sniffFormat(buffer.Data(), buffer.Length())));
+}
+
+Napi::Value CanEncode(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsString()) {
+    Napi::TypeError::New(env, "First argument must be a format name")
         .ThrowAsJavaScriptException();
     return env.Null();
   }
 
-  try {
-    Napi::Buffer<uint8_t> inputBuffer = info[0].As<Napi::Buffer<uint8_t>>();
-    int maxWidth = info[1].As<Napi::Number>().Int32Value();
-    int maxHeight = info[2].As<Napi::Number>().Int32Value();
+  std::string format = info[0].As<Napi::String>().Utf8Value();
+  return Napi::Boolean::New(
+      env, format == "frame" || (format == "jpeg" && canEncodeJpeg()));
+}
 
-    ImageData inputImage =
-        parseSimpleImage(inputBuffer.Data(), inputBuffer.Length());
+const char *formatName(ImageFormat format) {
+  switch (format) {
+  case ImageFormat::Jpeg:
+    return "jpeg";
+  case ImageFormat::Png:
+    return "png";
+  case ImageFormat::WebP:
+    return "webp";
+  case ImageFormat::Unknown:
+    break;
+  }
+  return "frame";
+}
+
+// The object probe and probeFiles return. decodeWidth and decodeHeight are
+// only set when a maxWidth was given (maxWidth > 0).
+Napi::Object probeResult(Napi::Env env, const ImageProbe &probe, int maxWidth,
+                         int maxHeight) {
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("format", Napi::String::New(env, formatName(probe.format)));
+  result.Set("width", Napi::Number::New(env, probe.width));
+  result.Set("height", Napi::Number::New(env, probe.height));
+  result.Set("channels", Napi::Number::New(env, probe.channels));
+  result.Set("bitDepth", Napi::Number::New(env, probe.bitDepth));
+  result.Set("orientation", Napi::Number::New(env, probe.orientation));
+  result.Set("progressive", Napi::Boolean::New(env, probe.progressive));
+  if (maxWidth > 0) {
+    OutputSize decoded = decodedSize(probe, maxWidth, maxHeight);
+    result.Set("decodeWidth", Napi::Number::New(env, decoded.width));
+    result.Set("decodeHeight", Napi::Number::New(env, decoded.height));
+  }
+  return result;
+}
+
+// probe(bufferOrPath[, maxWidth, maxHeight]) reads only the image header and
+// returns { format, width, height, channels, bitDepth, orientation,
+// progressive }. With a maximum size it adds decodeWidth and decodeHeight,
+// the size the decoder would produce for that output after shrink-on-load.
+// Synchronous: a path costs one open and a 4 KiB read for most files, so
+// code on an event loop probes paths with probeFiles instead.
+Napi::Value Probe(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
 
-    float aspectRatio =
-        static_cast<float>(inputImage.width) / inputImage.height;
-    int newWidth = inputImage.width;
-    int newHeight = inputImage.height;
+  if (info.Length() < 1 || !(info[0].IsBuffer() || info[0].IsString())) {
+    Napi::TypeError::New(env, "First argument must be a Buffer or a path")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  const bool fit = info.Length() > 1 && !info[1].IsUndefined();
+  int maxWidth = 0;
+  int maxHeight = 0;
+  if (fit && !readMaxSize(info[1], info[2], maxWidth, maxHeight)) {
+    return env.Null();
+  }
 
-    if (inputImage.width > maxWidth) {
-      newWidth = maxWidth;
-      newHeight = static_cast<int>(maxWidth / aspectRatio);
+  ImageProbe probe;
+  try {
+    if (info[0].IsString()) {
+      probe = probeFile(info[0].As<Napi::String>().Utf8Value());
+    } else {
+      Napi::Buffer<uint8_t> buffer = info[0].As<Napi::Buffer<uint8_t>>();
+      probe = probeImage(buffer.Data(), buffer.Length());
     }
+  } catch (const std::exception &e) {
+    Napi::Error::New(env, std::string("Probe failed: ") + e.what())
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  return probeResult(env, probe, maxWidth, maxHeight);
+}
+
+// probeFiles(paths[, maxWidth, maxHeight]) is probe for a list of paths,
+// read on a libuv pool thread so planning a large run does not block the
+// event loop. Resolves to an array with a header or an Error per path, in
+// order.
+class ProbeFilesWorker : public Napi::AsyncWorker {
+public:
+  struct Item {
+    std::string path;
+    ImageProbe probe;
+    std::string error;
+  };
+
+  ProbeFilesWorker(Napi::Env env, std::vector<Item> &&items, int maxWidth,
+                   int maxHeight)
+      : Napi::AsyncWorker(env, "ImageProcessor::probeFiles"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        items_(std::move(items)), maxWidth_(maxWidth), maxHeight_(maxHeight) {}
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
 
-    if (newHeight > maxHeight) {
-      newHeight = maxHeight;
-      newWidth = static_cast<int>(maxHeight * aspectRatio);
+  void Execute() override {
+    for (Item &item : items_) {
+      try {
+        item.probe = probeFile(item.path);
+      } catch (const std::exception &e) {
+        item.error = e.what();
+      }
     }
+  }
 
-    ImageData resizedImage = inputImage;
-    if (newWidth != inputImage.width || newHeight != inputImage.height) {
-      resizedImage = resizeImage(inputImage, newWidth, newHeight);
+  void OnOK() override {
+    Napi::Env env = Env();
+    Napi::Array results = Napi::Array::New(env, items_.size());
+    for (size_t i = 0; i < items_.size(); i++) {
+      const Item &item = items_[i];
+      results.Set(static_cast<uint32_t>(i),
+                  item.error.empty()
+                      ? Napi::Value(probeResult(env, item.probe, maxWidth_,
+                                                maxHeight_))
+                      : Napi::Error::New(env, "Probe failed: " + item.error)
+                            .Value());
     }
+    deferred_.Resolve(results);
+  }
 
-    ImageData grayscaleImage = convertToGrayscale(resizedImage);
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
 
-    std::vector<uint8_t> encoded = encodeAsJPEG(grayscaleImage);
+private:
+  Napi::Promise::Deferred deferred_;
+  std::vector<Item> items_;
+  int maxWidth_;
+  int maxHeight_;
+};
 
-    return Napi::Buffer<uint8_t>::Copy(env, encoded.data(), encoded.size());
+Napi::Value ProbeFiles(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
 
-  } catch (const std::exception &e) {
-    Napi::Error::New(env, std::string("Image processing failed: ") + e.what())
+  if (info.Length() < 1 || !info[0].IsArray()) {
+    Napi::TypeError::New(env, "First argument must be an array of paths")
         .ThrowAsJavaScriptException();
     return env.Null();
   }
+  int maxWidth = 0;
+  int maxHeight = 0;
+  if (info.Length() > 1 && !info[1].IsUndefined() &&
+      !readMaxSize(info[1], info[2], maxWidth, maxHeight)) {
+    return env.Null();
+  }
+
+  Napi::Array array = info[0].As<Napi::Array>();
+  std::vector<ProbeFilesWorker::Item> items(array.Length());
+  for (uint32_t i = 0; i < array.Length(); i++) {
+    Napi::Value path = array.Get(i);
+    if (!path.IsString()) {
+      Napi::TypeError::New(env, "Path " + std::to_string(i) +
+                                    " must be a string")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    items[i].path = path.As<Napi::String>().Utf8Value();
+  }
+
+  auto *worker =
+      new ProbeFilesWorker(env, std::move(items), maxWidth, maxHeight);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
 }
 
+// Runs the pipeline on a libuv pool thread. The input (and optional output)
+// Buffers are held by persistent references so their backing stores stay
+// alive until completion; callers must not touch them while the returned
+// Promise is pending. With an output Buffer the Promise resolves to the byte
+// count written, otherwise to a new Buffer.
+class ProcessImageWorker : public Napi::AsyncWorker {
+public:
+  ProcessImageWorker(Napi::Env env, Napi::Buffer<uint8_t> input,
+                     const ProcessOptions &options)
+      : Napi::AsyncWorker(env, "ImageProcessor::processImageAsync"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        inputRef_(Napi::Persistent(input)), inputData_(input.Data()),
+        inputLength_(input.Length()), options_(options) {}
+
+  ProcessImageWorker(Napi::Env env, Napi::Buffer<uint8_t> input,
+                     Napi::Buffer<uint8_t> output,
+                     const ProcessOptions &options)
+      : ProcessImageWorker(env, input, options) {
+    outputRef_ = Napi::Persistent(output);
+    outputData_ = output.Data();
+    outputLength_ = output.Length();
+  }
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    try {
+      if (outputData_ != nullptr) {
+        written_ = runPipelineInto(inputData_, inputLength_, options_,
+                                   outputData_, outputLength_);
+      } else {
+        encoded_ = runPipeline(inputData_, inputLength_, options_);
+      }
+    } catch (const std::exception &e) {
+      SetError(std::string("Image processing failed: ") + e.what());
+    }
+  }
+
+  void OnOK() override {
+    if (outputData_ != nullptr) {
+      deferred_.Resolve(
+          Napi::Number::New(Env(), static_cast<double>(written_)));
+    } else {
+      deferred_.Resolve(wrapOutput(Env(), std::move(encoded_)));
+    }
+  }
+
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  Napi::Reference<Napi::Buffer<uint8_t>> inputRef_;
+  const uint8_t *inputData_;
+  size_t inputLength_;
+  Napi::Reference<Napi::Buffer<uint8_t>> outputRef_;
+  uint8_t *outputData_ = nullptr;
+  size_t outputLength_ = 0;
+  size_t written_ = 0;
+  ProcessOptions options_;
+  std::vector<uint8_t> encoded_;
+};
+
+Napi::Value ProcessImageAsync(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  ProcessOptions options;
+  if (!parseProcessArgs(info, 1, options)) {
+    return env.Null();
+  }
+
+  Napi::Buffer<uint8_t> inputBuffer = info[0].As<Napi::Buffer<uint8_t>>();
+
+  auto *worker = new ProcessImageWorker(env, inputBuffer, options);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+Napi::Value ProcessImageIntoAsync(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  ProcessOptions options;
+  if (!parseProcessArgs(info, 2, options)) {
+    return env.Null();
+  }
+
+  auto *worker = new ProcessImageWorker(
+      env, info[0].As<Napi::Buffer<uint8_t>>(),
+      info[1].As<Napi::Buffer<uint8_t>>(), options);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+// processRenditions(buffer, sizes[, options]) decodes buffer once and
+// resolves to one output per { maxWidth, maxHeight } in sizes, in order;
+// see runRenditions. Options are processImage's and apply to every output.
+// Results do not go through the result cache: they can differ from what
+// processImage returns for the same size.
+class ProcessRenditionsWorker : public Napi::AsyncWorker {
+public:
+  ProcessRenditionsWorker(Napi::Env env, Napi::Buffer<uint8_t> input,
+                          std::vector<RenditionSize> &&sizes,
+                          const ProcessOptions &options)
+      : Napi::AsyncWorker(env, "ImageProcessor::processRenditions"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        inputRef_(Napi::Persistent(input)), inputData_(input.Data()),
+        inputLength_(input.Length()), sizes_(std::move(sizes)),
+        options_(options) {}
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    try {
+      outputs_ = runRenditions(inputData_, inputLength_, options_, sizes_);
+    } catch (const std::exception &e) {
+      SetError(std::string("Image processing failed: ") + e.what());
+    }
+  }
+
+  void OnOK() override {
+    Napi::Env env = Env();
+    Napi::Array results = Napi::Array::New(env, outputs_.size());
+    for (size_t i = 0; i < outputs_.size(); i++) {
+      results.Set(static_cast<uint32_t>(i),
+                  wrapOutput(env, std::move(outputs_[i])));
+    }
+    deferred_.Resolve(results);
+  }
+
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  Napi::Reference<Napi::Buffer<uint8_t>> inputRef_;
+  const uint8_t *inputData_;
+  size_t inputLength_;
+  std::vector<RenditionSize> sizes_;
+  ProcessOptions options_;
+  std::vector<std::vector<uint8_t>> outputs_;
+};
+
+Napi::Value ProcessRenditions(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 2 || !info[0].IsBuffer() || !info[1].IsArray()) {
+    Napi::TypeError::New(env, "Expected a Buffer and an array of sizes")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Array array = info[1].As<Napi::Array>();
+  if (array.Length() == 0) {
+    Napi::RangeError::New(env, "At least one size is required")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  std::vector<RenditionSize> sizes(array.Length());
+  for (uint32_t i = 0; i < array.Length(); i++) {
+    Napi::Value element = array.Get(i);
+    Napi::Value width = element.IsObject()
+                            ? element.As<Napi::Object>().Get("maxWidth")
+                            : Napi::Value();
+    Napi::Value height = element.IsObject()
+                             ? element.As<Napi::Object>().Get("maxHeight")
+                             : Napi::Value();
+    if (!width.IsNumber() || !height.IsNumber()) {
+      Napi::TypeError::New(env, "Size " + std::to_string(i) +
+                                    " must be { maxWidth, maxHeight }")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    if (!readMaxSize(width, height, sizes[i].maxWidth, sizes[i].maxHeight)) {
+      return env.Null();
+    }
+  }
+
+  ProcessOptions options;
+  if (info.Length() > 2 && !info[2].IsUndefined()) {
+    if (!info[2].IsObject()) {
+      Napi::TypeError::New(env, "Options must be an object")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    if (!parseOptionsObject(info[2].As<Napi::Object>(), options)) {
+      return env.Null();
+    }
+  }
+
+  auto *worker = new ProcessRenditionsWorker(
+      env, info[0].As<Napi::Buffer<uint8_t>>(), std::move(sizes), options);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+// Files handed to the addon by path are only processed as frames when they
+// really are frames; anything else gets "unsupported input format", so the
+// caller can pass them to another decoder.
+void checkFileFormat(const uint8_t *data, size_t size,
+                     const ProcessOptions &options, const std::string &path) {
+  if (options.rawWidth == 0 && !canDecode(sniffFormat(data, size)) &&
+      !isFramedImage(data, size)) {
+    throw std::runtime_error("unsupported input format: '" + path + "'");
+  }
+}
+
+// processFile(inPath, outPath, maxWidth, maxHeight[, options]) does the whole
+// job on a libuv pool thread: the input is mapped rather than read, the
+// output is rendered into a block-aligned buffer and written with one
+// pwrite loop (O_DIRECT with `direct: true`), so neither file touches the V8
+// heap. Resolves to { inputSize, outputSize }.
+class ProcessFileWorker : public Napi::AsyncWorker {
+public:
+  ProcessFileWorker(Napi::Env env, std::string inputPath,
+                    std::string outputPath, const ProcessOptions &options,
+                    bool direct)
+      : Napi::AsyncWorker(env, "ImageProcessor::processFile"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        inputPath_(std::move(inputPath)), outputPath_(std::move(outputPath)),
+        options_(options), direct_(direct) {}
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    try {
+      InputFile input(inputPath_);
+      inputSize_ = input.size();
+      checkFileFormat(input.data(), input.size(), options_, inputPath_);
+
+      ResultCache &cache = ResultCache::shared();
+      CacheKey key{};
+      if (cache.enabled()) {
+        key = makeCacheKey(input.data(), input.size(), options_);
+        if (CachedOutput hit = cache.find(key)) {
+          OutputBlock block = allocateOutputBlock(hit->size());
+          std::memcpy(block.data, hit->data(), hit->size());
+          outputSize_ = hit->size();
+          writeOutputFile(outputPath_, block, outputSize_, direct_);
+          return;
+        }
+      }
+
+      DecodedImage decoded;
+      OutputSize outputSize;
+      ImageView inputImage = readInput(input.data(), input.size(), options_,
+                                       decoded, outputSize);
+      OutputBlock block =
+          allocateOutputBlock(maxOutputLength(outputSize, options_));
+      outputSize_ = renderOutput(inputImage, outputSize, options_, block.data,
+                                 block.capacity);
+      if (cache.enabled()) {
+        cache.store(key, block.data, outputSize_);
+      }
+      writeOutputFile(outputPath_, block, outputSize_, direct_);
+    } catch (const std::exception &e) {
+      SetError(std::string("Image processing failed: ") + e.what());
+    }
+  }
+
+  void OnOK() override {
+    Napi::Env env = Env();
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("inputSize",
+               Napi::Number::New(env, static_cast<double>(inputSize_)));
+    result.Set("outputSize",
+               Napi::Number::New(env, static_cast<double>(outputSize_)));
+    deferred_.Resolve(result);
+  }
+
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  std::string inputPath_;
+  std::string outputPath_;
+  ProcessOptions options_;
+  bool direct_;
+  size_t inputSize_ = 0;
+  size_t outputSize_ = 0;
+};
+
+Napi::Value ProcessFile(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 4) {
+    Napi::TypeError::New(env, "Expected 4 arguments: inPath, outPath, "
+                              "maxWidth, maxHeight")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  if (!info[0].IsString() || !info[1].IsString()) {
+    Napi::TypeError::New(env, "inPath and outPath must be strings")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  ProcessOptions options;
+  if (!parseSizeAndOptions(info, 2, options)) {
+    return env.Null();
+  }
+  bool direct = false;
+  if (info.Length() > 4 && info[4].IsObject() &&
+      !readBoolOption(info[4].As<Napi::Object>(), "direct", direct)) {
+    return env.Null();
+  }
+
+  auto *worker = new ProcessFileWorker(
+      env, info[0].As<Napi::String>().Utf8Value(),
+      info[1].As<Napi::String>().Utf8Value(), options, direct);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+// processFiles(items, maxWidth, maxHeight[, options]) is processFile for a
+// batch of { inPath, outPath } items. All inputs are read in one file batch
+// (io_uring where available), processed across the thread pool straight
+// from those buffers, and the outputs written in a second batch. Resolves
+// to an array with { inputSize, outputSize } or an Error per item, in order.
+class ProcessFilesWorker : public Napi::AsyncWorker {
+public:
+  struct Item {
+    std::string inputPath;
+    std::string outputPath;
+    size_t inputSize = 0;
+    std::vector<uint8_t> encoded;
+    std::string error;
+  };
+
+  ProcessFilesWorker(Napi::Env env, std::vector<Item> &&items,
+                     const ProcessOptions &options)
+      : Napi::AsyncWorker(env, "ImageProcessor::processFiles"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        items_(std::move(items)), options_(options) {}
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    try {
+      std::vector<FileRead> reads(items_.size());
+      for (size_t i = 0; i < items_.size(); i++) {
+        reads[i].path = items_[i].inputPath;
+      }
+      readFiles(reads);
+
+      ThreadPool &pool = ThreadPool::shared();
+      int count = static_cast<int>(items_.size());
+      int grain = std::max(1, count / (4 * pool.concurrency()));
+      ProcessOptions itemOptions = options_;
+      itemOptions.threads = 1;
+      pool.parallelFor(0, count, grain, options_.threads, [&](int begin,
+                                                              int end) {
+        for (int i = begin; i < end; i++) {
+          Item &item = items_[i];
+          FileRead &read = reads[i];
+          item.inputSize = read.data.size();
+          try {
+            if (!read.error.empty()) {
+              throw std::runtime_error(read.error);
+            }
+            checkFileFormat(read.data.data(), read.data.size(), itemOptions,
+                            item.inputPath);
+            item.encoded =
+                runPipeline(read.data.data(), read.data.size(), itemOptions);
+          } catch (const std::exception &e) {
+            item.error = e.what();
+          }
+          read.data = ScratchBuffer();
+        }
+      });
+
+      std::vector<FileWrite> writes;
+      std::vector<size_t> written;
+      for (size_t i = 0; i < items_.size(); i++) {
+        if (items_[i].error.empty()) {
+          FileWrite write;
+          write.path = items_[i].outputPath;
+          write.data = items_[i].encoded.data();
+          write.size = items_[i].encoded.size();
+          writes.push_back(std::move(write));
+          written.push_back(i);
+        }
+      }
+      writeFiles(writes);
+      for (size_t i = 0; i < writes.size(); i++) {
+        items_[written[i]].error = writes[i].error;
+      }
+    } catch (const std::exception &e) {
+      SetError(std::string("Image processing failed: ") + e.what());
+    }
+  }
+
+  void OnOK() override {
+    Napi::Env env = Env();
+    Napi::Array results = Napi::Array::New(env, items_.size());
+
+    for (size_t i = 0; i < items_.size(); i++) {
+      Item &item = items_[i];
+      if (item.error.empty()) {
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("inputSize",
+                   Napi::Number::New(env, static_cast<double>(item.inputSize)));
+        result.Set("outputSize",
+                   Napi::Number::New(
+                       env, static_cast<double>(item.encoded.size())));
+        results.Set(static_cast<uint32_t>(i), result);
+      } else {
+        results.Set(static_cast<uint32_t>(i),
+                    Napi::Error::New(env, "Image processing failed: " +
+                                              item.error)
+                        .Value());
+      }
+    }
+
+    deferred_.Resolve(results);
+  }
+
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  std::vector<Item> items_;
+  ProcessOptions options_;
+};
+
+Napi::Value ProcessFiles(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 3) {
+    Napi::TypeError::New(env, "Expected 3 arguments: items, maxWidth, "
+                              "maxHeight")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  if (!info[0].IsArray()) {
+    Napi::TypeError::New(env, "First argument must be an array")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  ProcessOptions options;
+  if (!parseSizeAndOptions(info, 1, options)) {
+    return env.Null();
+  }
+
+  Napi::Array array = info[0].As<Napi::Array>();
+  std::vector<ProcessFilesWorker::Item> items(array.Length());
+  for (uint32_t i = 0; i < array.Length(); i++) {
+    Napi::Value element = array.Get(i);
+    Napi::Value inPath = element.IsObject()
+                             ? element.As<Napi::Object>().Get("inPath")
+                             : Napi::Value();
+    Napi::Value outPath = element.IsObject()
+                              ? element.As<Napi::Object>().Get("outPath")
+                              : Napi::Value();
+    if (!inPath.IsString() || !outPath.IsString()) {
+      Napi::TypeError::New(env, "Item " + std::to_string(i) +
+                                    " must be { inPath, outPath }")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    items[i].inputPath = inPath.As<Napi::String>().Utf8Value();
+    items[i].outputPath = outPath.As<Napi::String>().Utf8Value();
+  }
+
+  auto *worker = new ProcessFilesWorker(env, std::move(items), options);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+// listDirectory(path) resolves to the regular files in path as
+// [{ name, size }], in directory order. The sizes come from one batch of
+// statx calls, so callers need not stat each file again.
+class ListDirectoryWorker : public Napi::AsyncWorker {
+public:
+  ListDirectoryWorker(Napi::Env env, std::string path)
+      : Napi::AsyncWorker(env, "ImageProcessor::listDirectory"),
+        deferred_(Napi::Promise::Deferred::New(env)), path_(std::move(path)) {}
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    try {
+      entries_ = listDirectory(path_);
+    } catch (const std::exception &e) {
+      SetError(e.what());
+    }
+  }
+
+  void OnOK() override {
+    Napi::Env env = Env();
+    Napi::Array results = Napi::Array::New(env, entries_.size());
+    for (size_t i = 0; i < entries_.size(); i++) {
+      Napi::Object entry = Napi::Object::New(env);
+      entry.Set("name", Napi::String::New(env, entries_[i].name));
+      entry.Set("size", Napi::Number::New(
+                            env, static_cast<double>(entries_[i].size)));
+      results.Set(static_cast<uint32_t>(i), entry);
+    }
+    deferred_.Resolve(results);
+  }
+
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  std::string path_;
+  std::vector<DirectoryEntry> entries_;
+};
+
+Napi::Value ListDirectory(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsString()) {
+    Napi::TypeError::New(env, "First argument must be a directory path")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  auto *worker =
+      new ListDirectoryWorker(env, info[0].As<Napi::String>().Utf8Value());
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+// configureCache({ memoryBytes, directory }) turns the result cache on for
+// every entry point except streams, in this thread and all others; with
+// neither set it is off again. An output already in memory or under the
+// directory for the same input bytes and options is returned without
+// running the pipeline.
+Napi::Value ConfigureCache(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsObject()) {
+    Napi::TypeError::New(env, "First argument must be an options object")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Object object = info[0].As<Napi::Object>();
+  Napi::Value memoryBytes = object.Get("memoryBytes");
+  Napi::Value directory = object.Get("directory");
+  if ((!memoryBytes.IsUndefined() && !memoryBytes.IsNumber()) ||
+      (!directory.IsUndefined() && !directory.IsString())) {
+    Napi::TypeError::New(env, "memoryBytes must be a number and directory a "
+                              "string")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  int64_t budget =
+      memoryBytes.IsNumber() ? memoryBytes.As<Napi::Number>().Int64Value() : 0;
+  if (budget < 0) {
+    Napi::RangeError::New(env, "memoryBytes must be 0 or more")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  ResultCache::shared().configure(
+      static_cast<size_t>(budget),
+      directory.IsString() ? directory.As<Napi::String>().Utf8Value() : "");
+  return env.Undefined();
+}
+
+// cacheStats() returns the process-wide { memoryHits, diskHits, misses,
+// entries, bytes }, where the last two describe the in-memory part.
+Napi::Value CacheStats(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  ResultCacheStats stats = ResultCache::shared().stats();
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("memoryHits",
+             Napi::Number::New(env, static_cast<double>(stats.memoryHits)));
+  result.Set("diskHits",
+             Napi::Number::New(env, static_cast<double>(stats.diskHits)));
+  result.Set("misses",
+             Napi::Number::New(env, static_cast<double>(stats.misses)));
+  result.Set("entries",
+             Napi::Number::New(env, static_cast<double>(stats.entries)));
+  result.Set("bytes", Napi::Number::New(env, static_cast<double>(stats.bytes)));
+  return result;
+}
+
+// getStats() returns what every thread of the process has recorded so far:
+// { stages, histogramBounds, scratch, cache }. stages maps each stage name
+// to { count, seconds, bytes, histogram }, where histogram[i] counts calls
+// that took at most histogramBounds[i] seconds (and more than the bound
+// before it); the last bound is Infinity. scratch holds the scratch pool's
+// { heapAllocations, reusedBlocks } and cache is cacheStats().
+Napi::Value GetStats(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  auto number = [&](uint64_t value) {
+    return Napi::Number::New(env, static_cast<double>(value));
+  };
+
+  Napi::Object stages = Napi::Object::New(env);
+  for (int i = 0; i < kStageCount; i++) {
+    StageSnapshot snapshot = stageSnapshot(static_cast<Stage>(i));
+    Napi::Array histogram = Napi::Array::New(env, kStageBuckets);
+    for (int bucket = 0; bucket < kStageBuckets; bucket++) {
+      histogram.Set(bucket, number(snapshot.buckets[bucket]));
+    }
+    Napi::Object stage = Napi::Object::New(env);
+    stage.Set("count", number(snapshot.count));
+    stage.Set("seconds", Napi::Number::New(env, snapshot.nanoseconds / 1e9));
+    stage.Set("bytes", number(snapshot.bytes));
+    stage.Set("histogram", histogram);
+    stages.Set(stageName(static_cast<Stage>(i)), stage);
+  }
+
+  const double infinity = std::numeric_limits<double>::infinity();
+  Napi::Array bounds = Napi::Array::New(env, kStageBuckets);
+  for (int bucket = 0; bucket < kStageBuckets; bucket++) {
+    double bound = stageBucketBound(bucket) / 1e9;
+    bounds.Set(bucket, Napi::Number::New(env, bound > 0 ? bound : infinity));
+  }
+
+  ScratchPoolStats pool = scratchPoolStats();
+  Napi::Object scratch = Napi::Object::New(env);
+  scratch.Set("heapAllocations", number(pool.heapAllocations));
+  scratch.Set("reusedBlocks", number(pool.reusedBlocks));
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("stages", stages);
+  result.Set("histogramBounds", bounds);
+  result.Set("scratch", scratch);
+  result.Set("cache", CacheStats(info));
+  return result;
+}
+
+// recordStage(name, seconds[, bytes]) adds one call timed in JS, such as a
+// sharp decode or an fs read in a worker, to the same counters.
+Napi::Value RecordStage(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  Stage stage;
+  if (info.Length() < 2 || !info[0].IsString() || !info[1].IsNumber() ||
+      (info.Length() > 2 && !info[2].IsUndefined() && !info[2].IsNumber())) {
+    Napi::TypeError::New(env, "Expected a stage name, seconds and bytes")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  if (!stageFromName(info[0].As<Napi::String>().Utf8Value().c_str(), stage)) {
+    Napi::RangeError::New(env, "Unknown stage name")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  double seconds = info[1].As<Napi::Number>().DoubleValue();
+  double bytes = info.Length() > 2 && info[2].IsNumber()
+                     ? info[2].As<Napi::Number>().DoubleValue()
+                     : 0;
+  recordStage(stage, static_cast<uint64_t>(std::max(0.0, seconds) * 1e9),
+              static_cast<uint64_t>(std::max(0.0, bytes)));
+  return env.Undefined();
+}
+
+// numaNodes() returns [{ node, cpus }] for the CPUs this process may use.
+Napi::Value NumaNodes(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  std::vector<NumaNode> nodes = numaNodes();
+
+  Napi::Array result = Napi::Array::New(env, nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    Napi::Array cpus = Napi::Array::New(env, nodes[i].cpus.size());
+    for (size_t j = 0; j < nodes[i].cpus.size(); j++) {
+      cpus.Set(static_cast<uint32_t>(j),
+               Napi::Number::New(env, nodes[i].cpus[j]));
+    }
+    Napi::Object node = Napi::Object::New(env);
+    node.Set("node", Napi::Number::New(env, nodes[i].id));
+    node.Set("cpus", cpus);
+    result.Set(static_cast<uint32_t>(i), node);
+  }
+  return result;
+}
+
+// pinThread(cpus[, node]) pins the calling JS thread, which in a worker is
+// the thread the worker's jobs run on, and returns whether it could.
+Napi::Value PinThread(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsArray() ||
+      (info.Length() > 1 && !info[1].IsUndefined() && !info[1].IsNumber())) {
+    Napi::TypeError::New(env, "Expected an array of CPUs and a node number")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Array list = info[0].As<Napi::Array>();
+  std::vector<int> cpus;
+  for (uint32_t i = 0; i < list.Length(); i++) {
+    Napi::Value cpu = list.Get(i);
+    if (!cpu.IsNumber() || cpu.As<Napi::Number>().Int32Value() < 0) {
+      Napi::TypeError::New(env, "CPUs must be non-negative numbers")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    cpus.push_back(cpu.As<Napi::Number>().Int32Value());
+  }
+  int node = info.Length() > 1 && info[1].IsNumber()
+                 ? info[1].As<Napi::Number>().Int32Value()
+                 : -1;
+  return Napi::Boolean::New(env, pinCurrentThread(cpus, node));
+}
+
+// Processes many small images in one call: arguments are validated and
+// references taken once on the JS thread, the images are shared out across
+// the thread pool, and the Promise resolves to an array holding a Buffer or
+// an Error for each input, in order. Each image runs single-threaded; the
+// parallelism is across images.
+class ProcessBatchWorker : public Napi::AsyncWorker {
+public:
+  struct Item {
+    Napi::Reference<Napi::Buffer<uint8_t>> inputRef;
+    const uint8_t *data;
+    size_t length;
+    ProcessOptions options;
+    std::vector<uint8_t> encoded;
+    std::string error;
+  };
+
+  ProcessBatchWorker(Napi::Env env, std::vector<Item> &&items, int threads)
+      : Napi::AsyncWorker(env, "ImageProcessor::processBatch"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        items_(std::move(items)), threads_(threads) {}
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    ThreadPool &pool = ThreadPool::shared();
+    int count = static_cast<int>(items_.size());
+    int grain = std::max(1, count / (4 * pool.concurrency()));
+
+    pool.parallelFor(0, count, grain, threads_, [this](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        Item &item = items_[i];
+        try {
+          item.encoded = runPipeline(item.data, item.length, item.options);
+        } catch (const std::exception &e) {
+          item.error = e.what();
+        }
+      }
+    });
+  }
+
+  void OnOK() override {
+    Napi::Env env = Env();
+    Napi::Array results = Napi::Array::New(env, items_.size());
+
+    for (size_t i = 0; i < items_.size(); i++) {
+      Item &item = items_[i];
+      if (item.error.empty()) {
+        results.Set(static_cast<uint32_t>(i),
+                    wrapOutput(env, std::move(item.encoded)));
+      } else {
+        results.Set(static_cast<uint32_t>(i),
+                    Napi::Error::New(env, "Image processing failed: " +
+                                              item.error)
+                        .Value());
+      }
+      item.inputRef.Reset();
+    }
+
+    deferred_.Resolve(results);
+  }
+
+  void OnError(const Napi::Error &error) override {
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  std::vector<Item> items_;
+  int threads_;
+};
+
+// processBatch(items, maxWidth, maxHeight[, options]). Each item is a Buffer
+// in the same form processImage takes, or { data, raw } for headerless
+// pixels with their own layout.
+Napi::Value ProcessBatch(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 3) {
+    Napi::TypeError::New(env, "Expected 3 arguments: items, maxWidth, "
+                              "maxHeight")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  if (!info[0].IsArray()) {
+    Napi::TypeError::New(env, "First argument must be an array")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  ProcessOptions options;
+  if (!parseSizeAndOptions(info, 1, options)) {
+    return env.Null();
+  }
+
+  Napi::Array array = info[0].As<Napi::Array>();
+  std::vector<ProcessBatchWorker::Item> items(array.Length());
+
+  for (uint32_t i = 0; i < array.Length(); i++) {
+    Napi::Value element = array.Get(i);
+    ProcessBatchWorker::Item &item = items[i];
+    item.options = options;
+    item.options.threads = 1;
+
+    if (!element.IsBuffer()) {
+      Napi::Value data =
+          element.IsObject() ? element.As<Napi::Object>().Get("data")
+                             : Napi::Value();
+      if (!element.IsObject() || !data.IsBuffer()) {
+        Napi::TypeError::New(env, "Batch item " + std::to_string(i) +
+                                      " must be a Buffer or { data, raw }")
+            .ThrowAsJavaScriptException();
+        return env.Null();
+      }
+      Napi::Value raw = element.As<Napi::Object>().Get("raw");
+      if (!raw.IsUndefined() && !parseRawOption(raw, item.options)) {
+        return env.Null();
+      }
+      element = data;
+    }
+
+    Napi::Buffer<uint8_t> buffer = element.As<Napi::Buffer<uint8_t>>();
+    item.inputRef = Napi::Persistent(buffer);
+    item.data = buffer.Data();
+    item.length = buffer.Length();
+  }
+
+  auto *worker = new ProcessBatchWorker(env, std::move(items), options.threads);
+  Napi::Promise promise = worker->Promise();
+  worker->Queue();
+  return promise;
+}
+
+// Runs one write or the end of an ImageStream on a libuv pool thread and
+// resolves to the output produced by it, which may be an empty Buffer. The
+// stream object and the chunk are held by persistent references until then.
+class StreamStepWorker : public Napi::AsyncWorker {
+public:
+  StreamStepWorker(Napi::Env env, Napi::Object owner, StreamPipeline &pipeline,
+                   bool &busy)
+      : Napi::AsyncWorker(env, "ImageProcessor::ImageStream"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        ownerRef_(Napi::Persistent(owner)), pipeline_(pipeline), busy_(busy) {
+    busy_ = true;
+  }
+
+  StreamStepWorker(Napi::Env env, Napi::Object owner, StreamPipeline &pipeline,
+                   bool &busy, Napi::Buffer<uint8_t> chunk)
+      : StreamStepWorker(env, owner, pipeline, busy) {
+    chunkRef_ = Napi::Persistent(chunk);
+    chunkData_ = chunk.Data();
+    chunkLength_ = chunk.Length();
+    writing_ = true;
+  }
+
+  Napi::Promise Promise() const { return deferred_.Promise(); }
+
+  void Execute() override {
+    try {
+      if (writing_) {
+        pipeline_.write(chunkData_, chunkLength_);
+      } else {
+        pipeline_.end();
+      }
+      output_ = pipeline_.takeOutput();
+    } catch (const std::exception &e) {
+      SetError(std::string("Image processing failed: ") + e.what());
+    }
+  }
+
+  void OnOK() override {
+    busy_ = false;
+    if (output_.size() == 0) {
+      deferred_.Resolve(Napi::Buffer<uint8_t>::New(Env(), 0));
+    } else {
+      deferred_.Resolve(wrapOutput(Env(), std::move(output_)));
+    }
+  }
+
+  void OnError(const Napi::Error &error) override {
+    busy_ = false;
+    deferred_.Reject(error.Value());
+  }
+
+private:
+  Napi::Promise::Deferred deferred_;
+  Napi::ObjectReference ownerRef_;
+  StreamPipeline &pipeline_;
+  bool &busy_;
+  Napi::Reference<Napi::Buffer<uint8_t>> chunkRef_;
+  const uint8_t *chunkData_ = nullptr;
+  size_t chunkLength_ = 0;
+  bool writing_ = false;
+  std::vector<uint8_t> output_;
+};
+
+// new ImageStream(maxWidth, maxHeight[, options]) wraps a StreamPipeline:
+// write(chunk) and end() return Promises for the output bytes each step
+// produced. One step runs at a time; stream.js chains them.
+class ImageStream : public Napi::ObjectWrap<ImageStream> {
+public:
+  static Napi::Function Define(Napi::Env env) {
+    return DefineClass(env, "ImageStream",
+                       {InstanceMethod("write", &ImageStream::Write),
+                        InstanceMethod("end", &ImageStream::End)});
+  }
+
+  explicit ImageStream(const Napi::CallbackInfo &info)
+      : Napi::ObjectWrap<ImageStream>(info) {
+    ProcessOptions options;
+    if (parseSizeAndOptions(info, 0, options)) {
+      pipeline_ = std::make_unique<StreamPipeline>(options);
+    }
+  }
+
+private:
+  Napi::Value Write(const Napi::CallbackInfo &info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsBuffer()) {
+      Napi::TypeError::New(env, "First argument must be a Buffer")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    if (!checkIdle(env)) {
+      return env.Null();
+    }
+
+    auto *worker = new StreamStepWorker(env, Value(), *pipeline_, busy_,
+                                        info[0].As<Napi::Buffer<uint8_t>>());
+    Napi::Promise promise = worker->Promise();
+    worker->Queue();
+    return promise;
+  }
+
+  Napi::Value End(const Napi::CallbackInfo &info) {
+    Napi::Env env = info.Env();
+    if (!checkIdle(env)) {
+      return env.Null();
+    }
+
+    auto *worker = new StreamStepWorker(env, Value(), *pipeline_, busy_);
+    Napi::Promise promise = worker->Promise();
+    worker->Queue();
+    return promise;
+  }
+
+  bool checkIdle(Napi::Env env) {
+    if (!pipeline_ || busy_) {
+      Napi::Error::New(env, busy_ ? "ImageStream: the previous write or end "
+                                    "has not finished"
+                                  : "ImageStream was not constructed")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<StreamPipeline> pipeline_;
+  bool busy_ = false;
+};
+
+// new JobQueue(jobCount, workerCount[, { ordered }]) creates a native
+// work-stealing queue of job indices and new JobQueue(id) opens the one
+// with that id from any worker thread. With ordered, jobs go out in index
+// order to whichever worker asks next, so jobs numbered from most to least
+// expensive are dispatched longest-first. queue.next(worker)
+// returns that worker's next job index, or -1 once all jobs have been handed
+// out; it never blocks or posts a message.
+class JobQueueHandle : public Napi::ObjectWrap<JobQueueHandle> {
+public:
+  static Napi::Function Define(Napi::Env env) {
+    return DefineClass(env, "JobQueue",
+                       {InstanceMethod("next", &JobQueueHandle::Next),
+                        InstanceAccessor("id", &JobQueueHandle::Id, nullptr),
+                        InstanceAccessor("workerCount",
+                                         &JobQueueHandle::WorkerCount,
+                                         nullptr)});
+  }
+
+  explicit JobQueueHandle(const Napi::CallbackInfo &info)
+      : Napi::ObjectWrap<JobQueueHandle>(info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() == 1 && info[0].IsNumber()) {
+      id_ = info[0].As<Napi::Number>().Uint32Value();
+      queue_ = findJobQueue(id_);
+      if (!queue_) {
+        Napi::RangeError::New(env, "No job queue with id " +
+                                       std::to_string(id_))
+            .ThrowAsJavaScriptException();
+      }
+      return;
+    }
+
+    if (info.Length() < 2 || !info[0].IsNumber() || !info[1].IsNumber()) {
+      Napi::TypeError::New(env, "Expected jobCount and workerCount, or a "
+                                "queue id")
+          .ThrowAsJavaScriptException();
+      return;
+    }
+    int64_t jobCount = info[0].As<Napi::Number>().Int64Value();
+    int64_t workerCount = info[1].As<Napi::Number>().Int64Value();
+    if (jobCount < 0 || jobCount > INT32_MAX || workerCount < 1 ||
+        workerCount > 1024) {
+      Napi::RangeError::New(env, "jobCount or workerCount out of range")
+          .ThrowAsJavaScriptException();
+      return;
+    }
+
+    bool ordered = false;
+    if (info.Length() > 2 && info[2].IsObject()) {
+      Napi::Value value = info[2].As<Napi::Object>().Get("ordered");
+      ordered = value.IsBoolean() && value.As<Napi::Boolean>().Value();
+    }
+
+    queue_ = std::make_shared<JobQueue>(static_cast<int32_t>(jobCount),
+                                        static_cast<int>(workerCount),
+                                        ordered);
+    id_ = registerJobQueue(queue_);
+  }
+
+private:
+  Napi::Value Next(const Napi::CallbackInfo &info) {
+    Napi::Env env = info.Env();
+    if (!queue_) {
+      Napi::Error::New(env, "JobQueue was not constructed")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+      Napi::TypeError::New(env, "First argument must be a worker index")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    int worker = info[0].As<Napi::Number>().Int32Value();
+    return Napi::Number::New(env, queue_->next(worker));
+  }
+
+  Napi::Value Id(const Napi::CallbackInfo &info) {
+    return Napi::Number::New(info.Env(), id_);
+  }
+
+  Napi::Value WorkerCount(const Napi::CallbackInfo &info) {
+    return Napi::Number::New(info.Env(), queue_ ? queue_->workerCount() : 0);
+  }
+
+  std::shared_ptr<JobQueue> queue_;
+  uint32_t id_ = 0;
+};
+
 } // namespace ImageProcessor
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
   exports.Set(Napi::String::New(env, "processImage"),
               Napi::Function::New(env, ImageProcessor::ProcessImage));
+  exports.Set(Napi::String::New(env, "processImageAsync"),
+              Napi::Function::New(env, ImageProcessor::ProcessImageAsync));
+  exports.Set(Napi::String::New(env, "processImageInto"),
+              Napi::Function::New(env, ImageProcessor::ProcessImageInto));
+  exports.Set(Napi::String::New(env, "processImageIntoAsync"),
+              Napi::Function::New(env, ImageProcessor::ProcessImageIntoAsync));
+  exports.Set(Napi::String::New(env, "processRenditions"),
+              Napi::Function::New(env, ImageProcessor::ProcessRenditions));
+  exports.Set(Napi::String::New(env, "processFile"),
+              Napi::Function::New(env, ImageProcessor::ProcessFile));
+  exports.Set(Napi::String::New(env, "processFiles"),
+              Napi::Function::New(env, ImageProcessor::ProcessFiles));
+  exports.Set(Napi::String::New(env, "listDirectory"),
+              Napi::Function::New(env, ImageProcessor::ListDirectory));
+  exports.Set(Napi::String::New(env, "processBatch"),
+              Napi::Function::New(env, ImageProcessor::ProcessBatch));
+  exports.Set(Napi::String::New(env, "configureCache"),
+              Napi::Function::New(env, ImageProcessor::ConfigureCache));
+  exports.Set(Napi::String::New(env, "cacheStats"),
+              Napi::Function::New(env, ImageProcessor::CacheStats));
+  exports.Set(Napi::String::New(env, "getStats"),
+              Napi::Function::New(env, ImageProcessor::GetStats));
+  exports.Set(Napi::String::New(env, "recordStage"),
+              Napi::Function::New(env, ImageProcessor::RecordStage));
+  exports.Set(Napi::String::New(env, "numaNodes"),
+              Napi::Function::New(env, ImageProcessor::NumaNodes));
+  exports.Set(Napi::String::New(env, "pinThread"),
+              Napi::Function::New(env, ImageProcessor::PinThread));
+  exports.Set(Napi::String::New(env, "canDecode"),
+              Napi::Function::New(env, ImageProcessor::CanDecode));
+  exports.Set(Napi::String::New(env, "probe"),
+              Napi::Function::New(env, ImageProcessor::Probe));
+  exports.Set(Napi::String::New(env, "probeFiles"),
+              Napi::Function::New(env, ImageProcessor::ProbeFiles));
+  exports.Set(Napi::String::New(env, "canEncode"),
+              Napi::Function::New(env, ImageProcessor::CanEncode));
+  exports.Set(Napi::String::New(env, "computeOutputSize"),
+              Napi::Function::New(env, ImageProcessor::ComputeOutputSize));
+  exports.Set(Napi::String::New(env, "ImageStream"),
+              ImageProcessor::ImageStream::Define(env));
+  exports.Set(Napi::String::New(env, "JobQueue"),
+              ImageProcessor::JobQueueHandle::Define(env));
+  exports.Set(Napi::String::New(env, "kernels"),
+              Napi::String::New(env, ImageProcessor::activeKernels().name));
+  exports.Set(Napi::String::New(env, "ioBackend"),
+              Napi::String::New(env, ImageProcessor::fileBatchBackend()));
   return exports;
 }
 
@@ -0,0 +1,142 @@
+#include "job_queue.h"
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+
+namespace ImageProcessor {
+
+namespace {
+
+size_t roundUpToPowerOfTwo(size_t value) {
+  size_t result = 1;
+  while (result < value)
+    result <<= 1;
+  return result;
+}
+
+std::mutex registryMutex;
+std::unordered_map<uint32_t, std::weak_ptr<JobQueue>> registry;
+uint32_t nextQueueId = 1;
+
+} // namespace
+
+WorkDeque::WorkDeque(size_t capacity)
+    : buffer_(new std::atomic<int32_t>[roundUpToPowerOfTwo(capacity)]),
+      mask_(roundUpToPowerOfTwo(capacity) - 1) {}
+
+bool WorkDeque::push(int32_t job) {
+  int64_t bottom = bottom_.load(std::memory_order_relaxed);
+  int64_t top = top_.load(std::memory_order_acquire);
+  if (bottom - top > static_cast<int64_t>(mask_))
+    return false;
+  buffer_[bottom & mask_].store(job, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom_.store(bottom + 1, std::memory_order_relaxed);
+  return true;
+}
+
+bool WorkDeque::pop(int32_t &job) {
+  int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+  bottom_.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = top_.load(std::memory_order_relaxed);
+
+  if (top > bottom) {
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return false;
+  }
+  job = buffer_[bottom & mask_].load(std::memory_order_relaxed);
+  if (top < bottom)
+    return true;
+
+  // Last job: race the thieves for it through top.
+  bool won = top_.compare_exchange_strong(top, top + 1,
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed);
+  bottom_.store(bottom + 1, std::memory_order_relaxed);
+  return won;
+}
+
+WorkDeque::Steal WorkDeque::steal(int32_t &job) {
+  int64_t top = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t bottom = bottom_.load(std::memory_order_acquire);
+  if (top >= bottom)
+    return Steal::Empty;
+
+  job = buffer_[top & mask_].load(std::memory_order_relaxed);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed))
+    return Steal::Lost;
+  return Steal::Taken;
+}
+
+JobQueue::JobQueue(int32_t jobCount, int workerCount, bool ordered)
+    : workerCount_(std::max(1, workerCount)), ordered_(ordered),
+      jobCount_(std::max<int32_t>(0, jobCount)) {
+  if (ordered_)
+    return;
+  for (int worker = 0; worker < workerCount_; worker++) {
+    int32_t begin = static_cast<int32_t>(int64_t(jobCount_) * worker /
+                                         workerCount_);
+    int32_t end = static_cast<int32_t>(int64_t(jobCount_) * (worker + 1) /
+                                       workerCount_);
+    int32_t count = end - begin;
+
+    auto deque = std::make_unique<WorkDeque>(std::max(1, count));
+    // The owner pops from the bottom, so pushing the run backwards hands
+    // its jobs out in order while thieves take them from the far end.
+    for (int32_t job = end - 1; job >= begin; job--) {
+      deque->push(job);
+    }
+    deques_.push_back(std::move(deque));
+  }
+}
+
+int32_t JobQueue::next(int worker) {
+  if (ordered_) {
+    int64_t job = cursor_.fetch_add(1, std::memory_order_relaxed);
+    return job < jobCount_ ? static_cast<int32_t>(job) : -1;
+  }
+
+  int count = workerCount();
+  worker = ((worker % count) + count) % count;
+
+  int32_t job;
+  if (deques_[worker]->pop(job))
+    return job;
+
+  // Nothing is pushed after seeding, so once every deque reads empty the
+  // queue is done for good.
+  for (int offset = 1; offset < count; offset++) {
+    WorkDeque &victim = *deques_[(worker + offset) % count];
+    for (;;) {
+      WorkDeque::Steal result = victim.steal(job);
+      if (result == WorkDeque::Steal::Taken)
+        return job;
+      if (result == WorkDeque::Steal::Empty)
+        break;
+    }
+  }
+  return -1;
+}
+
+uint32_t registerJobQueue(const std::shared_ptr<JobQueue> &queue) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  for (auto it = registry.begin(); it != registry.end();) {
+    it = it->second.expired() ? registry.erase(it) : std::next(it);
+  }
+  uint32_t id = nextQueueId++;
+  registry[id] = queue;
+  return id;
+}
+
+std::shared_ptr<JobQueue> findJobQueue(uint32_t id) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto it = registry.find(id);
+  return it == registry.end() ? nullptr : it->second.lock();
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ImageProcessor {
+
+// Chase-Lev work-stealing deque of job indices (Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models", 2013). The owner pushes
+// and pops at the bottom; any other thread may steal from the top. None of
+// the operations lock, and an uncontended pop is a handful of atomic
+// accesses. The capacity is fixed when the deque is created.
+class WorkDeque {
+public:
+  explicit WorkDeque(size_t capacity);
+
+  WorkDeque(const WorkDeque &) = delete;
+  WorkDeque &operator=(const WorkDeque &) = delete;
+
+  // Owner only. Returns false when the deque is full.
+  bool push(int32_t job);
+  // Owner only. Returns false when the deque is empty.
+  bool pop(int32_t &job);
+
+  enum class Steal { Empty, Lost, Taken };
+  // Any thread. Lost means another thread took the job first; the deque
+  // may still hold more.
+  Steal steal(int32_t &job);
+
+private:
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+  std::unique_ptr<std::atomic<int32_t>[]> buffer_;
+  size_t mask_;
+};
+
+// A fixed set of jobs, numbered 0 to jobCount - 1, shared by the worker
+// threads of a process. Each worker owns one deque, seeded with a
+// contiguous run of the jobs in order, and takes the next job from it
+// without a message to the main thread; a worker whose deque runs dry
+// steals from the others. Every job is handed out exactly once.
+//
+// With ordered, there are no deques: every worker takes the lowest job
+// index not yet handed out, from one shared atomic cursor. Numbering jobs
+// from most to least expensive then gives a true
+// longest-processing-time-first schedule, each idle worker starting the
+// biggest job left. That costs one contended fetch_add per job, which is
+// nothing next to decoding an image.
+class JobQueue {
+public:
+  JobQueue(int32_t jobCount, int workerCount, bool ordered = false);
+
+  int workerCount() const { return workerCount_; }
+
+  // The next job for `worker`, or -1 once every job has been handed out.
+  // Each worker index must only be used from one thread at a time.
+  int32_t next(int worker);
+
+private:
+  int workerCount_;
+  bool ordered_;
+  int32_t jobCount_;
+  // 64-bit so that calls after the last job cannot wrap it around.
+  alignas(64) std::atomic<int64_t> cursor_{0};
+  std::vector<std::unique_ptr<WorkDeque>> deques_;
+};
+
+// Queues are shared between worker threads by id: the main thread creates
+// one and posts the id, and each worker looks it up. The registry does not
+// keep a queue alive; it lives as long as someone holds it.
+uint32_t registerJobQueue(const std::shared_ptr<JobQueue> &queue);
+std::shared_ptr<JobQueue> findJobQueue(uint32_t id);
+
+} // namespace ImageProcessor
@@ -0,0 +1,44 @@
+#pragma once
+
+// Error handling shared by the libjpeg decoder and encoder. Only include this
+// when IMAGE_PROCESSOR_HAVE_JPEG is defined.
+
+#include <csetjmp>
+#include <cstdio>
+#include <jerror.h>
+#include <jpeglib.h>
+
+namespace ImageProcessor {
+
+// libjpeg reports fatal errors through error_exit, which must not return.
+// The handler formats the message and longjmps back to the setjmp of the
+// function driving libjpeg, which then turns it into an exception.
+struct JpegErrorManager {
+  jpeg_error_mgr base;
+  std::jmp_buf jump;
+  char message[JMSG_LENGTH_MAX];
+};
+
+inline void jpegErrorExit(j_common_ptr cinfo) {
+  auto *errors = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+  (*cinfo->err->format_message)(cinfo, errors->message);
+  std::longjmp(errors->jump, 1);
+}
+
+// Warnings are ignored except running out of data: libjpeg would pad the
+// rest of a truncated file with gray and report success.
+inline void jpegEmitMessage(j_common_ptr cinfo, int level) {
+  if (level < 0 && cinfo->err->msg_code == JWRN_JPEG_EOF) {
+    jpegErrorExit(cinfo);
+  }
+}
+
+inline jpeg_error_mgr *initJpegErrors(JpegErrorManager &errors) {
+  jpeg_std_error(&errors.base);
+  errors.base.error_exit = jpegErrorExit;
+  errors.base.emit_message = jpegEmitMessage;
+  errors.message[0] = '\0';
+  return &errors.base;
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,191 @@
+#include "kernels.h"
+#include "resize.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(IMAGE_PROCESSOR_X86_KERNELS) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(IMAGE_PROCESSOR_NEON_KERNELS) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace ImageProcessor {
+
+namespace {
+
+// The scalar loops are instantiated per channel count, so the per-pixel
+// index math and the channel loop compile to constants and unroll.
+template <int Channels>
+void lumaRowFixed(const uint8_t *src, size_t pixels, uint8_t *dst) {
+  for (size_t i = 0; i < pixels; i++) {
+    const uint8_t *pixel = src + i * Channels;
+    if (Channels < 3) {
+      dst[i] = pixel[0];
+    } else {
+      dst[i] = static_cast<uint8_t>((kLumaRed * pixel[0] +
+                                     kLumaGreen * pixel[1] +
+                                     kLumaBlue * pixel[2]) >>
+                                    kLumaBits);
+    }
+  }
+}
+
+template <int Channels>
+void resampleColumnsFixed(const ResizePlan &plan, const uint8_t *srcRow,
+                          int xBegin, uint32_t *dst) {
+  dst += static_cast<size_t>(xBegin) * Channels;
+
+  for (int x = xBegin; x < plan.dstWidth; x++) {
+    const uint8_t *left = srcRow + plan.xOffset0[x];
+    const uint8_t *right = srcRow + plan.xOffset1[x];
+    uint32_t weight = plan.xWeight[x];
+    uint32_t inverse = kResizeWeightOne - weight;
+
+    for (int c = 0; c < Channels; c++) {
+      dst[c] = left[c] * inverse + right[c] * weight;
+    }
+    dst += Channels;
+  }
+}
+
+} // namespace
+
+void lumaRowScalar(const uint8_t *src, int channels, size_t pixels,
+                   uint8_t *dst) {
+  switch (channels) {
+  case 1:
+    std::memcpy(dst, src, pixels);
+    break;
+  case 2:
+    lumaRowFixed<2>(src, pixels, dst);
+    break;
+  case 3:
+    lumaRowFixed<3>(src, pixels, dst);
+    break;
+  default:
+    lumaRowFixed<4>(src, pixels, dst);
+    break;
+  }
+}
+
+void resampleColumnsScalar(const ResizePlan &plan, const uint8_t *srcRow,
+                           int xBegin, uint32_t *dst) {
+  switch (plan.channels) {
+  case 1:
+    resampleColumnsFixed<1>(plan, srcRow, xBegin, dst);
+    break;
+  case 2:
+    resampleColumnsFixed<2>(plan, srcRow, xBegin, dst);
+    break;
+  case 3:
+    resampleColumnsFixed<3>(plan, srcRow, xBegin, dst);
+    break;
+  default:
+    resampleColumnsFixed<4>(plan, srcRow, xBegin, dst);
+    break;
+  }
+}
+
+void blendRowsVerticalScalar(const uint32_t *row0, const uint32_t *row1,
+                             uint32_t weight, size_t count, uint8_t *dst) {
+  uint32_t inverse = kResizeWeightOne - weight;
+
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = static_cast<uint8_t>((row0[i] * inverse + row1[i] * weight) >>
+                                  (2 * kResizeWeightBits));
+  }
+}
+
+namespace {
+
+void resampleRowHorizontalScalar(const ResizePlan &plan, const uint8_t *srcRow,
+                                 uint32_t *dst) {
+  resampleColumnsScalar(plan, srcRow, 0, dst);
+}
+
+const KernelTable kScalarKernels = {"scalar", lumaRowScalar,
+                                    resampleRowHorizontalScalar,
+                                    blendRowsVerticalScalar};
+
+#if defined(IMAGE_PROCESSOR_X86_KERNELS)
+bool cpuSupportsSse41() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 19)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+bool cpuSupportsAvx2() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+  __cpuidex(info, 7, 0);
+  return osSavesYmm && (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if defined(IMAGE_PROCESSOR_NEON_KERNELS)
+bool cpuSupportsNeon() {
+#if defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#else
+  return true;
+#endif
+}
+#endif
+
+// IMAGE_PROCESSOR_KERNELS=<name> caps the selection at a kernel set the CPU
+// supports, e.g. to compare against scalar output or to rule out a SIMD path.
+bool allowed(const char *name) {
+  const char *requested = std::getenv("IMAGE_PROCESSOR_KERNELS");
+  if (requested == nullptr || *requested == '\0')
+    return true;
+
+  static const char *const order[] = {"scalar", "sse4.1", "avx2", "neon"};
+  int limit = -1;
+  int rank = -1;
+  for (int i = 0; i < 4; i++) {
+    if (std::strcmp(order[i], requested) == 0)
+      limit = i;
+    if (std::strcmp(order[i], name) == 0)
+      rank = i;
+  }
+  return limit < 0 || rank <= limit;
+}
+
+const KernelTable &selectKernels() {
+#if defined(IMAGE_PROCESSOR_X86_KERNELS)
+  if (allowed("avx2") && cpuSupportsAvx2())
+    return avx2Kernels();
+  if (allowed("sse4.1") && cpuSupportsSse41())
+    return sse41Kernels();
+#endif
+#if defined(IMAGE_PROCESSOR_NEON_KERNELS)
+  if (allowed("neon") && cpuSupportsNeon())
+    return neonKernels();
+#endif
+  return kScalarKernels;
+}
+
+const KernelTable &gActiveKernels = selectKernels();
+
+} // namespace
+
+const KernelTable &activeKernels() { return gActiveKernels; }
+
+const KernelTable &scalarKernels() { return kScalarKernels; }
+
+} // namespace ImageProcessor
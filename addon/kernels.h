@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+struct ResizePlan;
+
+// Luma weights in Q15 (0.299, 0.587, 0.114); they sum to exactly 1 << 15 so
+// white stays white. Every kernel set uses these so results are identical
+// whichever one the CPU selects.
+constexpr uint32_t kLumaRed = 9798;
+constexpr uint32_t kLumaGreen = 19235;
+constexpr uint32_t kLumaBlue = 3735;
+constexpr int kLumaBits = 15;
+
+// Per-pixel loops that have vectorized variants. One table is chosen when the
+// addon is loaded, from CPUID on x86 and HWCAP on Arm.
+struct KernelTable {
+  const char *name;
+  // Reduces `pixels` interleaved pixels to one luma byte each. Pixels with
+  // fewer than three channels keep their first channel.
+  void (*lumaRow)(const uint8_t *src, int channels, size_t pixels,
+                  uint8_t *dst);
+  // Interpolates one source row to plan.dstWidth * plan.channels values
+  // scaled by kResizeWeightOne.
+  void (*resampleRowHorizontal)(const ResizePlan &plan, const uint8_t *srcRow,
+                                uint32_t *dst);
+  // Blends two horizontally resampled rows; weight is the share of row1.
+  void (*blendRowsVertical)(const uint32_t *row0, const uint32_t *row1,
+                            uint32_t weight, size_t count, uint8_t *dst);
+};
+
+const KernelTable &activeKernels();
+const KernelTable &scalarKernels();
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(_M_IX86)
+#define IMAGE_PROCESSOR_X86_KERNELS 1
+const KernelTable &sse41Kernels();
+const KernelTable &avx2Kernels();
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define IMAGE_PROCESSOR_NEON_KERNELS 1
+const KernelTable &neonKernels();
+#endif
+
+// Scalar row tails shared by the vectorized kernels.
+void lumaRowScalar(const uint8_t *src, int channels, size_t pixels,
+                   uint8_t *dst);
+void resampleColumnsScalar(const ResizePlan &plan, const uint8_t *srcRow,
+                           int xBegin, uint32_t *dst);
+void blendRowsVerticalScalar(const uint32_t *row0, const uint32_t *row1,
+                             uint32_t weight, size_t count, uint8_t *dst);
+
+} // namespace ImageProcessor
@@ -0,0 +1,141 @@
+#include "kernels.h"
+#include "resize.h"
+
+#if defined(IMAGE_PROCESSOR_NEON_KERNELS)
+
+#include <arm_neon.h>
+#include <cstring>
+
+namespace ImageProcessor {
+
+namespace {
+
+inline uint8x8_t lumaHalf(uint16x8_t r, uint16x8_t g, uint16x8_t b) {
+  uint32x4_t low = vmull_n_u16(vget_low_u16(r), kLumaRed);
+  low = vmlal_n_u16(low, vget_low_u16(g), kLumaGreen);
+  low = vmlal_n_u16(low, vget_low_u16(b), kLumaBlue);
+
+  uint32x4_t high = vmull_n_u16(vget_high_u16(r), kLumaRed);
+  high = vmlal_n_u16(high, vget_high_u16(g), kLumaGreen);
+  high = vmlal_n_u16(high, vget_high_u16(b), kLumaBlue);
+
+  return vmovn_u16(
+      vcombine_u16(vshrn_n_u32(low, kLumaBits), vshrn_n_u32(high, kLumaBits)));
+}
+
+inline uint8x16_t luma16(uint8x16_t r, uint8x16_t g, uint8x16_t b) {
+  return vcombine_u8(lumaHalf(vmovl_u8(vget_low_u8(r)),
+                              vmovl_u8(vget_low_u8(g)),
+                              vmovl_u8(vget_low_u8(b))),
+                     lumaHalf(vmovl_u8(vget_high_u8(r)),
+                              vmovl_u8(vget_high_u8(g)),
+                              vmovl_u8(vget_high_u8(b))));
+}
+
+void lumaRowNeon(const uint8_t *src, int channels, size_t pixels,
+                 uint8_t *dst) {
+  size_t i = 0;
+
+  if (channels == 3) {
+    for (; i + 16 <= pixels; i += 16) {
+      uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+      vst1q_u8(dst + i, luma16(rgb.val[0], rgb.val[1], rgb.val[2]));
+    }
+  } else if (channels == 4) {
+    for (; i + 16 <= pixels; i += 16) {
+      uint8x16x4_t rgba = vld4q_u8(src + i * 4);
+      vst1q_u8(dst + i, luma16(rgba.val[0], rgba.val[1], rgba.val[2]));
+    }
+  } else if (channels == 2) {
+    for (; i + 16 <= pixels; i += 16) {
+      vst1q_u8(dst + i, vld2q_u8(src + i * 2).val[0]);
+    }
+  }
+
+  lumaRowScalar(src + i * channels, channels, pixels - i, dst + i);
+}
+
+// Widens the four bytes at p (one pixel, plus a spare byte for RGB) to 32-bit
+// lanes.
+inline uint32x4_t widenPixel(const uint8_t *p) {
+  uint32_t bytes;
+  std::memcpy(&bytes, p, sizeof(bytes));
+  return vmovl_u16(
+      vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)))));
+}
+
+void resampleRowHorizontalNeon(const ResizePlan &plan, const uint8_t *srcRow,
+                               uint32_t *dst) {
+  const int channels = plan.channels;
+  const int safe = plan.vectorSafeColumns;
+  int x = 0;
+
+  if (channels == 1) {
+    const uint32x4_t one = vdupq_n_u32(kResizeWeightOne);
+    for (; x + 4 <= safe; x += 4) {
+      const int32_t *offsets = &plan.xOffset0[x];
+      const uint32_t left[4] = {srcRow[offsets[0]], srcRow[offsets[1]],
+                                srcRow[offsets[2]], srcRow[offsets[3]]};
+      const uint32_t right[4] = {
+          srcRow[offsets[0] + 1], srcRow[offsets[1] + 1],
+          srcRow[offsets[2] + 1], srcRow[offsets[3] + 1]};
+      uint32x4_t l = vld1q_u32(left);
+      uint32x4_t r = vld1q_u32(right);
+      uint32x4_t weight = vmovl_u16(vld1_u16(&plan.xWeight[x]));
+      uint32x4_t value = vmulq_u32(l, vsubq_u32(one, weight));
+      vst1q_u32(dst + x, vmlaq_u32(value, r, weight));
+    }
+  } else if (channels >= 3) {
+    // See resampleRowHorizontalSse41: three-channel rows store a spare lane
+    // that the next column overwrites, which is why makeResizePlan never
+    // counts their last column as vector-safe.
+    uint32_t *out = dst;
+    for (; x < safe; x++) {
+      uint32x4_t left = widenPixel(srcRow + plan.xOffset0[x]);
+      uint32x4_t right = widenPixel(srcRow + plan.xOffset1[x]);
+      uint32_t weight = plan.xWeight[x];
+      uint32x4_t value = vmulq_n_u32(left, kResizeWeightOne - weight);
+      vst1q_u32(out, vmlaq_n_u32(value, right, weight));
+      out += channels;
+    }
+  }
+
+  resampleColumnsScalar(plan, srcRow, x, dst);
+}
+
+inline uint16x4_t blendQuad(const uint32_t *row0, const uint32_t *row1,
+                            uint32_t weight, uint32_t inverse) {
+  uint32x4_t value = vmulq_n_u32(vld1q_u32(row0), inverse);
+  value = vmlaq_n_u32(value, vld1q_u32(row1), weight);
+  return vmovn_u32(vshrq_n_u32(value, 2 * kResizeWeightBits));
+}
+
+void blendRowsVerticalNeon(const uint32_t *row0, const uint32_t *row1,
+                           uint32_t weight, size_t count, uint8_t *dst) {
+  const uint32_t inverse = kResizeWeightOne - weight;
+  size_t i = 0;
+
+  for (; i + 16 <= count; i += 16) {
+    uint16x8_t low = vcombine_u16(blendQuad(row0 + i, row1 + i, weight, inverse),
+                                  blendQuad(row0 + i + 4, row1 + i + 4, weight,
+                                            inverse));
+    uint16x8_t high =
+        vcombine_u16(blendQuad(row0 + i + 8, row1 + i + 8, weight, inverse),
+                     blendQuad(row0 + i + 12, row1 + i + 12, weight, inverse));
+    vst1q_u8(dst + i, vcombine_u8(vmovn_u16(low), vmovn_u16(high)));
+  }
+
+  blendRowsVerticalScalar(row0 + i, row1 + i, weight, count - i, dst + i);
+}
+
+const KernelTable kNeonKernels = {"neon", lumaRowNeon,
+                                  resampleRowHorizontalNeon,
+                                  blendRowsVerticalNeon};
+
+} // namespace
+
+const KernelTable &neonKernels() { return kNeonKernels; }
+
+} // namespace ImageProcessor
+
+#endif
@@ -0,0 +1,337 @@
+#include "kernels.h"
+#include "resize.h"
+
+#if defined(IMAGE_PROCESSOR_X86_KERNELS)
+
+#include <cstring>
+#include <immintrin.h>
+
+// Each function carries its own target attribute so this file builds with the
+// baseline ISA flags and the wider instructions only run after dispatch has
+// checked the CPU. MSVC accepts the intrinsics without an attribute.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace ImageProcessor {
+
+namespace {
+
+// Shuffles that widen four pixels to (R, G) and (B, 0) 16-bit pairs, so one
+// madd per pair yields R*kLumaRed + G*kLumaGreen and B*kLumaBlue. The RGB
+// "high" masks read pixels 4..7 from a load that starts at byte 8.
+#define Z -1
+#define RGB_LOW_RG 0, Z, 1, Z, 3, Z, 4, Z, 6, Z, 7, Z, 9, Z, 10, Z
+#define RGB_LOW_B 2, Z, Z, Z, 5, Z, Z, Z, 8, Z, Z, Z, 11, Z, Z, Z
+#define RGB_HIGH_RG 4, Z, 5, Z, 7, Z, 8, Z, 10, Z, 11, Z, 13, Z, 14, Z
+#define RGB_HIGH_B 6, Z, Z, Z, 9, Z, Z, Z, 12, Z, Z, Z, 15, Z, Z, Z
+#define RGBA_RG 0, Z, 1, Z, 4, Z, 5, Z, 8, Z, 9, Z, 12, Z, 13, Z
+#define RGBA_B 2, Z, Z, Z, 6, Z, Z, Z, 10, Z, Z, Z, 14, Z, Z, Z
+#define EVEN_BYTES 0, 2, 4, 6, 8, 10, 12, 14, Z, Z, Z, Z, Z, Z, Z, Z
+#define WEIGHTS_RG                                                             \
+  kLumaRed, kLumaGreen, kLumaRed, kLumaGreen, kLumaRed, kLumaGreen, kLumaRed, \
+      kLumaGreen
+#define WEIGHTS_B kLumaBlue, 0, kLumaBlue, 0, kLumaBlue, 0, kLumaBlue, 0
+
+TARGET_SSE41 inline __m128i lumaQuadSse41(__m128i pixels, __m128i rgMask,
+                                          __m128i bMask) {
+  const __m128i rgWeights = _mm_setr_epi16(WEIGHTS_RG);
+  const __m128i bWeights = _mm_setr_epi16(WEIGHTS_B);
+  __m128i sum =
+      _mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(pixels, rgMask), rgWeights),
+                    _mm_madd_epi16(_mm_shuffle_epi8(pixels, bMask), bWeights));
+  return _mm_srli_epi32(sum, kLumaBits);
+}
+
+TARGET_SSE41 inline void storeLuma8Sse41(__m128i low, __m128i high,
+                                         uint8_t *dst) {
+  __m128i words = _mm_packus_epi32(low, high);
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(dst),
+                   _mm_packus_epi16(words, words));
+}
+
+TARGET_SSE41 void lumaRowSse41(const uint8_t *src, int channels,
+                               size_t pixels, uint8_t *dst) {
+  size_t i = 0;
+
+  if (channels == 3) {
+    const __m128i lowRg = _mm_setr_epi8(RGB_LOW_RG);
+    const __m128i lowB = _mm_setr_epi8(RGB_LOW_B);
+    const __m128i highRg = _mm_setr_epi8(RGB_HIGH_RG);
+    const __m128i highB = _mm_setr_epi8(RGB_HIGH_B);
+
+    for (; i + 8 <= pixels; i += 8) {
+      const uint8_t *p = src + i * 3;
+      __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      __m128i second =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 8));
+      storeLuma8Sse41(lumaQuadSse41(first, lowRg, lowB),
+                      lumaQuadSse41(second, highRg, highB), dst + i);
+    }
+  } else if (channels == 4) {
+    const __m128i rg = _mm_setr_epi8(RGBA_RG);
+    const __m128i b = _mm_setr_epi8(RGBA_B);
+
+    for (; i + 8 <= pixels; i += 8) {
+      const uint8_t *p = src + i * 4;
+      __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      __m128i second =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+      storeLuma8Sse41(lumaQuadSse41(first, rg, b),
+                      lumaQuadSse41(second, rg, b), dst + i);
+    }
+  } else if (channels == 2) {
+    const __m128i even = _mm_setr_epi8(EVEN_BYTES);
+
+    for (; i + 8 <= pixels; i += 8) {
+      __m128i pairs =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i),
+                       _mm_shuffle_epi8(pairs, even));
+    }
+  }
+
+  lumaRowScalar(src + i * channels, channels, pixels - i, dst + i);
+}
+
+TARGET_AVX2 inline __m256i loadLanes(const uint8_t *low, const uint8_t *high) {
+  return _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(low))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(high)), 1);
+}
+
+TARGET_AVX2 inline __m256i lumaQuadsAvx2(__m256i pixels, __m256i rgMask,
+                                         __m256i bMask) {
+  const __m256i rgWeights = _mm256_setr_epi16(WEIGHTS_RG, WEIGHTS_RG);
+  const __m256i bWeights = _mm256_setr_epi16(WEIGHTS_B, WEIGHTS_B);
+  __m256i sum = _mm256_add_epi32(
+      _mm256_madd_epi16(_mm256_shuffle_epi8(pixels, rgMask), rgWeights),
+      _mm256_madd_epi16(_mm256_shuffle_epi8(pixels, bMask), bWeights));
+  return _mm256_srli_epi32(sum, kLumaBits);
+}
+
+// `low` holds pixels 0-3 | 8-11 and `high` pixels 4-7 | 12-15.
+TARGET_AVX2 inline void storeLuma16Avx2(__m256i low, __m256i high,
+                                        uint8_t *dst) {
+  __m256i words = _mm256_packus_epi32(low, high);
+  __m256i bytes = _mm256_packus_epi16(words, words);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                   _mm256_castsi256_si128(
+                       _mm256_permute4x64_epi64(bytes, _MM_SHUFFLE(3, 1, 2, 0))));
+}
+
+TARGET_AVX2 void lumaRowAvx2(const uint8_t *src, int channels, size_t pixels,
+                             uint8_t *dst) {
+  size_t i = 0;
+
+  if (channels == 3) {
+    const __m256i lowRg = _mm256_setr_epi8(RGB_LOW_RG, RGB_LOW_RG);
+    const __m256i lowB = _mm256_setr_epi8(RGB_LOW_B, RGB_LOW_B);
+    const __m256i highRg = _mm256_setr_epi8(RGB_HIGH_RG, RGB_HIGH_RG);
+    const __m256i highB = _mm256_setr_epi8(RGB_HIGH_B, RGB_HIGH_B);
+
+    for (; i + 16 <= pixels; i += 16) {
+      const uint8_t *p = src + i * 3;
+      storeLuma16Avx2(lumaQuadsAvx2(loadLanes(p, p + 24), lowRg, lowB),
+                      lumaQuadsAvx2(loadLanes(p + 8, p + 32), highRg, highB),
+                      dst + i);
+    }
+  } else if (channels == 4) {
+    const __m256i rg = _mm256_setr_epi8(RGBA_RG, RGBA_RG);
+    const __m256i b = _mm256_setr_epi8(RGBA_B, RGBA_B);
+
+    for (; i + 16 <= pixels; i += 16) {
+      const uint8_t *p = src + i * 4;
+      storeLuma16Avx2(lumaQuadsAvx2(loadLanes(p, p + 32), rg, b),
+                      lumaQuadsAvx2(loadLanes(p + 16, p + 48), rg, b),
+                      dst + i);
+    }
+  }
+
+  lumaRowSse41(src + i * channels, channels, pixels - i, dst + i);
+}
+
+#undef Z
+
+// Four output columns of a single-channel row. Both neighbours come from one
+// 32-bit load at the left offset, so the caller keeps x below
+// plan.vectorSafeColumns, where offset1 == offset0 + 1 and the load stays
+// inside the row.
+TARGET_SSE41 inline __m128i interpolatePairs(__m128i pairs, __m128i weight) {
+  const __m128i low = _mm_set1_epi32(0xFF);
+  const __m128i one = _mm_set1_epi32(kResizeWeightOne);
+  __m128i left = _mm_and_si128(pairs, low);
+  __m128i right = _mm_and_si128(_mm_srli_epi32(pairs, 8), low);
+  return _mm_add_epi32(_mm_mullo_epi32(left, _mm_sub_epi32(one, weight)),
+                       _mm_mullo_epi32(right, weight));
+}
+
+inline uint32_t load32(const uint8_t *p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+TARGET_SSE41 void resampleRowHorizontalSse41(const ResizePlan &plan,
+                                             const uint8_t *srcRow,
+                                             uint32_t *dst) {
+  const int channels = plan.channels;
+  const int safe = plan.vectorSafeColumns;
+  int x = 0;
+
+  if (channels == 1) {
+    for (; x + 4 <= safe; x += 4) {
+      const int32_t *offsets = &plan.xOffset0[x];
+      __m128i pairs = _mm_setr_epi32(
+          load32(srcRow + offsets[0]), load32(srcRow + offsets[1]),
+          load32(srcRow + offsets[2]), load32(srcRow + offsets[3]));
+      __m128i weight = _mm_cvtepu16_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&plan.xWeight[x])));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x),
+                       interpolatePairs(pairs, weight));
+    }
+  } else if (channels >= 3) {
+    // One pixel per step, all channels at once. Three-channel rows store a
+    // fourth lane that the next pixel overwrites; makeResizePlan keeps the
+    // last column out of plan.vectorSafeColumns for them, so that lane
+    // always lands inside the row.
+    const __m128i one = _mm_set1_epi32(kResizeWeightOne);
+    uint32_t *out = dst;
+    for (; x < safe; x++) {
+      __m128i left = _mm_cvtepu8_epi32(
+          _mm_cvtsi32_si128(static_cast<int>(load32(srcRow + plan.xOffset0[x]))));
+      __m128i right = _mm_cvtepu8_epi32(
+          _mm_cvtsi32_si128(static_cast<int>(load32(srcRow + plan.xOffset1[x]))));
+      __m128i weight = _mm_set1_epi32(plan.xWeight[x]);
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i *>(out),
+          _mm_add_epi32(_mm_mullo_epi32(left, _mm_sub_epi32(one, weight)),
+                        _mm_mullo_epi32(right, weight)));
+      out += channels;
+    }
+  }
+
+  resampleColumnsScalar(plan, srcRow, x, dst);
+}
+
+TARGET_AVX2 void resampleRowHorizontalAvx2(const ResizePlan &plan,
+                                           const uint8_t *srcRow,
+                                           uint32_t *dst) {
+  if (plan.channels != 1) {
+    resampleRowHorizontalSse41(plan, srcRow, dst);
+    return;
+  }
+
+  const int safe = plan.vectorSafeColumns;
+  const __m256i low = _mm256_set1_epi32(0xFF);
+  const __m256i one = _mm256_set1_epi32(kResizeWeightOne);
+  int x = 0;
+
+  for (; x + 8 <= safe; x += 8) {
+    __m256i offsets = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(&plan.xOffset0[x]));
+    __m256i pairs = _mm256_i32gather_epi32(
+        reinterpret_cast<const int *>(srcRow), offsets, 1);
+    __m256i weight = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(&plan.xWeight[x])));
+    __m256i left = _mm256_and_si256(pairs, low);
+    __m256i right = _mm256_and_si256(_mm256_srli_epi32(pairs, 8), low);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(dst + x),
+        _mm256_add_epi32(
+            _mm256_mullo_epi32(left, _mm256_sub_epi32(one, weight)),
+            _mm256_mullo_epi32(right, weight)));
+  }
+
+  resampleColumnsScalar(plan, srcRow, x, dst);
+}
+
+TARGET_SSE41 inline __m128i blendQuadSse41(const uint32_t *row0,
+                                           const uint32_t *row1,
+                                           __m128i weight, __m128i inverse) {
+  __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0));
+  __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1));
+  return _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(top, inverse),
+                                      _mm_mullo_epi32(bottom, weight)),
+                        2 * kResizeWeightBits);
+}
+
+TARGET_SSE41 void blendRowsVerticalSse41(const uint32_t *row0,
+                                         const uint32_t *row1,
+                                         uint32_t weight, size_t count,
+                                         uint8_t *dst) {
+  const __m128i w = _mm_set1_epi32(static_cast<int>(weight));
+  const __m128i inv = _mm_set1_epi32(static_cast<int>(kResizeWeightOne - weight));
+  size_t i = 0;
+
+  for (; i + 16 <= count; i += 16) {
+    __m128i a = blendQuadSse41(row0 + i, row1 + i, w, inv);
+    __m128i b = blendQuadSse41(row0 + i + 4, row1 + i + 4, w, inv);
+    __m128i c = blendQuadSse41(row0 + i + 8, row1 + i + 8, w, inv);
+    __m128i d = blendQuadSse41(row0 + i + 12, row1 + i + 12, w, inv);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packus_epi16(_mm_packus_epi32(a, b),
+                                      _mm_packus_epi32(c, d)));
+  }
+
+  blendRowsVerticalScalar(row0 + i, row1 + i, weight, count - i, dst + i);
+}
+
+TARGET_AVX2 inline __m256i blendOctAvx2(const uint32_t *row0,
+                                        const uint32_t *row1, __m256i weight,
+                                        __m256i inverse) {
+  __m256i top = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row0));
+  __m256i bottom = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row1));
+  return _mm256_srli_epi32(
+      _mm256_add_epi32(_mm256_mullo_epi32(top, inverse),
+                       _mm256_mullo_epi32(bottom, weight)),
+      2 * kResizeWeightBits);
+}
+
+TARGET_AVX2 void blendRowsVerticalAvx2(const uint32_t *row0,
+                                       const uint32_t *row1, uint32_t weight,
+                                       size_t count, uint8_t *dst) {
+  const __m256i w = _mm256_set1_epi32(static_cast<int>(weight));
+  const __m256i inv =
+      _mm256_set1_epi32(static_cast<int>(kResizeWeightOne - weight));
+  // The in-lane packs leave each 32-bit group of output bytes in lane order;
+  // this permutation restores source order.
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+
+  for (; i + 32 <= count; i += 32) {
+    __m256i a = blendOctAvx2(row0 + i, row1 + i, w, inv);
+    __m256i b = blendOctAvx2(row0 + i + 8, row1 + i + 8, w, inv);
+    __m256i c = blendOctAvx2(row0 + i + 16, row1 + i + 16, w, inv);
+    __m256i d = blendOctAvx2(row0 + i + 24, row1 + i + 24, w, inv);
+    __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(a, b),
+                                        _mm256_packus_epi32(c, d));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_permutevar8x32_epi32(bytes, order));
+  }
+
+  blendRowsVerticalSse41(row0 + i, row1 + i, weight, count - i, dst + i);
+}
+
+const KernelTable kSse41Kernels = {"sse4.1", lumaRowSse41,
+                                   resampleRowHorizontalSse41,
+                                   blendRowsVerticalSse41};
+
+const KernelTable kAvx2Kernels = {"avx2", lumaRowAvx2,
+                                  resampleRowHorizontalAvx2,
+                                  blendRowsVerticalAvx2};
+
+} // namespace
+
+const KernelTable &sse41Kernels() { return kSse41Kernels; }
+
+const KernelTable &avx2Kernels() { return kAvx2Kernels; }
+
+} // namespace ImageProcessor
+
+#endif
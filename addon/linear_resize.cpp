@@ -0,0 +1,292 @@
+#include "linear_resize.h"
+#include "resize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace ImageProcessor {
+
+namespace {
+
+// Encoded output is looked up at this many steps over 0-1. Linear light is
+// steepest just above black, where one 8-bit level spans about 20 steps.
+constexpr int kEncodeSteps = 65535;
+
+struct TransferTables {
+  float fromU8[256];
+  float fromU16[65536];
+  uint8_t toU8[kEncodeSteps + 1];
+
+  TransferTables() {
+    for (int i = 0; i < 256; i++) {
+      fromU8[i] = srgbToLinear(i / 255.0f);
+    }
+    for (int i = 0; i < 65536; i++) {
+      fromU16[i] = srgbToLinear(i / 65535.0f);
+    }
+    for (int i = 0; i <= kEncodeSteps; i++) {
+      toU8[i] = static_cast<uint8_t>(
+          std::lround(linearToSrgb(static_cast<float>(i) / kEncodeSteps) *
+                      255.0f));
+    }
+  }
+};
+
+// Built on first use; about 320 KiB that only linear-light callers touch.
+const TransferTables &transferTables() {
+  static const TransferTables tables;
+  return tables;
+}
+
+uint8_t encodeLinear(const TransferTables &tables, float linear) {
+  // std::clamp passes NaN through, and casting it to int is undefined (and
+  // INT_MIN on x86), so NaN samples from f32 or f16 input encode as black.
+  if (!(linear > 0.0f))
+    return tables.toU8[0];
+  float clamped = std::min(linear, 1.0f);
+  return tables.toU8[static_cast<int>(clamped * kEncodeSteps + 0.5f)];
+}
+
+// Samples may be unaligned in a caller's Buffer, so they are copied out.
+template <typename Sample> Sample loadSample(const uint8_t *src, size_t i) {
+  Sample value;
+  std::memcpy(&value, src + i * sizeof(Sample), sizeof(Sample));
+  return value;
+}
+
+template <typename Sample, typename Convert>
+void lumaRowOf(const uint8_t *src, int channels, int width, Convert convert,
+               float *out) {
+  for (int x = 0; x < width; x++) {
+    size_t i = static_cast<size_t>(x) * channels;
+    if (channels < 3) {
+      out[x] = convert(loadSample<Sample>(src, i));
+    } else {
+      out[x] = kLinearLumaRed * convert(loadSample<Sample>(src, i)) +
+               kLinearLumaGreen * convert(loadSample<Sample>(src, i + 1)) +
+               kLinearLumaBlue * convert(loadSample<Sample>(src, i + 2));
+    }
+  }
+}
+
+void encodeRow(const float *linear, size_t width, uint8_t *dst) {
+  const TransferTables &tables = transferTables();
+  for (size_t x = 0; x < width; x++) {
+    dst[x] = encodeLinear(tables, linear[x]);
+  }
+}
+
+void bilinearRows(const ResizePlan &plan, const ImageView &input,
+                  uint8_t *dst, int yBegin, int yEnd) {
+  const size_t dstWidth = static_cast<size_t>(plan.dstWidth);
+  ScratchBuffer storage((input.width + 3 * dstWidth) * sizeof(float));
+  float *luma = storage.as<float>();
+  float *slots[2] = {luma + input.width, luma + input.width + dstWidth};
+  float *blended = slots[1] + dstWidth;
+  int slotRow[2] = {-1, -1};
+
+  // Same two-slot row cache as the 8-bit resizer.
+  auto fetch = [&](int row, int keep) -> int {
+    for (int i = 0; i < 2; i++) {
+      if (slotRow[i] == row)
+        return i;
+    }
+    int victim = keep >= 0 ? 1 - keep : (slotRow[0] <= slotRow[1] ? 0 : 1);
+    linearLumaRow(input, row, luma);
+    for (size_t x = 0; x < dstWidth; x++) {
+      float left = luma[plan.xOffset0[x]];
+      float right = luma[plan.xOffset1[x]];
+      slots[victim][x] =
+          left + (right - left) * (plan.xWeight[x] / float(kResizeWeightOne));
+    }
+    slotRow[victim] = row;
+    return victim;
+  };
+
+  for (int y = yBegin; y < yEnd; y++) {
+    int upper = fetch(plan.yRow0[y], -1);
+    int lower = fetch(plan.yRow1[y], upper);
+    float weight = plan.yWeight[y] / float(kResizeWeightOne);
+    for (size_t x = 0; x < dstWidth; x++) {
+      float top = slots[upper][x];
+      blended[x] = top + (slots[lower][x] - top) * weight;
+    }
+    encodeRow(blended, dstWidth, dst + static_cast<size_t>(y) * dstWidth);
+  }
+}
+
+// Mirrors filterLumaRows stage for stage, in float.
+void filteredRows(const FilterPlan &plan, const ImageView &input,
+                  uint8_t *dst, int yBegin, int yEnd) {
+  const size_t srcWidth = static_cast<size_t>(plan.srcWidth);
+  const size_t reducedWidth = static_cast<size_t>(plan.reducedWidth);
+  const size_t dstWidth = static_cast<size_t>(plan.dstWidth);
+  const int slots = plan.y.maxTaps;
+  constexpr float kTapScale = 1.0f / kFilterWeightOne;
+
+  ScratchBuffer storage((srcWidth + reducedWidth +
+                         (static_cast<size_t>(slots) + 1) * dstWidth) *
+                        sizeof(float));
+  float *luma = storage.as<float>();
+  float *reduced = luma + srcWidth;
+  float *ring = reduced + reducedWidth;
+  float *accumulator = ring + static_cast<size_t>(slots) * dstWidth;
+  ScratchBuffer slotStorage(static_cast<size_t>(slots) * sizeof(int));
+  int *slotRow = slotStorage.as<int>();
+  std::fill(slotRow, slotRow + slots, -1);
+
+  auto reducedRow = [&](int row) -> const float * {
+    if (plan.shrinkX == 1 && plan.shrinkY == 1) {
+      linearLumaRow(input, row, luma);
+      return luma;
+    }
+    std::fill(reduced, reduced + reducedWidth, 0.0f);
+    const int first = row * plan.shrinkY;
+    const int last = std::min(plan.srcHeight, first + plan.shrinkY);
+    for (int sy = first; sy < last; sy++) {
+      linearLumaRow(input, sy, luma);
+      for (size_t c = 0; c < reducedWidth; c++) {
+        size_t x = c * plan.shrinkX;
+        size_t end = std::min(srcWidth, x + plan.shrinkX);
+        float sum = 0.0f;
+        for (; x < end; x++) {
+          sum += luma[x];
+        }
+        reduced[c] += sum;
+      }
+    }
+    for (size_t c = 0; c < reducedWidth; c++) {
+      size_t x = c * plan.shrinkX;
+      size_t area = (last - first) * (std::min(srcWidth, x + plan.shrinkX) - x);
+      reduced[c] /= static_cast<float>(area);
+    }
+    return reduced;
+  };
+
+  auto filteredRow = [&](int row) -> const float * {
+    int slot = row % slots;
+    float *out = ring + static_cast<size_t>(slot) * dstWidth;
+    if (slotRow[slot] != row) {
+      const float *in = reducedRow(row);
+      for (size_t x = 0; x < dstWidth; x++) {
+        const float *taps = in + plan.x.start[x];
+        const int16_t *weights = plan.x.weights + x * plan.x.maxTaps;
+        float sum = 0.0f;
+        for (int t = 0; t < plan.x.count[x]; t++) {
+          sum += weights[t] * taps[t];
+        }
+        out[x] = sum * kTapScale;
+      }
+      slotRow[slot] = row;
+    }
+    return out;
+  };
+
+  for (int y = yBegin; y < yEnd; y++) {
+    const int16_t *weights =
+        plan.y.weights + static_cast<size_t>(y) * plan.y.maxTaps;
+    std::fill(accumulator, accumulator + dstWidth, 0.0f);
+    for (int t = 0; t < plan.y.count[y]; t++) {
+      const float *row = filteredRow(plan.y.start[y] + t);
+      const float weight = weights[t] * kTapScale;
+      for (size_t x = 0; x < dstWidth; x++) {
+        accumulator[x] += weight * row[x];
+      }
+    }
+    encodeRow(accumulator, dstWidth, dst + static_cast<size_t>(y) * dstWidth);
+  }
+}
+
+} // namespace
+
+float srgbToLinear(float encoded) {
+  return encoded <= 0.04045f ? encoded / 12.92f
+                             : std::pow((encoded + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(float linear) {
+  return linear <= 0.0031308f
+             ? linear * 12.92f
+             : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+}
+
+float halfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1F;
+  const uint32_t mantissa = half & 0x3FF;
+  if (exponent == 0) {
+    float value = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign ? -value : value;
+  }
+
+  uint32_t bits = exponent == 0x1F
+                      ? sign | 0x7F800000 | (mantissa << 13)
+                      : sign | ((exponent + 112) << 23) | (mantissa << 13);
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+void linearLumaRow(const ImageView &input, int row, float *out) {
+  const uint8_t *src = input.data + static_cast<size_t>(row) * input.stride;
+  const TransferTables &tables = transferTables();
+
+  switch (input.type) {
+  case PixelType::U8:
+    if (input.linearLight) {
+      lumaRowOf<uint8_t>(
+          src, input.channels, input.width,
+          [](uint8_t value) { return value / 255.0f; }, out);
+    } else {
+      lumaRowOf<uint8_t>(
+          src, input.channels, input.width,
+          [&tables](uint8_t value) { return tables.fromU8[value]; }, out);
+    }
+    break;
+  case PixelType::U16:
+    if (input.linearLight) {
+      lumaRowOf<uint16_t>(
+          src, input.channels, input.width,
+          [](uint16_t value) { return value / 65535.0f; }, out);
+    } else {
+      lumaRowOf<uint16_t>(
+          src, input.channels, input.width,
+          [&tables](uint16_t value) { return tables.fromU16[value]; }, out);
+    }
+    break;
+  case PixelType::F16:
+    lumaRowOf<uint16_t>(src, input.channels, input.width, halfToFloat, out);
+    break;
+  case PixelType::F32:
+    lumaRowOf<float>(
+        src, input.channels, input.width, [](float value) { return value; },
+        out);
+    break;
+  }
+}
+
+void resizeLinearLuma(const ImageView &input, int newWidth, int newHeight,
+                      uint8_t *dst, int threads, ResizeFilter filter) {
+  const size_t sourceBytes = input.stride * input.height;
+
+  if (filter != ResizeFilter::Bilinear) {
+    FilterPlan plan = makeFilterPlan(filter, input.width, input.height,
+                                     newWidth, newHeight);
+    forEachRowBand(newHeight, sourceBytes, threads, [&](int yBegin, int yEnd) {
+      filteredRows(plan, input, dst, yBegin, yEnd);
+    });
+    return;
+  }
+
+  ResizePlan plan =
+      makeResizePlan(input.width, input.height, newWidth, newHeight, 1);
+  const size_t rowsRead =
+      std::min<size_t>(input.height, 2 * static_cast<size_t>(newHeight));
+  forEachRowBand(newHeight, input.stride * rowsRead, threads,
+                 [&](int yBegin, int yEnd) {
+                   bilinearRows(plan, input, dst, yBegin, yEnd);
+                 });
+}
+
+} // namespace ImageProcessor
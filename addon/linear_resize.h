@@ -0,0 +1,35 @@
+#pragma once
+
+#include "filters.h"
+#include "image_data.h"
+
+#include <cstdint>
+
+namespace ImageProcessor {
+
+// Luma of one linear-light RGB pixel, with Rec. 709 weights.
+constexpr float kLinearLumaRed = 0.2126f;
+constexpr float kLinearLumaGreen = 0.7152f;
+constexpr float kLinearLumaBlue = 0.0722f;
+
+// sRGB transfer function, on values nominally 0-1.
+float srgbToLinear(float encoded);
+float linearToSrgb(float linear);
+
+// IEEE 754 binary16 stored in a uint16_t.
+float halfToFloat(uint16_t half);
+
+// Converts source row `row` of input to linear-light luma, input.width
+// floats. 8- and 16-bit sRGB samples go through lookup tables; the alpha of
+// two- and four-channel input is ignored, as on the 8-bit path.
+void linearLumaRow(const ImageView &input, int row, float *out);
+
+// The linear-light counterpart of resizeToGrayscale: luma is formed and
+// resampled in linear light at float precision, and the output is
+// sRGB-encoded and rounded to 8 bits once, at the end. Takes any PixelType.
+// Bilinear resizing uses ResizePlan coordinates and box and Lanczos use
+// FilterPlan taps, so the geometry matches the 8-bit path exactly.
+void resizeLinearLuma(const ImageView &input, int newWidth, int newHeight,
+                      uint8_t *dst, int threads, ResizeFilter filter);
+
+} // namespace ImageProcessor
@@ -0,0 +1,345 @@
+#include "probe.h"
+#include "file_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace ImageProcessor {
+
+namespace {
+
+constexpr size_t kProbeChunkBytes = 4096;
+constexpr size_t kMaxProbeBytes = 1 << 20;
+
+enum class ProbeStatus { Done, NeedMore, Unrecognized };
+
+uint32_t readBigEndian16(const uint8_t *data) {
+  return (uint32_t(data[0]) << 8) | data[1];
+}
+
+uint32_t readBigEndian32(const uint8_t *data) {
+  return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) |
+         (uint32_t(data[2]) << 8) | data[3];
+}
+
+uint32_t readLittleEndian16(const uint8_t *data) {
+  return data[0] | (uint32_t(data[1]) << 8);
+}
+
+uint32_t readLittleEndian24(const uint8_t *data) {
+  return data[0] | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16);
+}
+
+uint32_t readLittleEndian32(const uint8_t *data) {
+  return readLittleEndian24(data) | (uint32_t(data[3]) << 24);
+}
+
+// Finds the Orientation tag (0x0112) in IFD0 of an APP1 Exif payload.
+// Returns 1 when it is missing or out of range.
+int exifOrientation(const uint8_t *data, size_t size) {
+  if (size < 14 || std::memcmp(data, "Exif\0\0", 6) != 0)
+    return 1;
+  const uint8_t *tiff = data + 6;
+  const size_t tiffSize = size - 6;
+  const bool little = tiff[0] == 'I' && tiff[1] == 'I';
+  if (!little && !(tiff[0] == 'M' && tiff[1] == 'M'))
+    return 1;
+  auto read16 = [little](const uint8_t *p) {
+    return little ? readLittleEndian16(p) : readBigEndian16(p);
+  };
+  auto read32 = [little](const uint8_t *p) {
+    return little ? readLittleEndian32(p) : readBigEndian32(p);
+  };
+
+  const uint32_t ifd = read32(tiff + 4);
+  if (read16(tiff + 2) != 42 || ifd > tiffSize - 2)
+    return 1;
+  const uint32_t entries = read16(tiff + ifd);
+  for (uint32_t i = 0; i < entries; i++) {
+    const size_t entry = ifd + 2 + size_t(i) * 12;
+    if (entry + 12 > tiffSize)
+      break;
+    if (read16(tiff + entry) == 0x0112) {
+      const uint32_t value = read16(tiff + entry + 8);
+      return value >= 1 && value <= 8 ? static_cast<int>(value) : 1;
+    }
+  }
+  return 1;
+}
+
+// Walks the marker segments up to the first SOF. `needed` is set to the end
+// of the segment that did not fit.
+ProbeStatus probeJpeg(const uint8_t *data, size_t size, ImageProbe &probe,
+                      size_t &needed) {
+  size_t pos = 2;
+  for (;;) {
+    // Markers may be padded with any number of 0xFF fill bytes.
+    while (pos < size && data[pos] == 0xFF && pos + 1 < size &&
+           data[pos + 1] == 0xFF) {
+      pos++;
+    }
+    if (pos + 4 > size) {
+      needed = pos + 4;
+      return ProbeStatus::NeedMore;
+    }
+    if (data[pos] != 0xFF) {
+      throw std::runtime_error("Invalid JPEG header: expected a marker");
+    }
+    const uint8_t marker = data[pos + 1];
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      pos += 2;
+      continue;
+    }
+    if (marker == 0xDA || marker == 0xD9) {
+      throw std::runtime_error("Invalid JPEG header: no frame before scan");
+    }
+
+    const size_t length = readBigEndian16(data + pos + 2);
+    const size_t end = pos + 2 + length;
+    if (length < 2) {
+      throw std::runtime_error("Invalid JPEG header: bad segment length");
+    }
+    if (end > size) {
+      needed = end;
+      return ProbeStatus::NeedMore;
+    }
+
+    const uint8_t *segment = data + pos + 4;
+    if (marker == 0xE1) {
+      int orientation = exifOrientation(segment, length - 2);
+      if (orientation != 1)
+        probe.orientation = orientation;
+    }
+    const bool frame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+                       marker != 0xC8 && marker != 0xCC;
+    if (frame) {
+      if (length < 8) {
+        throw std::runtime_error("Invalid JPEG header: short frame");
+      }
+      probe.format = ImageFormat::Jpeg;
+      probe.bitDepth = segment[0];
+      probe.height = static_cast<int>(readBigEndian16(segment + 1));
+      probe.width = static_cast<int>(readBigEndian16(segment + 3));
+      probe.channels = segment[5];
+      probe.progressive = marker == 0xC2 || marker == 0xC6 ||
+                          marker == 0xCA || marker == 0xCE;
+      // A height of 0 is deferred to a DNL marker after the first scan,
+      // which no decoder we link accepts.
+      if (probe.width == 0 || probe.height == 0) {
+        throw std::runtime_error("Invalid JPEG header: no dimensions");
+      }
+      return ProbeStatus::Done;
+    }
+    pos = end;
+  }
+}
+
+ProbeStatus probePng(const uint8_t *data, size_t size, ImageProbe &probe,
+                     size_t &needed) {
+  // Signature, then the IHDR chunk's length, type and 13 bytes of data.
+  constexpr size_t kHeaderEnd = 8 + 8 + 13;
+  if (size < kHeaderEnd) {
+    needed = kHeaderEnd;
+    return ProbeStatus::NeedMore;
+  }
+  if (std::memcmp(data + 12, "IHDR", 4) != 0) {
+    throw std::runtime_error("Invalid PNG header: IHDR is not first");
+  }
+  probe.format = ImageFormat::Png;
+  probe.width = static_cast<int>(readBigEndian32(data + 16));
+  probe.height = static_cast<int>(readBigEndian32(data + 20));
+  probe.bitDepth = data[24];
+  switch (data[25]) {
+  case 0:
+    probe.channels = 1;
+    break;
+  case 4:
+    probe.channels = 2;
+    break;
+  case 6:
+    probe.channels = 4;
+    break;
+  default:
+    // Truecolour, or a palette, which is expanded to RGB.
+    probe.channels = 3;
+    break;
+  }
+  probe.progressive = data[28] == 1;
+  if (probe.width <= 0 || probe.height <= 0) {
+    throw std::runtime_error("Invalid PNG header: bad dimensions");
+  }
+  return ProbeStatus::Done;
+}
+
+ProbeStatus probeWebP(const uint8_t *data, size_t size, ImageProbe &probe,
+                      size_t &needed) {
+  // RIFF header, then the first chunk's type, size and the 10 bytes of its
+  // payload that hold the dimensions in every variant.
+  constexpr size_t kHeaderEnd = 12 + 8 + 10;
+  if (size < kHeaderEnd) {
+    needed = kHeaderEnd;
+    return ProbeStatus::NeedMore;
+  }
+  const uint8_t *chunk = data + 12;
+  const uint8_t *payload = chunk + 8;
+  probe.format = ImageFormat::WebP;
+  if (std::memcmp(chunk, "VP8 ", 4) == 0) {
+    if (payload[3] != 0x9D || payload[4] != 0x01 || payload[5] != 0x2A) {
+      throw std::runtime_error("Invalid WebP header: bad VP8 start code");
+    }
+    probe.width = static_cast<int>(readLittleEndian16(payload + 6) & 0x3FFF);
+    probe.height = static_cast<int>(readLittleEndian16(payload + 8) & 0x3FFF);
+    probe.channels = 3;
+  } else if (std::memcmp(chunk, "VP8L", 4) == 0) {
+    if (payload[0] != 0x2F) {
+      throw std::runtime_error("Invalid WebP header: bad VP8L signature");
+    }
+    const uint32_t bits = readLittleEndian32(payload + 1);
+    probe.width = static_cast<int>(bits & 0x3FFF) + 1;
+    probe.height = static_cast<int>((bits >> 14) & 0x3FFF) + 1;
+    probe.channels = (bits >> 28) & 1 ? 4 : 3;
+  } else if (std::memcmp(chunk, "VP8X", 4) == 0) {
+    probe.width = static_cast<int>(readLittleEndian24(payload + 4)) + 1;
+    probe.height = static_cast<int>(readLittleEndian24(payload + 7)) + 1;
+    probe.channels = payload[0] & 0x10 ? 4 : 3;
+  } else {
+    throw std::runtime_error("Invalid WebP header: unknown first chunk");
+  }
+  if (probe.width == 0 || probe.height == 0) {
+    throw std::runtime_error("Invalid WebP header: no dimensions");
+  }
+  return ProbeStatus::Done;
+}
+
+// The frame header isn't signed, so only one that processImage would read
+// as a frame counts; guessed layouts for arbitrary bytes do not.
+ProbeStatus probeFrame(const uint8_t *data, size_t size, ImageProbe &probe,
+                       size_t &needed) {
+  if (size < 12) {
+    needed = 12;
+    return ProbeStatus::NeedMore;
+  }
+  const int width = static_cast<int>(readBigEndian32(data));
+  const int height = static_cast<int>(readBigEndian32(data + 4));
+  const int channels = static_cast<int>(readBigEndian32(data + 8));
+  if (width <= 0 || height <= 0 || channels <= 0 || channels > 4) {
+    return ProbeStatus::Unrecognized;
+  }
+  probe.format = ImageFormat::Unknown;
+  probe.width = width;
+  probe.height = height;
+  probe.channels = channels;
+  return ProbeStatus::Done;
+}
+
+ProbeStatus probeHeader(const uint8_t *data, size_t size, ImageProbe &probe,
+                        size_t &needed) {
+  probe = ImageProbe();
+  // Enough for every signature sniffFormat checks.
+  if (size < 12) {
+    needed = 12;
+    return ProbeStatus::NeedMore;
+  }
+  switch (sniffFormat(data, size)) {
+  case ImageFormat::Jpeg:
+    return probeJpeg(data, size, probe, needed);
+  case ImageFormat::Png:
+    return probePng(data, size, probe, needed);
+  case ImageFormat::WebP:
+    return probeWebP(data, size, probe, needed);
+  case ImageFormat::Unknown:
+    break;
+  }
+  return probeFrame(data, size, probe, needed);
+}
+
+} // namespace
+
+ImageProbe probeImage(const uint8_t *data, size_t size) {
+  ImageProbe probe;
+  size_t needed = 0;
+  switch (probeHeader(data, size, probe, needed)) {
+  case ProbeStatus::Done:
+    return probe;
+  case ProbeStatus::NeedMore:
+    throw std::runtime_error("Invalid image data: header needs " +
+                             std::to_string(needed) + " bytes, got " +
+                             std::to_string(size));
+  case ProbeStatus::Unrecognized:
+    break;
+  }
+  throw std::runtime_error("unsupported input format");
+}
+
+ImageProbe probeFile(const std::string &path) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    throw std::runtime_error(fileErrorMessage("cannot open", path, errno));
+  }
+  // The reads below are already in large chunks.
+  std::setvbuf(file, nullptr, _IONBF, 0);
+
+  std::vector<uint8_t> header;
+  ImageProbe probe;
+  size_t needed = kProbeChunkBytes;
+  for (;;) {
+    const size_t want =
+        std::min(kMaxProbeBytes, (needed + kProbeChunkBytes - 1) /
+                                     kProbeChunkBytes * kProbeChunkBytes);
+    const size_t have = header.size();
+    header.resize(want);
+    const size_t read = std::fread(header.data() + have, 1, want - have, file);
+    header.resize(have + read);
+    if (read < want - have && std::ferror(file)) {
+      int error = errno;
+      std::fclose(file);
+      throw std::runtime_error(fileErrorMessage("cannot read", path, error));
+    }
+
+    ProbeStatus status;
+    try {
+      status = probeHeader(header.data(), header.size(), probe, needed);
+    } catch (const std::exception &error) {
+      std::fclose(file);
+      throw std::runtime_error(std::string(error.what()) + ": '" + path + "'");
+    }
+    if (status == ProbeStatus::Done) {
+      std::fclose(file);
+      return probe;
+    }
+    if (status == ProbeStatus::Unrecognized) {
+      std::fclose(file);
+      throw std::runtime_error("unsupported input format: '" + path + "'");
+    }
+    if (read < want - have || header.size() >= kMaxProbeBytes) {
+      std::fclose(file);
+      throw std::runtime_error("Invalid image data: header incomplete in '" +
+                               path + "'");
+    }
+  }
+}
+
+OutputSize decodedSize(const ImageProbe &probe, int fitWidth, int fitHeight) {
+  OutputSize full{probe.width, probe.height};
+  if (probe.format != ImageFormat::Jpeg || !canDecode(ImageFormat::Jpeg)) {
+    return full;
+  }
+
+  const OutputSize target =
+      computeOutputSize(probe.width, probe.height, fitWidth, fitHeight);
+  for (int denom : {8, 4, 2}) {
+    // libjpeg rounds scaled dimensions up.
+    OutputSize scaled{(probe.width + denom - 1) / denom,
+                      (probe.height + denom - 1) / denom};
+    if (scaled.width >= target.width && scaled.height >= target.height) {
+      return scaled;
+    }
+  }
+  return full;
+}
+
+} // namespace ImageProcessor
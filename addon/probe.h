@@ -0,0 +1,45 @@
+#pragma once
+
+#include "decode.h"
+#include "resize.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ImageProcessor {
+
+// What the header of an image says, without decoding any pixels.
+struct ImageProbe {
+  // Unknown stands for the addon's own framed pixels (12-byte header).
+  ImageFormat format = ImageFormat::Unknown;
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  int bitDepth = 8;
+  // EXIF orientation, 1 (upright) to 8. Only JPEGs carry it here; the EXIF
+  // chunk of PNG and WebP files sits after the pixels, past what is read.
+  int orientation = 1;
+  // Progressive JPEG or interlaced PNG.
+  bool progressive = false;
+};
+
+// Parses the header at the start of a file. Reads only as far as the JPEG
+// SOF marker, the PNG IHDR chunk, the first WebP chunk or the frame header,
+// so a few hundred bytes for most files; JPEGs add their APP segments.
+// Throws std::runtime_error when the bytes are no supported format, or end
+// before the header does.
+ImageProbe probeImage(const uint8_t *data, size_t size);
+
+// probeImage for a file, reading it 4 KiB at a time until the header is
+// complete, and never more than 1 MiB. Throws std::runtime_error naming the
+// path on failure.
+ImageProbe probeFile(const std::string &path);
+
+// The size a JPEG is decoded at when shrunk on load for an output that fits
+// fitWidth x fitHeight: the header's size divided by the largest of 8, 4 or
+// 2 that still covers the output, as decodeImage picks it. Other formats,
+// and builds without the JPEG decoder, decode at full size.
+OutputSize decodedSize(const ImageProbe &probe, int fitWidth, int fitHeight);
+
+} // namespace ImageProcessor
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "encode.h"
+#include "filters.h"
+#include "image_data.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+constexpr size_t kFrameHeaderSize = 12;
+
+enum class OutputFormat { Frame, Jpeg };
+
+// Options shared by every entry point, parsed from the JS options object.
+struct ProcessOptions {
+  int maxWidth;
+  int maxHeight;
+  // Set when the input is headerless raw pixels (the `raw` option).
+  int rawWidth = 0;
+  int rawHeight = 0;
+  int rawChannels = 0;
+  PixelType rawType = PixelType::U8;
+  // Upper bound on threads used for one image; 0 lets the addon decide.
+  int threads = 0;
+  ResizeFilter filter = ResizeFilter::Bilinear;
+  // `format`: a 12-byte header plus pixels, or a grayscale JPEG.
+  OutputFormat format = OutputFormat::Frame;
+  JpegOptions jpeg;
+  // Let JPEG decoding shrink in the DCT domain towards the output size.
+  bool shrinkOnLoad = true;
+  // Resize 8-bit input in linear light as well; typed input always is.
+  bool linear = false;
+};
+
+// Writes the frame header: width, height and channels as big-endian int32.
+inline void writeFrameHeader(uint8_t *dst, int width, int height,
+                             int channels) {
+  auto writeInt = [&dst](int value) {
+    *dst++ = (value >> 24) & 0xFF;
+    *dst++ = (value >> 16) & 0xFF;
+    *dst++ = (value >> 8) & 0xFF;
+    *dst++ = value & 0xFF;
+  };
+  writeInt(width);
+  writeInt(height);
+  writeInt(channels);
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,220 @@
+#include "resize.h"
+#include "kernels.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace ImageProcessor {
+
+namespace {
+
+// Maps destination coordinates 0..dstSize-1 onto the source the same way the
+// original per-pixel interpolator did (src = dst * ratio, no half-pixel
+// offset), so fixed-point output stays within one level of the float path.
+void buildAxis(int srcSize, int dstSize, int32_t *index0, int32_t *index1,
+               uint16_t *weight) {
+  float ratio = static_cast<float>(srcSize) / dstSize;
+
+  for (int i = 0; i < dstSize; i++) {
+    float src = i * ratio;
+    int i0 = std::min(static_cast<int>(std::floor(src)), srcSize - 1);
+    float fraction = src - i0;
+
+    index0[i] = i0;
+    index1[i] = std::min(i0 + 1, srcSize - 1);
+    weight[i] = static_cast<uint16_t>(std::min<long>(
+        std::lround(fraction * kResizeWeightOne), kResizeWeightOne));
+  }
+}
+
+} // namespace
+
+OutputSize computeOutputSize(int width, int height, int maxWidth,
+                             int maxHeight) {
+  float aspectRatio = static_cast<float>(width) / height;
+  int newWidth = width;
+  int newHeight = height;
+
+  if (width > maxWidth) {
+    newWidth = maxWidth;
+    newHeight = static_cast<int>(maxWidth / aspectRatio);
+  }
+
+  if (newHeight > maxHeight) {
+    newHeight = maxHeight;
+    newWidth = static_cast<int>(maxHeight * aspectRatio);
+  }
+
+  // A very thin image can round its short side down to nothing; keep at
+  // least one pixel so callers never allocate an empty image.
+  return {std::max(newWidth, 1), std::max(newHeight, 1)};
+}
+
+ResizePlan makeResizePlan(int srcWidth, int srcHeight, int dstWidth,
+                          int dstHeight, int channels) {
+  ResizePlan plan;
+  plan.srcWidth = srcWidth;
+  plan.srcHeight = srcHeight;
+  plan.dstWidth = dstWidth;
+  plan.dstHeight = dstHeight;
+  plan.channels = channels;
+
+  // Index tables first, then the weights, keeping every table 4-byte aligned.
+  const size_t columns = static_cast<size_t>(dstWidth);
+  const size_t rows = static_cast<size_t>(dstHeight);
+  plan.storage = ScratchBuffer((2 * columns + 2 * rows) * sizeof(int32_t) +
+                               (columns + rows) * sizeof(uint16_t));
+
+  int32_t *xOffset0 = plan.storage.as<int32_t>();
+  int32_t *xOffset1 = xOffset0 + columns;
+  int32_t *yRow0 = xOffset1 + columns;
+  int32_t *yRow1 = yRow0 + rows;
+  uint16_t *xWeight = reinterpret_cast<uint16_t *>(yRow1 + rows);
+  uint16_t *yWeight = xWeight + columns;
+
+  buildAxis(srcWidth, dstWidth, xOffset0, xOffset1, xWeight);
+  buildAxis(srcHeight, dstHeight, yRow0, yRow1, yWeight);
+
+  const int32_t rowBytes = srcWidth * channels;
+  plan.vectorSafeColumns = 0;
+  for (int x = 0; x < dstWidth; x++) {
+    xOffset0[x] *= channels;
+    xOffset1[x] *= channels;
+    if (xOffset1[x] + 4 <= rowBytes)
+      plan.vectorSafeColumns = x + 1;
+  }
+  // Three-channel kernels store four lanes per column, the spare one into
+  // the next column, so the last column must be left to the scalar tail
+  // however far its loads are from the end of the source row.
+  if (channels == 3)
+    plan.vectorSafeColumns = std::min(plan.vectorSafeColumns, dstWidth - 1);
+
+  plan.xOffset0 = xOffset0;
+  plan.xOffset1 = xOffset1;
+  plan.xWeight = xWeight;
+  plan.yRow0 = yRow0;
+  plan.yRow1 = yRow1;
+  plan.yWeight = yWeight;
+
+  return plan;
+}
+
+namespace {
+
+// Shared row loop for the resize entry points. loadRow(row, out) fills out
+// with source row `row` interpolated horizontally; it runs at most once per
+// source row an output row actually uses.
+template <typename LoadRow>
+void blendOutputRows(const ResizePlan &plan, LoadRow loadRow, uint8_t *dst,
+                     size_t dstStride, int yBegin, int yEnd) {
+  const KernelTable &kernels = activeKernels();
+  const size_t rowLength =
+      static_cast<size_t>(plan.dstWidth) * plan.channels;
+
+  // Horizontally resampled source rows are cached in two slots; consecutive
+  // output rows usually share at least one source row.
+  ScratchBuffer slotStorage(2 * rowLength * sizeof(uint32_t));
+  uint32_t *slots[2] = {slotStorage.as<uint32_t>(),
+                        slotStorage.as<uint32_t>() + rowLength};
+  int slotRow[2] = {-1, -1};
+
+  auto fetch = [&](int row, int keep) -> const uint32_t * {
+    for (int i = 0; i < 2; i++) {
+      if (slotRow[i] == row)
+        return slots[i];
+    }
+    int victim = keep >= 0 ? 1 - keep : (slotRow[0] <= slotRow[1] ? 0 : 1);
+    loadRow(row, slots[victim]);
+    slotRow[victim] = row;
+    return slots[victim];
+  };
+
+  for (int y = yBegin; y < yEnd; y++) {
+    int row0 = plan.yRow0[y];
+    int row1 = plan.yRow1[y];
+
+    const uint32_t *upper = fetch(row0, -1);
+    int upperSlot = slotRow[0] == row0 ? 0 : 1;
+    const uint32_t *lower = fetch(row1, upperSlot);
+
+    kernels.blendRowsVertical(upper, lower, plan.yWeight[y], rowLength,
+                              dst + static_cast<size_t>(y) * dstStride);
+  }
+}
+
+} // namespace
+
+void resizeRows(const ResizePlan &plan, const uint8_t *src, size_t srcStride,
+                uint8_t *dst, size_t dstStride, int yBegin, int yEnd) {
+  const KernelTable &kernels = activeKernels();
+
+  blendOutputRows(
+      plan,
+      [&](int row, uint32_t *out) {
+        kernels.resampleRowHorizontal(
+            plan, src + static_cast<size_t>(row) * srcStride, out);
+      },
+      dst, dstStride, yBegin, yEnd);
+}
+
+void resizeLumaRows(const ResizePlan &plan, const uint8_t *src,
+                    int srcChannels, size_t srcStride, uint8_t *dst,
+                    size_t dstStride, int yBegin, int yEnd) {
+  if (srcChannels == 1) {
+    resizeRows(plan, src, srcStride, dst, dstStride, yBegin, yEnd);
+    return;
+  }
+
+  const KernelTable &kernels = activeKernels();
+  ScratchBuffer luma(static_cast<size_t>(plan.srcWidth));
+
+  blendOutputRows(
+      plan,
+      [&](int row, uint32_t *out) {
+        kernels.lumaRow(src + static_cast<size_t>(row) * srcStride,
+                        srcChannels, luma.size(), luma.data());
+        kernels.resampleRowHorizontal(plan, luma.data(), out);
+      },
+      dst, dstStride, yBegin, yEnd);
+}
+
+void forEachRowBand(int rows, size_t sourceBytes, int threads,
+                    const std::function<void(int, int)> &body) {
+  if (threads == 1 || sourceBytes < kParallelMinSourceBytes) {
+    body(0, rows);
+    return;
+  }
+
+  // A few bands per thread leaves room to rebalance when one thread is
+  // descheduled; each band recomputes at most two shared source rows.
+  ThreadPool &pool = ThreadPool::shared();
+  int bandRows = std::max(8, rows / (4 * pool.concurrency()));
+  pool.parallelFor(0, rows, bandRows, threads, body);
+}
+
+ImageData resizeImage(const ImageData &input, int newWidth, int newHeight,
+                      int threads) {
+  ImageData output;
+  output.width = newWidth;
+  output.height = newHeight;
+  output.channels = input.channels;
+  output.data =
+      ScratchBuffer(static_cast<size_t>(newWidth) * newHeight * input.channels);
+
+  ResizePlan plan = makeResizePlan(input.width, input.height, newWidth,
+                                   newHeight, input.channels);
+  const size_t srcStride = static_cast<size_t>(input.width) * input.channels;
+  const size_t dstStride = static_cast<size_t>(newWidth) * input.channels;
+  const size_t rowsRead = std::min<size_t>(input.height, 2 * size_t(newHeight));
+
+  forEachRowBand(newHeight, srcStride * rowsRead, threads,
+                 [&](int yBegin, int yEnd) {
+                   resizeRows(plan, input.data.data(), srcStride,
+                              output.data.data(), dstStride, yBegin, yEnd);
+                 });
+
+  return output;
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "image_data.h"
+#include "scratch_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace ImageProcessor {
+
+// Interpolation weights are fixed point with this many fractional bits. The
+// horizontal pass keeps its result at that scale and the vertical pass
+// multiplies by a second weight, so 255 << (2 * kResizeWeightBits) has to fit
+// in a uint32_t accumulator.
+constexpr int kResizeWeightBits = 11;
+constexpr uint32_t kResizeWeightOne = 1u << kResizeWeightBits;
+
+struct OutputSize {
+  int width;
+  int height;
+};
+
+// Fits width x height inside maxWidth x maxHeight, keeping the aspect ratio
+// and never enlarging.
+OutputSize computeOutputSize(int width, int height, int maxWidth,
+                             int maxHeight);
+
+// Source coordinates and weights for a bilinear resize, computed once per
+// output column and once per output row. Column offsets are byte offsets into
+// a source row, already multiplied by the channel count and clamped to the
+// image, so the resampling loops never test for borders. All tables live in
+// one pooled block, so building a plan does not touch the heap once the
+// thread's pool is warm.
+struct ResizePlan {
+  int srcWidth;
+  int srcHeight;
+  int dstWidth;
+  int dstHeight;
+  int channels;
+  const int32_t *xOffset0;
+  const int32_t *xOffset1;
+  const uint16_t *xWeight;
+  const int32_t *yRow0;
+  const int32_t *yRow1;
+  const uint16_t *yWeight;
+  // Columns below this one can be resampled by 32-bit loads at their
+  // offsets without reading past the source row, and, for three channels,
+  // by 4-lane stores without writing past the output row.
+  int vectorSafeColumns;
+  ScratchBuffer storage;
+};
+
+ResizePlan makeResizePlan(int srcWidth, int srcHeight, int dstWidth,
+                          int dstHeight, int channels);
+
+// Produces output rows [yBegin, yEnd) of the resized image.
+void resizeRows(const ResizePlan &plan, const uint8_t *src, size_t srcStride,
+                uint8_t *dst, size_t dstStride, int yBegin, int yEnd);
+
+// Fused grayscale + resize for a single-channel plan: each source row an output
+// row needs is reduced to luma and interpolated once, and output rows are
+// written straight to dst, so no full-size intermediate frame exists.
+void resizeLumaRows(const ResizePlan &plan, const uint8_t *src,
+                    int srcChannels, size_t srcStride, uint8_t *dst,
+                    size_t dstStride, int yBegin, int yEnd);
+
+// Jobs that read fewer source bytes than this run as one band on the calling
+// thread; waking helpers would cost more than it saves.
+constexpr size_t kParallelMinSourceBytes = size_t(1) << 22;
+
+// Calls body(yBegin, yEnd) for bands of output rows covering [0, rows),
+// spread over up to `threads` threads of the shared pool (0 uses all of
+// them). sourceBytes is how much input the whole job reads. Each band keeps
+// its own row cache, so bands are independent.
+void forEachRowBand(int rows, size_t sourceBytes, int threads,
+                    const std::function<void(int, int)> &body);
+
+ImageData resizeImage(const ImageData &input, int newWidth, int newHeight,
+                      int threads = 0);
+
+} // namespace ImageProcessor
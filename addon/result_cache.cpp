@@ -0,0 +1,210 @@
+#include "result_cache.h"
+
+#include "hash.h"
+#include "stage_stats.h"
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace ImageProcessor {
+
+namespace {
+
+std::atomic<bool> cacheEnabled{false};
+
+// Output-affecting options in a fixed order, so equal settings hash alike
+// whatever the struct's padding holds.
+uint64_t hashOptions(const ProcessOptions &options) {
+  const int64_t fields[] = {options.maxWidth,
+                            options.maxHeight,
+                            options.rawWidth,
+                            options.rawHeight,
+                            options.rawChannels,
+                            static_cast<int64_t>(options.rawType),
+                            static_cast<int64_t>(options.filter),
+                            static_cast<int64_t>(options.format),
+                            options.jpeg.quality,
+                            options.jpeg.progressive,
+                            options.shrinkOnLoad,
+                            options.linear};
+  return xxh64(fields, sizeof(fields), 0);
+}
+
+void makeDirectory(const std::string &path) {
+#if defined(_WIN32)
+  _mkdir(path.c_str());
+#else
+  ::mkdir(path.c_str(), 0777);
+#endif
+}
+
+bool readWholeFile(const std::string &path, std::vector<uint8_t> &bytes) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = std::fseek(file, 0, SEEK_END) == 0;
+  long size = ok ? std::ftell(file) : -1;
+  ok = size >= 0 && std::fseek(file, 0, SEEK_SET) == 0;
+  if (ok) {
+    bytes.resize(static_cast<size_t>(size));
+    ok = std::fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  }
+  std::fclose(file);
+  return ok;
+}
+
+// Unique per process and call, so concurrent writers of the same key each
+// rename a complete file of their own into place.
+std::string temporaryName(const std::string &path) {
+  static const uint64_t processTag = std::random_device{}() * 0x9E3779B1ULL;
+  static std::atomic<uint64_t> counter{0};
+  return path + ".tmp" + std::to_string(processTag) + "-" +
+         std::to_string(counter++);
+}
+
+bool writeWholeFile(const std::string &path, const uint8_t *data,
+                    size_t size) {
+  std::string temporary = temporaryName(path);
+  std::FILE *file = std::fopen(temporary.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = std::fwrite(data, 1, size, file) == size;
+  ok = std::fclose(file) == 0 && ok;
+  // On Windows rename() fails if the file exists, which only means another
+  // writer stored the same bytes first.
+  ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    std::remove(temporary.c_str());
+  }
+  return ok;
+}
+
+} // namespace
+
+CacheKey makeCacheKey(const uint8_t *data, size_t size,
+                      const ProcessOptions &options) {
+  StageTimer timer(Stage::Hash, size);
+  return {xxh64(data, size, 0), static_cast<uint64_t>(size),
+          hashOptions(options)};
+}
+
+ResultCache &ResultCache::shared() {
+  static ResultCache cache;
+  return cache;
+}
+
+void ResultCache::configure(size_t memoryBytes, const std::string &directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  memoryBudget_ = memoryBytes;
+  directory_ = directory;
+  recent_.clear();
+  index_.clear();
+  memoryBytes_ = 0;
+  if (!directory_.empty()) {
+    makeDirectory(directory_);
+  }
+  cacheEnabled.store(memoryBudget_ > 0 || !directory_.empty());
+}
+
+bool ResultCache::enabled() const { return cacheEnabled.load(); }
+
+CachedOutput ResultCache::find(const CacheKey &key) {
+  StageTimer timer(Stage::Cache, 0);
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      recent_.splice(recent_.begin(), recent_, it->second);
+      memoryHits_++;
+      return it->second->second;
+    }
+    if (directory_.empty()) {
+      misses_++;
+      return nullptr;
+    }
+    path = pathFor(key);
+  }
+
+  auto bytes = std::make_shared<std::vector<uint8_t>>();
+  bool found = readWholeFile(path, *bytes);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!found) {
+    misses_++;
+    return nullptr;
+  }
+  diskHits_++;
+  timer.setBytes(bytes->size());
+  insertLocked(key, bytes);
+  return bytes;
+}
+
+void ResultCache::store(const CacheKey &key, const uint8_t *data,
+                        size_t size) {
+  auto bytes = std::make_shared<const std::vector<uint8_t>>(data, data + size);
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    insertLocked(key, bytes);
+    if (directory_.empty()) {
+      return;
+    }
+    path = pathFor(key);
+  }
+
+  // The first two hex digits pick a subdirectory, so no directory grows
+  // past a few thousand entries per million outputs.
+  makeDirectory(path.substr(0, path.rfind('/')));
+  writeWholeFile(path, data, size);
+}
+
+ResultCacheStats ResultCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return {memoryHits_, diskHits_, misses_,
+          static_cast<uint64_t>(index_.size()),
+          static_cast<uint64_t>(memoryBytes_)};
+}
+
+void ResultCache::insertLocked(const CacheKey &key, CachedOutput output) {
+  if (output->size() > memoryBudget_) {
+    return;
+  }
+
+  auto existing = index_.find(key);
+  if (existing != index_.end()) {
+    memoryBytes_ -= existing->second->second->size();
+    recent_.erase(existing->second);
+    index_.erase(existing);
+  }
+
+  memoryBytes_ += output->size();
+  recent_.emplace_front(key, std::move(output));
+  index_[key] = recent_.begin();
+
+  while (memoryBytes_ > memoryBudget_) {
+    memoryBytes_ -= recent_.back().second->size();
+    index_.erase(recent_.back().first);
+    recent_.pop_back();
+  }
+}
+
+std::string ResultCache::pathFor(const CacheKey &key) const {
+  char name[49];
+  std::snprintf(name, sizeof(name), "%016llx%016llx%016llx",
+                static_cast<unsigned long long>(key.input),
+                static_cast<unsigned long long>(key.length),
+                static_cast<unsigned long long>(key.options));
+  return directory_ + "/" + std::string(name, 2) + "/" + name;
+}
+
+} // namespace ImageProcessor
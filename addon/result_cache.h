@@ -0,0 +1,87 @@
+#pragma once
+
+#include "process_options.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ImageProcessor {
+
+// Identifies one output: the XXH64 of the input bytes, their length, and a
+// hash of every option that changes the output (size, raw layout, filter,
+// format, JPEG settings). Thread counts are left out because they never
+// change the bytes produced.
+struct CacheKey {
+  uint64_t input;
+  uint64_t length;
+  uint64_t options;
+
+  bool operator==(const CacheKey &other) const {
+    return input == other.input && length == other.length &&
+           options == other.options;
+  }
+};
+
+CacheKey makeCacheKey(const uint8_t *data, size_t size,
+                      const ProcessOptions &options);
+
+using CachedOutput = std::shared_ptr<const std::vector<uint8_t>>;
+
+struct ResultCacheStats {
+  uint64_t memoryHits;
+  uint64_t diskHits;
+  uint64_t misses;
+  uint64_t entries;
+  uint64_t bytes;
+};
+
+// Process-wide cache of finished outputs, shared by every worker thread.
+// Recently used outputs are kept in memory up to a byte budget and evicted
+// least-recently-used first; with a directory every output is also stored
+// on disk as one file per key, so later runs and other processes get hits
+// as well. Disk entries are written to a temporary name and renamed into
+// place, so a reader never sees a partial file. The disk store is never
+// pruned. Disabled until configure() gives it a budget or a directory.
+class ResultCache {
+public:
+  static ResultCache &shared();
+
+  // Replaces the settings and drops the in-memory entries.
+  void configure(size_t memoryBytes, const std::string &directory);
+  bool enabled() const;
+
+  // The output for key, from memory or else from disk, or null.
+  CachedOutput find(const CacheKey &key);
+  void store(const CacheKey &key, const uint8_t *data, size_t size);
+
+  ResultCacheStats stats() const;
+
+private:
+  struct KeyHash {
+    size_t operator()(const CacheKey &key) const {
+      return static_cast<size_t>(key.input ^ key.options);
+    }
+  };
+  using Entry = std::pair<CacheKey, CachedOutput>;
+
+  void insertLocked(const CacheKey &key, CachedOutput output);
+  std::string pathFor(const CacheKey &key) const;
+
+  mutable std::mutex mutex_;
+  size_t memoryBudget_ = 0;
+  size_t memoryBytes_ = 0;
+  std::string directory_;
+  std::list<Entry> recent_;
+  std::unordered_map<CacheKey, std::list<Entry>::iterator, KeyHash> index_;
+  uint64_t memoryHits_ = 0;
+  uint64_t diskHits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+} // namespace ImageProcessor
@@ -0,0 +1,134 @@
+#include "scratch_pool.h"
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace ImageProcessor {
+
+namespace {
+
+// Blocks are 64-byte aligned so SIMD rows and cache lines line up. The
+// smallest class is 4 KiB; blocks above kMaxCachedBlock are always freed.
+constexpr int kMinClassBits = 12;
+constexpr int kClassCount = 48 - kMinClassBits;
+constexpr size_t kBlockAlignment = 64;
+constexpr size_t kBlocksPerClass = 4;
+constexpr size_t kMaxCachedBlock = size_t(1) << 30;
+constexpr size_t kMaxCachedBytes = size_t(256) << 20;
+
+std::atomic<uint64_t> gHeapAllocations{0};
+std::atomic<uint64_t> gReusedBlocks{0};
+
+constexpr size_t kLargestClass = size_t(1) << (kMinClassBits + kClassCount - 1);
+
+// Sizes above kLargestClass have no class; the caller rejects them first,
+// since rounding them up would shift past the width of size_t.
+int sizeClassFor(size_t size) {
+  int bits = kMinClassBits;
+  while ((size_t(1) << bits) < size) {
+    bits++;
+  }
+  return bits - kMinClassBits;
+}
+
+size_t classCapacity(int sizeClass) {
+  return size_t(1) << (sizeClass + kMinClassBits);
+}
+
+class ScratchCache {
+public:
+  ~ScratchCache() {
+    for (auto &blocks : free_) {
+      for (uint8_t *block : blocks) {
+        ::operator delete(block, std::align_val_t(kBlockAlignment));
+      }
+    }
+  }
+
+  uint8_t *take(int sizeClass) {
+    std::vector<uint8_t *> &blocks = free_[sizeClass];
+    if (!blocks.empty()) {
+      uint8_t *block = blocks.back();
+      blocks.pop_back();
+      cachedBytes_ -= classCapacity(sizeClass);
+      gReusedBlocks.fetch_add(1, std::memory_order_relaxed);
+      return block;
+    }
+
+    gHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<uint8_t *>(::operator new(
+        classCapacity(sizeClass), std::align_val_t(kBlockAlignment)));
+  }
+
+  void give(uint8_t *block, int sizeClass) {
+    size_t capacity = classCapacity(sizeClass);
+    std::vector<uint8_t *> &blocks = free_[sizeClass];
+
+    if (capacity > kMaxCachedBlock || blocks.size() >= kBlocksPerClass ||
+        cachedBytes_ + capacity > kMaxCachedBytes) {
+      ::operator delete(block, std::align_val_t(kBlockAlignment));
+      return;
+    }
+
+    blocks.push_back(block);
+    cachedBytes_ += capacity;
+  }
+
+private:
+  std::vector<uint8_t *> free_[kClassCount];
+  size_t cachedBytes_ = 0;
+};
+
+ScratchCache &threadCache() {
+  thread_local ScratchCache cache;
+  return cache;
+}
+
+} // namespace
+
+ScratchBuffer::ScratchBuffer(size_t size) : size_(size) {
+  if (size == 0) {
+    return;
+  }
+  if (size > kLargestClass) {
+    size_ = 0;
+    throw std::bad_alloc();
+  }
+  sizeClass_ = sizeClassFor(size);
+  data_ = threadCache().take(sizeClass_);
+}
+
+ScratchBuffer::~ScratchBuffer() { release(); }
+
+ScratchBuffer::ScratchBuffer(ScratchBuffer &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)),
+      sizeClass_(std::exchange(other.sizeClass_, -1)) {}
+
+ScratchBuffer &ScratchBuffer::operator=(ScratchBuffer &&other) noexcept {
+  if (this != &other) {
+    release();
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+    sizeClass_ = std::exchange(other.sizeClass_, -1);
+  }
+  return *this;
+}
+
+void ScratchBuffer::release() {
+  if (data_ != nullptr) {
+    threadCache().give(data_, sizeClass_);
+    data_ = nullptr;
+    size_ = 0;
+    sizeClass_ = -1;
+  }
+}
+
+ScratchPoolStats scratchPoolStats() {
+  return {gHeapAllocations.load(std::memory_order_relaxed),
+          gReusedBlocks.load(std::memory_order_relaxed)};
+}
+
+} // namespace ImageProcessor
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+// Move-only handle to an uninitialized block from the calling thread's
+// scratch cache. Blocks are grouped into power-of-two size classes and go
+// back to the cache of whichever thread releases them, so nothing is
+// zero-filled only to be overwritten. Buffers allocated and released on the
+// same thread are reused without touching the shared heap. One released on
+// another thread feeds that thread's cache, so the allocating thread goes
+// back to the heap next time. Outputs handed to JS are therefore plain heap
+// blocks, not scratch buffers.
+class ScratchBuffer {
+public:
+  ScratchBuffer() = default;
+  explicit ScratchBuffer(size_t size);
+  ~ScratchBuffer();
+
+  ScratchBuffer(ScratchBuffer &&other) noexcept;
+  ScratchBuffer &operator=(ScratchBuffer &&other) noexcept;
+  ScratchBuffer(const ScratchBuffer &) = delete;
+  ScratchBuffer &operator=(const ScratchBuffer &) = delete;
+
+  uint8_t *data() { return data_; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  template <typename T> T *as() { return reinterpret_cast<T *>(data_); }
+  template <typename T> const T *as() const {
+    return reinterpret_cast<const T *>(data_);
+  }
+
+private:
+  void release();
+
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  int sizeClass_ = -1;
+};
+
+struct ScratchPoolStats {
+  uint64_t heapAllocations;
+  uint64_t reusedBlocks;
+};
+
+// Totals across all threads since the addon was loaded.
+ScratchPoolStats scratchPoolStats();
+
+} // namespace ImageProcessor
@@ -0,0 +1,78 @@
+#include "stage_stats.h"
+
+#include <atomic>
+#include <cstring>
+
+namespace ImageProcessor {
+
+namespace {
+
+// One cache line or more per stage, so threads timing different stages do
+// not contend.
+struct alignas(64) StageCounters {
+  std::atomic<uint64_t> nanoseconds{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> buckets[kStageBuckets] = {};
+};
+
+StageCounters gStages[kStageCount];
+
+const char *const kStageNames[kStageCount] = {
+    "parse", "decode", "resize", "encode",       "hash",
+    "cache", "read",   "write",  "sharp_decode", "sharp_encode"};
+
+int bucketFor(uint64_t nanoseconds) {
+  int bucket = 0;
+  while (bucket < kStageBuckets - 1 &&
+         nanoseconds > stageBucketBound(bucket)) {
+    bucket++;
+  }
+  return bucket;
+}
+
+} // namespace
+
+const char *stageName(Stage stage) {
+  return kStageNames[static_cast<int>(stage)];
+}
+
+bool stageFromName(const char *name, Stage &stage) {
+  for (int i = 0; i < kStageCount; i++) {
+    if (std::strcmp(kStageNames[i], name) == 0) {
+      stage = static_cast<Stage>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t stageBucketBound(int bucket) {
+  return bucket < kStageBuckets - 1 ? uint64_t(1000) << bucket : 0;
+}
+
+void recordStage(Stage stage, uint64_t nanoseconds, uint64_t bytes) {
+  StageCounters &counters = gStages[static_cast<int>(stage)];
+  counters.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+  counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  counters.buckets[bucketFor(nanoseconds)].fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+StageSnapshot stageSnapshot(Stage stage) {
+  const StageCounters &counters = gStages[static_cast<int>(stage)];
+  StageSnapshot snapshot;
+  snapshot.nanoseconds = counters.nanoseconds.load(std::memory_order_relaxed);
+  snapshot.bytes = counters.bytes.load(std::memory_order_relaxed);
+  for (int i = 0; i < kStageBuckets; i++) {
+    snapshot.buckets[i] = counters.buckets[i].load(std::memory_order_relaxed);
+  }
+  // Counted from the buckets, so the total always matches the histogram
+  // even while other threads are recording.
+  snapshot.count = 0;
+  for (uint64_t bucket : snapshot.buckets) {
+    snapshot.count += bucket;
+  }
+  return snapshot;
+}
+
+} // namespace ImageProcessor
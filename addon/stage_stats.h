@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageProcessor {
+
+// Pipeline stages with their own timer. Grayscale conversion is fused into
+// the resize, so it is timed as part of Resize. The Sharp stages and some
+// reads and writes happen in JS and are recorded through recordStage().
+enum class Stage {
+  Parse,
+  Decode,
+  Resize,
+  Encode,
+  Hash,
+  Cache,
+  Read,
+  Write,
+  SharpDecode,
+  SharpEncode,
+  Count
+};
+
+constexpr int kStageCount = static_cast<int>(Stage::Count);
+
+// Durations are counted in buckets whose upper bounds double from 1 us;
+// the last bucket holds everything above about 4 s.
+constexpr int kStageBuckets = 24;
+
+const char *stageName(Stage stage);
+// Returns false for a name that is not a stage.
+bool stageFromName(const char *name, Stage &stage);
+
+// Upper bound of a bucket in nanoseconds, or 0 for the last one.
+uint64_t stageBucketBound(int bucket);
+
+// Adds one timed call of a stage. Every counter is a relaxed atomic add, so
+// recording costs a few nanoseconds and never takes a lock.
+void recordStage(Stage stage, uint64_t nanoseconds, uint64_t bytes);
+
+struct StageSnapshot {
+  uint64_t count;
+  uint64_t nanoseconds;
+  uint64_t bytes;
+  uint64_t buckets[kStageBuckets];
+};
+
+// Totals across all threads since the addon was loaded.
+StageSnapshot stageSnapshot(Stage stage);
+
+// Times its own lifetime as one call of `stage` that handled `bytes`.
+class StageTimer {
+public:
+  StageTimer(Stage stage, size_t bytes)
+      : stage_(stage), bytes_(bytes),
+        start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    recordStage(stage_,
+                static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        elapsed)
+                        .count()),
+                bytes_);
+  }
+
+  // For calls that only learn their size as they go, such as file reads.
+  void setBytes(size_t bytes) { bytes_ = bytes; }
+
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+  Stage stage_;
+  size_t bytes_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace ImageProcessor
@@ -0,0 +1,493 @@
+#include "stream.h"
+#include "decode.h"
+#include "encode.h"
+#include "filters.h"
+#include "kernels.h"
+#include "resize.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace ImageProcessor {
+
+namespace {
+
+// Rows asked of the JPEG decoder per call; two MCU rows at most.
+constexpr int kJpegRowBatch = 16;
+
+constexpr size_t kMinOutputBlock = 64 * 1024;
+
+// Push-driven version of the resize loops: source rows arrive top to bottom
+// and each output row is passed to emit as soon as every source row it needs
+// has been seen. It keeps only the rows a filter still needs (two for
+// bilinear, the tap count for box and Lanczos) and produces the same bytes
+// as resizeLumaRows and filterLumaRows.
+class RowResizer {
+public:
+  RowResizer(int srcWidth, int srcHeight, int channels, int dstWidth,
+             int dstHeight, ResizeFilter filter)
+      : srcWidth_(srcWidth), srcHeight_(srcHeight), channels_(channels),
+        dstWidth_(dstWidth), dstHeight_(dstHeight),
+        luma_(channels == 1 ? 0 : static_cast<size_t>(srcWidth)),
+        outRow_(static_cast<size_t>(dstWidth)) {
+    const size_t columns = static_cast<size_t>(dstWidth);
+
+    if (srcWidth == dstWidth && srcHeight == dstHeight) {
+      mode_ = Mode::Copy;
+    } else if (filter == ResizeFilter::Bilinear) {
+      mode_ = Mode::Bilinear;
+      bilinear_ = makeResizePlan(srcWidth, srcHeight, dstWidth, dstHeight, 1);
+      slots_ = ScratchBuffer(2 * columns * sizeof(uint32_t));
+    } else {
+      mode_ = Mode::Filtered;
+      filter_ =
+          makeFilterPlan(filter, srcWidth, srcHeight, dstWidth, dstHeight);
+      const size_t reducedWidth = static_cast<size_t>(filter_.reducedWidth);
+      const size_t taps = static_cast<size_t>(filter_.y.maxTaps);
+      blockSums_ = ScratchBuffer(reducedWidth * sizeof(uint32_t));
+      std::fill(blockSums_.as<uint32_t>(),
+                blockSums_.as<uint32_t>() + reducedWidth, 0u);
+      reduced_ = ScratchBuffer(reducedWidth);
+      ring_ = ScratchBuffer(taps * columns * sizeof(int32_t));
+      taps_ = ScratchBuffer(taps * sizeof(const int32_t *));
+      accumulator_ = ScratchBuffer(columns * sizeof(int32_t));
+    }
+  }
+
+  // Consumes the next source row (srcWidth x channels bytes).
+  template <typename Emit> void push(const uint8_t *row, Emit &&emit) {
+    const int index = nextSource_++;
+    switch (mode_) {
+    case Mode::Copy:
+      emit(luma(row));
+      nextOutput_++;
+      break;
+    case Mode::Bilinear:
+      pushBilinear(row, index, emit);
+      break;
+    case Mode::Filtered:
+      pushFiltered(luma(row), index, emit);
+      break;
+    }
+  }
+
+  bool complete() const { return nextOutput_ == dstHeight_; }
+
+private:
+  enum class Mode { Copy, Bilinear, Filtered };
+
+  const uint8_t *luma(const uint8_t *row) {
+    if (channels_ == 1)
+      return row;
+    activeKernels().lumaRow(row, channels_, luma_.size(), luma_.data());
+    return luma_.data();
+  }
+
+  uint32_t *slot(int index) {
+    return slots_.as<uint32_t>() + static_cast<size_t>(index) * dstWidth_;
+  }
+
+  // Output rows read source rows yRow0[y] and yRow1[y], both non-decreasing
+  // in y, so the two most recent rows any pending output row needs are all
+  // that has to be kept. Rows no output needs are skipped before the luma
+  // conversion.
+  template <typename Emit>
+  void pushBilinear(const uint8_t *row, int index, Emit &&emit) {
+    const ResizePlan &plan = bilinear_;
+    const KernelTable &kernels = activeKernels();
+
+    for (int y = nextOutput_; y < dstHeight_ && plan.yRow0[y] <= index; y++) {
+      if (plan.yRow0[y] == index || plan.yRow1[y] == index) {
+        int victim = slotRow_[0] <= slotRow_[1] ? 0 : 1;
+        kernels.resampleRowHorizontal(plan, luma(row), slot(victim));
+        slotRow_[victim] = index;
+        break;
+      }
+    }
+
+    while (nextOutput_ < dstHeight_ && plan.yRow1[nextOutput_] <= index) {
+      const int y = nextOutput_++;
+      const uint32_t *upper = slot(slotRow_[0] == plan.yRow0[y] ? 0 : 1);
+      const uint32_t *lower = slot(slotRow_[0] == plan.yRow1[y] ? 0 : 1);
+      kernels.blendRowsVertical(upper, lower, plan.yWeight[y], dstWidth_,
+                                outRow_.data());
+      emit(outRow_.data());
+    }
+  }
+
+  // Box sums collect over shrinkY source rows before a reduced row exists;
+  // each reduced row is filtered horizontally into a ring of y.maxTaps rows,
+  // which covers every tap of the next output row because tap ranges only
+  // move down.
+  template <typename Emit>
+  void pushFiltered(const uint8_t *luma, int index, Emit &&emit) {
+    const FilterPlan &plan = filter_;
+    const uint8_t *reduced = luma;
+
+    if (plan.shrinkX > 1 || plan.shrinkY > 1) {
+      uint32_t *sums = blockSums_.as<uint32_t>();
+      accumulateBlocks(plan, luma, sums);
+      if (++blockRowsSeen_ < plan.shrinkY && index != srcHeight_ - 1)
+        return;
+      finishBlocks(plan, sums, blockRowsSeen_, reduced_.data());
+      std::fill(sums, sums + plan.reducedWidth, 0u);
+      blockRowsSeen_ = 0;
+      reduced = reduced_.data();
+    }
+
+    const int slots = plan.y.maxTaps;
+    const int current = nextReduced_++;
+    auto ringRow = [&](int row) {
+      return ring_.as<int32_t>() + static_cast<size_t>(row % slots) * dstWidth_;
+    };
+    filterRowHorizontal(plan, reduced, ringRow(current));
+
+    const int32_t **taps = taps_.as<const int32_t *>();
+    while (nextOutput_ < dstHeight_ &&
+           plan.y.start[nextOutput_] + plan.y.count[nextOutput_] - 1 <=
+               current) {
+      const int y = nextOutput_++;
+      for (int t = 0; t < plan.y.count[y]; t++) {
+        taps[t] = ringRow(plan.y.start[y] + t);
+      }
+      filterRowVertical(plan, y, taps, accumulator_.as<int32_t>(),
+                        outRow_.data());
+      emit(outRow_.data());
+    }
+  }
+
+  int srcWidth_;
+  int srcHeight_;
+  int channels_;
+  int dstWidth_;
+  int dstHeight_;
+  Mode mode_;
+  int nextSource_ = 0;
+  int nextOutput_ = 0;
+  ScratchBuffer luma_;
+  ScratchBuffer outRow_;
+
+  ResizePlan bilinear_;
+  ScratchBuffer slots_;
+  int slotRow_[2] = {-1, -1};
+
+  FilterPlan filter_;
+  ScratchBuffer blockSums_;
+  ScratchBuffer reduced_;
+  int blockRowsSeen_ = 0;
+  int nextReduced_ = 0;
+  ScratchBuffer ring_;
+  ScratchBuffer taps_;
+  ScratchBuffer accumulator_;
+};
+
+int readBigEndian(const uint8_t *data) {
+  return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+// Rows are resized by the 8-bit kernels as they arrive, so the other paths
+// are left to the whole-image pipeline.
+void checkStreamable(const ProcessOptions &options) {
+  if (options.linear) {
+    throw std::runtime_error("Linear-light resizing can't be streamed");
+  }
+  if (options.rawType != PixelType::U8) {
+    throw std::runtime_error("Raw input wider than 8 bits can't be streamed");
+  }
+}
+
+} // namespace
+
+struct StreamPipeline::State {
+  ProcessOptions options;
+  enum class Source { Undecided, Rows, Jpeg } source = Source::Undecided;
+  bool failed = false;
+  bool ended = false;
+
+  uint8_t header[kFrameHeaderSize];
+  size_t headerLength = 0;
+
+  // Framed or raw input: rows are pushed straight from the caller's chunk,
+  // and only a row split across two chunks is copied.
+  int srcHeight = 0;
+  size_t rowBytes = 0;
+  int rowsIn = 0;
+  ScratchBuffer partialRow;
+  size_t partialLength = 0;
+
+  std::unique_ptr<JpegRowDecoder> decoder;
+  ScratchBuffer decodedRows;
+
+  OutputSize outputSize;
+  std::unique_ptr<RowResizer> resizer;
+  std::unique_ptr<JpegRowEncoder> encoder;
+  ScratchBuffer output;
+  size_t outputLength = 0;
+
+  void write(const uint8_t *data, size_t size);
+  void end();
+  void decide();
+  void startRows(int width, int height, int channels);
+  void start(int width, int height, int channels, int sourceWidth,
+             int sourceHeight);
+  void feedRows(const uint8_t *data, size_t size);
+  void pumpJpeg();
+  void emitRow(const uint8_t *row);
+  void append(const uint8_t *data, size_t size);
+};
+
+void StreamPipeline::State::write(const uint8_t *data, size_t size) {
+  if (source == Source::Undecided) {
+    checkStreamable(options);
+    if (options.rawWidth > 0) {
+      startRows(options.rawWidth, options.rawHeight, options.rawChannels);
+    } else {
+      // A JPEG is recognised from its first three bytes; anything else
+      // must start with a complete frame header.
+      size_t take = std::min(size, kFrameHeaderSize - headerLength);
+      std::memcpy(header + headerLength, data, take);
+      headerLength += take;
+      data += take;
+      size -= take;
+      bool jpeg = sniffFormat(header, headerLength) == ImageFormat::Jpeg;
+      if (!jpeg && headerLength < kFrameHeaderSize) {
+        return;
+      }
+      decide();
+    }
+  }
+
+  if (source == Source::Rows) {
+    feedRows(data, size);
+  } else if (size > 0) {
+    decoder->append(data, size);
+    pumpJpeg();
+  }
+}
+
+void StreamPipeline::State::end() {
+  if (source == Source::Undecided) {
+    checkStreamable(options);
+    if (options.rawWidth > 0) {
+      startRows(options.rawWidth, options.rawHeight, options.rawChannels);
+    } else if (headerLength < kFrameHeaderSize &&
+               sniffFormat(header, headerLength) != ImageFormat::Jpeg) {
+      throw std::runtime_error("Invalid image data: too small");
+    } else {
+      decide();
+    }
+  }
+
+  if (source == Source::Jpeg) {
+    decoder->endOfInput();
+    pumpJpeg();
+  }
+  if (!resizer || !resizer->complete()) {
+    throw std::runtime_error("Invalid image data: stream ended before the "
+                             "last row");
+  }
+  if (encoder) {
+    encoder->finish();
+  }
+}
+
+void StreamPipeline::State::decide() {
+  ImageFormat format = sniffFormat(header, headerLength);
+
+  if (format == ImageFormat::Jpeg) {
+    if (!canDecode(format)) {
+      throw std::runtime_error("JPEG decoding is not available in this build");
+    }
+    DecodeOptions decodeOptions;
+    decodeOptions.lumaOnly = true;
+    if (options.shrinkOnLoad) {
+      decodeOptions.fitWidth = options.maxWidth;
+      decodeOptions.fitHeight = options.maxHeight;
+    }
+    decoder = std::make_unique<JpegRowDecoder>(decodeOptions);
+    source = Source::Jpeg;
+    decoder->append(header, headerLength);
+    pumpJpeg();
+    return;
+  }
+
+  if (format != ImageFormat::Unknown) {
+    throw std::runtime_error(std::string(format == ImageFormat::Png ? "PNG"
+                                                                    : "WebP") +
+                             " input can't be streamed");
+  }
+
+  int width = readBigEndian(header);
+  int height = readBigEndian(header + 4);
+  int channels = readBigEndian(header + 8);
+  if (width <= 0 || height <= 0 || channels <= 0 || channels > 4) {
+    throw std::runtime_error("Invalid image data: a stream must start with a "
+                             "frame header, or pass the raw option");
+  }
+  startRows(width, height, channels);
+}
+
+void StreamPipeline::State::startRows(int width, int height, int channels) {
+  source = Source::Rows;
+  srcHeight = height;
+  rowBytes = static_cast<size_t>(width) * channels;
+  partialRow = ScratchBuffer(rowBytes);
+  start(width, height, channels, width, height);
+}
+
+// The output size always comes from the stored dimensions, as in readInput,
+// so a JPEG decoded at a reduced DCT scale keeps the same result size.
+void StreamPipeline::State::start(int width, int height, int channels,
+                                  int sourceWidth, int sourceHeight) {
+  outputSize = computeOutputSize(sourceWidth, sourceHeight, options.maxWidth,
+                                 options.maxHeight);
+  if (outputSize.width <= 0 || outputSize.height <= 0) {
+    throw std::runtime_error("Invalid output size: " +
+                             std::to_string(outputSize.width) + "x" +
+                             std::to_string(outputSize.height));
+  }
+
+  resizer = std::make_unique<RowResizer>(width, height, channels,
+                                         outputSize.width, outputSize.height,
+                                         options.filter);
+
+  if (options.format == OutputFormat::Jpeg) {
+    encoder = std::make_unique<JpegRowEncoder>(
+        outputSize.width, outputSize.height, 1, options.jpeg,
+        [this](const uint8_t *data, size_t size) {
+          try {
+            append(data, size);
+            return true;
+          } catch (const std::bad_alloc &) {
+            return false;
+          }
+        });
+  } else {
+    uint8_t frameHeader[kFrameHeaderSize];
+    writeFrameHeader(frameHeader, outputSize.width, outputSize.height, 1);
+    append(frameHeader, kFrameHeaderSize);
+  }
+}
+
+void StreamPipeline::State::feedRows(const uint8_t *data, size_t size) {
+  auto emit = [this](const uint8_t *row) { emitRow(row); };
+
+  // Bytes after the last row are ignored, as processImage does.
+  if (partialLength > 0 && rowsIn < srcHeight) {
+    size_t take = std::min(size, rowBytes - partialLength);
+    std::memcpy(partialRow.data() + partialLength, data, take);
+    partialLength += take;
+    data += take;
+    size -= take;
+    if (partialLength < rowBytes) {
+      return;
+    }
+    resizer->push(partialRow.data(), emit);
+    rowsIn++;
+    partialLength = 0;
+  }
+
+  while (size >= rowBytes && rowsIn < srcHeight) {
+    resizer->push(data, emit);
+    rowsIn++;
+    data += rowBytes;
+    size -= rowBytes;
+  }
+
+  if (size > 0 && rowsIn < srcHeight) {
+    std::memcpy(partialRow.data(), data, size);
+    partialLength = size;
+  }
+}
+
+void StreamPipeline::State::pumpJpeg() {
+  if (!resizer) {
+    if (!decoder->readHeader()) {
+      return;
+    }
+    decodedRows = ScratchBuffer(static_cast<size_t>(kJpegRowBatch) *
+                                decoder->width() * decoder->channels());
+    start(decoder->width(), decoder->height(), decoder->channels(),
+          decoder->sourceWidth(), decoder->sourceHeight());
+  }
+
+  auto emit = [this](const uint8_t *row) { emitRow(row); };
+  const size_t stride =
+      static_cast<size_t>(decoder->width()) * decoder->channels();
+  int rows;
+  do {
+    rows = decoder->readRows(decodedRows.data(), stride, kJpegRowBatch);
+    for (int i = 0; i < rows; i++) {
+      resizer->push(decodedRows.data() + i * stride, emit);
+    }
+  } while (rows == kJpegRowBatch);
+}
+
+void StreamPipeline::State::emitRow(const uint8_t *row) {
+  if (encoder) {
+    encoder->writeRows(row, outputSize.width, 1);
+  } else {
+    append(row, outputSize.width);
+  }
+}
+
+void StreamPipeline::State::append(const uint8_t *data, size_t size) {
+  if (outputLength + size > output.size()) {
+    ScratchBuffer grown(std::max(
+        {outputLength + size, 2 * output.size(), kMinOutputBlock}));
+    if (outputLength > 0) {
+      std::memcpy(grown.data(), output.data(), outputLength);
+    }
+    output = std::move(grown);
+  }
+  std::memcpy(output.data() + outputLength, data, size);
+  outputLength += size;
+}
+
+StreamPipeline::StreamPipeline(const ProcessOptions &options)
+    : state_(new State) {
+  state_->options = options;
+}
+
+StreamPipeline::~StreamPipeline() = default;
+
+void StreamPipeline::write(const uint8_t *data, size_t size) {
+  if (state_->failed || state_->ended) {
+    throw std::runtime_error(state_->failed ? "stream already failed"
+                                            : "write after end");
+  }
+  try {
+    state_->write(data, size);
+  } catch (...) {
+    state_->failed = true;
+    throw;
+  }
+}
+
+void StreamPipeline::end() {
+  if (state_->failed || state_->ended) {
+    throw std::runtime_error(state_->failed ? "stream already failed"
+                                            : "stream already ended");
+  }
+  state_->ended = true;
+  try {
+    state_->end();
+  } catch (...) {
+    state_->failed = true;
+    throw;
+  }
+}
+
+std::vector<uint8_t> StreamPipeline::takeOutput() {
+  State &state = *state_;
+  std::vector<uint8_t> exact(state.output.data(),
+                             state.output.data() + state.outputLength);
+  state.outputLength = 0;
+  return exact;
+}
+
+} // namespace ImageProcessor
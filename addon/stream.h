@@ -0,0 +1,44 @@
+#pragma once
+
+#include "process_options.h"
+#include "scratch_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ImageProcessor {
+
+// Bounded-memory counterpart of runPipeline for images that arrive in
+// pieces, such as a 30k x 30k scan read from disk. The input is a framed
+// image, raw pixels (the raw option) or a single-scan JPEG. Each chunk is
+// pushed through decode, grayscale, resize and encode as far as it goes, one
+// scanline at a time. Memory is therefore a few source rows plus the rows the
+// filter taps span, never the whole frame. The output (a frame or a JPEG,
+// per options.format) collects until takeOutput. Calls must not overlap, and
+// the image is processed on the calling thread; options.threads is ignored.
+class StreamPipeline {
+public:
+  explicit StreamPipeline(const ProcessOptions &options);
+  ~StreamPipeline();
+
+  StreamPipeline(const StreamPipeline &) = delete;
+  StreamPipeline &operator=(const StreamPipeline &) = delete;
+
+  // Consumes the next piece of the input. Throws std::runtime_error on
+  // invalid input; the pipeline cannot be used after that.
+  void write(const uint8_t *data, size_t size);
+  // Marks the end of the input and flushes the output. Throws if the image
+  // is incomplete.
+  void end();
+  // Copies out the output bytes produced since the last call, as an
+  // exact-size block that does not come from the scratch pool.
+  std::vector<uint8_t> takeOutput();
+
+private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+} // namespace ImageProcessor
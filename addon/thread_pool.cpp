@@ -0,0 +1,223 @@
+#include "thread_pool.h"
+#include "affinity.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <map>
+#include <memory>
+
+namespace ImageProcessor {
+
+namespace {
+
+// A contiguous run of chunk indices. The owner takes chunks from the front
+// and thieves from the back, so each keeps walking rows in order.
+struct Lane {
+  std::mutex mutex;
+  int next = 0;
+  int end = 0;
+};
+
+bool takeFront(Lane &lane, int &chunk) {
+  std::lock_guard<std::mutex> lock(lane.mutex);
+  if (lane.next >= lane.end)
+    return false;
+  chunk = lane.next++;
+  return true;
+}
+
+bool takeBack(Lane &lane, int &chunk) {
+  std::lock_guard<std::mutex> lock(lane.mutex);
+  if (lane.next >= lane.end)
+    return false;
+  chunk = --lane.end;
+  return true;
+}
+
+} // namespace
+
+struct ThreadPool::Batch {
+  const std::function<void(int, int)> *body;
+  int begin;
+  int end;
+  int grain;
+  std::unique_ptr<Lane[]> lanes;
+  size_t laneCount;
+  size_t nextLane = 1;
+
+  std::atomic<int> helpers{0};
+  std::mutex mutex;
+  std::condition_variable done;
+  std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(int helpers, const std::vector<int> &cpus, int node) {
+  for (int i = 0; i < helpers; i++) {
+    helpers_.emplace_back([this, cpus, node] {
+      if (!cpus.empty())
+        pinCurrentThread(cpus, node);
+      helperLoop();
+    });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &helper : helpers_) {
+    helper.join();
+  }
+}
+
+ThreadPool &ThreadPool::shared() {
+  const int node = currentNode();
+  if (node < 0) {
+    static ThreadPool pool(
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency())) -
+        1);
+    return pool;
+  }
+
+  // Node pools live as long as the process, like the shared one, so each
+  // thread can remember its own.
+  thread_local int cachedNode = -1;
+  thread_local ThreadPool *cachedPool = nullptr;
+  if (node == cachedNode)
+    return *cachedPool;
+
+  static std::mutex mutex;
+  static std::map<int, std::unique_ptr<ThreadPool>> pools;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<ThreadPool> &pool = pools[node];
+  if (!pool) {
+    std::vector<int> cpus;
+    for (const NumaNode &candidate : numaNodes()) {
+      if (candidate.id == node)
+        cpus = candidate.cpus;
+    }
+    pool.reset(new ThreadPool(
+        std::max(1, static_cast<int>(cpus.size())) - 1, cpus, node));
+  }
+  cachedNode = node;
+  cachedPool = pool.get();
+  return *pool;
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grain, int maxThreads,
+                             const std::function<void(int, int)> &body) {
+  if (begin >= end)
+    return;
+
+  grain = std::max(grain, 1);
+  const int chunks = (end - begin + grain - 1) / grain;
+  int threads = maxThreads > 0 ? std::min(maxThreads, concurrency())
+                               : concurrency();
+  threads = std::min(threads, chunks);
+
+  if (threads <= 1) {
+    body(begin, end);
+    return;
+  }
+
+  Batch batch;
+  batch.body = &body;
+  batch.begin = begin;
+  batch.end = end;
+  batch.grain = grain;
+  batch.laneCount = static_cast<size_t>(threads);
+  batch.lanes.reset(new Lane[batch.laneCount]);
+  for (int i = 0; i < threads; i++) {
+    batch.lanes[i].next = static_cast<int>(int64_t(chunks) * i / threads);
+    batch.lanes[i].end = static_cast<int>(int64_t(chunks) * (i + 1) / threads);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batches_.push_back(&batch);
+  }
+  wake_.notify_all();
+
+  runLane(batch, 0);
+
+  // Every chunk has been claimed once our lane (and what we could steal) is
+  // empty. Unlist the batch so no helper joins late, then wait for the ones
+  // still finishing a chunk.
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto listed = std::find(batches_.begin(), batches_.end(), &batch);
+    if (listed != batches_.end())
+      batches_.erase(listed);
+  }
+
+  std::unique_lock<std::mutex> lock(batch.mutex);
+  batch.done.wait(lock, [&batch] { return batch.helpers.load() == 0; });
+
+  if (batch.error)
+    std::rethrow_exception(batch.error);
+}
+
+ThreadPool::Batch *ThreadPool::joinableBatch() {
+  return batches_.empty() ? nullptr : batches_.front();
+}
+
+void ThreadPool::helperLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    wake_.wait(lock,
+               [this] { return stopping_ || joinableBatch() != nullptr; });
+    if (stopping_)
+      return;
+
+    Batch *batch = joinableBatch();
+    size_t lane = batch->nextLane++;
+    if (batch->nextLane == batch->laneCount)
+      batches_.pop_front();
+    batch->helpers.fetch_add(1);
+    lock.unlock();
+
+    runLane(*batch, lane);
+
+    // Notify while still holding the batch lock: once it is released the
+    // caller may return and destroy the batch.
+    {
+      std::lock_guard<std::mutex> batchLock(batch->mutex);
+      batch->helpers.fetch_sub(1);
+      batch->done.notify_all();
+    }
+
+    lock.lock();
+  }
+}
+
+void ThreadPool::runLane(Batch &batch, size_t lane) {
+  auto runChunk = [&batch](int chunk) {
+    int chunkBegin = batch.begin + chunk * batch.grain;
+    int chunkEnd = std::min(chunkBegin + batch.grain, batch.end);
+    try {
+      (*batch.body)(chunkBegin, chunkEnd);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(batch.mutex);
+      if (!batch.error)
+        batch.error = std::current_exception();
+    }
+  };
+
+  int chunk;
+  while (takeFront(batch.lanes[lane], chunk)) {
+    runChunk(chunk);
+  }
+
+  for (size_t offset = 1; offset < batch.laneCount; offset++) {
+    Lane &victim = batch.lanes[(lane + offset) % batch.laneCount];
+    while (takeBack(victim, chunk)) {
+      runChunk(chunk);
+    }
+  }
+}
+
+} // namespace ImageProcessor
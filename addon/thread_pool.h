@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ImageProcessor {
+
+// Fixed set of helper threads shared by every caller in the process. A
+// parallelFor call splits its range into one lane of chunks per participant;
+// the caller works its own lane, helpers each claim another, and anyone
+// whose lane runs dry steals chunks from the far end of the others. The
+// caller always takes part, so a call completes even when every helper is
+// busy elsewhere.
+class ThreadPool {
+public:
+  // Helpers are pinned to cpus, and to node as pinCurrentThread() does,
+  // unless cpus is empty.
+  explicit ThreadPool(int helpers, const std::vector<int> &cpus = {},
+                      int node = -1);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // One helper per hardware thread beyond the caller's, created on first use.
+  // A thread pinned to a NUMA node gets that node's pool instead, with one
+  // helper per CPU of the node beyond the caller's.
+  static ThreadPool &shared();
+
+  // The most threads a single call can use, including the caller.
+  int concurrency() const { return static_cast<int>(helpers_.size()) + 1; }
+
+  // Runs body(chunkBegin, chunkEnd) over [begin, end) in chunks of at most
+  // `grain` items on up to maxThreads threads (0 means concurrency()).
+  // Blocks until every chunk has run; the first exception a chunk throws is
+  // rethrown here.
+  void parallelFor(int begin, int end, int grain, int maxThreads,
+                   const std::function<void(int, int)> &body);
+
+private:
+  struct Batch;
+
+  void helperLoop();
+  Batch *joinableBatch();
+  static void runLane(Batch &batch, size_t lane);
+
+  std::vector<std::thread> helpers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<Batch *> batches_;
+  bool stopping_ = false;
+};
+
+} // namespace ImageProcessor
@@ -0,0 +1,42 @@
+// Where pool workers run. Workers are spread round-robin over the NUMA
+// nodes the addon reports, so a two-socket host gets half on each, and the
+// addon keeps each worker's helper threads and scratch memory on its node.
+
+const os = require("os");
+
+const PIN_MODES = ["none", "core", "node", "auto"];
+
+function availableCpus() {
+  return os.availableParallelism ? os.availableParallelism() : os.cpus().length;
+}
+
+// Returns { node, cpus } for worker `index`, or null to leave it unpinned.
+// mode is "node" (any CPU of one node), "core" (one CPU, taking a CPU from
+// every node in turn before reusing any), "auto" ("node" when there are
+// several nodes, else unpinned) or "none".
+function planAffinity(index, nodes, mode) {
+  if (!PIN_MODES.includes(mode)) {
+    throw new RangeError(`Unknown pin mode "${mode}"`);
+  }
+  if (!nodes || nodes.length === 0 || mode === "none") return null;
+  if (mode === "auto") {
+    if (nodes.length < 2) return null;
+    mode = "node";
+  }
+
+  if (mode === "node") {
+    const { node, cpus } = nodes[index % nodes.length];
+    return { node, cpus };
+  }
+
+  const order = [];
+  const deepest = Math.max(...nodes.map(({ cpus }) => cpus.length));
+  for (let depth = 0; depth < deepest; depth++) {
+    for (const { node, cpus } of nodes) {
+      if (depth < cpus.length) order.push({ node, cpus: [cpus[depth]] });
+    }
+  }
+  return order[index % order.length];
+}
+
+module.exports = { PIN_MODES, availableCpus, planAffinity };
@@ -0,0 +1,249 @@
+// End-to-end throughput benchmark behind `index.js --bench`. It writes a
+// synthetic corpus of JPEGs with a chosen mix of sizes, then runs the whole
+// pipeline over it once for every combination of engine, worker count and
+// batch size, each time on fresh workers. Each run reports throughput,
+// per-image latency percentiles and the peak resident set size.
+
+const fs = require("fs");
+const os = require("os");
+const path = require("path");
+const sharp = require("sharp");
+const { ImageProcessor } = require("./index");
+
+// Workers are threads of this process, so sampling its RSS covers them.
+const RSS_SAMPLE_MS = 50;
+
+// "640x480:70,4000x3000:5" -> [{ width, height, weight }]
+function parseSizeMix(text) {
+  return text.split(",").map((entry) => {
+    const match = /^\s*(\d+)x(\d+)(?::(\d+(?:\.\d+)?))?\s*$/.exec(entry);
+    if (!match) {
+      throw new Error(`Invalid size "${entry}", expected WIDTHxHEIGHT:WEIGHT`);
+    }
+    return {
+      width: Number(match[1]),
+      height: Number(match[2]),
+      weight: match[3] === undefined ? 1 : Number(match[3]),
+    };
+  });
+}
+
+function parseList(text) {
+  return String(text)
+    .split(",")
+    .map((entry) => entry.trim())
+    .filter((entry) => entry !== "");
+}
+
+// Nearest-rank percentile of an ascending array.
+function percentile(sorted, p) {
+  if (sorted.length === 0) return 0;
+  const rank = Math.ceil((p / 100) * sorted.length);
+  return sorted[Math.min(sorted.length, Math.max(1, rank)) - 1];
+}
+
+// Gives each of `count` files a size from the mix, in proportion to the
+// weights. Positions are spread evenly over the total weight, so the split
+// is exact and the same on every run.
+function assignSizes(count, mix) {
+  const total = mix.reduce((sum, size) => sum + size.weight, 0);
+  return Array.from({ length: count }, (_, i) => {
+    let position = ((i + 0.5) / count) * total;
+    for (const size of mix) {
+      if (position < size.weight) return size;
+      position -= size.weight;
+    }
+    return mix[mix.length - 1];
+  });
+}
+
+// A colour gradient with noise, which compresses about like a photo.
+function syntheticJpeg(width, height) {
+  const pixels = Buffer.allocUnsafe(width * height * 3);
+  let noise = 0x2545f491;
+  let offset = 0;
+  for (let y = 0; y < height; y++) {
+    for (let x = 0; x < width; x++) {
+      noise = (Math.imul(noise, 1664525) + 1013904223) | 0;
+      const grain = (noise >>> 27) - 16;
+      pixels[offset++] = ((x * 255) / width + grain) & 0xff;
+      pixels[offset++] = ((y * 255) / height + grain) & 0xff;
+      pixels[offset++] = (((x + y) * 255) / (width + height) + grain) & 0xff;
+    }
+  }
+  return sharp(pixels, { raw: { width, height, channels: 3 } })
+    .jpeg({ quality: 90 })
+    .toBuffer();
+}
+
+// Every file of a size has the same bytes, so the corpus costs one encode
+// per size rather than per file.
+async function createCorpus(dir, count, mix) {
+  await fs.promises.mkdir(dir, { recursive: true });
+  const encoded = new Map();
+  const files = [];
+  const fileSizes = new Map();
+  const sizes = assignSizes(count, mix);
+  for (let i = 0; i < sizes.length; i++) {
+    const { width, height } = sizes[i];
+    const key = `${width}x${height}`;
+    if (!encoded.has(key)) encoded.set(key, await syntheticJpeg(width, height));
+    const data = encoded.get(key);
+    const file = path.join(dir, `bench-${String(i).padStart(6, "0")}.jpg`);
+    await fs.promises.writeFile(file, data);
+    files.push(file);
+    fileSizes.set(file, data.length);
+  }
+  return { files, fileSizes };
+}
+
+async function runOnce(corpus, outputDir, config, options) {
+  const processor = new ImageProcessor(config.workers, {
+    ...options,
+    engine: config.engine,
+    batchSize: config.batchSize,
+    quiet: true,
+  });
+  await processor.initialize();
+
+  let peakRss = process.memoryUsage.rss();
+  const sampler = setInterval(() => {
+    peakRss = Math.max(peakRss, process.memoryUsage.rss());
+  }, RSS_SAMPLE_MS);
+
+  const start = performance.now();
+  let processed;
+  try {
+    processed = await processor.processImageQueue(
+      corpus.files,
+      outputDir,
+      new Map(corpus.fileSizes)
+    );
+  } finally {
+    clearInterval(sampler);
+    await processor.cleanup();
+  }
+  const seconds = (performance.now() - start) / 1000;
+  peakRss = Math.max(peakRss, process.memoryUsage.rss());
+
+  const inputBytes = [...corpus.fileSizes.values()].reduce((a, b) => a + b, 0);
+  const latencies = processor.latencies.slice().sort((a, b) => a - b);
+  return {
+    ...config,
+    images: processed.length,
+    failed: corpus.files.length - processed.length,
+    seconds,
+    imagesPerSecond: processed.length / seconds,
+    megabytesPerSecond: inputBytes / (1024 * 1024) / seconds,
+    p50Ms: percentile(latencies, 50),
+    p95Ms: percentile(latencies, 95),
+    p99Ms: percentile(latencies, 99),
+    peakRssBytes: peakRss,
+  };
+}
+
+function formatRow(columns) {
+  const widths = [6, 7, 6, 9, 8, 9, 9, 9, 9];
+  return columns
+    .map((column, i) => String(column).padStart(widths[i]))
+    .join(" ");
+}
+
+function printResult(result) {
+  console.log(
+    formatRow([
+      result.engine,
+      result.workers,
+      result.batchSize,
+      result.imagesPerSecond.toFixed(1),
+      result.megabytesPerSecond.toFixed(1),
+      result.p50Ms.toFixed(1),
+      result.p95Ms.toFixed(1),
+      result.p99Ms.toFixed(1),
+      (result.peakRssBytes / (1024 * 1024)).toFixed(0),
+    ]) + (result.failed > 0 ? `  (${result.failed} failed)` : "")
+  );
+}
+
+// options: { images, mix, workers, batchSizes, engines, dir, json } for the
+// sweep itself, plus `pipeline`, which is passed to every ImageProcessor.
+// Resolves to one result per run.
+async function runBench(options) {
+  const mix = parseSizeMix(options.mix);
+  const keepCorpus = Boolean(options.dir);
+  const root =
+    options.dir ||
+    (await fs.promises.mkdtemp(path.join(os.tmpdir(), "image-bench-")));
+  const outputDir = path.join(root, "output");
+  await fs.promises.mkdir(outputDir, { recursive: true });
+
+  let addonBuilt = true;
+  try {
+    require("./build/Release/image_processor");
+  } catch (error) {
+    addonBuilt = false;
+  }
+  const engines = parseList(options.engines).filter((engine) => {
+    if (engine === "addon" && !addonBuilt) {
+      console.log("C++ addon not built, skipping the addon engine");
+      return false;
+    }
+    return true;
+  });
+
+  try {
+    console.log(`Writing ${options.images} synthetic images to ${root}...`);
+    const corpus = await createCorpus(
+      path.join(root, "input"),
+      options.images,
+      mix
+    );
+
+    console.log(
+      "\n" +
+        formatRow([
+          "engine",
+          "workers",
+          "batch",
+          "images/s",
+          "MiB/s",
+          "p50 ms",
+          "p95 ms",
+          "p99 ms",
+          "peak MiB",
+        ])
+    );
+    const results = [];
+    for (const engine of engines) {
+      for (const workers of parseList(options.workers).map(Number)) {
+        for (const batchSize of parseList(options.batchSizes).map(Number)) {
+          const result = await runOnce(
+            corpus,
+            outputDir,
+            { engine, workers, batchSize },
+            options.pipeline || {}
+          );
+          printResult(result);
+          results.push(result);
+        }
+      }
+    }
+
+    if (options.json) {
+      await fs.promises.writeFile(
+        options.json,
+        JSON.stringify({ images: options.images, mix, results }, null, 2)
+      );
+      console.log(`\nResults written to ${options.json}`);
+    }
+    return results;
+  } finally {
+    if (keepCorpus) {
+      await fs.promises.rm(outputDir, { recursive: true, force: true });
+    } else {
+      await fs.promises.rm(root, { recursive: true, force: true });
+    }
+  }
+}
+
+module.exports = { runBench, parseSizeMix, percentile, assignSizes };
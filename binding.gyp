@@ -1,9 +1,35 @@
 {
+  "variables": {
+    "with_jpeg%": "true",
+    "with_png%": "true",
+    "with_webp%": "false",
+    "with_bench%": "false",
+    "march%": ""
+  },
   "targets": [
     {
       "target_name": "image_processor",
       "sources": [
-        "addon/image_processor.cpp"
+        "addon/affinity.cpp",
+        "addon/decode.cpp",
+        "addon/encode.cpp",
+        "addon/file_batch.cpp",
+        "addon/file_io.cpp",
+        "addon/filters.cpp",
+        "addon/hash.cpp",
+        "addon/image_processor.cpp",
+        "addon/job_queue.cpp",
+        "addon/kernels.cpp",
+        "addon/kernels_neon.cpp",
+        "addon/kernels_x86.cpp",
+        "addon/linear_resize.cpp",
+        "addon/probe.cpp",
+        "addon/resize.cpp",
+        "addon/result_cache.cpp",
+        "addon/scratch_pool.cpp",
+        "addon/stage_stats.cpp",
+        "addon/stream.cpp",
+        "addon/thread_pool.cpp"
       ],
       "include_dirs": [
         "<!@(node -p \"require('node-addon-api').include\")"
@@ -17,6 +43,24 @@
         "NAPI_DISABLE_CPP_EXCEPTIONS"
       ],
       "conditions": [
+        ["march!=\"\"", {
+          "cflags": [ "-march=<(march)" ],
+          "xcode_settings": {
+            "OTHER_CFLAGS": [ "-march=<(march)" ]
+          }
+        }],
+        ["with_jpeg==\"true\"", {
+          "defines": [ "IMAGE_PROCESSOR_HAVE_JPEG" ],
+          "libraries": [ "-ljpeg" ]
+        }],
+        ["with_png==\"true\"", {
+          "defines": [ "IMAGE_PROCESSOR_HAVE_PNG" ],
+          "libraries": [ "-lpng" ]
+        }],
+        ["with_webp==\"true\"", {
+          "defines": [ "IMAGE_PROCESSOR_HAVE_WEBP" ],
+          "libraries": [ "-lwebp" ]
+        }],
         ["OS==\"win\"", {
           "msvs_settings": {
             "VCCLCompilerTool": {
@@ -33,5 +77,69 @@
         }]
       ]
     }
+  ],
+  "conditions": [
+    ["with_bench==\"true\"", {
+      "targets": [
+        {
+          "target_name": "image_processor_bench",
+          "type": "executable",
+          "sources": [
+            "addon/affinity.cpp",
+            "addon/bench.cpp",
+            "addon/decode.cpp",
+            "addon/encode.cpp",
+            "addon/file_io.cpp",
+            "addon/filters.cpp",
+            "addon/hash.cpp",
+            "addon/kernels.cpp",
+            "addon/kernels_neon.cpp",
+            "addon/kernels_x86.cpp",
+            "addon/linear_resize.cpp",
+            "addon/probe.cpp",
+            "addon/resize.cpp",
+            "addon/scratch_pool.cpp",
+            "addon/stage_stats.cpp",
+            "addon/thread_pool.cpp"
+          ],
+          "cflags!": [ "-fno-exceptions" ],
+          "cflags_cc!": [ "-fno-exceptions" ],
+          "conditions": [
+            ["march!=\"\"", {
+              "cflags": [ "-march=<(march)" ],
+              "xcode_settings": {
+                "OTHER_CFLAGS": [ "-march=<(march)" ]
+              }
+            }],
+            ["with_jpeg==\"true\"", {
+              "defines": [ "IMAGE_PROCESSOR_HAVE_JPEG" ],
+              "libraries": [ "-ljpeg" ]
+            }],
+            ["with_png==\"true\"", {
+              "defines": [ "IMAGE_PROCESSOR_HAVE_PNG" ],
+              "libraries": [ "-lpng" ]
+            }],
+            ["with_webp==\"true\"", {
+              "defines": [ "IMAGE_PROCESSOR_HAVE_WEBP" ],
+              "libraries": [ "-lwebp" ]
+            }],
+            ["OS==\"win\"", {
+              "msvs_settings": {
+                "VCCLCompilerTool": {
+                  "ExceptionHandling": 1
+                }
+              }
+            }],
+            ["OS==\"mac\"", {
+              "xcode_settings": {
+                "GCC_ENABLE_CPP_EXCEPTIONS": "YES",
+                "CLANG_CXX_LIBRARY": "libc++",
+                "MACOSX_DEPLOYMENT_TARGET": "10.7"
+              }
+            }]
+          ]
+        }
+      ]
+    }]
   ]
 } 
\ No newline at end of file
@@ -0,0 +1,568 @@
+// Sharded runs across machines. A coordinator lists the source directory,
+// plans the jobs as a single run would, and leases them out over TCP to
+// nodes, each of which runs an ImageProcessor pool of its own. Jobs are
+// sharded by consistent hashing of their first path, so a file keeps going
+// to the same node from one run to the next (and hits that node's result
+// cache), and adding or losing a node only moves that node's share. A node
+// that runs out of work steals from the longest queue, and once nothing is
+// queued, idle nodes re-run the oldest outstanding lease, so a slow node
+// doesn't hold up the end of the batch. The first copy to finish counts;
+// outputs are deterministic, so the other one writes the same bytes. A node
+// that misses its heartbeats loses its leases, which go back into the
+// queue. Nodes read and write the paths they are sent, so the source and
+// output directories have to be on storage every node mounts at the same
+// place.
+//
+// Trust model: the protocol is plain TCP, neither encrypted nor
+// authenticated beyond an optional shared token. Any node that says hello
+// is leased jobs, learns their paths and has its results recorded, DONE
+// results included. The coordinator therefore listens on 127.0.0.1 unless
+// given another host, and a cluster spanning machines should set a token
+// and stay on a trusted network.
+
+const crypto = require("crypto");
+const { once } = require("events");
+const fs = require("fs");
+const net = require("net");
+const os = require("os");
+const { ManifestWriter } = require("./manifest");
+
+// Every message starts with three big-endian uint32s, like the addon's
+// frame header (width, height, channels): the message type, an id, and the
+// length of the payload that follows.
+const HEADER_BYTES = 12;
+const MAX_PAYLOAD_BYTES = 64 * 1024 * 1024;
+
+// Node: id is its capacity in jobs, payload its name, then a NUL and the
+// shared token when the cluster has one.
+const HELLO = 1;
+// Coordinator: id is the heartbeat interval in ms, payload the output dir.
+const WELCOME = 2;
+// Coordinator: id is the lease, payload the job's paths, NUL-separated.
+const LEASE = 3;
+// Node: renews all of its leases.
+const HEARTBEAT = 4;
+// Node: id is the lease, payload a result per path (see encodeResults).
+const DONE = 5;
+// Coordinator: the run is over.
+const BYE = 6;
+
+// A node is presumed dead after this long without a message.
+const LEASE_MS = 10000;
+// Jobs whose node died this many times are failed, not leased again.
+const MAX_ATTEMPTS = 3;
+// Points per node on the hash ring; more even out the shards.
+const RING_REPLICAS = 64;
+
+function encodeMessage(type, id, payload = Buffer.alloc(0)) {
+  const header = Buffer.alloc(HEADER_BYTES);
+  header.writeUInt32BE(type, 0);
+  header.writeUInt32BE(id, 4);
+  header.writeUInt32BE(payload.length, 8);
+  return Buffer.concat([header, payload]);
+}
+
+// Splits a byte stream back into { type, id, payload } messages.
+class MessageReader {
+  constructor(onMessage) {
+    this.onMessage = onMessage;
+    this.pending = Buffer.alloc(0);
+  }
+
+  push(chunk) {
+    this.pending =
+      this.pending.length > 0 ? Buffer.concat([this.pending, chunk]) : chunk;
+    while (this.pending.length >= HEADER_BYTES) {
+      const length = this.pending.readUInt32BE(8);
+      if (length > MAX_PAYLOAD_BYTES) {
+        throw new Error(`Message of ${length} bytes exceeds the limit`);
+      }
+      if (this.pending.length < HEADER_BYTES + length) return;
+      const message = {
+        type: this.pending.readUInt32BE(0),
+        id: this.pending.readUInt32BE(4),
+        payload: this.pending.subarray(HEADER_BYTES, HEADER_BYTES + length),
+      };
+      this.pending = this.pending.subarray(HEADER_BYTES + length);
+      this.onMessage(message);
+    }
+  }
+}
+
+// Per result: a success byte, input and output sizes as uint32s, then the
+// error's length and UTF-8 bytes.
+function encodeResults(results) {
+  return Buffer.concat(
+    results.map((result) => {
+      const error = Buffer.from(result.success ? "" : result.error || "");
+      const fixed = Buffer.alloc(13);
+      fixed.writeUInt8(result.success ? 1 : 0, 0);
+      fixed.writeUInt32BE(Math.min(result.inputSize || 0, 0xffffffff), 1);
+      fixed.writeUInt32BE(Math.min(result.outputSize || 0, 0xffffffff), 5);
+      fixed.writeUInt32BE(error.length, 9);
+      return Buffer.concat([fixed, error]);
+    })
+  );
+}
+
+function decodeResults(payload) {
+  const results = [];
+  for (let offset = 0; offset + 13 <= payload.length; ) {
+    const success = payload.readUInt8(offset) === 1;
+    const inputSize = payload.readUInt32BE(offset + 1);
+    const outputSize = payload.readUInt32BE(offset + 5);
+    const errorLength = payload.readUInt32BE(offset + 9);
+    offset += 13;
+    const error = payload.toString("utf8", offset, offset + errorLength);
+    offset += errorLength;
+    results.push(
+      success ? { success, inputSize, outputSize } : { success, error }
+    );
+  }
+  return results;
+}
+
+// 32-bit FNV-1a with murmur3's finalizer, so similar paths spread out.
+function hash32(text) {
+  let hash = 0x811c9dc5;
+  for (let i = 0; i < text.length; i++) {
+    hash ^= text.charCodeAt(i);
+    hash = Math.imul(hash, 0x01000193);
+  }
+  hash ^= hash >>> 16;
+  hash = Math.imul(hash, 0x85ebca6b);
+  hash ^= hash >>> 13;
+  hash = Math.imul(hash, 0xc2b2ae35);
+  hash ^= hash >>> 16;
+  return hash >>> 0;
+}
+
+class HashRing {
+  constructor(replicas = RING_REPLICAS) {
+    this.replicas = replicas;
+    this.points = [];
+  }
+
+  get size() {
+    return this.points.length / this.replicas;
+  }
+
+  add(node) {
+    for (let i = 0; i < this.replicas; i++) {
+      this.points.push({ hash: hash32(`${node}#${i}`), node });
+    }
+    this.points.sort((a, b) => a.hash - b.hash);
+  }
+
+  remove(node) {
+    this.points = this.points.filter((point) => point.node !== node);
+  }
+
+  // The node owning key: the first point at or after its hash, wrapping.
+  lookup(key) {
+    if (this.points.length === 0) return null;
+    const hash = hash32(key);
+    let low = 0;
+    let high = this.points.length;
+    while (low < high) {
+      const mid = (low + high) >>> 1;
+      if (this.points[mid].hash < hash) low = mid + 1;
+      else high = mid;
+    }
+    return this.points[low % this.points.length].node;
+  }
+}
+
+class Coordinator {
+  // jobs is a list of path lists, as ImageProcessor#planJobs returns them.
+  // Options: leaseMs, maxAttempts, manifest (NDJSON file of results), quiet,
+  // and token, which every node's hello must carry when set.
+  constructor(jobs, outputDir, options = {}) {
+    this.jobs = jobs.map((files, index) => ({
+      index,
+      files,
+      attempts: 0,
+      leases: new Set(),
+      done: false,
+    }));
+    this.outputDir = outputDir;
+    this.leaseMs = options.leaseMs || LEASE_MS;
+    this.maxAttempts = options.maxAttempts || MAX_ATTEMPTS;
+    this.quiet = Boolean(options.quiet);
+    this.token = options.token || "";
+    this.manifest = options.manifest
+      ? new ManifestWriter(options.manifest)
+      : null;
+
+    this.ring = new HashRing();
+    this.nodes = new Map();
+    this.leases = new Map();
+    this.nextLeaseId = 1;
+    // Jobs wait here until the first node joins.
+    this.unassigned = this.jobs.slice();
+    this.remaining = this.jobs.length;
+    this.completed = 0;
+    this.succeeded = 0;
+    this.writes = Promise.resolve();
+    this.finished = new Promise((resolve) => {
+      this.resolveFinished = resolve;
+    });
+  }
+
+  // Starts listening and resolves to the bound port, for port 0. Only local
+  // nodes can join unless a host such as "0.0.0.0" is given.
+  async listen(port, host = "127.0.0.1") {
+    this.server = net.createServer((socket) => this.accept(socket));
+    this.server.listen(port, host);
+    await once(this.server, "listening");
+    this.sweeper = setInterval(() => this.expireNodes(), this.leaseMs / 3);
+    if (this.remaining === 0) this.finish();
+    return this.server.address().port;
+  }
+
+  // Resolves to { completed, succeeded, nodes } once every job is done.
+  run() {
+    return this.finished;
+  }
+
+  accept(socket) {
+    let node = null;
+    const reader = new MessageReader((message) => {
+      if (node) {
+        this.handleMessage(node, message);
+      } else if (message.type === HELLO) {
+        node = this.join(socket, message);
+      } else {
+        socket.destroy();
+      }
+    });
+    socket.setNoDelay(true);
+    socket.on("data", (chunk) => {
+      try {
+        reader.push(chunk);
+      } catch (error) {
+        socket.destroy(error);
+      }
+    });
+    socket.on("error", () => {});
+    socket.on("close", () => {
+      if (node) this.leave(node);
+    });
+  }
+
+  // Returns the new node, or null after turning away a hello without the
+  // cluster's token.
+  join(socket, message) {
+    const separator = message.payload.indexOf(0);
+    const requested = message.payload
+      .subarray(0, separator < 0 ? undefined : separator)
+      .toString();
+    const token =
+      separator < 0 ? Buffer.alloc(0) : message.payload.subarray(separator + 1);
+    if (!this.acceptsToken(token)) {
+      this.log(`Turned away ${socket.remoteAddress}: wrong cluster token`);
+      socket.destroy();
+      return null;
+    }
+
+    let name = requested || socket.remoteAddress;
+    for (let n = 2; this.nodes.has(name); n++) {
+      name = `${requested}-${n}`;
+    }
+    const node = {
+      name,
+      socket,
+      capacity: Math.max(1, message.id),
+      leases: new Map(),
+      queue: [],
+      lastSeen: Date.now(),
+      completed: 0,
+    };
+    this.nodes.set(name, node);
+    this.ring.add(name);
+    this.log(`Node ${name} joined, running ${node.capacity} jobs at once`);
+
+    socket.write(
+      encodeMessage(
+        WELCOME,
+        Math.round(this.leaseMs / 3),
+        Buffer.from(this.outputDir)
+      )
+    );
+    this.rebalance();
+    this.fillAll();
+    return node;
+  }
+
+  acceptsToken(token) {
+    if (!this.token) return true;
+    const expected = Buffer.from(this.token);
+    return (
+      token.length === expected.length &&
+      crypto.timingSafeEqual(token, expected)
+    );
+  }
+
+  leave(node) {
+    if (this.nodes.get(node.name) !== node) return;
+    this.nodes.delete(node.name);
+    this.ring.remove(node.name);
+    if (this.remaining === 0) return;
+    this.log(
+      `Node ${node.name} left with ${node.leases.size} jobs leased, ` +
+        `${node.queue.length} queued`
+    );
+
+    for (const [leaseId, job] of node.leases) {
+      this.leases.delete(leaseId);
+      job.leases.delete(leaseId);
+      if (job.done || job.leases.size > 0) continue;
+      job.attempts++;
+      if (job.attempts >= this.maxAttempts) {
+        this.record(
+          job,
+          job.files.map(() => ({
+            success: false,
+            error: `Lease lost ${job.attempts} times`,
+          }))
+        );
+      } else {
+        node.queue.push(job);
+      }
+    }
+    node.leases.clear();
+    this.unassigned.push(...node.queue);
+    node.queue = [];
+    this.rebalance();
+    this.fillAll();
+    this.checkFinished();
+  }
+
+  handleMessage(node, message) {
+    node.lastSeen = Date.now();
+    if (message.type !== DONE) return;
+
+    const job = node.leases.get(message.id);
+    if (!job) return;
+    node.leases.delete(message.id);
+    this.leases.delete(message.id);
+    job.leases.delete(message.id);
+    if (!job.done) {
+      node.completed++;
+      this.record(job, decodeResults(message.payload));
+    }
+    this.fill(node);
+    this.checkFinished();
+  }
+
+  record(job, results) {
+    job.done = true;
+    this.remaining--;
+    job.files.forEach((input, index) => {
+      const result = results[index] || {
+        success: false,
+        error: "No result returned",
+      };
+      this.completed++;
+      if (result.success) this.succeeded++;
+      if (this.manifest) {
+        const record = result.success
+          ? {
+              input,
+              success: true,
+              inputSize: result.inputSize,
+              outputSize: result.outputSize,
+            }
+          : { input, success: false, error: result.error };
+        this.writes = this.writes.then(() => this.manifest.write(record));
+      }
+    });
+  }
+
+  // Hands every queued job to the node that owns it on the ring, keeping
+  // the largest-first order of the plan.
+  rebalance() {
+    if (this.ring.size === 0) return;
+    const queued = this.unassigned;
+    for (const node of this.nodes.values()) {
+      queued.push(...node.queue);
+      node.queue = [];
+    }
+    this.unassigned = [];
+    queued.sort((a, b) => a.index - b.index);
+    for (const job of queued) {
+      if (job.done) continue;
+      this.nodes.get(this.ring.lookup(job.files[0])).queue.push(job);
+    }
+  }
+
+  fillAll() {
+    for (const node of this.nodes.values()) this.fill(node);
+  }
+
+  fill(node) {
+    while (node.leases.size < node.capacity) {
+      const job = this.nextJob(node);
+      if (!job) return;
+      this.lease(node, job);
+    }
+  }
+
+  // The node's own next job; else the cheapest job of the longest queue;
+  // else a second copy of the oldest lease held elsewhere.
+  nextJob(node) {
+    if (node.queue.length > 0) return node.queue.shift();
+
+    let victim = null;
+    for (const other of this.nodes.values()) {
+      if (!victim || other.queue.length > victim.queue.length) victim = other;
+    }
+    if (victim && victim.queue.length > 0) return victim.queue.pop();
+
+    for (const { job, node: holder } of this.leases.values()) {
+      if (holder !== node && !job.done && job.leases.size === 1) return job;
+    }
+    return null;
+  }
+
+  lease(node, job) {
+    const leaseId = this.nextLeaseId++;
+    this.leases.set(leaseId, { job, node });
+    node.leases.set(leaseId, job);
+    job.leases.add(leaseId);
+    node.socket.write(
+      encodeMessage(LEASE, leaseId, Buffer.from(job.files.join("\0")))
+    );
+  }
+
+  expireNodes() {
+    const now = Date.now();
+    for (const node of this.nodes.values()) {
+      if (now - node.lastSeen > this.leaseMs) {
+        this.log(`Node ${node.name} missed its heartbeats`);
+        node.socket.destroy();
+        this.leave(node);
+      }
+    }
+  }
+
+  checkFinished() {
+    if (this.remaining === 0) this.finish();
+  }
+
+  async finish() {
+    if (this.finishing) return;
+    this.finishing = true;
+    clearInterval(this.sweeper);
+    const nodes = [...this.nodes.values()].map((node) => ({
+      name: node.name,
+      completed: node.completed,
+    }));
+    for (const node of this.nodes.values()) {
+      node.socket.end(encodeMessage(BYE, 0));
+      // A hung node never closes its end, which would keep us running.
+      node.socket.setTimeout(this.leaseMs, () => node.socket.destroy());
+    }
+    this.server.close();
+    await this.writes;
+    if (this.manifest) await this.manifest.close();
+    this.resolveFinished({
+      completed: this.completed,
+      succeeded: this.succeeded,
+      nodes,
+    });
+  }
+
+  log(...args) {
+    if (!this.quiet) console.log(...args);
+  }
+}
+
+// Serves a coordinator with an initialized ImageProcessor until the run is
+// over or the connection drops. token must match the coordinator's, if it
+// has one. Resolves to the node's { completed, succeeded, leases }.
+async function joinCluster(processor, { host, port, name, token }) {
+  const socket = net.connect(port, host);
+  socket.setNoDelay(true);
+  await once(socket, "connect");
+
+  await processor.startOpenRun();
+  const capacity = processor.workers.length * processor.jobsPerWorker;
+  const hello = name || `${os.hostname()}:${process.pid}`;
+  socket.write(
+    encodeMessage(
+      HELLO,
+      capacity,
+      Buffer.from(token ? `${hello}\0${token}` : hello)
+    )
+  );
+
+  let outputDir = null;
+  let outputReady = null;
+  let heartbeat = null;
+  let leases = 0;
+  let slot = 0;
+
+  // Never rejects: nothing awaits it, so a failure, such as an output
+  // directory this node cannot create, is sent back as an error per path.
+  const runLease = async (leaseId, files) => {
+    leases++;
+    let results;
+    try {
+      await outputReady;
+      results = await processor.runJob(files, outputDir, slot++);
+    } catch (error) {
+      results = files.map((inputPath) => ({
+        success: false,
+        inputPath,
+        error: error.message,
+      }));
+    }
+    if (socket.writable) {
+      socket.write(encodeMessage(DONE, leaseId, encodeResults(results)));
+    }
+  };
+
+  const reader = new MessageReader(({ type, id, payload }) => {
+    if (type === WELCOME) {
+      outputDir = payload.toString();
+      outputReady = fs.promises.mkdir(outputDir, { recursive: true });
+      heartbeat = setInterval(() => {
+        socket.write(encodeMessage(HEARTBEAT, 0));
+      }, id);
+    } else if (type === LEASE) {
+      runLease(id, payload.toString().split("\0"));
+    } else if (type === BYE) {
+      socket.end();
+    }
+  });
+  socket.on("data", (chunk) => {
+    try {
+      reader.push(chunk);
+    } catch (error) {
+      socket.destroy(error);
+    }
+  });
+
+  await new Promise((resolve) => {
+    socket.on("close", resolve);
+    socket.on("error", () => {});
+  });
+  clearInterval(heartbeat);
+  processor.finishOpenRun();
+  return {
+    completed: processor.completedJobs,
+    succeeded: processor.succeededJobs,
+    leases,
+  };
+}
+
+module.exports = {
+  Coordinator,
+  HashRing,
+  MessageReader,
+  decodeResults,
+  encodeMessage,
+  encodeResults,
+  joinCluster,
+};
@@ -5,125 +5,745 @@ const path = require("path");
 const { Worker } = require("worker_threads");
 const yargs = require("yargs/yargs");
 const { hideBin } = require("yargs/helpers");
+const { PIN_MODES, availableCpus, planAffinity } = require("./affinity");
+const { Coordinator, joinCluster } = require("./cluster");
+const { ManifestWriter } = require("./manifest");
+const { formatMetrics, serveMetrics } = require("./metrics");
+const { SharedFrameRing } = require("./shared_ring");
+
+// Job cost is estimated in input bytes: decoding and resizing scale with
+// the compressed size, and each file adds a fixed cost for opening it and
+// encoding an output of at most maxWidth x maxHeight.
+const FILE_COST_BYTES = 32 * 1024;
+// With the addon, large files are probed instead, and cost the pixels they
+// decode to after shrink-on-load, at what a typical JPEG stores per pixel.
+const BYTES_PER_DECODED_PIXEL = 0.25;
+// Dispatched jobs time out after this long, plus a second per MiB of input,
+// so a huge image is not failed for taking longer than a small one.
+const BASE_TIMEOUT_MS = 30000;
+// An autoscaled pool shrinks back to its minimum after idling this long.
+const IDLE_WORKER_MS = 30000;
+const SUPPORTED_EXTENSIONS = [
+  ".jpg",
+  ".jpeg",
+  ".png",
+  ".bmp",
+  ".tiff",
+  ".webp",
+];
+
+let imageProcessor = null;
+try {
+  imageProcessor = require("./build/Release/image_processor");
+} catch (error) {
+  imageProcessor = null;
+}
 
 class ImageProcessor {
-  constructor(workerCount = 4) {
-    this.workerCount = workerCount;
+  // workerCount "auto" sizes the pool for each run between minWorkers
+  // (default 1) and maxWorkers (default: the CPUs this process may use).
+  constructor(workerCount = 4, options = {}) {
+    this.autoscale = workerCount === "auto";
+    this.minWorkers = options.minWorkers || 1;
+    this.maxWorkers = Math.max(
+      this.minWorkers,
+      options.maxWorkers || availableCpus()
+    );
+    this.workerCount = this.autoscale ? this.minWorkers : workerCount;
+    this.idleWorkerMs = options.idleWorkerMs || IDLE_WORKER_MS;
+    this.idleTimer = null;
+    // Worker placement, see affinity.js.
+    this.pin = options.pin || "auto";
+    if (!PIN_MODES.includes(this.pin)) {
+      throw new RangeError(
+        `Option 'pin' must be one of ${PIN_MODES.join(", ")}`
+      );
+    }
+    this.nodes = null;
+    this.jobsPerWorker = options.jobsPerWorker || 2;
+    this.threadsPerImage = options.threadsPerImage || 0;
+    this.filter = options.filter;
+    this.linear = Boolean(options.linear);
+    this.directIO = Boolean(options.directIO);
+    this.batchSize = options.batchSize || 16;
+    this.smallImageBytes = options.smallImageBytes || 64 * 1024;
+    this.order = options.order || "size";
+    this.maxWidth = options.maxWidth || 800;
+    this.maxHeight = options.maxHeight || 600;
+    this.maxInputBytes = options.maxInputBytes || 32 * 1024 * 1024;
+    // Workers turn down files whose header declares more pixels than this,
+    // before reading them; 0 leaves the limit to the decoders.
+    this.maxInputPixels = options.maxInputPixels || 0;
+    this.cache = options.cache || null;
+    // "sharp" runs everything through the JS fallback, even with the addon
+    // built, so the two can be compared.
+    this.engine = options.engine || "addon";
+    this.native = this.engine === "addon" ? imageProcessor : null;
+    this.quiet = Boolean(options.quiet);
+    this.ring = null;
+    this.freeSlots = [];
+    this.slotWaiters = [];
+    this.slotJobs = new Map();
+    this.watchingSlots = false;
     this.workers = [];
     this.activeJobs = 0;
     this.completedJobs = 0;
+    this.succeededJobs = 0;
+    // Streaming runs count results without keeping them.
+    this.retainResults = true;
     this.totalJobs = 0;
     this.startTime = null;
     this.processedImages = [];
-    this.pendingQueue = [];
+    this.latencies = [];
+    this.fileSizes = new Map();
+    this.decodedPixels = new Map();
+    // Header sizes from planning, sent along with each job so workers can
+    // enforce maxInputPixels without reading the header again.
+    this.inputHeaders = new Map();
+    this.jobs = [];
+    this.nextJob = 0;
+    this.jobQueue = null;
+    // Paths with a result so far, while a native queue run is going.
+    this.reportedFiles = null;
+    this.drainWaiters = new Map();
+    this.pendingJobs = new Map();
+    this.nextJobId = 0;
     this.isProcessing = false;
   }
 
   async initialize() {
-    console.log(`Initializing ${this.workerCount} worker threads...`);
+    // The cache lives in the addon and is shared by every thread of the
+    // process, so configuring it here covers all the workers.
+    if (this.cache) {
+      if (!imageProcessor || !imageProcessor.configureCache) {
+        throw new Error("The result cache needs the C++ addon");
+      }
+      imageProcessor.configureCache(this.cache);
+    }
+
+    if (this.pin !== "none" && imageProcessor && imageProcessor.numaNodes) {
+      this.nodes = imageProcessor.numaNodes();
+      const pinned = planAffinity(0, this.nodes, this.pin);
+      if (pinned && this.pin === "core") {
+        const cores = this.nodes.reduce((n, node) => n + node.cpus.length, 0);
+        this.log(`Pinning each worker to one of ${cores} cores`);
+      } else if (pinned) {
+        this.log(`Pinning each worker to one of ${this.nodes.length} nodes`);
+      }
+    }
+
+    this.log(`Initializing ${this.workerCount} worker threads...`);
 
     for (let i = 0; i < this.workerCount; i++) {
-      const worker = new Worker(path.join(__dirname, "worker.js"));
-      this.workers.push(worker);
+      this.spawnWorker();
+    }
+
+    this.log(`Worker threads initialized successfully`);
+  }
+
+  spawnWorker() {
+    this.workers.push(this.createWorker(this.workers.length));
+  }
+
+  createWorker(index) {
+    const worker = new Worker(path.join(__dirname, "worker.js"), {
+      workerData: {
+        maxWidth: this.maxWidth,
+        maxHeight: this.maxHeight,
+        threads: this.threadsPerImage,
+        filter: this.filter,
+        linear: this.linear,
+        directIO: this.directIO,
+        maxInputPixels: this.maxInputPixels,
+        engine: this.engine,
+        affinity: planAffinity(index, this.nodes, this.pin),
+      },
+    });
+    worker.on("message", (result) => this.handleWorkerMessage(index, result));
+    worker.on("error", (error) => this.failWorkerJobs(index, error));
+    // Retired workers are out of the pool before they are terminated, so
+    // only a crash finds itself still in its slot.
+    worker.on("exit", (code) => {
+      if (this.workers[index] !== worker) return;
+      this.failWorkerJobs(index, new Error(`Worker exited with code ${code}`));
+      this.replaceWorker(index);
+    });
+    return worker;
+  }
+
+  // Puts a fresh worker in the slot of one that died, so later runs never
+  // post to a dead thread. A ring worker is handed the ring again.
+  replaceWorker(index) {
+    console.error(`Worker ${index} died, starting a replacement`);
+    const worker = this.createWorker(index);
+    this.workers[index] = worker;
+    if (this.ring) {
+      worker.postMessage({
+        ring: this.ring.buffer,
+        concurrency: this.jobsPerWorker,
+      });
+    }
+  }
+
+  // Workers a run of jobCount jobs can keep busy, within the pool's bounds.
+  targetWorkerCount(jobCount) {
+    const busy = Math.ceil(jobCount / this.jobsPerWorker);
+    return Math.min(this.maxWorkers, Math.max(this.minWorkers, busy));
+  }
+
+  // Grows or shrinks the pool to count workers. Shrinking retires the
+  // newest workers, so it is only done between runs, when none has a job.
+  async scaleTo(count) {
+    while (this.workers.length < count) {
+      this.spawnWorker();
+    }
+    const retired = [];
+    while (this.workers.length > count) {
+      retired.push(this.workers.pop().terminate());
     }
+    this.workerCount = this.workers.length;
+    await Promise.all(retired);
+  }
 
-    console.log(`Worker threads initialized successfully`);
+  scheduleScaleDown() {
+    clearTimeout(this.idleTimer);
+    this.idleTimer = setTimeout(() => {
+      if (!this.isProcessing && !this.ring) this.scaleTo(this.minWorkers);
+    }, this.idleWorkerMs);
+    this.idleTimer.unref();
   }
 
-  async processImageQueue(imageFiles, outputDir) {
+  // fileSizes, when given, maps paths to byte sizes already known from the
+  // directory listing, so batching small files needs no stat calls.
+  async processImageQueue(imageFiles, outputDir, fileSizes) {
+    if (fileSizes) this.fileSizes = fileSizes;
     this.totalJobs = imageFiles.length;
     this.startTime = Date.now();
     this.isProcessing = true;
 
-    console.log(
-      `Processing ${this.totalJobs} images with ${this.workerCount} workers...`
-    );
+    this.jobs = await this.planJobs(imageFiles);
+    this.nextJob = 0;
 
-    this.pendingQueue = [...imageFiles];
+    // Workers serving the slot ring are never retired, so library mode
+    // keeps its pool.
+    if (this.autoscale && !this.ring) {
+      clearTimeout(this.idleTimer);
+      const target = this.targetWorkerCount(this.jobs.length);
+      if (target !== this.workers.length) {
+        this.log(`Scaling to ${target} workers for ${this.jobs.length} jobs`);
+        await this.scaleTo(target);
+      }
+    }
 
-    const workerPromises = this.workers.map((worker, index) =>
-      this.processWorkerQueue(worker, index, outputDir)
+    this.log(
+      `Processing ${this.totalJobs} images with ${this.workerCount} workers ` +
+        `(${this.jobsPerWorker} in flight each)...`
     );
 
-    await Promise.all(workerPromises);
+    if (this.native && this.native.JobQueue) {
+      await this.runScheduledQueue(outputDir);
+    } else {
+      // Keeping more than one job in flight per worker lets a worker read
+      // and decode the next image while the addon processes the current one.
+      const workerPromises = this.workers.flatMap((worker, index) =>
+        Array.from({ length: this.jobsPerWorker }, () =>
+          this.processWorkerQueue(worker, index, outputDir)
+        )
+      );
+      await Promise.all(workerPromises);
+    }
 
     this.isProcessing = false;
+    if (this.autoscale) this.scheduleScaleDown();
     return this.processedImages;
   }
 
-  async processWorkerQueue(worker, workerIndex, outputDir) {
-    while (this.pendingQueue.length > 0) {
-      const imageFile = this.pendingQueue.shift();
-      if (!imageFile) break;
+  // Every worker gets the job list once and then pulls job indices from the
+  // addon's work-stealing queue itself, so the main thread only hears about
+  // completions, a batch at a time, and never sits between two jobs.
+  async runScheduledQueue(outputDir) {
+    // The native queue lives as long as a handle to it does, so the main
+    // thread holds one until every worker has drained it.
+    const queue = new this.native.JobQueue(
+      this.jobs.length,
+      this.workers.length,
+      { ordered: this.order === "size" }
+    );
+    this.jobQueue = queue;
+    const reported = new Set();
+    this.reportedFiles = reported;
+
+    await Promise.all(
+      this.workers.map(
+        (worker, workerIndex) =>
+          new Promise((resolve) => {
+            this.drainWaiters.set(workerIndex, resolve);
+            worker.postMessage({
+              run: {
+                queueId: queue.id,
+                workerIndex,
+                jobs: this.jobs,
+                headers: Object.fromEntries(this.inputHeaders),
+                outputDir,
+                concurrency: this.jobsPerWorker,
+              },
+            });
+          })
+      )
+    );
+    this.jobQueue = null;
+    this.reportedFiles = null;
+
+    // Jobs a worker had taken from the queue when it died get no result from
+    // it; they are failed here so every file is counted once.
+    const lost = this.jobs.flat().filter((file) => !reported.has(file));
+    if (lost.length > 0) {
+      this.recordResults(
+        lost.map((inputPath) => ({
+          success: false,
+          inputPath,
+          filename: path.basename(inputPath),
+          error: "Worker died before finishing it",
+        }))
+      );
+    }
+  }
 
+  async processWorkerQueue(worker, workerIndex, outputDir) {
+    while (this.nextJob < this.jobs.length) {
+      const batch = this.jobs[this.nextJob++];
+      const imageFile = batch[0];
       try {
-        await this.processImageWithWorker(
+        if (batch.length > 1) {
+          await this.processBatchWithWorker(
+            worker,
+            workerIndex,
+            batch,
+            outputDir
+          );
+        } else {
+          await this.processImageWithWorker(
+            worker,
+            workerIndex,
+            imageFile,
+            outputDir
+          );
+        }
+      } catch (error) {
+        console.error(`Error processing ${imageFile}:`, error.message);
+      }
+    }
+  }
+
+  // Turns the file list into jobs of one large file or a run of small ones,
+  // largest first unless the order is "listing".
+  async planJobs(imageFiles) {
+    if (this.order !== "size") return this.groupJobs(imageFiles);
+    await this.loadFileSizes(imageFiles);
+    await this.probeLargeFiles(imageFiles);
+    const largestFirst = this.sortByCost(imageFiles.map((file) => [file]));
+    return this.sortByCost(this.groupJobs(largestFirst.flat()));
+  }
+
+  // Starts a run whose jobs arrive one at a time, from a directory stream or
+  // a cluster coordinator. Results are counted, not kept, and an autoscaled
+  // pool runs at maxWorkers, since the job count is unknown.
+  async startOpenRun() {
+    if (this.autoscale && !this.ring) {
+      clearTimeout(this.idleTimer);
+      await this.scaleTo(this.maxWorkers);
+    }
+    this.retainResults = false;
+    this.totalJobs = null;
+    this.startTime = Date.now();
+    this.isProcessing = true;
+  }
+
+  finishOpenRun() {
+    this.isProcessing = false;
+    if (this.autoscale) this.scheduleScaleDown();
+  }
+
+  // Runs one job, a file or a batch, on the worker serving `slot`, and
+  // resolves to a result per file. Failures, the job's own included,
+  // resolve as { success: false, error } results too.
+  async runJob(files, outputDir, slot) {
+    const workerIndex = slot % this.workers.length;
+    const worker = this.workers[workerIndex];
+    try {
+      if (files.length > 1) {
+        return await this.processBatchWithWorker(
           worker,
           workerIndex,
-          imageFile,
+          files,
           outputDir
         );
-      } catch (error) {
-        console.error(`Error processing ${imageFile}:`, error.message);
       }
+      return [
+        await this.processImageWithWorker(
+          worker,
+          workerIndex,
+          files[0],
+          outputDir
+        ),
+      ];
+    } catch (error) {
+      return files.map((inputPath) => ({
+        success: false,
+        inputPath,
+        error: error.message,
+      }));
+    }
+  }
+
+  // Streaming counterpart of getImageFiles plus processImageQueue, for
+  // directories too big to list. Entries are read with fs.opendir only as
+  // jobs finish, so at most `window` jobs (default: jobsPerWorker per
+  // worker) are in flight, and each result is appended to the NDJSON
+  // `manifest` file, if given, instead of being kept. Memory therefore stays
+  // flat however many files there are. Files are not batched or sorted, as
+  // that needs the whole listing. An autoscaled pool grows to maxWorkers.
+  // Resolves to { completed, succeeded }.
+  async processDirectoryStream(sourceDir, outputDir, options = {}) {
+    await this.startOpenRun();
+    const window = options.window || this.workers.length * this.jobsPerWorker;
+    const manifest = options.manifest
+      ? new ManifestWriter(options.manifest)
+      : null;
+
+    this.log(
+      `Streaming ${sourceDir} with ${this.workers.length} workers ` +
+        `(${window} jobs in flight)...`
+    );
+
+    // Dir reads must not overlap, so the consumers take turns.
+    const entries = (await fs.promises.opendir(sourceDir))[
+      Symbol.asyncIterator
+    ]();
+    let reading = Promise.resolve();
+    const nextFile = () =>
+      (reading = reading.then(async () => {
+        for (;;) {
+          const { value: entry, done } = await entries.next();
+          if (done) return null;
+          const ext = path.extname(entry.name).toLowerCase();
+          if (
+            (entry.isFile() || entry.isSymbolicLink()) &&
+            SUPPORTED_EXTENSIONS.includes(ext)
+          ) {
+            return path.join(sourceDir, entry.name);
+          }
+        }
+      }));
+
+    const consume = async (slot) => {
+      const workerIndex = slot % this.workers.length;
+      for (let file = await nextFile(); file; file = await nextFile()) {
+        let record;
+        try {
+          const result = await this.processImageWithWorker(
+            this.workers[workerIndex],
+            workerIndex,
+            file,
+            outputDir
+          );
+          record = {
+            input: file,
+            output: result.outputPath,
+            success: true,
+            inputSize: result.inputSize,
+            outputSize: result.outputSize,
+            durationMs: result.durationMs,
+          };
+        } catch (error) {
+          console.error(`Error processing ${file}:`, error.message);
+          record = { input: file, success: false, error: error.message };
+        }
+        if (manifest) await manifest.write(record);
+      }
+    };
+
+    try {
+      await Promise.all(Array.from({ length: window }, (_, i) => consume(i)));
+    } finally {
+      this.finishOpenRun();
+      if (manifest) await manifest.close();
+    }
+    return { completed: this.completedJobs, succeeded: this.succeededJobs };
+  }
+
+  // Small files cost more in per-job overhead than in pixel work, so runs of
+  // consecutive small files become one job of up to batchSize files.
+  groupJobs(imageFiles) {
+    const jobs = [];
+    let batch = null;
+    for (const imageFile of imageFiles) {
+      if (this.batchSize <= 1 || !this.isSmallImage(imageFile)) {
+        jobs.push([imageFile]);
+        batch = null;
+        continue;
+      }
+      if (!batch || batch.length >= this.batchSize) {
+        batch = [];
+        jobs.push(batch);
+      }
+      batch.push(imageFile);
+    }
+    return jobs;
+  }
+
+  // Longest processing time first: with the biggest jobs started first, the
+  // tail of a run is made of small jobs that spread evenly over the workers,
+  // instead of one huge image that keeps a single worker busy at the end.
+  sortByCost(jobs) {
+    return jobs
+      .map((job) => ({ job, cost: this.estimateCost(job) }))
+      .sort((a, b) => b.cost - a.cost)
+      .map(({ job }) => job);
+  }
+
+  estimateCost(job) {
+    return job.reduce((cost, file) => {
+      const pixels = this.decodedPixels.get(file);
+      const work =
+        pixels !== undefined
+          ? pixels * BYTES_PER_DECODED_PIXEL
+          : this.fileSizes.get(file) || 0;
+      return cost + work + FILE_COST_BYTES;
+    }, 0);
+  }
+
+  // Reads the header of every file too big to be batched. Compressed size
+  // says little about a PNG's or a high-quality JPEG's pixel count, and
+  // shrink-on-load makes a large JPEG far cheaper than its size suggests.
+  // Formats the addon doesn't probe keep their byte cost. The headers are
+  // read on the libuv pool in one probeFiles call, off the event loop.
+  async probeLargeFiles(imageFiles) {
+    if (!this.native || !this.native.probeFiles) return;
+    const large = imageFiles.filter(
+      (file) => !this.decodedPixels.has(file) && !this.isSmallImage(file)
+    );
+    if (large.length === 0) return;
+    const headers = await this.native.probeFiles(
+      large,
+      this.maxWidth,
+      this.maxHeight
+    );
+    headers.forEach((header, index) => {
+      // Errors are left to the byte estimate, and to the worker to report.
+      if (header instanceof Error) return;
+      const file = large[index];
+      this.decodedPixels.set(file, header.decodeWidth * header.decodeHeight);
+      this.inputHeaders.set(file, {
+        width: header.width,
+        height: header.height,
+      });
+    });
+  }
+
+  // Stats the files the directory listing gave no size for, a few at a time.
+  async loadFileSizes(imageFiles) {
+    const missing = imageFiles.filter((file) => !this.fileSizes.has(file));
+    for (let i = 0; i < missing.length; i += 64) {
+      await Promise.all(
+        missing.slice(i, i + 64).map(async (file) => {
+          try {
+            this.fileSizes.set(file, (await fs.promises.stat(file)).size);
+          } catch (error) {
+            this.fileSizes.set(file, 0);
+          }
+        })
+      );
+    }
+  }
+
+  isSmallImage(imageFile) {
+    const size = this.fileSizes.get(imageFile);
+    if (size !== undefined) return size < this.smallImageBytes;
+    try {
+      return fs.statSync(imageFile).size < this.smallImageBytes;
+    } catch (error) {
+      return false;
     }
   }
 
   async processImageWithWorker(worker, workerIndex, imageFile, outputDir) {
+    return this.dispatchJob(
+      worker,
+      workerIndex,
+      {
+        inputPath: imageFile,
+        outputPath: path.join(outputDir, path.basename(imageFile)),
+        header: this.inputHeaders.get(imageFile),
+      },
+      imageFile,
+      this.jobTimeout([imageFile])
+    );
+  }
+
+  async processBatchWithWorker(worker, workerIndex, imageFiles, outputDir) {
+    return this.dispatchJob(
+      worker,
+      workerIndex,
+      {
+        batch: imageFiles.map((imageFile) => ({
+          inputPath: imageFile,
+          outputPath: path.join(outputDir, path.basename(imageFile)),
+          filename: path.basename(imageFile),
+          header: this.inputHeaders.get(imageFile),
+        })),
+      },
+      `${imageFiles.length} images starting at ${imageFiles[0]}`,
+      this.jobTimeout(imageFiles)
+    );
+  }
+
+  jobTimeout(imageFiles) {
+    const bytes = imageFiles.reduce(
+      (total, file) => total + (this.fileSizes.get(file) || 0),
+      0
+    );
+    return BASE_TIMEOUT_MS + Math.round(bytes / 1024);
+  }
+
+  dispatchJob(worker, workerIndex, message, description, timeoutMs) {
     return new Promise((resolve, reject) => {
       this.activeJobs++;
 
-      const imageData = {
-        inputPath: imageFile,
-        outputPath: path.join(outputDir, path.basename(imageFile)),
-        workerIndex,
-      };
+      const jobId = this.nextJobId++;
+      const imageData = { ...message, jobId, workerIndex };
 
       const timeout = setTimeout(() => {
+        this.pendingJobs.delete(jobId);
+        this.activeJobs--;
         reject(
-          new Error(`Worker ${workerIndex} timeout processing ${imageFile}`)
+          new Error(`Worker ${workerIndex} timeout processing ${description}`)
         );
-      }, 30000);
+      }, timeoutMs);
 
-      const messageHandler = (result) => {
-        clearTimeout(timeout);
-        worker.off("message", messageHandler);
-        worker.off("error", errorHandler);
+      const files = message.batch ? message.batch.length : 1;
+      this.pendingJobs.set(jobId, {
+        workerIndex,
+        files,
+        resolve,
+        reject,
+        timeout,
+      });
+      worker.postMessage(imageData);
+    });
+  }
 
-        this.activeJobs--;
-        this.completedJobs++;
+  handleWorkerMessage(workerIndex, result) {
+    if (result.completed) {
+      this.recordResults(result.completed);
+      return;
+    }
+    if (result.drained) {
+      this.finishWorker(workerIndex);
+      return;
+    }
 
-        if (result.success) {
-          this.processedImages.push(result.outputPath);
-          this.logProgress();
-          resolve(result);
-        } else {
-          reject(new Error(result.error));
-        }
-      };
+    const job = this.pendingJobs.get(result.jobId);
+    if (!job) {
+      if (result.jobId === undefined && !result.success) {
+        this.failWorkerJobs(workerIndex, new Error(result.error));
+      }
+      return;
+    }
 
-      const errorHandler = (error) => {
-        clearTimeout(timeout);
-        worker.off("message", messageHandler);
-        worker.off("error", errorHandler);
+    clearTimeout(job.timeout);
+    this.pendingJobs.delete(result.jobId);
 
-        this.activeJobs--;
-        reject(error);
-      };
+    this.activeJobs--;
 
-      worker.on("message", messageHandler);
-      worker.on("error", errorHandler);
-      worker.postMessage(imageData);
-    });
+    if (result.results) {
+      this.recordResults(result.results);
+      job.resolve(result.results);
+      return;
+    }
+
+    this.completedJobs++;
+
+    if (result.success) {
+      this.recordSuccess(result);
+      this.logProgress();
+      job.resolve(result);
+    } else {
+      job.reject(new Error(result.error));
+    }
+  }
+
+  recordResults(results) {
+    for (const item of results) {
+      this.completedJobs++;
+      if (this.reportedFiles) this.reportedFiles.add(item.inputPath);
+      if (item.success) {
+        this.recordSuccess(item);
+      } else {
+        console.error(`Error processing ${item.inputPath}:`, item.error);
+      }
+    }
+    this.logProgress();
+  }
+
+  recordSuccess(result) {
+    this.succeededJobs++;
+    if (!this.retainResults) return;
+    this.processedImages.push(result.outputPath);
+    this.recordLatency(result);
+  }
+
+  // Workers time each job they run; every image of a batch gets the time of
+  // the whole batch, since that is when its output is done.
+  recordLatency(result) {
+    if (result.durationMs !== undefined) this.latencies.push(result.durationMs);
+  }
+
+  finishWorker(workerIndex) {
+    const resolve = this.drainWaiters.get(workerIndex);
+    if (resolve) {
+      this.drainWaiters.delete(workerIndex);
+      resolve();
+    }
+  }
+
+  failWorkerJobs(workerIndex, error) {
+    // A worker that dies while draining the native queue has lost the jobs
+    // it was in the middle of; the others steal whatever it had not begun.
+    if (this.drainWaiters.has(workerIndex)) {
+      console.error(`Worker ${workerIndex} failed:`, error.message);
+      this.finishWorker(workerIndex);
+    }
+
+    for (const [jobId, job] of this.pendingJobs) {
+      if (job.workerIndex !== workerIndex) continue;
+
+      clearTimeout(job.timeout);
+      this.pendingJobs.delete(jobId);
+
+      // Counted as failed like a job the worker reported failing, so the
+      // progress totals still add up.
+      this.activeJobs--;
+      this.completedJobs += job.files;
+      job.reject(error);
+    }
   }
 
   logProgress() {
     const elapsed = Date.now() - this.startTime;
     const rate = this.completedJobs / (elapsed / 1000);
+    if (this.totalJobs === null) {
+      this.log(
+        `Progress: ${this.completedJobs} done | ` +
+          `Rate: ${rate.toFixed(1)} img/s | ` +
+          `Active: ${this.activeJobs}`
+      );
+      return;
+    }
     const remaining = this.totalJobs - this.completedJobs;
     const eta = remaining / rate;
 
-    console.log(
+    this.log(
       `Progress: ${this.completedJobs}/${this.totalJobs} (${(
         (this.completedJobs / this.totalJobs) *
         100
@@ -134,46 +754,197 @@ class ImageProcessor {
     );
   }
 
+  log(...args) {
+    if (!this.quiet) console.log(...args);
+  }
+
+  // Hit and miss counts of the result cache, or null when it is off.
+  cacheStats() {
+    if (!this.cache) return null;
+    const stats = imageProcessor.cacheStats();
+    const hits = stats.memoryHits + stats.diskHits;
+    const lookups = hits + stats.misses;
+    return { ...stats, hits, hitRate: lookups > 0 ? hits / lookups : 0 };
+  }
+
+  // Per-stage timings, byte counts and allocation counts from the addon,
+  // covering every worker, or null without it.
+  stats() {
+    return imageProcessor && imageProcessor.getStats
+      ? imageProcessor.getStats()
+      : null;
+  }
+
+  // The same counters in Prometheus text format, plus the image totals.
+  metrics() {
+    return formatMetrics(this.stats(), {
+      completed: this.completedJobs,
+      succeeded: this.succeededJobs,
+    });
+  }
+
+  // Library mode: resizes an image held in memory on the worker pool and
+  // resolves to the output Buffer. The input is copied into a shared slot
+  // and the output out of it; use acquireSlot() to avoid both copies.
+  async process(buffer) {
+    if (buffer.length > this.maxInputBytes) {
+      throw new RangeError(
+        `Input of ${buffer.length} bytes exceeds maxInputBytes`
+      );
+    }
+
+    const slot = await this.acquireSlot();
+    try {
+      buffer.copy(slot.input);
+      return Buffer.from(await slot.process(buffer.length));
+    } finally {
+      slot.release();
+    }
+  }
+
+  // Checks out one slot of the shared slab, waiting for one to free up if
+  // all are in use. Write the image into slot.input, then await
+  // slot.process(length) for a view of the output, which stays valid until
+  // slot.release(). The addon reads and writes the slot in place.
+  async acquireSlot() {
+    if (!this.ring) this.createRing();
+
+    const index =
+      this.freeSlots.length > 0
+        ? this.freeSlots.pop()
+        : await new Promise((resolve) => this.slotWaiters.push(resolve));
+
+    let released = false;
+    return {
+      input: this.ring.input(index),
+      process: (length) => this.runSlot(index, length),
+      release: () => {
+        if (released) return;
+        released = true;
+        const waiter = this.slotWaiters.shift();
+        if (waiter) waiter(index);
+        else this.freeSlots.push(index);
+      },
+    };
+  }
+
+  // The ring is created on first use, so runs over a directory never pay
+  // for the slab.
+  createRing() {
+    if (!imageProcessor || !imageProcessor.processImageIntoAsync) {
+      throw new Error("In-memory processing needs the C++ addon");
+    }
+    if (this.workers.length === 0) {
+      throw new Error("Call initialize() before process()");
+    }
+
+    const outputOptions = { format: "jpeg" };
+    const slots = this.workers.length * this.jobsPerWorker;
+    this.ring = new SharedFrameRing({
+      slots,
+      inputBytes: this.maxInputBytes,
+      outputBytes: imageProcessor.computeOutputSize(
+        this.maxWidth,
+        this.maxHeight,
+        this.maxWidth,
+        this.maxHeight,
+        outputOptions
+      ).byteLength,
+    });
+    this.freeSlots = Array.from({ length: slots }, (_, i) => slots - 1 - i);
+    for (const worker of this.workers) {
+      worker.postMessage({
+        ring: this.ring.buffer,
+        concurrency: this.jobsPerWorker,
+      });
+    }
+  }
+
+  runSlot(index, length) {
+    return new Promise((resolve, reject) => {
+      this.slotJobs.set(index, { resolve, reject });
+      this.ring.submit(index, length);
+      this.watchSlots();
+    });
+  }
+
+  // Settles slot jobs as workers finish them. Atomics.waitAsync does not
+  // keep the event loop alive by itself, so a timer does while jobs are out.
+  async watchSlots() {
+    if (this.watchingSlots) return;
+    this.watchingSlots = true;
+    const keepAlive = setInterval(() => {}, 1 << 30);
+
+    try {
+      while (this.slotJobs.size > 0) {
+        const seen = this.ring.completions();
+        for (const [index, job] of this.slotJobs) {
+          const result = this.ring.result(index);
+          if (!result) continue;
+          this.slotJobs.delete(index);
+          if (result.error) job.reject(result.error);
+          else job.resolve(result.output);
+        }
+        if (this.slotJobs.size > 0) {
+          await this.ring.waitForCompletion(seen);
+        }
+      }
+    } finally {
+      clearInterval(keepAlive);
+      this.watchingSlots = false;
+    }
+  }
+
   async cleanup() {
-    console.log("Cleaning up worker threads...");
+    clearTimeout(this.idleTimer);
+    if (this.ring) this.ring.stop();
+    this.log("Cleaning up worker threads...");
+    // Emptied first, so the exits below are not taken for crashes.
+    const workers = this.workers;
+    this.workers = [];
     await Promise.all(
-      this.workers.map(
+      workers.map(
         (worker) =>
           new Promise((resolve) => {
             worker.terminate().then(() => resolve());
           })
       )
     );
-    console.log("Cleanup completed");
+    this.log("Cleanup completed");
   }
 }
 
-function getImageFiles(sourceDir) {
-  const supportedExtensions = [
-    ".jpg",
-    ".jpeg",
-    ".png",
-    ".bmp",
-    ".tiff",
-    ".webp",
-  ];
-
+// Lists the supported images in sourceDir with their sizes. The addon lists
+// and stats the whole directory in one batch; without it, readdir is used
+// and sizes are looked up later as needed.
+async function getImageFiles(sourceDir) {
   console.log(`Scanning directory: ${sourceDir}`);
 
   if (!fs.existsSync(sourceDir)) {
     throw new Error(`Source directory does not exist: ${sourceDir}`);
   }
 
-  const files = fs.readdirSync(sourceDir);
+  const fileSizes = new Map();
+  let files;
+  if (imageProcessor && imageProcessor.listDirectory) {
+    const entries = await imageProcessor.listDirectory(sourceDir);
+    files = entries.map((entry) => {
+      fileSizes.set(path.join(sourceDir, entry.name), entry.size);
+      return entry.name;
+    });
+  } else {
+    files = await fs.promises.readdir(sourceDir);
+  }
+
   const imageFiles = files
     .filter((file) => {
       const ext = path.extname(file).toLowerCase();
-      return supportedExtensions.includes(ext);
+      return SUPPORTED_EXTENSIONS.includes(ext);
     })
     .map((file) => path.join(sourceDir, file));
 
   console.log(`Found ${imageFiles.length} supported image files`);
-  return imageFiles;
+  return { imageFiles, fileSizes };
 }
 
 async function ensureOutputDir(outputDir) {
@@ -188,39 +959,292 @@ async function run() {
     .option("source", {
       alias: "s",
       type: "string",
-      demandOption: true,
       description: "Source directory containing images",
     })
     .option("output", {
       alias: "o",
       type: "string",
-      demandOption: true,
       description: "Output directory for processed images",
     })
     .option("workers", {
       alias: "w",
+      type: "string",
+      default: "4",
+      description: "Number of worker threads, or auto to scale with the queue",
+      coerce: (value) => {
+        if (value === "auto") return value;
+        const count = Number(value);
+        if (!Number.isInteger(count) || count < 1) {
+          throw new Error("--workers must be a positive integer or auto");
+        }
+        return count;
+      },
+    })
+    .option("max-workers", {
+      type: "number",
+      description: "Upper bound for --workers auto (default: available CPUs)",
+    })
+    .option("pin", {
+      type: "string",
+      choices: PIN_MODES,
+      default: "auto",
+      description:
+        "Pin each worker to a core or NUMA node (auto: by node on NUMA hosts)",
+    })
+    .option("jobs-per-worker", {
+      type: "number",
+      default: 2,
+      description: "Images kept in flight per worker thread",
+    })
+    .option("batch-size", {
+      type: "number",
+      default: 16,
+      description: "Small images (under 64 KB) sent to a worker at once",
+    })
+    .option("threads", {
+      type: "number",
+      default: 0,
+      description:
+        "Threads the addon may use for one large image (0 = all cores)",
+    })
+    .option("filter", {
+      type: "string",
+      choices: ["bilinear", "box", "lanczos3"],
+      default: "bilinear",
+      description: "Resampling filter used by the addon",
+    })
+    .option("linear", {
+      type: "boolean",
+      default: false,
+      description: "Resize in linear light, keeping 16-bit input at depth",
+    })
+    .option("stream", {
+      type: "boolean",
+      default: false,
+      description: "Read the source directory as it goes, for huge trees",
+    })
+    .option("manifest", {
+      type: "string",
+      description: "With --stream, write per-image results here as NDJSON",
+    })
+    .option("window", {
+      type: "number",
+      description: "With --stream, jobs in flight (default: workers x jobs)",
+    })
+    .option("coordinate", {
+      type: "number",
+      description: "Lease the source's jobs to --join nodes on this TCP port",
+    })
+    .option("join", {
+      type: "string",
+      description: "Process jobs for the coordinator at HOST:PORT",
+    })
+    .option("host", {
+      type: "string",
+      default: "127.0.0.1",
+      description: "With --coordinate, the address to listen on",
+    })
+    .option("token", {
+      type: "string",
+      description:
+        "Shared secret nodes must present (default: $CLUSTER_TOKEN, or none)",
+    })
+    .option("node-name", {
+      type: "string",
+      description: "With --join, the name that picks this node's shard",
+    })
+    .option("lease-ms", {
+      type: "number",
+      default: 10000,
+      description: "With --coordinate, drop nodes silent for this long",
+    })
+    .option("order", {
+      type: "string",
+      choices: ["size", "listing"],
+      default: "size",
+      description:
+        "Job order: largest first, or as listed in the source directory",
+    })
+    .option("cache-dir", {
+      type: "string",
+      description: "Directory of cached outputs, shared between runs",
+    })
+    .option("cache-memory", {
+      type: "number",
+      default: 0,
+      description: "Megabytes of recent outputs cached in memory",
+    })
+    .option("direct-io", {
+      type: "boolean",
+      default: false,
+      description: "Write outputs with O_DIRECT, bypassing the page cache",
+    })
+    .option("max-input-pixels", {
+      type: "number",
+      default: 0,
+      description: "Reject inputs of more pixels than this (0 = no limit)",
+    })
+    .option("metrics-port", {
+      type: "number",
+      description: "Serve Prometheus metrics at /metrics on this port",
+    })
+    .option("stats", {
+      type: "boolean",
+      default: false,
+      description: "Print the time spent in each stage when done",
+    })
+    .option("engine", {
+      type: "string",
+      choices: ["addon", "sharp"],
+      default: "addon",
+      description: "Process with the C++ addon, or with sharp alone",
+    })
+    .option("bench", {
+      type: "boolean",
+      default: false,
+      description: "Benchmark the pipeline on a synthetic corpus",
+    })
+    .option("bench-images", {
       type: "number",
-      default: 4,
-      description: "Number of worker threads",
+      default: 200,
+      description: "Images in the benchmark corpus",
+    })
+    .option("bench-mix", {
+      type: "string",
+      default: "640x480:60,1920x1080:30,4000x3000:10",
+      description: "Corpus sizes and their weights, WIDTHxHEIGHT:WEIGHT,...",
+    })
+    .option("bench-workers", {
+      type: "string",
+      default: "1,2,4",
+      description: "Worker counts to sweep, comma-separated",
+    })
+    .option("bench-batch-sizes", {
+      type: "string",
+      default: "1,16",
+      description: "Batch sizes to sweep, comma-separated",
+    })
+    .option("bench-engines", {
+      type: "string",
+      default: "addon,sharp",
+      description: "Engines to sweep, comma-separated",
+    })
+    .option("bench-dir", {
+      type: "string",
+      description: "Directory for the corpus, kept afterwards (default: temp)",
+    })
+    .option("bench-json", {
+      type: "string",
+      description: "Write the benchmark results to this JSON file",
+    })
+    .check((args) => {
+      if (args.bench || args.join || (args.source && args.output)) return true;
+      throw new Error("Missing required arguments: source, output");
     })
     .help().argv;
 
-  const sourceDir = path.resolve(argv.source);
-  const outputDir = path.resolve(argv.output);
+  if (argv.bench) {
+    const { runBench } = require("./bench");
+    await runBench({
+      images: argv.benchImages,
+      mix: argv.benchMix,
+      workers: argv.benchWorkers,
+      batchSizes: argv.benchBatchSizes,
+      engines: argv.benchEngines,
+      dir: argv.benchDir && path.resolve(argv.benchDir),
+      json: argv.benchJson,
+      pipeline: {
+        jobsPerWorker: argv.jobsPerWorker,
+        threadsPerImage: argv.threads,
+        filter: argv.filter,
+        linear: argv.linear,
+        order: argv.order,
+        pin: argv.pin,
+      },
+    });
+    return;
+  }
+
+  if (argv.coordinate !== undefined) {
+    await coordinate(argv);
+    return;
+  }
+
+  const sourceDir = argv.source && path.resolve(argv.source);
+  const outputDir = argv.output && path.resolve(argv.output);
   const workerCount = argv.workers;
 
   console.log("Image Processing Pipeline Starting");
-  console.log(`Source: ${sourceDir}`);
-  console.log(`Output: ${outputDir}`);
+  if (!argv.join) {
+    console.log(`Source: ${sourceDir}`);
+    console.log(`Output: ${outputDir}`);
+  }
   console.log(`Workers: ${workerCount}`);
 
-  const processor = new ImageProcessor(workerCount);
+  const processor = new ImageProcessor(workerCount, {
+    maxWorkers: argv.maxWorkers,
+    pin: argv.pin,
+    jobsPerWorker: argv.jobsPerWorker,
+    threadsPerImage: argv.threads,
+    filter: argv.filter,
+    linear: argv.linear,
+    directIO: argv.directIo,
+    maxInputPixels: argv.maxInputPixels,
+    batchSize: argv.batchSize,
+    order: argv.order,
+    engine: argv.engine,
+    cache:
+      argv.cacheDir || argv.cacheMemory > 0
+        ? {
+            directory: argv.cacheDir && path.resolve(argv.cacheDir),
+            memoryBytes: Math.round(argv.cacheMemory * 1024 * 1024),
+          }
+        : null,
+  });
+
+  const metricsServer =
+    argv.metricsPort !== undefined
+      ? serveMetrics(argv.metricsPort, () => processor.metrics())
+      : null;
 
   try {
     await processor.initialize();
+
+    if (argv.join) {
+      const [host, port] = splitAddress(argv.join);
+      console.log(`Joining the coordinator at ${host}:${port}`);
+      const { succeeded, completed } = await joinCluster(processor, {
+        host,
+        port,
+        name: argv.nodeName,
+        token: clusterToken(argv),
+      });
+      console.log(`\nProcessed: ${succeeded}/${completed} images`);
+      return;
+    }
+
     await ensureOutputDir(outputDir);
 
-    const imageFiles = getImageFiles(sourceDir);
+    if (argv.stream) {
+      const startTime = Date.now();
+      const { completed, succeeded } = await processor.processDirectoryStream(
+        sourceDir,
+        outputDir,
+        {
+          manifest: argv.manifest && path.resolve(argv.manifest),
+          window: argv.window,
+        }
+      );
+      const duration = (Date.now() - startTime) / 1000;
+      console.log("\nProcessing completed!");
+      console.log(`Processed: ${succeeded}/${completed} images`);
+      console.log(`Duration: ${duration.toFixed(2)}s`);
+      console.log(`Rate: ${(succeeded / duration).toFixed(2)} images/second`);
+      if (argv.manifest) console.log(`Manifest: ${argv.manifest}`);
+      return;
+    }
+
+    const { imageFiles, fileSizes } = await getImageFiles(sourceDir);
     if (imageFiles.length === 0) {
       console.log("No supported image files found");
       return;
@@ -229,7 +1253,8 @@ async function run() {
     const startTime = Date.now();
     const processedImages = await processor.processImageQueue(
       imageFiles,
-      outputDir
+      outputDir,
+      fileSizes
     );
     const endTime = Date.now();
 
@@ -242,14 +1267,96 @@ async function run() {
     );
     console.log(`Duration: ${duration.toFixed(2)}s`);
     console.log(`Rate: ${rate.toFixed(2)} images/second`);
+
+    const cache = processor.cacheStats();
+    if (cache) {
+      console.log(
+        `Cache: ${cache.hits}/${cache.hits + cache.misses} hits ` +
+          `(${(cache.hitRate * 100).toFixed(1)}%, ${cache.diskHits} from disk)`
+      );
+    }
+
+    const stats = argv.stats && processor.stats();
+    if (stats) printStageStats(stats);
   } catch (error) {
     console.error("Pipeline error:", error.message);
     process.exit(1);
   } finally {
+    if (metricsServer) metricsServer.close();
     await processor.cleanup();
   }
 }
 
+// Plans the source's jobs as a local run would, without starting any
+// workers, and waits while the --join nodes work through them.
+async function coordinate(argv) {
+  const sourceDir = path.resolve(argv.source);
+  const outputDir = path.resolve(argv.output);
+  const planner = new ImageProcessor(1, {
+    batchSize: argv.batchSize,
+    order: argv.order,
+    engine: argv.engine,
+  });
+
+  await ensureOutputDir(outputDir);
+  const { imageFiles, fileSizes } = await getImageFiles(sourceDir);
+  planner.fileSizes = fileSizes;
+  const jobs = await planner.planJobs(imageFiles);
+
+  const coordinator = new Coordinator(jobs, outputDir, {
+    leaseMs: argv.leaseMs,
+    manifest: argv.manifest && path.resolve(argv.manifest),
+    token: clusterToken(argv),
+  });
+  const port = await coordinator.listen(argv.coordinate, argv.host);
+  console.log(
+    `Leasing ${jobs.length} jobs to nodes joining on ${argv.host}:${port}`
+  );
+
+  const startTime = Date.now();
+  const { completed, succeeded, nodes } = await coordinator.run();
+  const duration = (Date.now() - startTime) / 1000;
+  console.log("\nProcessing completed!");
+  console.log(`Processed: ${succeeded}/${completed} images`);
+  console.log(`Duration: ${duration.toFixed(2)}s`);
+  console.log(`Rate: ${(succeeded / duration).toFixed(2)} images/second`);
+  for (const node of nodes) {
+    console.log(`   ${node.name}: ${node.completed} jobs`);
+  }
+}
+
+// An environment variable keeps the secret out of the process list.
+function clusterToken(argv) {
+  return argv.token || process.env.CLUSTER_TOKEN || "";
+}
+
+function splitAddress(address) {
+  const colon = address.lastIndexOf(":");
+  const port = Number(address.slice(colon + 1));
+  if (colon < 0 || !Number.isInteger(port) || port <= 0) {
+    throw new Error(`--join needs HOST:PORT, got "${address}"`);
+  }
+  return [address.slice(0, colon) || "localhost", port];
+}
+
+function printStageStats(stats) {
+  console.log("\nStage          calls    total s   mean ms      MiB");
+  for (const [stage, counters] of Object.entries(stats.stages)) {
+    if (counters.count === 0) continue;
+    console.log(
+      stage.padEnd(12) +
+        String(counters.count).padStart(8) +
+        counters.seconds.toFixed(2).padStart(11) +
+        ((counters.seconds * 1000) / counters.count).toFixed(2).padStart(10) +
+        (counters.bytes / (1024 * 1024)).toFixed(1).padStart(9)
+    );
+  }
+  console.log(
+    `Scratch blocks: ${stats.scratch.heapAllocations} allocated, ` +
+      `${stats.scratch.reusedBlocks} reused`
+  );
+}
+
 if (require.main === module) {
   run().catch((error) => {
     console.error("Fatal error:", error);
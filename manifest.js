@@ -0,0 +1,36 @@
+// Append-only NDJSON log of per-image results, one JSON object per line, so
+// a streaming run can report every file without holding the list.
+
+const fs = require("fs");
+const { once } = require("events");
+
+class ManifestWriter {
+  constructor(file) {
+    this.stream = fs.createWriteStream(file);
+    this.error = null;
+    this.stream.on("error", (error) => {
+      this.error = error;
+    });
+  }
+
+  // Resolves once the line is buffered. When the buffer is full it waits for
+  // the file to catch up, which in turn holds back new jobs.
+  async write(record) {
+    if (this.error) throw this.error;
+    if (!this.stream.write(JSON.stringify(record) + "\n")) {
+      await once(this.stream, "drain");
+    }
+  }
+
+  close() {
+    return new Promise((resolve, reject) => {
+      if (this.error) {
+        reject(this.error);
+        return;
+      }
+      this.stream.end((error) => (error ? reject(error) : resolve()));
+    });
+  }
+}
+
+module.exports = { ManifestWriter };
@@ -0,0 +1,109 @@
+// Prometheus text exposition of the addon's getStats() counters, plus the
+// pipeline's own image counts. Everything is a running total since the
+// process started, as Prometheus expects of counters and histograms.
+
+const http = require("http");
+
+const PREFIX = "image_processor";
+
+function formatNumber(value) {
+  if (value === Infinity) return "+Inf";
+  return String(value);
+}
+
+// stats is the addon's getStats(); images is { completed, succeeded }.
+function formatMetrics(stats, images) {
+  const lines = [];
+  const family = (name, type, help) => {
+    lines.push(`# HELP ${PREFIX}_${name} ${help}`);
+    lines.push(`# TYPE ${PREFIX}_${name} ${type}`);
+  };
+
+  if (stats) {
+    const stages = Object.entries(stats.stages);
+
+    family("stage_seconds", "histogram", "Time spent per call of a stage.");
+    for (const [stage, counters] of stages) {
+      let cumulative = 0;
+      counters.histogram.forEach((count, i) => {
+        cumulative += count;
+        const le = formatNumber(stats.histogramBounds[i]);
+        lines.push(
+          `${PREFIX}_stage_seconds_bucket{stage="${stage}",le="${le}"} ` +
+            cumulative
+        );
+      });
+      lines.push(
+        `${PREFIX}_stage_seconds_sum{stage="${stage}"} ${counters.seconds}`
+      );
+      lines.push(
+        `${PREFIX}_stage_seconds_count{stage="${stage}"} ${counters.count}`
+      );
+    }
+
+    family("stage_bytes_total", "counter", "Bytes handled by each stage.");
+    for (const [stage, counters] of stages) {
+      lines.push(
+        `${PREFIX}_stage_bytes_total{stage="${stage}"} ${counters.bytes}`
+      );
+    }
+
+    family(
+      "scratch_heap_allocations_total",
+      "counter",
+      "Scratch blocks taken from the heap."
+    );
+    lines.push(
+      `${PREFIX}_scratch_heap_allocations_total ` +
+        stats.scratch.heapAllocations
+    );
+    family(
+      "scratch_reused_blocks_total",
+      "counter",
+      "Scratch blocks reused from a thread's pool."
+    );
+    lines.push(
+      `${PREFIX}_scratch_reused_blocks_total ${stats.scratch.reusedBlocks}`
+    );
+
+    family("cache_lookups_total", "counter", "Result cache lookups.");
+    for (const [result, count] of [
+      ["memory_hit", stats.cache.memoryHits],
+      ["disk_hit", stats.cache.diskHits],
+      ["miss", stats.cache.misses],
+    ]) {
+      lines.push(`${PREFIX}_cache_lookups_total{result="${result}"} ${count}`);
+    }
+  }
+
+  if (images) {
+    family("images_total", "counter", "Images finished, by outcome.");
+    lines.push(`${PREFIX}_images_total{result="success"} ${images.succeeded}`);
+    lines.push(
+      `${PREFIX}_images_total{result="failure"} ` +
+        (images.completed - images.succeeded)
+    );
+  }
+
+  return lines.join("\n") + "\n";
+}
+
+// Serves render() at /metrics until the returned server is closed. The
+// server does not keep the process alive by itself.
+function serveMetrics(port, render) {
+  const server = http.createServer((request, response) => {
+    if (request.url !== "/metrics") {
+      response.writeHead(404).end();
+      return;
+    }
+    response.writeHead(200, {
+      "Content-Type": "text/plain; version=0.0.4; charset=utf-8",
+    });
+    response.end(render());
+  });
+  server.listen(port);
+  server.unref();
+  return server;
+}
+
+module.exports = { formatMetrics, serveMetrics };
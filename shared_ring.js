@@ -0,0 +1,176 @@
+// Shared-memory transport between the main thread and the workers. One
+// SharedArrayBuffer holds a control block and a slab of fixed-size frame
+// slots. The main thread copies an image into a free slot and pushes the
+// slot's index onto a ring of job descriptors. A worker claims the index
+// with a compare-and-swap, has the addon read the input from the slot and
+// write the output straight back into it, then flags the slot done. No
+// message is posted and nothing is structured-cloned: both sides wait with
+// Atomics.waitAsync and wake each other with Atomics.notify.
+
+// Control block, in Int32 words: job ring head and tail, a completion
+// counter, a stop flag, then the ring itself. Every slot also has a header
+// of SLOT_WORDS words, and the slots' bytes follow.
+const HEAD = 0;
+const TAIL = 1;
+const DONE = 2;
+const STOP = 3;
+const RING = 4;
+
+const SLOT_WORDS = 4;
+const SLOT_STATE = 0;
+const SLOT_INPUT_LENGTH = 1;
+const SLOT_OUTPUT_LENGTH = 2;
+
+const FREE = 0;
+const QUEUED = 1;
+const SUCCEEDED = 2;
+const FAILED = 3;
+
+class SharedFrameRing {
+  // Main thread: new SharedFrameRing({ slots, inputBytes, outputBytes }).
+  // Workers: new SharedFrameRing(ring.buffer) on the buffer it shares.
+  constructor(options) {
+    if (options instanceof SharedArrayBuffer) {
+      this.buffer = options;
+      const header = new Int32Array(options, 0, 3);
+      [this.slots, this.inputBytes, this.outputBytes] = header;
+    } else {
+      this.slots = options.slots;
+      this.inputBytes = options.inputBytes;
+      this.outputBytes = options.outputBytes;
+    }
+
+    // The three sizes come first, so a worker can map the same layout.
+    const controlWords = 3 + RING + this.slots * (1 + SLOT_WORDS);
+    const controlBytes = Math.ceil((controlWords * 4) / 64) * 64;
+    this.slotBytes = this.inputBytes + this.outputBytes;
+    if (!this.buffer) {
+      this.buffer = new SharedArrayBuffer(
+        controlBytes + this.slots * this.slotBytes
+      );
+      new Int32Array(this.buffer, 0, 3).set([
+        this.slots,
+        this.inputBytes,
+        this.outputBytes,
+      ]);
+    }
+
+    this.control = new Int32Array(this.buffer, 12, RING + this.slots);
+    this.headers = new Int32Array(
+      this.buffer,
+      12 + (RING + this.slots) * 4,
+      this.slots * SLOT_WORDS
+    );
+    this.dataOffset = controlBytes;
+  }
+
+  input(slot, length = this.inputBytes) {
+    return Buffer.from(
+      this.buffer,
+      this.dataOffset + slot * this.slotBytes,
+      length
+    );
+  }
+
+  output(slot, length = this.outputBytes) {
+    return Buffer.from(
+      this.buffer,
+      this.dataOffset + slot * this.slotBytes + this.inputBytes,
+      length
+    );
+  }
+
+  inputLength(slot) {
+    return this.headers[slot * SLOT_WORDS + SLOT_INPUT_LENGTH];
+  }
+
+  // Main thread: queues a slot whose input holds `length` bytes. The ring
+  // has room for every slot, so it cannot overflow.
+  submit(slot, length) {
+    const header = slot * SLOT_WORDS;
+    this.headers[header + SLOT_INPUT_LENGTH] = length;
+    Atomics.store(this.headers, header + SLOT_STATE, QUEUED);
+
+    const tail = Atomics.load(this.control, TAIL);
+    Atomics.store(this.control, RING + ((tail >>> 0) % this.slots), slot);
+    Atomics.store(this.control, TAIL, (tail + 1) | 0);
+    Atomics.notify(this.control, TAIL, 1);
+  }
+
+  // Main thread: the slot's outcome once a worker is done with it, or null
+  // while it is still queued or running. The output view stays valid until
+  // the slot is submitted again.
+  result(slot) {
+    const header = slot * SLOT_WORDS;
+    const state = Atomics.load(this.headers, header + SLOT_STATE);
+    if (state !== SUCCEEDED && state !== FAILED) return null;
+
+    const output = this.output(slot, this.headers[header + SLOT_OUTPUT_LENGTH]);
+    Atomics.store(this.headers, header + SLOT_STATE, FREE);
+    if (state === FAILED) return { error: new Error(output.toString()) };
+    return { output };
+  }
+
+  completions() {
+    return Atomics.load(this.control, DONE);
+  }
+
+  // Resolves once the completion counter moves past `seen`.
+  async waitForCompletion(seen) {
+    const wait = Atomics.waitAsync(this.control, DONE, seen);
+    if (wait.async) await wait.value;
+  }
+
+  stop() {
+    Atomics.store(this.control, STOP, 1);
+    Atomics.notify(this.control, TAIL);
+  }
+
+  // Worker: claims the next queued slot, or returns -1 if there is none.
+  take() {
+    for (;;) {
+      const head = Atomics.load(this.control, HEAD);
+      if (head === Atomics.load(this.control, TAIL)) return -1;
+      const slot = Atomics.load(
+        this.control,
+        RING + ((head >>> 0) % this.slots)
+      );
+      if (
+        Atomics.compareExchange(this.control, HEAD, head, (head + 1) | 0) ===
+        head
+      ) {
+        return slot;
+      }
+    }
+  }
+
+  // Worker: resolves with the next slot to process, or -1 once stopped.
+  async next() {
+    for (;;) {
+      if (Atomics.load(this.control, STOP)) return -1;
+      const tail = Atomics.load(this.control, TAIL);
+      const slot = this.take();
+      if (slot >= 0) return slot;
+
+      const wait = Atomics.waitAsync(this.control, TAIL, tail);
+      if (wait.async) await wait.value;
+    }
+  }
+
+  // Worker: records `length` output bytes, or an error message written in
+  // place of the output, and wakes the main thread.
+  finish(slot, length, error) {
+    const header = slot * SLOT_WORDS;
+    let state = SUCCEEDED;
+    if (error) {
+      length = this.output(slot).write(error.message);
+      state = FAILED;
+    }
+    this.headers[header + SLOT_OUTPUT_LENGTH] = length;
+    Atomics.store(this.headers, header + SLOT_STATE, state);
+    Atomics.add(this.control, DONE, 1);
+    Atomics.notify(this.control, DONE);
+  }
+}
+
+module.exports = { SharedFrameRing };
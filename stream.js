@@ -0,0 +1,47 @@
+const { Transform } = require("stream");
+
+let imageProcessor = null;
+try {
+  imageProcessor = require("./build/Release/image_processor");
+} catch (error) {
+  imageProcessor = null;
+}
+
+const canStream = Boolean(imageProcessor && imageProcessor.ImageStream);
+
+// Resizes one image as it flows through: write a framed image, raw pixels
+// (with the `raw` option) or a baseline JPEG in chunks of any size, and read
+// the output frame or JPEG as it is produced. The addon keeps only the rows
+// the resize filter still needs, so memory stays flat however large the
+// input is. Options are the same as processImage's; `threads` is ignored.
+class ResizeStream extends Transform {
+  constructor(maxWidth, maxHeight, options = {}) {
+    super();
+    if (!canStream) {
+      throw new Error("Streaming needs the C++ addon");
+    }
+    this.image = new imageProcessor.ImageStream(maxWidth, maxHeight, options);
+  }
+
+  // Transform never overlaps _transform and _flush calls, which is what the
+  // native stream requires.
+  _transform(chunk, encoding, callback) {
+    this.image.write(chunk).then((output) => {
+      if (output.length > 0) this.push(output);
+      callback();
+    }, callback);
+  }
+
+  _flush(callback) {
+    this.image.end().then((output) => {
+      if (output.length > 0) this.push(output);
+      callback();
+    }, callback);
+  }
+}
+
+function createResizeStream(maxWidth, maxHeight, options) {
+  return new ResizeStream(maxWidth, maxHeight, options);
+}
+
+module.exports = { ResizeStream, createResizeStream, canStream };
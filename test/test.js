@@ -1,7 +1,35 @@
+const assert = require("assert");
+const { spawnSync } = require("child_process");
+const { once } = require("events");
 const fs = require("fs").promises;
+const net = require("net");
+const os = require("os");
 const path = require("path");
+const { Readable } = require("stream");
+const { Worker } = require("worker_threads");
 const sharp = require("sharp");
+const { planAffinity } = require("../affinity");
+const {
+  Coordinator,
+  HashRing,
+  MessageReader,
+  decodeResults,
+  encodeMessage,
+  encodeResults,
+  joinCluster,
+} = require("../cluster");
+const { assignSizes, parseSizeMix, percentile, runBench } = require("../bench");
 const { ImageProcessor } = require("../index");
+const { formatMetrics } = require("../metrics");
+const { createResizeStream } = require("../stream");
+
+function loadAddon() {
+  try {
+    return require("../build/Release/image_processor");
+  } catch (error) {
+    return null;
+  }
+}
 
 function createTestImageBuffer() {
   const width = 2;
@@ -46,6 +74,1329 @@ function createGradientImageBuffer() {
   return Buffer.concat([header, imageData]);
 }
 
+function createNoiseImageBuffer(width, height, channels, seed = 1) {
+  const header = Buffer.alloc(12);
+  header.writeInt32BE(width, 0);
+  header.writeInt32BE(height, 4);
+  header.writeInt32BE(channels, 8);
+
+  const imageData = Buffer.alloc(width * height * channels);
+  let state = seed;
+  for (let i = 0; i < imageData.length; i++) {
+    state = (state * 1103515245 + 12345) >>> 0;
+    imageData[i] = state >>> 24;
+  }
+
+  return Buffer.concat([header, imageData]);
+}
+
+function readFrameHeader(buffer) {
+  return {
+    width: buffer.readInt32BE(0),
+    height: buffer.readInt32BE(4),
+    channels: buffer.readInt32BE(8),
+  };
+}
+
+// Float32 model of the original per-pixel bilinear resize, used as the
+// reference the fixed-point kernels must stay within one level of.
+function referenceResize(pixels, width, height, channels, newWidth, newHeight) {
+  const f = Math.fround;
+  const output = Buffer.alloc(newWidth * newHeight * channels);
+  const xRatio = f(width / newWidth);
+  const yRatio = f(height / newHeight);
+  const at = (x, y, c) => pixels[(y * width + x) * channels + c];
+
+  for (let y = 0; y < newHeight; y++) {
+    for (let x = 0; x < newWidth; x++) {
+      const srcX = f(x * xRatio);
+      const srcY = f(y * yRatio);
+      const x1 = Math.floor(srcX);
+      const y1 = Math.floor(srcY);
+      const x2 = Math.min(x1 + 1, width - 1);
+      const y2 = Math.min(y1 + 1, height - 1);
+      const dx = f(srcX - x1);
+      const dy = f(srcY - y1);
+
+      for (let c = 0; c < channels; c++) {
+        const top = f(f(at(x1, y1, c) * f(1 - dx)) + f(at(x2, y1, c) * dx));
+        const bottom = f(f(at(x1, y2, c) * f(1 - dx)) + f(at(x2, y2, c) * dx));
+        output[(y * newWidth + x) * channels + c] = Math.trunc(
+          f(f(top * f(1 - dy)) + f(bottom * dy))
+        );
+      }
+    }
+  }
+
+  return output;
+}
+
+function runResizeAccuracyTests(addon) {
+  console.log("Checking resize accuracy against the float reference...");
+
+  // One- and two-channel frames pass through grayscale conversion as their
+  // first channel, so the addon output is exactly the resized channel 0.
+  const cases = [
+    { width: 97, height: 61, channels: 1, maxWidth: 40, maxHeight: 40 },
+    { width: 300, height: 200, channels: 1, maxWidth: 77, maxHeight: 600 },
+    { width: 128, height: 255, channels: 2, maxWidth: 50, maxHeight: 33 },
+    { width: 641, height: 479, channels: 2, maxWidth: 640, maxHeight: 478 },
+  ];
+
+  for (const testCase of cases) {
+    const { width, height, channels, maxWidth, maxHeight } = testCase;
+    const input = createNoiseImageBuffer(width, height, channels);
+    const output = addon.processImage(input, maxWidth, maxHeight);
+    const dims = readFrameHeader(output);
+
+    const expected = referenceResize(
+      input.subarray(12),
+      width,
+      height,
+      channels,
+      dims.width,
+      dims.height
+    );
+
+    let worst = 0;
+    for (let i = 0; i < dims.width * dims.height; i++) {
+      worst = Math.max(
+        worst,
+        Math.abs(output[12 + i] - expected[i * channels])
+      );
+    }
+
+    assert.ok(
+      worst <= 1,
+      `${width}x${height}x${channels} -> ${dims.width}x${dims.height}: ` +
+        `max error ${worst}`
+    );
+    console.log(
+      `   ${width}x${height}x${channels} -> ${dims.width}x${dims.height}: ` +
+        `max error ${worst}`
+    );
+  }
+}
+
+function runRawInputTests(addon) {
+  console.log("Checking headerless raw input...");
+
+  const framed = createNoiseImageBuffer(200, 150, 3, 7);
+  const raw = { width: 200, height: 150, channels: 3 };
+  const expected = addon.processImage(framed, 64, 64);
+
+  assert.ok(
+    addon.processImage(framed.subarray(12), 64, 64, { raw }).equals(expected)
+  );
+
+  const truncated = framed.subarray(0, framed.length - 1);
+  assert.throws(() => addon.processImage(truncated, 64, 64), /expected/);
+  assert.throws(
+    () => addon.processImage(truncated.subarray(12), 64, 64, { raw }),
+    /expected/
+  );
+  console.log("   raw input matches framed input");
+}
+
+function runLinearTests(addon) {
+  console.log("Checking typed planes and linear-light resizing...");
+
+  const width = 120;
+  const height = 90;
+  const raw = { width, height, channels: 3 };
+  const bytes = createNoiseImageBuffer(width, height, 3, 11).subarray(12);
+
+  // Samples are in native byte order.
+  const littleEndian = os.endianness() === "LE";
+  const wide = Buffer.alloc(bytes.length * 2);
+  const floats = Buffer.alloc(bytes.length * 4);
+  for (let i = 0; i < bytes.length; i++) {
+    const encoded = bytes[i] / 255;
+    const linear =
+      encoded <= 0.04045
+        ? encoded / 12.92
+        : Math.pow((encoded + 0.055) / 1.055, 2.4);
+    if (littleEndian) {
+      wide.writeUInt16LE(bytes[i] * 257, i * 2);
+      floats.writeFloatLE(linear, i * 4);
+    } else {
+      wide.writeUInt16BE(bytes[i] * 257, i * 2);
+      floats.writeFloatBE(linear, i * 4);
+    }
+  }
+
+  for (const filter of ["bilinear", "box", "lanczos3"]) {
+    const expected = addon.processImage(bytes, 40, 40, {
+      raw,
+      filter,
+      linear: true,
+    });
+    const fromWide = addon.processImage(wide, 40, 40, {
+      raw: { ...raw, type: "u16" },
+      filter,
+    });
+    const fromFloat = addon.processImage(floats, 40, 40, {
+      raw: { ...raw, type: "f32" },
+      filter,
+    });
+    assert.deepStrictEqual(
+      readFrameHeader(fromWide),
+      readFrameHeader(expected)
+    );
+    for (let i = 12; i < expected.length; i++) {
+      assert.ok(Math.abs(fromWide[i] - expected[i]) <= 1, `u16 ${filter}`);
+      assert.ok(Math.abs(fromFloat[i] - expected[i]) <= 1, `f32 ${filter}`);
+    }
+  }
+
+  // Halving a black and white checkerboard averages to half the light,
+  // which sRGB encodes as 188; averaging the encoded values gives 128.
+  const checker = Buffer.alloc(12 + 64 * 64);
+  checker.writeInt32BE(64, 0);
+  checker.writeInt32BE(64, 4);
+  checker.writeInt32BE(1, 8);
+  for (let i = 0; i < 64 * 64; i++) {
+    checker[12 + i] = ((i % 64) + Math.floor(i / 64)) % 2 ? 255 : 0;
+  }
+  const gamma = addon.processImage(checker, 32, 32, { filter: "box" });
+  const linear = addon.processImage(checker, 32, 32, {
+    filter: "box",
+    linear: true,
+  });
+  assert.ok(Math.abs(gamma[12 + 100] - 128) <= 1);
+  assert.strictEqual(linear[12 + 100], 188);
+
+  // NaN samples encode as black instead of indexing the transfer table
+  // with INT_MIN.
+  const nanPlane = Buffer.alloc(8 * 8 * 4);
+  const nanHalves = Buffer.alloc(8 * 8 * 2);
+  if (littleEndian) {
+    nanPlane.writeFloatLE(NaN, 27 * 4);
+    nanHalves.writeUInt16LE(0x7e00, 27 * 2);
+  } else {
+    nanPlane.writeFloatBE(NaN, 27 * 4);
+    nanHalves.writeUInt16BE(0x7e00, 27 * 2);
+  }
+  for (const [plane, type] of [
+    [nanPlane, "f32"],
+    [nanHalves, "f16"],
+  ]) {
+    for (const filter of ["bilinear", "box", "lanczos3"]) {
+      const output = addon.processImage(plane, 4, 4, {
+        raw: { width: 8, height: 8, channels: 1, type },
+        filter,
+      });
+      assert.ok(output.subarray(12).every((value) => value === 0), type);
+    }
+  }
+
+  assert.throws(
+    () => addon.processImage(bytes, 40, 40, { raw: { ...raw, type: "u32" } }),
+    TypeError
+  );
+  assert.throws(
+    () =>
+      addon.processImage(wide.subarray(1), 40, 40, {
+        raw: { ...raw, type: "u16" },
+      }),
+    /expected/
+  );
+  console.log("   u16 and f32 planes match 8-bit input in linear light");
+}
+
+async function runProcessIntoTests(addon) {
+  console.log("Checking processImageInto / computeOutputSize...");
+
+  const input = createNoiseImageBuffer(321, 123, 4, 11);
+  const expected = addon.processImage(input, 100, 100);
+  const size = addon.computeOutputSize(321, 123, 100, 100);
+
+  assert.deepStrictEqual(size, {
+    ...readFrameHeader(expected),
+    byteLength: expected.length,
+  });
+  assert.throws(() => addon.computeOutputSize(321, 123, 0, 100), RangeError);
+  assert.throws(() => addon.processImage(input, -1, 100), RangeError);
+  assert.throws(() => addon.processImage(input, 100, 1e12), RangeError);
+  assert.throws(() => addon.probe(input, 100, NaN), RangeError);
+
+  const output = Buffer.alloc(size.byteLength + 16, 0xaa);
+  const written = addon.processImageInto(input, output, 100, 100);
+  assert.strictEqual(written, expected.length);
+  assert.ok(output.subarray(0, written).equals(expected));
+
+  output.fill(0);
+  assert.strictEqual(
+    await addon.processImageIntoAsync(input, output, 100, 100),
+    expected.length
+  );
+  assert.ok(output.subarray(0, written).equals(expected));
+
+  assert.throws(
+    () => addon.processImageInto(input, Buffer.alloc(12), 100, 100),
+    /too small/
+  );
+  console.log(`   ${size.width}x${size.height} frame written in place`);
+}
+
+async function runBatchTests(addon) {
+  console.log("Checking processBatch...");
+
+  const framed = [1, 3, 4].map((channels, i) =>
+    createNoiseImageBuffer(90 + i * 17, 60 + i * 5, channels, 20 + i)
+  );
+  const rawSource = createNoiseImageBuffer(77, 55, 3, 30);
+  const items = [
+    ...framed,
+    {
+      data: rawSource.subarray(12),
+      raw: { width: 77, height: 55, channels: 3 },
+    },
+    Buffer.alloc(4),
+  ];
+
+  const results = await addon.processBatch(items, 40, 40);
+  assert.strictEqual(results.length, items.length);
+  framed.forEach((input, i) => {
+    assert.ok(results[i].equals(addon.processImage(input, 40, 40)));
+  });
+  assert.ok(results[3].equals(addon.processImage(rawSource, 40, 40)));
+  assert.ok(results[4] instanceof Error);
+  assert.match(results[4].message, /too small/);
+
+  assert.deepStrictEqual(await addon.processBatch([], 40, 40), []);
+  assert.throws(() => addon.processBatch([{}], 40, 40), TypeError);
+  console.log(`   ${items.length} items, per-item errors reported in place`);
+}
+
+async function runDecodeTests(addon) {
+  console.log("Checking native decoding...");
+
+  const framed = createNoiseImageBuffer(240, 160, 3, 40);
+  const raw = { width: 240, height: 160, channels: 3 };
+  const pixels = sharp(framed.subarray(12), { raw });
+
+  // PNG is lossless, so decoding it must match the framed pixels exactly.
+  const png = await pixels.clone().png().toBuffer();
+  if (addon.canDecode(png)) {
+    const expected = addon.processImage(framed, 100, 100);
+    assert.ok(addon.processImage(png, 100, 100).equals(expected));
+    assert.throws(
+      () => addon.processImage(png.subarray(0, png.length >> 1), 100, 100),
+      /PNG decode failed/
+    );
+  }
+
+  const jpeg = await pixels.clone().jpeg({ quality: 90 }).toBuffer();
+  if (addon.canDecode(jpeg)) {
+    const frame = await addon.processImageAsync(jpeg, 100, 100);
+    assert.deepStrictEqual(readFrameHeader(frame), {
+      width: 100,
+      height: 66,
+      channels: 1,
+    });
+    assert.throws(
+      () => addon.processImage(jpeg.subarray(0, jpeg.length >> 1), 100, 100),
+      /JPEG decode failed/
+    );
+
+    // A large smooth source is decoded at 1/8 scale for a 100-pixel output;
+    // the result keeps its size and stays close to a full decode.
+    const gradient = createGradientImageBuffer();
+    const large = await sharp(gradient.subarray(12), {
+      raw: { width: 64, height: 64, channels: 3 },
+    })
+      .resize(960, 640, { fit: "fill" })
+      .jpeg({ quality: 90 })
+      .toBuffer();
+    const shrunk = addon.processImage(large, 100, 100);
+    const full = addon.processImage(large, 100, 100, { shrinkOnLoad: false });
+    assert.deepStrictEqual(readFrameHeader(shrunk), readFrameHeader(full));
+    let difference = 0;
+    for (let i = 12; i < full.length; i++) {
+      difference += Math.abs(shrunk[i] - full[i]);
+    }
+    assert.ok(difference / (full.length - 12) < 4);
+  }
+
+  assert.strictEqual(addon.canDecode(framed), false);
+  console.log(
+    `   png: ${addon.canDecode(png)}, jpeg: ${addon.canDecode(jpeg)}`
+  );
+}
+
+async function runEncodeTests(addon) {
+  if (!addon.canEncode("jpeg")) {
+    console.log("JPEG encoder not built, skipping encode tests");
+    return;
+  }
+  console.log("Checking native JPEG encoding...");
+
+  const input = createNoiseImageBuffer(300, 200, 3, 50);
+  const jpeg = addon.processImage(input, 150, 150, { format: "jpeg" });
+  const metadata = await sharp(jpeg).metadata();
+  assert.strictEqual(metadata.format, "jpeg");
+  assert.strictEqual(metadata.width, 150);
+  assert.strictEqual(metadata.height, 100);
+  assert.strictEqual(metadata.channels, 1);
+  assert.strictEqual(metadata.isProgressive, false);
+
+  const progressive = await addon.processImageAsync(input, 150, 150, {
+    format: "jpeg",
+    progressive: true,
+  });
+  assert.strictEqual((await sharp(progressive).metadata()).isProgressive, true);
+
+  const size = addon.computeOutputSize(300, 200, 150, 150, { format: "jpeg" });
+  const output = Buffer.alloc(size.byteLength);
+  const written = addon.processImageInto(input, output, 150, 150, {
+    format: "jpeg",
+  });
+  assert.ok(output.subarray(0, written).equals(jpeg));
+
+  assert.throws(
+    () =>
+      addon.processImageInto(input, Buffer.alloc(64), 150, 150, {
+        format: "jpeg",
+      }),
+    /too small/
+  );
+  assert.throws(
+    () => addon.processImage(input, 150, 150, { format: "jpeg", quality: 0 }),
+    RangeError
+  );
+  console.log(`   ${jpeg.length}-byte grayscale JPEG, ${written} in place`);
+}
+
+// Row bands are independent, so splitting a large image across threads must
+// reproduce the single-threaded frame exactly.
+function runThreadedResizeTests(addon) {
+  console.log("Checking row-band parallel resize...");
+
+  const input = createNoiseImageBuffer(2500, 1700, 3, 5);
+  for (const [maxWidth, maxHeight] of [
+    [800, 600],
+    [2500, 1700],
+  ]) {
+    const single = addon.processImage(input, maxWidth, maxHeight, {
+      threads: 1,
+    });
+    assert.ok(addon.processImage(input, maxWidth, maxHeight).equals(single));
+    assert.ok(
+      addon
+        .processImage(input, maxWidth, maxHeight, { threads: 3 })
+        .equals(single)
+    );
+  }
+
+  assert.throws(
+    () => addon.processImage(input, 800, 600, { threads: -1 }),
+    /threads/
+  );
+  console.log("   threaded output matches single-threaded output");
+}
+
+// Box and Lanczos taps sum to exactly one, and the box filter averages whole
+// blocks for integer ratios, so both are checked against exact values.
+function runFilterTests(addon) {
+  console.log("Checking box and lanczos3 filters...");
+
+  const grey = Buffer.alloc(12 + 900 * 600, 117);
+  grey.writeInt32BE(900, 0);
+  grey.writeInt32BE(600, 4);
+  grey.writeInt32BE(1, 8);
+  for (const filter of ["box", "lanczos3"]) {
+    const frame = addon.processImage(grey, 97, 97, { filter });
+    assert.deepStrictEqual(readFrameHeader(frame), {
+      width: 97,
+      height: 64,
+      channels: 1,
+    });
+    assert.ok(frame.subarray(12).every((value) => value === 117));
+  }
+
+  const input = createNoiseImageBuffer(240, 160, 1, 60);
+  const pixels = input.subarray(12);
+  const frame = addon.processImage(input, 60, 40, { filter: "box" });
+  for (let y = 0; y < 40; y++) {
+    for (let x = 0; x < 60; x++) {
+      let sum = 0;
+      for (let dy = 0; dy < 4; dy++) {
+        for (let dx = 0; dx < 4; dx++) {
+          sum += pixels[(y * 4 + dy) * 240 + x * 4 + dx];
+        }
+      }
+      assert.strictEqual(frame[12 + y * 60 + x], (sum + 8) >> 4);
+    }
+  }
+
+  // Single-pixel stripes alias into full-contrast bands under bilinear
+  // sampling; the filters average them out.
+  const stripes = Buffer.alloc(12 + 1500 * 1000);
+  stripes.writeInt32BE(1500, 0);
+  stripes.writeInt32BE(1000, 4);
+  stripes.writeInt32BE(1, 8);
+  for (let i = 0; i < 1500 * 1000; i++) {
+    stripes[12 + i] = i % 3 === 0 ? 255 : 0;
+  }
+  const spread = (filter) => {
+    const values = addon.processImage(stripes, 211, 211, { filter });
+    return Math.max(...values.subarray(12)) - Math.min(...values.subarray(12));
+  };
+  assert.ok(spread("box") < spread("bilinear") / 2);
+  assert.ok(spread("lanczos3") < spread("bilinear") / 2);
+
+  assert.throws(
+    () => addon.processImage(input, 60, 40, { filter: "cubic" }),
+    /filter/
+  );
+  console.log("   flat, integer-ratio and aliasing checks passed");
+}
+
+// processFile maps the input and writes the output itself; the file it
+// writes must hold exactly what processImage returns.
+async function runFileTests(addon) {
+  console.log("Checking processFile...");
+
+  const dir = await fs.mkdtemp(path.join(os.tmpdir(), "image-processor-"));
+  try {
+    const input = createNoiseImageBuffer(640, 480, 3, 80);
+    const inPath = path.join(dir, "input.frame");
+    const outPath = path.join(dir, "output.frame");
+    await fs.writeFile(inPath, input);
+
+    for (const direct of [false, true]) {
+      const result = await addon.processFile(inPath, outPath, 200, 200, {
+        direct,
+      });
+      const expected = addon.processImage(input, 200, 200);
+      assert.deepStrictEqual(result, {
+        inputSize: input.length,
+        outputSize: expected.length,
+      });
+      assert.ok((await fs.readFile(outPath)).equals(expected));
+    }
+
+    const textPath = path.join(dir, "notes.txt");
+    await fs.writeFile(textPath, "not an image at all");
+    await assert.rejects(
+      addon.processFile(textPath, outPath, 200, 200),
+      /unsupported input format/
+    );
+    await assert.rejects(
+      addon.processFile(path.join(dir, "missing"), outPath, 200, 200),
+      /cannot open/
+    );
+    assert.throws(() => addon.processFile(inPath, outPath), TypeError);
+  } finally {
+    await fs.rm(dir, { recursive: true, force: true });
+  }
+  console.log("   mapped input, buffered and direct output match");
+}
+
+async function runFileBatchTests(addon) {
+  console.log(`Checking processFiles (I/O backend: ${addon.ioBackend})...`);
+
+  const dir = await fs.mkdtemp(path.join(os.tmpdir(), "image-processor-"));
+  try {
+    const inputs = [];
+    for (let i = 0; i < 5; i++) {
+      inputs.push(createNoiseImageBuffer(160 + 40 * i, 120, 1 + (i % 4), i));
+      await fs.writeFile(path.join(dir, `${i}.frame`), inputs[i]);
+    }
+    await fs.writeFile(path.join(dir, "notes.txt"), "not an image at all");
+    await fs.mkdir(path.join(dir, "nested"));
+
+    const entries = await addon.listDirectory(dir);
+    const sizes = Object.fromEntries(entries.map((e) => [e.name, e.size]));
+    const expectedSizes = { "notes.txt": 19 };
+    inputs.forEach((input, i) => (expectedSizes[`${i}.frame`] = input.length));
+    assert.deepStrictEqual(sizes, expectedSizes);
+    await assert.rejects(
+      addon.listDirectory(path.join(dir, "missing")),
+      /cannot open directory/
+    );
+
+    const items = [...inputs.keys(), "notes.txt", "missing"].map((name) => ({
+      inPath: path.join(dir, typeof name === "number" ? `${name}.frame` : name),
+      outPath: path.join(dir, "nested", `${name}.out`),
+    }));
+    const script = `
+      const addon = require(${JSON.stringify(
+        path.join(__dirname, "../build/Release/image_processor")
+      )});
+      addon.processFiles(${JSON.stringify(items)}, 100, 100).then((results) => {
+        console.log(JSON.stringify(results.map((r) => r.message || r)));
+      });
+    `;
+
+    // Both backends must write the same files and report the same errors.
+    for (const io of ["default", "threads"]) {
+      const child = spawnSync(process.execPath, ["-e", script], {
+        env: { ...process.env, IMAGE_PROCESSOR_IO: io },
+        encoding: "utf8",
+      });
+      assert.strictEqual(child.status, 0, child.stderr);
+      const results = JSON.parse(child.stdout);
+
+      for (let i = 0; i < inputs.length; i++) {
+        const expected = addon.processImage(inputs[i], 100, 100);
+        assert.deepStrictEqual(results[i], {
+          inputSize: inputs[i].length,
+          outputSize: expected.length,
+        });
+        assert.ok((await fs.readFile(items[i].outPath)).equals(expected));
+      }
+      assert.match(results[inputs.length], /unsupported input format/);
+      assert.match(results[inputs.length + 1], /cannot open/);
+    }
+    assert.throws(
+      () => addon.processFiles([{ inPath: "a" }], 10, 10),
+      TypeError
+    );
+  } finally {
+    await fs.rm(dir, { recursive: true, force: true });
+  }
+  console.log("   io_uring and thread-pool backends agree");
+}
+
+async function runRenditionTests(addon) {
+  console.log("Checking renditions from one decode...");
+
+  const input = createGradientImageBuffer();
+  const sizes = [
+    { maxWidth: 40, maxHeight: 40 },
+    { maxWidth: 160, maxHeight: 120 },
+    { maxWidth: 80, maxHeight: 60 },
+  ];
+  for (const filter of ["bilinear", "lanczos3"]) {
+    const outputs = await addon.processRenditions(input, sizes, { filter });
+    assert.strictEqual(outputs.length, sizes.length);
+    sizes.forEach(({ maxWidth, maxHeight }, i) => {
+      const expected = addon.processImage(input, maxWidth, maxHeight, {
+        filter,
+      });
+      const output = outputs[i];
+      assert.deepStrictEqual(
+        readFrameHeader(output),
+        readFrameHeader(expected)
+      );
+      let diff = 0;
+      for (let j = 12; j < output.length; j++) {
+        diff += Math.abs(output[j] - expected[j]);
+      }
+      assert.ok(diff / (output.length - 12) < 3, `${filter} size ${i}`);
+    });
+  }
+
+  if (addon.canEncode("jpeg")) {
+    const jpegs = await addon.processRenditions(input, sizes, {
+      format: "jpeg",
+    });
+    for (const jpeg of jpegs) {
+      assert.strictEqual(jpeg.readUInt16BE(0), 0xffd8);
+    }
+  }
+
+  assert.throws(() => addon.processRenditions(input, []), RangeError);
+  assert.throws(
+    () => addon.processRenditions(input, [{ maxWidth: 10 }]),
+    TypeError
+  );
+  console.log("   sizes match processImage, pixels within rounding");
+}
+
+async function runProbeTests(addon) {
+  console.log("Checking header probes...");
+
+  assert.deepStrictEqual(addon.probe(createTestImageBuffer()), {
+    format: "frame",
+    width: 2,
+    height: 2,
+    channels: 3,
+    bitDepth: 8,
+    orientation: 1,
+    progressive: false,
+  });
+
+  const png = await sharp(createNoiseImageBuffer(90, 70, 3).subarray(12), {
+    raw: { width: 90, height: 70, channels: 3 },
+  })
+    .png()
+    .toBuffer();
+  const pngHeader = addon.probe(png);
+  assert.strictEqual(pngHeader.format, "png");
+  assert.strictEqual(pngHeader.width, 90);
+  assert.strictEqual(pngHeader.height, 70);
+  assert.strictEqual(pngHeader.channels, 3);
+
+  const jpeg = await sharp(createNoiseImageBuffer(1600, 1200, 3).subarray(12), {
+    raw: { width: 1600, height: 1200, channels: 3 },
+  })
+    .withMetadata({ orientation: 6 })
+    .jpeg({ progressive: true })
+    .toBuffer();
+  const scratch = await fs.mkdtemp(path.join(os.tmpdir(), "probe-"));
+  const file = path.join(scratch, "photo.jpg");
+  await fs.writeFile(file, jpeg);
+  try {
+    const header = addon.probe(file, 200, 200);
+    assert.strictEqual(header.format, "jpeg");
+    assert.strictEqual(header.width, 1600);
+    assert.strictEqual(header.height, 1200);
+    assert.strictEqual(header.orientation, 6);
+    assert.strictEqual(header.progressive, true);
+    // 1/8 still covers the 200x150 output.
+    if (addon.canDecode(jpeg)) {
+      assert.strictEqual(header.decodeWidth, 200);
+      assert.strictEqual(header.decodeHeight, 150);
+    }
+    assert.deepStrictEqual(addon.probe(jpeg.subarray(0, 4096)).width, 1600);
+
+    const missing = path.join(scratch, "missing.jpg");
+    const [batched, error] = await addon.probeFiles([file, missing], 200, 200);
+    assert.deepStrictEqual(batched, header);
+    assert.ok(error instanceof Error && /open/.test(error.message));
+    const [unfitted] = await addon.probeFiles([file]);
+    assert.strictEqual(unfitted.decodeWidth, undefined);
+  } finally {
+    await fs.rm(scratch, { recursive: true, force: true });
+  }
+
+  assert.throws(() => addon.probe(jpeg.subarray(0, 20)), /header needs/);
+  assert.throws(() => addon.probe(Buffer.from("BM not an image")), /format/);
+  assert.throws(() => addon.probe(path.join(os.tmpdir(), "none")), /open/);
+  assert.throws(() => addon.probe(42), TypeError);
+  assert.throws(() => addon.probeFiles([42]), TypeError);
+  console.log("   frame, PNG and JPEG headers read without decoding");
+}
+
+function runStatsTests(addon) {
+  console.log("Checking per-stage stats...");
+
+  const before = addon.getStats();
+  const input = createGradientImageBuffer();
+  addon.processImage(input, 32, 32);
+  addon.recordStage("sharp_decode", 0.003, 1234);
+  const after = addon.getStats();
+
+  const calls = (stats, stage) => stats.stages[stage].count;
+  assert.strictEqual(calls(after, "parse") - calls(before, "parse"), 1);
+  assert.strictEqual(calls(after, "resize") - calls(before, "resize"), 1);
+  assert.strictEqual(
+    after.stages.resize.bytes - before.stages.resize.bytes,
+    input.length - 12
+  );
+  for (const counters of Object.values(after.stages)) {
+    const total = counters.histogram.reduce((sum, count) => sum + count, 0);
+    assert.strictEqual(total, counters.count);
+  }
+
+  const bounds = after.histogramBounds;
+  assert.strictEqual(bounds[bounds.length - 1], Infinity);
+  const bucket = bounds.findIndex((bound) => bound >= 0.003);
+  const decodes = (stats) => stats.stages.sharp_decode;
+  assert.strictEqual(
+    decodes(after).histogram[bucket] - decodes(before).histogram[bucket],
+    1
+  );
+  assert.strictEqual(decodes(after).bytes - decodes(before).bytes, 1234);
+  assert.throws(() => addon.recordStage("nope", 1), RangeError);
+
+  const text = formatMetrics(after, { completed: 2, succeeded: 1 });
+  assert.match(
+    text,
+    new RegExp(
+      `image_processor_stage_seconds_count\\{stage="resize"\\} ` +
+        after.stages.resize.count
+    )
+  );
+  assert.match(text, /image_processor_images_total\{result="failure"\} 1/);
+  console.log(
+    `   ${Object.keys(after.stages).length} stages, ` +
+      `${after.scratch.reusedBlocks} scratch blocks reused`
+  );
+}
+
+async function runCacheTests(addon) {
+  console.log("Checking the result cache...");
+
+  const dir = await fs.mkdtemp(path.join(os.tmpdir(), "image-processor-"));
+  const before = addon.cacheStats();
+  const delta = () => {
+    const stats = addon.cacheStats();
+    return {
+      memoryHits: stats.memoryHits - before.memoryHits,
+      diskHits: stats.diskHits - before.diskHits,
+      misses: stats.misses - before.misses,
+    };
+  };
+
+  try {
+    const input = createNoiseImageBuffer(400, 300, 3, 7);
+    const expected = addon.processImage(input, 120, 120);
+
+    addon.configureCache({ memoryBytes: 1 << 20, directory: dir });
+    assert.ok(addon.processImage(input, 120, 120).equals(expected));
+    assert.ok(addon.processImage(input, 120, 120).equals(expected));
+    const other = addon.processImage(input, 120, 120, { filter: "box" });
+    assert.ok(!other.equals(expected));
+    assert.deepStrictEqual(delta(), { memoryHits: 1, diskHits: 0, misses: 2 });
+
+    // A fresh memory tier still finds both outputs on disk.
+    addon.configureCache({ memoryBytes: 1 << 20, directory: dir });
+    const output = Buffer.alloc(expected.length);
+    assert.strictEqual(
+      await addon.processImageIntoAsync(input, output, 120, 120),
+      expected.length
+    );
+    assert.ok(output.equals(expected));
+    const inPath = path.join(dir, "input.frame");
+    const outPath = path.join(dir, "output.frame");
+    await fs.writeFile(inPath, input);
+    await addon.processFile(inPath, outPath, 120, 120, { filter: "box" });
+    assert.ok((await fs.readFile(outPath)).equals(other));
+    assert.deepStrictEqual(delta(), { memoryHits: 1, diskHits: 2, misses: 2 });
+  } finally {
+    addon.configureCache({});
+    await fs.rm(dir, { recursive: true, force: true });
+  }
+  console.log("   memory and disk hits return the stored bytes");
+}
+
+async function runJobQueueTests(addon) {
+  console.log("Checking the work-stealing job queue...");
+
+  const jobCount = 20000;
+  const queue = new addon.JobQueue(jobCount, 4);
+  assert.strictEqual(queue.workerCount, 4);
+
+  // Worker 0 idles while the others drain the queue, stealing its share.
+  const script = `
+    const { parentPort, workerData } = require("worker_threads");
+    const addon = require(workerData.addonPath);
+    const queue = new addon.JobQueue(workerData.queueId);
+    const taken = [];
+    for (let job; (job = queue.next(workerData.workerIndex)) >= 0; ) {
+      taken.push(job);
+    }
+    parentPort.postMessage(taken);
+  `;
+  const addonPath = path.join(__dirname, "../build/Release/image_processor");
+  const taken = await Promise.all(
+    [1, 2, 3].map(
+      (workerIndex) =>
+        new Promise((resolve, reject) => {
+          const worker = new Worker(script, {
+            eval: true,
+            workerData: {
+              addonPath,
+              queueId: queue.id,
+              workerIndex,
+            },
+          });
+          worker.once("message", resolve);
+          worker.once("error", reject);
+        })
+    )
+  );
+
+  const all = taken.flat().sort((a, b) => a - b);
+  assert.deepStrictEqual(
+    all,
+    Array.from({ length: jobCount }, (_, i) => i)
+  );
+  assert.strictEqual(queue.next(0), -1);
+  // Each worker starts on its own share, in order.
+  assert.strictEqual(taken[0][0], 5000);
+
+  const single = new addon.JobQueue(3, 1);
+  assert.deepStrictEqual(
+    [single.next(0), single.next(0), single.next(0), single.next(0)],
+    [0, 1, 2, -1]
+  );
+  // Longest first: whichever worker asks takes the next job in order.
+  const ordered = new addon.JobQueue(3, 3, { ordered: true });
+  assert.deepStrictEqual(
+    [ordered.next(0), ordered.next(0), ordered.next(2), ordered.next(1)],
+    [0, 1, 2, -1]
+  );
+
+  assert.throws(() => new addon.JobQueue(0xfffffff), RangeError);
+  assert.throws(() => new addon.JobQueue(-1, 2), RangeError);
+  console.log(`   ${jobCount} jobs handed out once each across 3 threads`);
+}
+
+async function runLibraryModeTests(addon) {
+  if (!addon.canEncode("jpeg")) {
+    console.log("Skipping in-memory processing (no native JPEG encoder)");
+    return;
+  }
+  console.log("Checking in-memory processing over shared memory...");
+
+  const processor = new ImageProcessor(2, { maxWidth: 200, maxHeight: 150 });
+  await processor.initialize();
+  try {
+    const options = { format: "jpeg", quality: 85 };
+    const inputs = Array.from({ length: 12 }, (_, i) =>
+      createNoiseImageBuffer(300 + 17 * i, 200, 1 + (i % 4), i)
+    );
+    const outputs = await Promise.all(
+      inputs.map((input) => processor.process(input))
+    );
+    outputs.forEach((output, i) => {
+      assert.ok(
+        output.equals(addon.processImage(inputs[i], 200, 150, options))
+      );
+    });
+
+    // Filling the slot in place skips both copies.
+    const slot = await processor.acquireSlot();
+    inputs[0].copy(slot.input);
+    const output = await slot.process(inputs[0].length);
+    assert.ok(output.equals(outputs[0]));
+    slot.release();
+
+    await assert.rejects(
+      processor.process(Buffer.from("definitely not an image")),
+      /Image processing failed/
+    );
+    await assert.rejects(
+      processor.process(Buffer.alloc(processor.maxInputBytes + 1)),
+      RangeError
+    );
+  } finally {
+    await processor.cleanup();
+  }
+  console.log("   shared-slot outputs match processImage");
+}
+
+function runSchedulingTests() {
+  console.log("Checking largest-first job order...");
+
+  const processor = new ImageProcessor(2, { batchSize: 2 });
+  const sizes = { a: 10, b: 5000000, c: 20, d: 300000, e: 30, f: 40 };
+  for (const [file, size] of Object.entries(sizes)) {
+    processor.fileSizes.set(file, size);
+  }
+
+  const files = Object.keys(sizes);
+  const largestFirst = processor.sortByCost(files.map((file) => [file]));
+  const jobs = processor.sortByCost(processor.groupJobs(largestFirst.flat()));
+  assert.deepStrictEqual(jobs, [["b"], ["d"], ["f", "e"], ["c", "a"]]);
+  assert.deepStrictEqual(processor.groupJobs(files), [
+    ["a"],
+    ["b"],
+    ["c"],
+    ["d"],
+    ["e", "f"],
+  ]);
+
+  // A probed pixel count outweighs the compressed size.
+  processor.decodedPixels.set("d", 40000000);
+  assert.deepStrictEqual(processor.sortByCost([["b"], ["d"]]), [["d"], ["b"]]);
+  console.log(`   ${jobs.map((job) => job.join("+")).join(", ")}`);
+}
+
+async function runPoolTests(addon) {
+  console.log("Checking worker placement and autoscaling...");
+
+  const nodes = [
+    { node: 0, cpus: [0, 1] },
+    { node: 1, cpus: [2, 3] },
+  ];
+  const placed = (mode) =>
+    [0, 1, 2, 3].map((index) => planAffinity(index, nodes, mode));
+  assert.deepStrictEqual(placed("node"), [
+    nodes[0],
+    nodes[1],
+    nodes[0],
+    nodes[1],
+  ]);
+  assert.deepStrictEqual(
+    placed("core").map(({ cpus }) => cpus[0]),
+    [0, 2, 1, 3]
+  );
+  assert.deepStrictEqual(placed("auto"), placed("node"));
+  assert.strictEqual(planAffinity(0, [nodes[0]], "auto"), null);
+  assert.strictEqual(planAffinity(0, nodes, "none"), null);
+  assert.throws(() => planAffinity(0, nodes, "socket"), RangeError);
+
+  const pool = new ImageProcessor("auto", {
+    minWorkers: 1,
+    maxWorkers: 3,
+    jobsPerWorker: 2,
+    pin: "none",
+    quiet: true,
+  });
+  assert.strictEqual(pool.targetWorkerCount(1), 1);
+  assert.strictEqual(pool.targetWorkerCount(5), 3);
+  assert.strictEqual(pool.targetWorkerCount(500), 3);
+  await pool.initialize();
+  assert.strictEqual(pool.workers.length, 1);
+  await pool.scaleTo(3);
+  assert.strictEqual(pool.workers.length, 3);
+  await pool.scaleTo(1);
+  assert.strictEqual(pool.workerCount, 1);
+
+  // A worker that dies in its slot fails its jobs and is replaced.
+  const crashed = pool.workers[0];
+  pool.activeJobs++;
+  const lost = new Promise((resolve, reject) =>
+    pool.pendingJobs.set(-1, { workerIndex: 0, files: 2, resolve, reject })
+  );
+  await crashed.terminate();
+  await assert.rejects(lost, /exited/);
+  assert.notStrictEqual(pool.workers[0], crashed);
+  assert.strictEqual(pool.completedJobs, 2);
+  assert.strictEqual(pool.activeJobs, 0);
+  await pool.cleanup();
+
+  if (addon) {
+    const topology = addon.numaNodes();
+    assert.ok(topology.length >= 1);
+    const cpus = topology.flatMap((node) => node.cpus);
+    assert.ok(cpus.length >= 1);
+    // Pinning the test thread to every CPU it may use changes nothing.
+    assert.strictEqual(typeof addon.pinThread(cpus), "boolean");
+    assert.throws(() => addon.pinThread("0"), TypeError);
+  }
+  console.log("   placement spreads over nodes, pool grows, shrinks, heals");
+}
+
+async function runStreamingIngestTests(inputDir, imageFiles) {
+  console.log("\nChecking streaming ingest...");
+
+  const scratch = await fs.mkdtemp(path.join(os.tmpdir(), "ingest-"));
+  const outputDir = path.join(scratch, "output");
+  const manifest = path.join(scratch, "manifest.ndjson");
+  await fs.mkdir(outputDir);
+  await fs.writeFile(path.join(inputDir, "notes.txt"), "not an image");
+
+  try {
+    const processor = new ImageProcessor(2, { quiet: true });
+    await processor.initialize();
+    const summary = await processor.processDirectoryStream(
+      inputDir,
+      outputDir,
+      { manifest, window: 3 }
+    );
+    await processor.cleanup();
+
+    assert.deepStrictEqual(summary, {
+      completed: imageFiles.length,
+      succeeded: imageFiles.length,
+    });
+    assert.strictEqual(processor.processedImages.length, 0);
+
+    const records = (await fs.readFile(manifest, "utf8"))
+      .trim()
+      .split("\n")
+      .map((line) => JSON.parse(line));
+    assert.deepStrictEqual(
+      records.map((record) => record.input).sort(),
+      [...imageFiles].sort()
+    );
+    for (const record of records) {
+      assert.strictEqual(record.success, true);
+      assert.ok(record.outputSize > 0);
+      await fs.access(record.output);
+    }
+  } finally {
+    await fs.unlink(path.join(inputDir, "notes.txt"));
+    await fs.rm(scratch, { recursive: true, force: true });
+  }
+  console.log(`   ${imageFiles.length} images streamed, one line each`);
+}
+
+// Stands in for an ImageProcessor pool on a cluster node. Jobs take
+// delayMs each, or never finish when delayMs is null.
+function fakeClusterPool(delayMs) {
+  return {
+    workers: [0, 1],
+    jobsPerWorker: 2,
+    completedJobs: 0,
+    succeededJobs: 0,
+    async startOpenRun() {},
+    finishOpenRun() {},
+    runJob(files) {
+      if (delayMs === null) return new Promise(() => {});
+      return new Promise((resolve) =>
+        setTimeout(() => {
+          this.completedJobs += files.length;
+          this.succeededJobs += files.length;
+          resolve(
+            files.map(() => ({ success: true, inputSize: 10, outputSize: 4 }))
+          );
+        }, delayMs)
+      );
+    },
+  };
+}
+
+async function runClusterTests() {
+  console.log("Checking sharded cluster runs...");
+
+  const ring = new HashRing();
+  ["a", "b", "c"].forEach((node) => ring.add(node));
+  const keys = Array.from({ length: 3000 }, (_, i) => `/photos/${i}.jpg`);
+  const owners = keys.map((key) => ring.lookup(key));
+  for (const node of ["a", "b", "c"]) {
+    const share = owners.filter((owner) => owner === node).length;
+    assert.ok(share > 600 && share < 1400, `${node} owns ${share} of 3000`);
+  }
+  ring.remove("b");
+  keys.forEach((key, i) => {
+    if (owners[i] !== "b") assert.strictEqual(ring.lookup(key), owners[i]);
+  });
+
+  const messages = [];
+  const reader = new MessageReader((message) => messages.push(message));
+  const wire = Buffer.concat([
+    encodeMessage(3, 7, Buffer.from("a.jpg\0b.jpg")),
+    encodeMessage(4, 0),
+  ]);
+  for (let i = 0; i < wire.length; i++) reader.push(wire.subarray(i, i + 1));
+  assert.deepStrictEqual(
+    messages.map(({ type, id, payload }) => [type, id, payload.toString()]),
+    [
+      [3, 7, "a.jpg\0b.jpg"],
+      [4, 0, ""],
+    ]
+  );
+  const results = [
+    { success: true, inputSize: 1000, outputSize: 200 },
+    { success: false, error: "corrupt" },
+  ];
+  assert.deepStrictEqual(decodeResults(encodeResults(results)), results);
+
+  // One node finishes everything, one hangs on its jobs while still
+  // heartbeating, and one goes silent after saying hello. An intruder
+  // without the token is turned away before it can fake a result.
+  const scratch = await fs.mkdtemp(path.join(os.tmpdir(), "cluster-"));
+  const manifest = path.join(scratch, "manifest.ndjson");
+  const jobs = Array.from({ length: 30 }, (_, i) => [`/photos/${i}.jpg`]);
+  const coordinator = new Coordinator(jobs, path.join(scratch, "output"), {
+    leaseMs: 150,
+    manifest,
+    quiet: true,
+    token: "secret",
+  });
+  const port = await coordinator.listen(0);
+  const silent = net.connect(port, "127.0.0.1");
+  silent.on("error", () => {});
+  silent.write(encodeMessage(1, 3, Buffer.from("silent\0secret")));
+  const intruder = net.connect(port, "127.0.0.1");
+  intruder.on("error", () => {});
+  intruder.write(encodeMessage(1, 3, Buffer.from("intruder\0guess")));
+  intruder.write(encodeMessage(5, 1, encodeResults([{ success: false }])));
+  await once(intruder, "close");
+  await new Promise((resolve) => setTimeout(resolve, 50));
+
+  try {
+    const fast = joinCluster(fakeClusterPool(40), {
+      host: "127.0.0.1",
+      port,
+      name: "fast",
+      token: "secret",
+    });
+    const stuck = joinCluster(fakeClusterPool(null), {
+      host: "127.0.0.1",
+      port,
+      name: "stuck",
+      token: "secret",
+    });
+    const summary = await coordinator.run();
+    assert.strictEqual(summary.completed, 30);
+    assert.strictEqual(summary.succeeded, 30);
+    assert.ok(!summary.nodes.some((node) => node.name === "silent"));
+    assert.ok(!summary.nodes.some((node) => node.name === "intruder"));
+    assert.strictEqual((await fast).succeeded, 30);
+    assert.strictEqual((await stuck).succeeded, 0);
+
+    const lines = (await fs.readFile(manifest, "utf8")).trim().split("\n");
+    assert.strictEqual(lines.length, 30);
+    // A node that cannot create the output directory fails its leases
+    // instead of crashing on an unhandled rejection.
+    const blocked = path.join(scratch, "blocked");
+    await fs.writeFile(blocked, "");
+    const unwritable = new Coordinator(
+      [["/photos/a.jpg"], ["/photos/b.jpg", "/photos/c.jpg"]],
+      path.join(blocked, "output"),
+      { quiet: true }
+    );
+    const unwritablePort = await unwritable.listen(0);
+    const node = joinCluster(fakeClusterPool(0), {
+      port: unwritablePort,
+      name: "blocked",
+    });
+    const failures = await unwritable.run();
+    assert.strictEqual(failures.completed, 3);
+    assert.strictEqual(failures.succeeded, 0);
+    assert.strictEqual((await node).leases, 2);
+  } finally {
+    silent.destroy();
+    await fs.rm(scratch, { recursive: true, force: true });
+  }
+  console.log("   shards stay put, a hung and a silent node are worked around");
+}
+
+async function runBenchTests() {
+  console.log("Checking the end-to-end benchmark...");
+
+  const mix = parseSizeMix("64x48:3,96x64");
+  assert.deepStrictEqual(mix[1], { width: 96, height: 64, weight: 1 });
+  assert.deepStrictEqual(
+    assignSizes(8, mix).map((size) => size.width),
+    [64, 64, 64, 64, 64, 64, 96, 96]
+  );
+  assert.throws(() => parseSizeMix("64:48"), /WIDTHxHEIGHT/);
+
+  const latencies = Array.from({ length: 100 }, (_, i) => i + 1);
+  assert.strictEqual(percentile(latencies, 50), 50);
+  assert.strictEqual(percentile(latencies, 99), 99);
+  assert.strictEqual(percentile([], 95), 0);
+
+  const results = await runBench({
+    images: 6,
+    mix: "64x48:2,160x120",
+    workers: "1,2",
+    batchSizes: "4",
+    engines: "sharp",
+  });
+  assert.strictEqual(results.length, 2);
+  for (const result of results) {
+    assert.strictEqual(result.images, 6);
+    assert.ok(result.p50Ms > 0 && result.p50Ms <= result.p99Ms);
+    assert.ok(result.peakRssBytes > 0);
+  }
+}
+
+// Pipes input through a ResizeStream in chunks of `chunkSize` bytes and
+// returns everything it produced.
+async function streamThrough(input, chunkSize, maxWidth, maxHeight, options) {
+  const chunks = [];
+  for (let offset = 0; offset < input.length; offset += chunkSize) {
+    chunks.push(input.subarray(offset, offset + chunkSize));
+  }
+  const output = [];
+  const stream = Readable.from(chunks).pipe(
+    createResizeStream(maxWidth, maxHeight, options)
+  );
+  for await (const chunk of stream) {
+    output.push(chunk);
+  }
+  return Buffer.concat(output);
+}
+
+// The streaming engine keeps only a window of rows but runs the same
+// arithmetic, so it must reproduce processImage byte for byte.
+async function runStreamTests(addon) {
+  console.log("Checking the streaming pipeline...");
+
+  const framed = createNoiseImageBuffer(700, 500, 3, 70);
+  for (const filter of ["bilinear", "box", "lanczos3"]) {
+    const expected = addon.processImage(framed, 160, 160, { filter });
+    const streamed = await streamThrough(framed, 997, 160, 160, { filter });
+    assert.ok(streamed.equals(expected));
+  }
+
+  const raw = { width: 700, height: 500, channels: 3 };
+  const pixels = sharp(framed.subarray(12), { raw });
+  const jpeg = await pixels.clone().jpeg({ quality: 90 }).toBuffer();
+  if (addon.canDecode(jpeg)) {
+    const expected = addon.processImage(jpeg, 160, 160);
+    assert.ok((await streamThrough(jpeg, 4096, 160, 160)).equals(expected));
+
+    const progressive = await pixels
+      .clone()
+      .jpeg({ quality: 90, progressive: true })
+      .toBuffer();
+    await assert.rejects(
+      streamThrough(progressive, 4096, 160, 160),
+      /can't be streamed/
+    );
+  }
+
+  await assert.rejects(
+    streamThrough(framed.subarray(0, framed.length >> 1), 4096, 160, 160),
+    /before the last row/
+  );
+  console.log("   streamed output matches processImage");
+}
+
+// Every kernel set computes the same fixed-point formulas, so forcing a lower
+// set through IMAGE_PROCESSOR_KERNELS must not change a single byte.
+function runKernelDispatchTests(addon) {
+  console.log(`Comparing kernel sets (active: ${addon.kernels})...`);
+
+  const script = `
+    const crypto = require("crypto");
+    const addon = require(${JSON.stringify(
+      path.join(__dirname, "../build/Release/image_processor")
+    )});
+    const { createNoiseImageBuffer } = require(${JSON.stringify(__filename)});
+    const hash = crypto.createHash("sha1");
+    for (const channels of [1, 2, 3, 4]) {
+      hash.update(addon.processImage(createNoiseImageBuffer(333, 211, channels), 100, 100));
+      hash.update(addon.processImage(createNoiseImageBuffer(123, 77, channels), 500, 500));
+    }
+    console.log(addon.kernels + " " + hash.digest("hex"));
+  `;
+
+  const digests = new Map();
+  for (const kernels of ["scalar", "sse4.1", "avx2", "neon"]) {
+    const child = spawnSync(process.execPath, ["-e", script], {
+      env: { ...process.env, IMAGE_PROCESSOR_KERNELS: kernels },
+      encoding: "utf8",
+    });
+    assert.strictEqual(child.status, 0, child.stderr);
+    const [selected, digest] = child.stdout.trim().split(" ");
+    digests.set(selected, digest);
+  }
+
+  for (const [selected, digest] of digests) {
+    console.log(`   ${selected}: ${digest}`);
+  }
+  assert.strictEqual(
+    new Set(digests.values()).size,
+    1,
+    "kernel sets disagree"
+  );
+}
+
+// processImage only resizes luma planes, so multichannel resizeImage is
+// compared through the native bench's --digest, built with
+// `npm run build:bench`. Skipped when the bench is not built.
+function runMultichannelKernelTests() {
+  const bench = path.join(__dirname, "../build/Release/image_processor_bench");
+  if (spawnSync(bench, ["--list"]).status !== 0) {
+    console.log("Native bench not built, skipping multichannel kernel tests");
+    return;
+  }
+  console.log("Comparing kernel sets on 1- to 4-channel resizes...");
+
+  const digests = new Map();
+  for (const kernels of ["scalar", "sse4.1", "avx2", "neon"]) {
+    const child = spawnSync(bench, ["--digest"], {
+      env: { ...process.env, IMAGE_PROCESSOR_KERNELS: kernels },
+      encoding: "utf8",
+    });
+    assert.strictEqual(child.status, 0, child.stderr);
+    const [selected, digest] = child.stdout.trim().split(" ");
+    digests.set(selected, digest);
+  }
+
+  for (const [selected, digest] of digests) {
+    console.log(`   ${selected}: ${digest}`);
+  }
+  assert.strictEqual(
+    new Set(digests.values()).size,
+    1,
+    "kernel sets disagree on multichannel resizes"
+  );
+}
+
 async function createSharpTestImages(testDir) {
   const images = [
     {
@@ -135,6 +1486,36 @@ async function runTests() {
   console.log("Running Image Processing Pipeline Tests\n");
 
   try {
+    const addon = loadAddon();
+    if (addon) {
+      runResizeAccuracyTests(addon);
+      runRawInputTests(addon);
+      runLinearTests(addon);
+      await runProcessIntoTests(addon);
+      runThreadedResizeTests(addon);
+      runFilterTests(addon);
+      await runBatchTests(addon);
+      await runDecodeTests(addon);
+      await runEncodeTests(addon);
+      await runStreamTests(addon);
+      await runFileTests(addon);
+      await runFileBatchTests(addon);
+      await runRenditionTests(addon);
+      await runCacheTests(addon);
+      await runProbeTests(addon);
+      runStatsTests(addon);
+      await runJobQueueTests(addon);
+      await runLibraryModeTests(addon);
+      runKernelDispatchTests(addon);
+      runMultichannelKernelTests();
+    } else {
+      console.log("C++ addon not built, skipping addon kernel tests");
+    }
+    runSchedulingTests();
+    await runPoolTests(addon);
+    await runClusterTests();
+    await runBenchTests();
+
     const testInputDir = path.join(__dirname, "input");
     const testOutputDir = path.join(__dirname, "output");
 
@@ -157,6 +1538,7 @@ async function runTests() {
 
     await processor.processImageQueue(imageFiles, testOutputDir);
     await processor.cleanup();
+    await runStreamingIngestTests(testInputDir, imageFiles);
 
     const outputFiles = await fs.readdir(testOutputDir);
     console.log(`\nTest completed successfully!`);
@@ -215,5 +1597,6 @@ module.exports = {
   runTests,
   createTestImageBuffer,
   createGradientImageBuffer,
+  createNoiseImageBuffer,
   createSharpTestImages,
 };
@@ -1,12 +1,31 @@
 const { parentPort, workerData } = require("worker_threads");
+const { createReadStream, createWriteStream } = require("fs");
 const fs = require("fs").promises;
 const path = require("path");
+const { pipeline } = require("stream/promises");
+const { SharedFrameRing } = require("./shared_ring");
+const { canStream, createResizeStream } = require("./stream");
 
-let imageProcessor;
-try {
-  imageProcessor = require("./build/Release/image_processor");
-} catch (error) {
-  console.warn("C++ addon not available, falling back to Sharp");
+// Inputs at least this large are streamed through the addon instead of read
+// into memory whole.
+const STREAM_MIN_BYTES = 64 * 1024 * 1024;
+
+// Completions are reported to the main thread once this many have piled up,
+// or when the last report is this old.
+const COMPLETION_BATCH = 64;
+const COMPLETION_INTERVAL_MS = 250;
+
+// The "sharp" engine skips the addon even when it is built, so benchmarks
+// can compare the two paths.
+let imageProcessor = null;
+if (!workerData || workerData.engine !== "sharp") {
+  try {
+    imageProcessor = require("./build/Release/image_processor");
+  } catch (error) {
+    console.warn("C++ addon not available, falling back to Sharp");
+  }
+}
+if (!imageProcessor) {
   const sharp = require("sharp");
 
   imageProcessor = {
@@ -29,16 +48,107 @@ try {
   };
 }
 
+// Recycles output frames between images. Several jobs can be in flight per
+// worker, so buffers are checked out rather than shared; most images in a
+// batch have the same size, so after warm-up acquire() rarely allocates.
+class OutputBufferPool {
+  constructor(maxFree = 4) {
+    this.maxFree = maxFree;
+    this.free = [];
+  }
+
+  acquire(byteLength) {
+    const index = this.free.findIndex((buffer) => buffer.length >= byteLength);
+    if (index !== -1) {
+      return this.free.splice(index, 1)[0];
+    }
+    return Buffer.allocUnsafeSlow(byteLength);
+  }
+
+  release(buffer) {
+    if (this.free.length < this.maxFree) {
+      this.free.push(buffer);
+    }
+  }
+}
+
 class ImageWorker {
   constructor(options) {
     this.maxWidth = options.maxWidth || 800;
     this.maxHeight = options.maxHeight || 600;
+    this.threads = options.threads || 0;
+    this.quality = options.quality || 85;
+    this.filter = options.filter;
+    this.linear = Boolean(options.linear);
+    this.directIO = Boolean(options.directIO);
+    this.maxInputPixels = options.maxInputPixels || 0;
     this.processedCount = 0;
+    this.outputPool = new OutputBufferPool();
+
+    // With the native encoder the addon returns finished JPEGs; otherwise it
+    // returns grayscale frames and sharp compresses them.
+    this.nativeJpeg = Boolean(
+      imageProcessor.canEncode && imageProcessor.canEncode("jpeg")
+    );
+    const shared = { filter: this.filter, linear: this.linear };
+    this.outputOptions = this.nativeJpeg
+      ? { format: "jpeg", quality: this.quality, ...shared }
+      : shared;
+  }
+
+  finishOutput(output) {
+    return this.nativeJpeg ? output : encodeFrame(output, this.quality);
+  }
+
+  // Turns down an input over maxInputPixels before it is read or decoded.
+  // Uses the { width, height } the main thread probed while planning when
+  // there is one; otherwise reads only the header, a path on the libuv pool
+  // and a Buffer in place. Resolves to the Error to fail it with, or null.
+  // Inputs the probe can't parse are left to the decoders.
+  async oversizedError(input, header) {
+    if (!this.maxInputPixels || !imageProcessor.probe) return null;
+    if (!header) {
+      if (typeof input === "string") {
+        [header] = await imageProcessor.probeFiles([input]);
+      } else {
+        try {
+          header = imageProcessor.probe(input);
+        } catch (error) {
+          header = error;
+        }
+      }
+      if (header instanceof Error) return null;
+    }
+    if (header.width * header.height <= this.maxInputPixels) return null;
+    return new Error(
+      `Input of ${header.width}x${header.height} exceeds ` +
+        `${this.maxInputPixels} pixels`
+    );
   }
 
   async processImage(imageData) {
     try {
-      const inputBuffer = await fs.readFile(imageData.inputPath);
+      const oversized = await this.oversizedError(
+        imageData.inputPath,
+        imageData.header
+      );
+      if (oversized) throw oversized;
+
+      // The stream resizes 8-bit rows in gamma space, so linear-light jobs
+      // always take the whole-image path.
+      if (this.nativeJpeg && canStream && !this.linear) {
+        const { size } = await fs.stat(imageData.inputPath);
+        if (size >= STREAM_MIN_BYTES) {
+          const result = await this.processStreamed(imageData, size);
+          if (result) return result;
+        }
+      }
+      if (this.nativeJpeg && imageProcessor.processFile) {
+        const result = await this.processFileNatively(imageData);
+        if (result) return result;
+      }
+
+      const inputBuffer = await readFileTimed(imageData.inputPath);
 
       let processedBuffer;
 
@@ -48,96 +158,456 @@ class ImageWorker {
           this.maxWidth,
           this.maxHeight
         );
+        await writeFileTimed(imageData.outputPath, processedBuffer);
+      } else if (canDecodeNatively(inputBuffer)) {
+        // The addon decodes JPEG and PNG itself (a YCbCr JPEG only as far as
+        // its luma plane) and encodes the result, so sharp is not involved.
+        const output = await imageProcessor.processImageAsync(
+          inputBuffer,
+          this.maxWidth,
+          this.maxHeight,
+          { threads: this.threads, ...this.outputOptions }
+        );
+        processedBuffer = await this.finishOutput(output);
+        await writeFileTimed(imageData.outputPath, processedBuffer);
       } else {
-        const sharp = require("sharp");
+        const { data: rawInputData, info } = await decodeWithSharp(
+          inputBuffer,
+          this.linear
+        );
+
+        const outputSize = imageProcessor.computeOutputSize(
+          info.width,
+          info.height,
+          this.maxWidth,
+          this.maxHeight,
+          this.outputOptions
+        );
+        const outputBuffer = this.outputPool.acquire(outputSize.byteLength);
 
-        const metadata = await sharp(inputBuffer).metadata();
-        const rawInputData = await sharp(inputBuffer).raw().toBuffer();
+        try {
+          // The addon reads the raw pixels in place when told their layout
+          // and writes into the pooled buffer, so steady-state processing
+          // allocates neither a frame copy nor a fresh output Buffer.
+          const processInto =
+            imageProcessor.processImageIntoAsync ||
+            imageProcessor.processImageInto;
+          const written = await processInto(
+            rawInputData,
+            outputBuffer,
+            this.maxWidth,
+            this.maxHeight,
+            {
+              raw: rawLayout(rawInputData, info),
+              threads: this.threads,
+              ...this.outputOptions,
+            }
+          );
 
-        const headerBuffer = Buffer.alloc(12);
-        headerBuffer.writeInt32BE(metadata.width, 0);
-        headerBuffer.writeInt32BE(metadata.height, 4);
-        headerBuffer.writeInt32BE(metadata.channels, 8);
+          // A native JPEG aliases the pooled buffer, so it is written out
+          // before the buffer goes back to the pool.
+          processedBuffer = await this.finishOutput(
+            outputBuffer.subarray(0, written)
+          );
+          await writeFileTimed(imageData.outputPath, processedBuffer);
+        } finally {
+          this.outputPool.release(outputBuffer);
+        }
+      }
 
-        const inputForCpp = Buffer.concat([headerBuffer, rawInputData]);
+      return this.succeeded(
+        imageData,
+        inputBuffer.length,
+        processedBuffer.length
+      );
+    } catch (error) {
+      return failed(imageData, error);
+    }
+  }
 
-        const rawBuffer = await imageProcessor.processImage(
-          inputForCpp,
-          this.maxWidth,
-          this.maxHeight
-        );
+  // The addon maps the input and writes the JPEG itself, so neither file
+  // passes through a JS Buffer. Returns null for formats only sharp decodes.
+  async processFileNatively(imageData) {
+    try {
+      const { inputSize, outputSize } = await imageProcessor.processFile(
+        imageData.inputPath,
+        imageData.outputPath,
+        this.maxWidth,
+        this.maxHeight,
+        { threads: this.threads, direct: this.directIO, ...this.outputOptions }
+      );
+      return this.succeeded(imageData, inputSize, outputSize);
+    } catch (error) {
+      if (/unsupported input format/.test(error.message)) return null;
+      throw error;
+    }
+  }
+
+  // Reads the file in chunks and writes the JPEG as the addon produces it.
+  // Returns null for inputs the stream does not take (PNG, progressive
+  // JPEG); those are refused before any output is written.
+  async processStreamed(imageData, inputSize) {
+    try {
+      await pipeline(
+        createReadStream(imageData.inputPath, { highWaterMark: 1 << 20 }),
+        createResizeStream(this.maxWidth, this.maxHeight, this.outputOptions),
+        createWriteStream(imageData.outputPath)
+      );
+    } catch (error) {
+      if (/can't be streamed/.test(error.message)) return null;
+      throw error;
+    }
 
-        if (rawBuffer.length < 12) {
-          throw new Error("Invalid processed data from C++ addon");
+    const { size } = await fs.stat(imageData.outputPath);
+    return this.succeeded(imageData, inputSize, size);
+  }
+
+  // Decodes every image of a batch, then hands them all to the addon in a
+  // single processBatch call instead of one call (and one message) each.
+  async processBatch(batch) {
+    const oversized = await Promise.all(
+      batch.map((imageData) =>
+        this.oversizedError(imageData.inputPath, imageData.header)
+      )
+    );
+    if (oversized.some(Boolean)) {
+      const accepted = batch.filter((_, index) => !oversized[index]);
+      const results =
+        accepted.length > 0 ? await this.processBatch(accepted) : [];
+      return batch.map((imageData, index) =>
+        oversized[index] ? failed(imageData, oversized[index]) : results.shift()
+      );
+    }
+
+    if (this.nativeJpeg && imageProcessor.processFiles) {
+      return this.processFilesNatively(batch);
+    }
+    if (!imageProcessor.processBatch) {
+      return Promise.all(
+        batch.map((imageData) => this.processImage(imageData))
+      );
+    }
+
+    const inputs = await Promise.all(
+      batch.map(async (imageData) => {
+        try {
+          const inputBuffer = await readFileTimed(imageData.inputPath);
+          if (canDecodeNatively(inputBuffer)) {
+            return { inputBuffer, item: inputBuffer };
+          }
+
+          const { data, info } = await decodeWithSharp(
+            inputBuffer,
+            this.linear
+          );
+          return { inputBuffer, item: { data, raw: rawLayout(data, info) } };
+        } catch (error) {
+          return { error };
         }
+      })
+    );
 
-        const width =
-          (rawBuffer[0] << 24) |
-          (rawBuffer[1] << 16) |
-          (rawBuffer[2] << 8) |
-          rawBuffer[3];
-        const height =
-          (rawBuffer[4] << 24) |
-          (rawBuffer[5] << 16) |
-          (rawBuffer[6] << 8) |
-          rawBuffer[7];
-        const channels =
-          (rawBuffer[8] << 24) |
-          (rawBuffer[9] << 16) |
-          (rawBuffer[10] << 8) |
-          rawBuffer[11];
-
-        const imageData = rawBuffer.slice(12);
-
-        processedBuffer = await sharp(imageData, {
-          raw: {
-            width: width,
-            height: height,
-            channels: channels,
-          },
-        })
-          .jpeg({ quality: 85 })
-          .toBuffer();
+    const decoded = inputs.filter((input) => !input.error);
+    const frames = await imageProcessor.processBatch(
+      decoded.map((input) => input.item),
+      this.maxWidth,
+      this.maxHeight,
+      { threads: this.threads, ...this.outputOptions }
+    );
+    decoded.forEach((input, index) => {
+      input.frame = frames[index];
+    });
+
+    return Promise.all(
+      batch.map(async (imageData, index) => {
+        const input = inputs[index];
+        try {
+          if (input.error) throw input.error;
+          if (input.frame instanceof Error) throw input.frame;
+
+          const processedBuffer = await this.finishOutput(input.frame);
+          await writeFileTimed(imageData.outputPath, processedBuffer);
+
+          return this.succeeded(
+            imageData,
+            input.inputBuffer.length,
+            processedBuffer.length
+          );
+        } catch (error) {
+          return failed(imageData, error);
+        }
+      })
+    );
+  }
+
+  // Reads, processes and writes the whole batch in one addon call, which
+  // queues the file I/O in batches of its own. Files only sharp decodes go
+  // through processImage afterwards.
+  async processFilesNatively(batch) {
+    const results = await imageProcessor.processFiles(
+      batch.map((imageData) => ({
+        inPath: imageData.inputPath,
+        outPath: imageData.outputPath,
+      })),
+      this.maxWidth,
+      this.maxHeight,
+      { threads: this.threads, ...this.outputOptions }
+    );
+
+    return Promise.all(
+      batch.map((imageData, index) => {
+        const result = results[index];
+        if (!(result instanceof Error)) {
+          return this.succeeded(imageData, result.inputSize, result.outputSize);
+        }
+        if (/unsupported input format/.test(result.message)) {
+          return this.processImage(imageData);
+        }
+        return failed(imageData, result);
+      })
+    );
+  }
+
+  // Works through the shared native queue: `concurrency` loops each take the
+  // next job index for this worker (stealing once its own share is gone)
+  // until none are left, then "drained" is posted.
+  async runQueue({
+    queueId,
+    workerIndex,
+    jobs,
+    headers,
+    outputDir,
+    concurrency,
+  }) {
+    const queue = new imageProcessor.JobQueue(queueId);
+    const completed = [];
+    let lastReport = Date.now();
+
+    const report = () => {
+      if (completed.length > 0) {
+        parentPort.postMessage({ completed: completed.splice(0) });
       }
+      lastReport = Date.now();
+    };
 
-      await fs.writeFile(imageData.outputPath, processedBuffer);
+    const drain = async () => {
+      for (let job = queue.next(workerIndex); job >= 0; ) {
+        const batch = jobs[job].map((inputPath) => ({
+          inputPath,
+          outputPath: path.join(outputDir, path.basename(inputPath)),
+          filename: path.basename(inputPath),
+          header: headers && headers[inputPath],
+        }));
 
-      this.processedCount++;
+        const started = performance.now();
+        let results;
+        try {
+          results =
+            batch.length > 1
+              ? await this.processBatch(batch)
+              : [await this.processImage(batch[0])];
+        } catch (error) {
+          results = batch.map((imageData) => failed(imageData, error));
+        }
+        completed.push(...timed(results, started));
 
-      return {
-        success: true,
-        inputPath: imageData.inputPath,
-        outputPath: imageData.outputPath,
-        filename: imageData.filename,
-        inputSize: inputBuffer.length,
-        outputSize: processedBuffer.length,
-        compressionRatio: (
-          ((inputBuffer.length - processedBuffer.length) / inputBuffer.length) *
-          100
-        ).toFixed(1),
-      };
-    } catch (error) {
-      return {
-        success: false,
-        error: error.message,
-        inputPath: imageData.inputPath,
-        filename: imageData.filename,
-      };
+        job = queue.next(workerIndex);
+        if (
+          completed.length >= COMPLETION_BATCH ||
+          Date.now() - lastReport >= COMPLETION_INTERVAL_MS
+        ) {
+          report();
+        }
+      }
+    };
+
+    await Promise.all(Array.from({ length: concurrency || 1 }, drain));
+    report();
+    parentPort.postMessage({ drained: true });
+  }
+
+  // Serves in-memory jobs from the shared ring until the main thread stops
+  // it. The addon reads each input from its slot and writes the output
+  // straight back into the slot.
+  async serveRing(ring, concurrency) {
+    const serve = async () => {
+      for (let slot = await ring.next(); slot >= 0; slot = await ring.next()) {
+        try {
+          const input = ring.input(slot, ring.inputLength(slot));
+          const length = await this.processIntoSlot(input, ring.output(slot));
+          ring.finish(slot, length);
+        } catch (error) {
+          ring.finish(slot, 0, error);
+        }
+      }
+    };
+    await Promise.all(Array.from({ length: concurrency || 1 }, serve));
+  }
+
+  async processIntoSlot(input, output) {
+    const oversized = await this.oversizedError(input);
+    if (oversized) throw oversized;
+    const options = { threads: this.threads, ...this.outputOptions };
+    const processInto =
+      imageProcessor.processImageIntoAsync || imageProcessor.processImageInto;
+    if (this.nativeJpeg) {
+      return processInto(input, output, this.maxWidth, this.maxHeight, options);
+    }
+
+    const frame = await imageProcessor.processImageAsync(
+      input,
+      this.maxWidth,
+      this.maxHeight,
+      options
+    );
+    const jpeg = await encodeFrame(frame, this.quality);
+    if (jpeg.length > output.length) {
+      throw new Error(`output of ${jpeg.length} bytes does not fit its slot`);
     }
+    return jpeg.copy(output);
+  }
+
+  succeeded(imageData, inputSize, outputSize) {
+    this.processedCount++;
+    const savings = ((inputSize - outputSize) / inputSize) * 100;
+
+    return {
+      success: true,
+      inputPath: imageData.inputPath,
+      outputPath: imageData.outputPath,
+      filename: imageData.filename,
+      inputSize,
+      outputSize,
+      compressionRatio: savings.toFixed(1),
+    };
   }
 }
 
+function failed(imageData, error) {
+  return {
+    success: false,
+    error: error.message,
+    inputPath: imageData.inputPath,
+    filename: imageData.filename,
+  };
+}
+
+// Stamps each result with the time since `started`, the job's start.
+function timed(results, started) {
+  const durationMs = performance.now() - started;
+  for (const result of results) result.durationMs = durationMs;
+  return results;
+}
+
+function canDecodeNatively(buffer) {
+  return Boolean(imageProcessor.canDecode && imageProcessor.canDecode(buffer));
+}
+
+// Adds a step timed in JS to the addon's per-stage counters, which
+// getStats() reports for the whole process.
+function recordStage(stage, started, bytes) {
+  if (imageProcessor.recordStage) {
+    imageProcessor.recordStage(
+      stage,
+      (performance.now() - started) / 1000,
+      bytes
+    );
+  }
+}
+
+async function readFileTimed(file) {
+  const started = performance.now();
+  const data = await fs.readFile(file);
+  recordStage("read", started, data.length);
+  return data;
+}
+
+async function writeFileTimed(file, data) {
+  const started = performance.now();
+  await fs.writeFile(file, data);
+  recordStage("write", started, data.length);
+}
+
+// With `wide`, pixels come out as 16-bit sRGB, so a 16-bit TIFF or PNG
+// reaches the addon at full depth (8-bit input is scaled up exactly).
+async function decodeWithSharp(buffer, wide = false) {
+  const sharp = require("sharp");
+  const started = performance.now();
+  let image = sharp(buffer);
+  if (wide) image = image.toColourspace("rgb16");
+  const decoded = await image.raw().toBuffer({ resolveWithObject: true });
+  recordStage("sharp_decode", started, buffer.length);
+  return decoded;
+}
+
+// The addon's `raw` option for pixels from decodeWithSharp.
+function rawLayout(data, info) {
+  const samples = info.width * info.height * info.channels;
+  return {
+    width: info.width,
+    height: info.height,
+    channels: info.channels,
+    type: data.length >= 2 * samples ? "u16" : "u8",
+  };
+}
+
+// Compresses a grayscale frame from the addon (12-byte header, then pixels).
+async function encodeFrame(frame, quality) {
+  const sharp = require("sharp");
+  const started = performance.now();
+
+  const jpeg = await sharp(frame.subarray(12), {
+    raw: {
+      width: frame.readInt32BE(0),
+      height: frame.readInt32BE(4),
+      channels: frame.readInt32BE(8),
+    },
+  })
+    .jpeg({ quality })
+    .toBuffer();
+  recordStage("sharp_encode", started, frame.length - 12);
+  return jpeg;
+}
+
 async function main() {
+  // Pinned before any job runs, so the scratch memory this thread touches
+  // first, and the addon's helper pool it uses, are on its node.
+  const affinity = workerData && workerData.affinity;
+  if (affinity && imageProcessor.pinThread) {
+    imageProcessor.pinThread(affinity.cpus, affinity.node);
+  }
+
   const worker = new ImageWorker(
     workerData || { maxWidth: 800, maxHeight: 600 }
   );
 
   parentPort.on("message", async (imageData) => {
+    if (imageData.run) {
+      await worker.runQueue(imageData.run);
+      return;
+    }
+    if (imageData.ring) {
+      const ring = new SharedFrameRing(imageData.ring);
+      await worker.serveRing(ring, imageData.concurrency);
+      return;
+    }
+
+    const started = performance.now();
     try {
-      const result = await worker.processImage(imageData);
-      parentPort.postMessage(result);
+      if (imageData.batch) {
+        const results = timed(
+          await worker.processBatch(imageData.batch),
+          started
+        );
+        parentPort.postMessage({ jobId: imageData.jobId, results });
+        return;
+      }
+
+      const [result] = timed([await worker.processImage(imageData)], started);
+      parentPort.postMessage({ ...result, jobId: imageData.jobId });
     } catch (error) {
       parentPort.postMessage({
+        jobId: imageData.jobId,
         success: false,
         error: error.message,
         inputPath: imageData.inputPath,